@@ -0,0 +1,250 @@
+/*
+ * Atomic read-modify-write helpers for guest memory
+ *
+ * Included from cputlb.c and user-exec.c, which must define
+ *
+ *   static void *atomic_mmu_lookup(CPUArchState *env, target_ulong addr,
+ *                                  TCGMemOpIdx oi, uintptr_t retaddr);
+ *
+ * returning the host address of the operand, or NULL for accesses that
+ * cannot use host atomics: in system emulation those that are not to
+ * plain RAM, and unaligned ones.  These go through atomic_slow_ld and
+ * atomic_slow_st, between atomic_slow_lock and atomic_slow_unlock.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+#include "qemu/atomic.h"
+#include "qemu/bswap.h"
+
+static inline uint64_t atomic_size_mask(TCGMemOp mop)
+{
+    return -1ull >> (64 - (8 << (mop & MO_SIZE)));
+}
+
+/* The following operate on host memory, with values in guest order.  */
+
+static uint64_t atomic_host_cmpxchg(void *haddr, TCGMemOp mop,
+                                    uint64_t cmpv, uint64_t newv)
+{
+    bool bswap = (mop & MO_BSWAP) != 0;
+    uint64_t old;
+
+    switch (mop & MO_SIZE) {
+    case MO_8:
+        return atomic_cmpxchg((uint8_t *)haddr, (uint8_t)cmpv, (uint8_t)newv);
+    case MO_16:
+        if (bswap) {
+            cmpv = bswap16(cmpv);
+            newv = bswap16(newv);
+        }
+        old = atomic_cmpxchg((uint16_t *)haddr, (uint16_t)cmpv,
+                             (uint16_t)newv);
+        return bswap ? bswap16(old) : old;
+    case MO_32:
+        if (bswap) {
+            cmpv = bswap32(cmpv);
+            newv = bswap32(newv);
+        }
+        old = atomic_cmpxchg((uint32_t *)haddr, (uint32_t)cmpv,
+                             (uint32_t)newv);
+        return bswap ? bswap32(old) : old;
+    default:
+        if (bswap) {
+            cmpv = bswap64(cmpv);
+            newv = bswap64(newv);
+        }
+        old = atomic_cmpxchg((uint64_t *)haddr, cmpv, newv);
+        return bswap ? bswap64(old) : old;
+    }
+}
+
+static uint64_t atomic_host_xchg(void *haddr, TCGMemOp mop, uint64_t val)
+{
+    bool bswap = (mop & MO_BSWAP) != 0;
+    uint64_t old;
+
+    switch (mop & MO_SIZE) {
+    case MO_8:
+        return atomic_xchg((uint8_t *)haddr, (uint8_t)val);
+    case MO_16:
+        old = atomic_xchg((uint16_t *)haddr,
+                          (uint16_t)(bswap ? bswap16(val) : val));
+        return bswap ? bswap16(old) : old;
+    case MO_32:
+        old = atomic_xchg((uint32_t *)haddr,
+                          (uint32_t)(bswap ? bswap32(val) : val));
+        return bswap ? bswap32(old) : old;
+    default:
+        old = atomic_xchg((uint64_t *)haddr, bswap ? bswap64(val) : val);
+        return bswap ? bswap64(old) : old;
+    }
+}
+
+static uint64_t atomic_host_fetch_add(void *haddr, TCGMemOp mop, uint64_t val)
+{
+    uint64_t old, cur;
+
+    if (!(mop & MO_BSWAP)) {
+        switch (mop & MO_SIZE) {
+        case MO_8:
+            return atomic_fetch_add((uint8_t *)haddr, (uint8_t)val);
+        case MO_16:
+            return atomic_fetch_add((uint16_t *)haddr, (uint16_t)val);
+        case MO_32:
+            return atomic_fetch_add((uint32_t *)haddr, (uint32_t)val);
+        default:
+            return atomic_fetch_add((uint64_t *)haddr, val);
+        }
+    }
+
+    /* The addition must be done in guest order, retry a compare-and-swap
+       until no other thread modified the location in between.  */
+    cur = atomic_host_cmpxchg(haddr, mop, 0, 0);
+    do {
+        old = cur;
+        cur = atomic_host_cmpxchg(haddr, mop, old, old + val);
+    } while (cur != old);
+    return old;
+}
+
+static uint64_t atomic_cmpxchg_common(CPUArchState *env, target_ulong addr,
+                                      uint64_t cmpv, uint64_t newv,
+                                      TCGMemOpIdx oi, uintptr_t retaddr)
+{
+    TCGMemOp mop = get_memop(oi);
+    void *haddr = atomic_mmu_lookup(env, addr, oi, retaddr);
+
+    cmpv &= atomic_size_mask(mop);
+    newv &= atomic_size_mask(mop);
+    if (likely(haddr)) {
+        return atomic_host_cmpxchg(haddr, mop, cmpv, newv);
+    }
+    {
+        uint64_t old;
+
+        /* Like real hardware, always write back to the location.  */
+        atomic_slow_lock(env, addr, oi);
+        old = atomic_slow_ld(env, addr, oi, retaddr);
+        atomic_slow_st(env, addr, old == cmpv ? newv : old, oi, retaddr);
+        atomic_slow_unlock();
+        return old;
+    }
+}
+
+static uint64_t atomic_xchg_common(CPUArchState *env, target_ulong addr,
+                                   uint64_t val, TCGMemOpIdx oi,
+                                   uintptr_t retaddr)
+{
+    TCGMemOp mop = get_memop(oi);
+    void *haddr = atomic_mmu_lookup(env, addr, oi, retaddr);
+
+    if (likely(haddr)) {
+        return atomic_host_xchg(haddr, mop, val);
+    }
+    {
+        uint64_t old;
+
+        atomic_slow_lock(env, addr, oi);
+        old = atomic_slow_ld(env, addr, oi, retaddr);
+        atomic_slow_st(env, addr, val, oi, retaddr);
+        atomic_slow_unlock();
+        return old;
+    }
+}
+
+static uint64_t atomic_fetch_add_common(CPUArchState *env, target_ulong addr,
+                                        uint64_t val, TCGMemOpIdx oi,
+                                        uintptr_t retaddr)
+{
+    TCGMemOp mop = get_memop(oi);
+    void *haddr = atomic_mmu_lookup(env, addr, oi, retaddr);
+
+    if (likely(haddr)) {
+        return atomic_host_fetch_add(haddr, mop, val);
+    }
+    {
+        uint64_t old;
+
+        atomic_slow_lock(env, addr, oi);
+        old = atomic_slow_ld(env, addr, oi, retaddr);
+        atomic_slow_st(env, addr, old + val, oi, retaddr);
+        atomic_slow_unlock();
+        return old;
+    }
+}
+
+#ifdef CONFIG_SOFTMMU
+/* Called from the slow path of the operations that the TCG backend emits
+   inline, which passes the return address to the translated code.  */
+
+uint64_t helper_atomic_cmpxchg_mmu(CPUArchState *env, target_ulong addr,
+                                   uint64_t cmpv, uint64_t newv,
+                                   TCGMemOpIdx oi, uintptr_t retaddr)
+{
+    return atomic_cmpxchg_common(env, addr, cmpv, newv, oi, retaddr);
+}
+
+uint64_t helper_atomic_xchg_mmu(CPUArchState *env, target_ulong addr,
+                                uint64_t val, TCGMemOpIdx oi,
+                                uintptr_t retaddr)
+{
+    return atomic_xchg_common(env, addr, val, oi, retaddr);
+}
+
+uint64_t helper_atomic_fetch_add_mmu(CPUArchState *env, target_ulong addr,
+                                     uint64_t val, TCGMemOpIdx oi,
+                                     uintptr_t retaddr)
+{
+    return atomic_fetch_add_common(env, addr, val, oi, retaddr);
+}
+#endif
+
+/* The helpers return the old value, zero-extended.  GETRA() must be
+   evaluated here, in the function called by the generated code.  */
+
+uint32_t HELPER(atomic_cmpxchgl)(CPUArchState *env, target_ulong addr,
+                                 uint32_t cmpv, uint32_t newv, uint32_t oi)
+{
+    return atomic_cmpxchg_common(env, addr, cmpv, newv, oi, GETRA());
+}
+
+uint64_t HELPER(atomic_cmpxchgq)(CPUArchState *env, target_ulong addr,
+                                 uint64_t cmpv, uint64_t newv, uint32_t oi)
+{
+    return atomic_cmpxchg_common(env, addr, cmpv, newv, oi, GETRA());
+}
+
+uint32_t HELPER(atomic_xchgl)(CPUArchState *env, target_ulong addr,
+                              uint32_t val, uint32_t oi)
+{
+    return atomic_xchg_common(env, addr, val, oi, GETRA());
+}
+
+uint64_t HELPER(atomic_xchgq)(CPUArchState *env, target_ulong addr,
+                              uint64_t val, uint32_t oi)
+{
+    return atomic_xchg_common(env, addr, val, oi, GETRA());
+}
+
+uint32_t HELPER(atomic_fetch_addl)(CPUArchState *env, target_ulong addr,
+                                   uint32_t val, uint32_t oi)
+{
+    return atomic_fetch_add_common(env, addr, val, oi, GETRA());
+}
+
+uint64_t HELPER(atomic_fetch_addq)(CPUArchState *env, target_ulong addr,
+                                   uint64_t val, uint32_t oi)
+{
+    return atomic_fetch_add_common(env, addr, val, oi, GETRA());
+}
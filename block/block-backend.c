@@ -772,6 +772,21 @@ int blk_get_max_transfer_length(BlockBackend *blk)
     return blk->bs->bl.max_transfer_length;
 }
 
+int blk_get_max_discard(BlockBackend *blk)
+{
+    return blk->bs->bl.max_discard;
+}
+
+int64_t blk_get_write_zeroes_alignment(BlockBackend *blk)
+{
+    return blk->bs->bl.write_zeroes_alignment;
+}
+
+int blk_get_info(BlockBackend *blk, BlockDriverInfo *bdi)
+{
+    return bdrv_get_info(blk->bs, bdi);
+}
+
 void blk_set_guest_block_size(BlockBackend *blk, int align)
 {
     bdrv_set_guest_block_size(blk->bs, align);
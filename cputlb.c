@@ -29,12 +29,113 @@
 #include "exec/memory-internal.h"
 #include "exec/ram_addr.h"
 #include "tcg/tcg.h"
+#include "qemu/timer.h"
+#include "exec/helper-proto.h"
 
 //#define DEBUG_TLB
 //#define DEBUG_TLB_CHECK
 
 /* statistics */
 int tlb_flush_count;
+int tlb_flush_page_count;
+int tlb_flush_large_count;
+int tlb_refill_count;
+int tlb_victim_hit_count;
+int tlb_resize_count;
+
+#ifdef CPU_TLB_DYN
+/* Only shrink a TLB whose use stayed low for this long.  */
+#define TLB_RESIZE_WINDOW_NS (100 * 1000 * 1000)
+
+typedef struct CPUTLBStorage {
+    CPUTLBEntry *table[NB_MMU_MODES];
+    CPUIOTLBEntry *iotlb[NB_MMU_MODES];
+    size_t n_entries[NB_MMU_MODES];
+    /* Peak of tlb_n_used at flush time during the current window */
+    size_t window_max_used[NB_MMU_MODES];
+    int64_t window_begin[NB_MMU_MODES];
+} CPUTLBStorage;
+
+static void tlb_storage_alloc(CPUTLBStorage *st, int mmu_idx, size_t n)
+{
+    g_free(st->table[mmu_idx]);
+    g_free(st->iotlb[mmu_idx]);
+    st->table[mmu_idx] = g_new(CPUTLBEntry, n);
+    st->iotlb[mmu_idx] = g_new(CPUIOTLBEntry, n);
+    st->n_entries[mmu_idx] = n;
+}
+
+/* Pick a new size for the TLB of mmu_idx from the number of entries
+   that were filled since the last flush.  Grow as soon as more than 70%
+   of the entries are used, shrink when less than 30% were used during a
+   whole window, to the size at which the peak use would be below 70%.
+   The clock is only read when the TLB could change size.  */
+static void tlb_mmu_resize(CPUState *cpu, int mmu_idx)
+{
+    CPUArchState *env = cpu->env_ptr;
+    CPUTLBStorage *st = cpu->tlb_storage;
+    size_t old_size = st->n_entries[mmu_idx];
+    size_t new_size;
+    size_t max_used;
+    int64_t now;
+
+    max_used = MIN(env->tlb_n_used[mmu_idx], old_size);
+    max_used = MAX(max_used, st->window_max_used[mmu_idx]);
+    st->window_max_used[mmu_idx] = max_used;
+
+    if (max_used * 10 > old_size * 7) {
+        if (old_size == 1 << CPU_TLB_DYN_MAX_BITS) {
+            return;
+        }
+        new_size = old_size << 1;
+        now = get_clock_realtime();
+    } else if (max_used * 10 < old_size * 3) {
+        now = get_clock_realtime();
+        if (now <= st->window_begin[mmu_idx] + TLB_RESIZE_WINDOW_NS) {
+            return;
+        }
+        new_size = pow2ceil(max_used);
+        if (max_used * 10 > new_size * 7) {
+            new_size <<= 1;
+        }
+        new_size = MAX(new_size, 1 << CPU_TLB_DYN_MIN_BITS);
+    } else {
+        return;
+    }
+
+    st->window_begin[mmu_idx] = now;
+    st->window_max_used[mmu_idx] = 0;
+    if (new_size != old_size) {
+        tlb_storage_alloc(st, mmu_idx, new_size);
+        tlb_resize_count++;
+    }
+}
+#endif
+
+/* Allocate the TLBs that are resized at run time and empty all of them,
+   so that the CPU state points to valid tables even before the first
+   reset.  Other accelerators never use the softmmu TLB, so they get no
+   storage and the flush functions do nothing for them.  */
+void tlb_init(CPUState *cpu)
+{
+#ifdef CPU_TLB_DYN
+    CPUTLBStorage *st;
+    int64_t now;
+    int mmu_idx;
+
+    if (!tcg_enabled()) {
+        return;
+    }
+    st = g_new0(CPUTLBStorage, 1);
+    now = get_clock_realtime();
+    for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
+        tlb_storage_alloc(st, mmu_idx, CPU_TLB_SIZE);
+        st->window_begin[mmu_idx] = now;
+    }
+    cpu->tlb_storage = st;
+#endif
+    tlb_flush(cpu, 1);
+}
 
 /* NOTE:
  * If flush_global is true (the usual case), flush all tlb entries.
@@ -51,7 +152,13 @@ int tlb_flush_count;
 void tlb_flush(CPUState *cpu, int flush_global)
 {
     CPUArchState *env = cpu->env_ptr;
+    int mmu_idx;
 
+#ifdef CPU_TLB_DYN
+    if (!cpu->tlb_storage) {
+        return;
+    }
+#endif
 #if defined(DEBUG_TLB)
     printf("tlb_flush:\n");
 #endif
@@ -59,17 +166,33 @@ void tlb_flush(CPUState *cpu, int flush_global)
        links while we are modifying them */
     cpu->current_tb = NULL;
 
-    memset(env->tlb_table, -1, sizeof(env->tlb_table));
     memset(env->tlb_v_table, -1, sizeof(env->tlb_v_table));
     memset(cpu->tb_jmp_cache, 0, sizeof(cpu->tb_jmp_cache));
 
     env->vtlb_index = 0;
-    env->tlb_flush_addr = -1;
-    env->tlb_flush_mask = 0;
+    for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
+#ifdef CPU_TLB_DYN
+        CPUTLBStorage *st = cpu->tlb_storage;
+
+        /* A CPU reset may have cleared these fields, so always reload
+           them from the storage.  */
+        tlb_mmu_resize(cpu, mmu_idx);
+        env->tlb_table[mmu_idx] = st->table[mmu_idx];
+        env->iotlb[mmu_idx] = st->iotlb[mmu_idx];
+        env->tlb_mask[mmu_idx] =
+            (uintptr_t)(st->n_entries[mmu_idx] - 1) << CPU_TLB_ENTRY_BITS;
+#endif
+        memset(env->tlb_table[mmu_idx], -1,
+               tlb_n_entries(env, mmu_idx) * sizeof(CPUTLBEntry));
+        env->tlb_n_used[mmu_idx] = 0;
+        env->tlb_flush_addr[mmu_idx] = -1;
+        env->tlb_flush_mask[mmu_idx] = 0;
+        env->tlb_large_page_mask[mmu_idx] = TARGET_PAGE_MASK;
+    }
     tlb_flush_count++;
 }
 
-static inline void tlb_flush_entry(CPUTLBEntry *tlb_entry, target_ulong addr)
+static inline bool tlb_flush_entry(CPUTLBEntry *tlb_entry, target_ulong addr)
 {
     if (addr == (tlb_entry->addr_read &
                  (TARGET_PAGE_MASK | TLB_INVALID_MASK)) ||
@@ -78,47 +201,116 @@ static inline void tlb_flush_entry(CPUTLBEntry *tlb_entry, target_ulong addr)
         addr == (tlb_entry->addr_code &
                  (TARGET_PAGE_MASK | TLB_INVALID_MASK))) {
         memset(tlb_entry, -1, sizeof(*tlb_entry));
+        return true;
+    }
+    return false;
+}
+
+static inline bool tlb_flush_entry_mask(CPUTLBEntry *tlb_entry,
+                                        target_ulong addr, target_ulong mask)
+{
+    mask |= TLB_INVALID_MASK;
+    if (addr == (tlb_entry->addr_read & mask) ||
+        addr == (tlb_entry->addr_write & mask) ||
+        addr == (tlb_entry->addr_code & mask)) {
+        memset(tlb_entry, -1, sizeof(*tlb_entry));
+        return true;
+    }
+    return false;
+}
+
+static inline bool tlb_entry_is_empty(CPUTLBEntry *tlb_entry)
+{
+    return tlb_entry->addr_read == -1 && tlb_entry->addr_write == -1 &&
+           tlb_entry->addr_code == -1;
+}
+
+static inline void tlb_dec_used(CPUArchState *env, int mmu_idx)
+{
+    if (env->tlb_n_used[mmu_idx]) {
+        env->tlb_n_used[mmu_idx]--;
+    }
+}
+
+/* Flush the entries of mmu_idx that may be part of the large page
+   containing addr.  Only the size of the largest page is known, so
+   drop every entry in the naturally aligned block of that size; the
+   entries for the other pages in the TLB are kept.  */
+static void tlb_flush_large_page(CPUState *cpu, int mmu_idx,
+                                 target_ulong addr)
+{
+    CPUArchState *env = cpu->env_ptr;
+    target_ulong mask = env->tlb_large_page_mask[mmu_idx];
+    target_ulong npages = (~mask >> TARGET_PAGE_BITS) + 1;
+    target_ulong i;
+    int k;
+
+#if defined(DEBUG_TLB)
+    printf("tlb_flush_page: large page flush ("
+           TARGET_FMT_lx "/" TARGET_FMT_lx ")\n", addr & mask, mask);
+#endif
+    addr &= mask;
+    for (k = 0; k < tlb_n_entries(env, mmu_idx); k++) {
+        if (tlb_flush_entry_mask(&env->tlb_table[mmu_idx][k], addr, mask)) {
+            tlb_dec_used(env, mmu_idx);
+        }
     }
+    for (k = 0; k < CPU_VTLB_SIZE; k++) {
+        tlb_flush_entry_mask(&env->tlb_v_table[mmu_idx][k], addr, mask);
+    }
+
+    /* Past this many pages every slot of the jump cache is hit anyway.  */
+    if (npages >= TB_JMP_CACHE_SIZE / TB_JMP_PAGE_SIZE) {
+        memset(cpu->tb_jmp_cache, 0, sizeof(cpu->tb_jmp_cache));
+    } else {
+        for (i = 0; i < npages; i++) {
+            tb_flush_jmp_cache(cpu, addr + (i << TARGET_PAGE_BITS));
+        }
+    }
+    tlb_flush_large_count++;
 }
 
 void tlb_flush_page(CPUState *cpu, target_ulong addr)
 {
     CPUArchState *env = cpu->env_ptr;
-    int i;
+    int i, k;
     int mmu_idx;
 
-#if defined(DEBUG_TLB)
-    printf("tlb_flush_page: " TARGET_FMT_lx "\n", addr);
+#ifdef CPU_TLB_DYN
+    if (!cpu->tlb_storage) {
+        return;
+    }
 #endif
-    /* Check if we need to flush due to large pages.  */
-    if ((addr & env->tlb_flush_mask) == env->tlb_flush_addr) {
 #if defined(DEBUG_TLB)
-        printf("tlb_flush_page: forced full flush ("
-               TARGET_FMT_lx "/" TARGET_FMT_lx ")\n",
-               env->tlb_flush_addr, env->tlb_flush_mask);
+    printf("tlb_flush_page: " TARGET_FMT_lx "\n", addr);
 #endif
-        tlb_flush(cpu, 1);
-        return;
-    }
     /* must reset current TB so that interrupts cannot modify the
        links while we are modifying them */
     cpu->current_tb = NULL;
 
     addr &= TARGET_PAGE_MASK;
-    i = (addr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
     for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
-        tlb_flush_entry(&env->tlb_table[mmu_idx][i], addr);
-    }
+        /* Check if we need to flush due to large pages.  */
+        if ((addr & env->tlb_flush_mask[mmu_idx]) ==
+            env->tlb_flush_addr[mmu_idx]) {
+            tlb_flush_large_page(cpu, mmu_idx, addr);
+            continue;
+        }
 
-    /* check whether there are entries that need to be flushed in the vtlb */
-    for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
-        int k;
+        i = tlb_index(env, mmu_idx, addr);
+        if (tlb_flush_entry(&env->tlb_table[mmu_idx][i], addr)) {
+            tlb_dec_used(env, mmu_idx);
+        }
+
+        /* check whether there are entries that need to be flushed in
+           the vtlb */
         for (k = 0; k < CPU_VTLB_SIZE; k++) {
             tlb_flush_entry(&env->tlb_v_table[mmu_idx][k], addr);
         }
     }
 
     tb_flush_jmp_cache(cpu, addr);
+    tlb_flush_page_count++;
 }
 
 /* update the TLBs so that writes to code in the virtual page 'addr'
@@ -178,7 +370,7 @@ void cpu_tlb_reset_dirty_all(ram_addr_t start1, ram_addr_t length)
         for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
             unsigned int i;
 
-            for (i = 0; i < CPU_TLB_SIZE; i++) {
+            for (i = 0; i < tlb_n_entries(env, mmu_idx); i++) {
                 tlb_reset_dirty_range(&env->tlb_table[mmu_idx][i],
                                       start1, length);
             }
@@ -206,8 +398,8 @@ void tlb_set_dirty(CPUArchState *env, target_ulong vaddr)
     int mmu_idx;
 
     vaddr &= TARGET_PAGE_MASK;
-    i = (vaddr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
     for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
+        i = tlb_index(env, mmu_idx, vaddr);
         tlb_set_dirty1(&env->tlb_table[mmu_idx][i], vaddr);
     }
 
@@ -220,26 +412,29 @@ void tlb_set_dirty(CPUArchState *env, target_ulong vaddr)
 }
 
 /* Our TLB does not support large pages, so remember the area covered by
-   large pages and trigger a full TLB flush if these are invalidated.  */
-static void tlb_add_large_page(CPUArchState *env, target_ulong vaddr,
-                               target_ulong size)
+   large pages for each MMU mode, as well as the size of the largest page.
+   Invalidating a page in this area flushes the TLB entries around it,
+   see tlb_flush_large_page().  */
+static void tlb_add_large_page(CPUArchState *env, int mmu_idx,
+                               target_ulong vaddr, target_ulong size)
 {
     target_ulong mask = ~(size - 1);
 
-    if (env->tlb_flush_addr == (target_ulong)-1) {
-        env->tlb_flush_addr = vaddr & mask;
-        env->tlb_flush_mask = mask;
+    env->tlb_large_page_mask[mmu_idx] &= mask;
+    if (env->tlb_flush_addr[mmu_idx] == (target_ulong)-1) {
+        env->tlb_flush_addr[mmu_idx] = vaddr & mask;
+        env->tlb_flush_mask[mmu_idx] = mask;
         return;
     }
     /* Extend the existing region to include the new page.
        This is a compromise between unnecessary flushes and the cost
        of maintaining a full variable size TLB.  */
-    mask &= env->tlb_flush_mask;
-    while (((env->tlb_flush_addr ^ vaddr) & mask) != 0) {
+    mask &= env->tlb_flush_mask[mmu_idx];
+    while (((env->tlb_flush_addr[mmu_idx] ^ vaddr) & mask) != 0) {
         mask <<= 1;
     }
-    env->tlb_flush_addr &= mask;
-    env->tlb_flush_mask = mask;
+    env->tlb_flush_addr[mmu_idx] &= mask;
+    env->tlb_flush_mask[mmu_idx] = mask;
 }
 
 /* Add a new TLB entry. At most one entry for a given virtual address
@@ -265,8 +460,9 @@ void tlb_set_page_with_attrs(CPUState *cpu, target_ulong vaddr,
 
     assert(size >= TARGET_PAGE_SIZE);
     if (size != TARGET_PAGE_SIZE) {
-        tlb_add_large_page(env, vaddr, size);
+        tlb_add_large_page(env, mmu_idx, vaddr, size);
     }
+    tlb_refill_count++;
 
     sz = size;
     section = address_space_translate_for_iotlb(cpu, paddr, &xlat, &sz);
@@ -293,8 +489,11 @@ void tlb_set_page_with_attrs(CPUState *cpu, target_ulong vaddr,
     iotlb = memory_region_section_get_iotlb(cpu, section, vaddr, paddr, xlat,
                                             prot, &address);
 
-    index = (vaddr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
+    index = tlb_index(env, mmu_idx, vaddr);
     te = &env->tlb_table[mmu_idx][index];
+    if (tlb_entry_is_empty(te)) {
+        env->tlb_n_used[mmu_idx]++;
+    }
 
     /* do not discard the translation in te, evict it into a victim tlb */
     env->tlb_v_table[mmu_idx][vidx] = *te;
@@ -355,8 +554,8 @@ tb_page_addr_t get_page_addr_code(CPUArchState *env1, target_ulong addr)
     MemoryRegion *mr;
     CPUState *cpu = ENV_GET_CPU(env1);
 
-    page_index = (addr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
     mmu_idx = cpu_mmu_index(env1);
+    page_index = tlb_index(env1, mmu_idx, addr);
     if (unlikely(env1->tlb_table[mmu_idx][page_index].addr_code !=
                  (addr & TARGET_PAGE_MASK))) {
         cpu_ldub_code(env1, addr);
@@ -392,6 +591,109 @@ tb_page_addr_t get_page_addr_code(CPUArchState *env1, target_ulong addr)
 #include "softmmu_template.h"
 #undef MMUSUFFIX
 
+/* Return the host address for an atomic read-modify-write operation,
+   filling the TLB for writing if needed, or NULL if the access must be
+   emulated with atomic_slow_ld and atomic_slow_st: unaligned accesses,
+   pages that are not readable, and I/O or not dirty memory.  */
+static void *atomic_mmu_lookup(CPUArchState *env, target_ulong addr,
+                               TCGMemOpIdx oi, uintptr_t retaddr)
+{
+    unsigned mmu_idx = get_mmuidx(oi);
+    int index = tlb_index(env, mmu_idx, addr);
+    CPUTLBEntry *te = &env->tlb_table[mmu_idx][index];
+    unsigned size = 1 << (get_memop(oi) & MO_SIZE);
+    target_ulong tlb_addr;
+
+    if (addr & (size - 1)) {
+        return NULL;
+    }
+#if HOST_LONG_BITS == 32
+    if (size == 8) {
+        return NULL;
+    }
+#endif
+
+    tlb_addr = te->addr_write;
+    if ((addr & TARGET_PAGE_MASK)
+        != (tlb_addr & (TARGET_PAGE_MASK | TLB_INVALID_MASK))) {
+        if (!VICTIM_TLB_HIT(addr_write)) {
+            tlb_fill(ENV_GET_CPU(env), addr, MMU_DATA_STORE, mmu_idx,
+                     retaddr - GETPC_ADJ);
+        }
+        tlb_addr = te->addr_write;
+    }
+    if ((tlb_addr & ~TARGET_PAGE_MASK) != 0 || te->addr_read != tlb_addr) {
+        return NULL;
+    }
+    return (void *)((uintptr_t)addr + te->addend);
+}
+
+/* Only one CPU runs guest code at a time, so a read-modify-write through
+   the I/O path is atomic with respect to the others.  */
+static inline void atomic_slow_lock(CPUArchState *env, target_ulong addr,
+                                    TCGMemOpIdx oi)
+{
+}
+
+static inline void atomic_slow_unlock(void)
+{
+}
+
+static uint64_t atomic_slow_ld(CPUArchState *env, target_ulong addr,
+                               TCGMemOpIdx oi, uintptr_t retaddr)
+{
+    switch (get_memop(oi) & (MO_BSWAP | MO_SIZE)) {
+    case MO_UB:
+        return helper_ret_ldub_mmu(env, addr, oi, retaddr);
+    case MO_LEUW:
+        return helper_le_lduw_mmu(env, addr, oi, retaddr);
+    case MO_BEUW:
+        return helper_be_lduw_mmu(env, addr, oi, retaddr);
+    case MO_LEUL:
+        return helper_le_ldul_mmu(env, addr, oi, retaddr);
+    case MO_BEUL:
+        return helper_be_ldul_mmu(env, addr, oi, retaddr);
+    case MO_LEQ:
+        return helper_le_ldq_mmu(env, addr, oi, retaddr);
+    case MO_BEQ:
+        return helper_be_ldq_mmu(env, addr, oi, retaddr);
+    default:
+        tcg_abort();
+    }
+}
+
+static void atomic_slow_st(CPUArchState *env, target_ulong addr,
+                           uint64_t val, TCGMemOpIdx oi, uintptr_t retaddr)
+{
+    switch (get_memop(oi) & (MO_BSWAP | MO_SIZE)) {
+    case MO_UB:
+        helper_ret_stb_mmu(env, addr, val, oi, retaddr);
+        break;
+    case MO_LEUW:
+        helper_le_stw_mmu(env, addr, val, oi, retaddr);
+        break;
+    case MO_BEUW:
+        helper_be_stw_mmu(env, addr, val, oi, retaddr);
+        break;
+    case MO_LEUL:
+        helper_le_stl_mmu(env, addr, val, oi, retaddr);
+        break;
+    case MO_BEUL:
+        helper_be_stl_mmu(env, addr, val, oi, retaddr);
+        break;
+    case MO_LEQ:
+        helper_le_stq_mmu(env, addr, val, oi, retaddr);
+        break;
+    case MO_BEQ:
+        helper_be_stq_mmu(env, addr, val, oi, retaddr);
+        break;
+    default:
+        tcg_abort();
+    }
+}
+
+#include "atomic_template.h"
+
 #define MMUSUFFIX _cmmu
 #undef GETPC_ADJ
 #define GETPC_ADJ 0
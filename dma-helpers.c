@@ -79,6 +79,8 @@ typedef struct {
     QEMUIOVector iov;
     QEMUBH *bh;
     DMAIOFunc *io_func;
+    uint64_t max_bytes;
+    int nr_requests;
 } DMAAIOCB;
 
 static void dma_blk_cb(void *opaque, int ret);
@@ -106,7 +108,7 @@ static void dma_blk_unmap(DMAAIOCB *dbs)
 
 static void dma_complete(DMAAIOCB *dbs, int ret)
 {
-    trace_dma_complete(dbs, ret, dbs->common.cb);
+    trace_dma_complete(dbs, ret, dbs->common.cb, dbs->nr_requests);
 
     dma_blk_unmap(dbs);
     if (dbs->common.cb) {
@@ -124,6 +126,7 @@ static void dma_blk_cb(void *opaque, int ret)
 {
     DMAAIOCB *dbs = (DMAAIOCB *)opaque;
     dma_addr_t cur_addr, cur_len;
+    bool at_limit = false;
     void *mem;
 
     trace_dma_blk_cb(dbs, ret);
@@ -137,9 +140,21 @@ static void dma_blk_cb(void *opaque, int ret)
     }
     dma_blk_unmap(dbs);
 
+    /*
+     * Map as much of the list as possible so that RAM-backed transfers
+     * go out as a single request.  Only a mapping failure (MMIO with the
+     * bounce buffers in use) or the backend's transfer limit split it.
+     */
     while (dbs->sg_cur_index < dbs->sg->nsg) {
         cur_addr = dbs->sg->sg[dbs->sg_cur_index].base + dbs->sg_cur_byte;
         cur_len = dbs->sg->sg[dbs->sg_cur_index].len - dbs->sg_cur_byte;
+        if (dbs->max_bytes) {
+            if (dbs->iov.size >= dbs->max_bytes) {
+                at_limit = true;
+                break;
+            }
+            cur_len = MIN(cur_len, dbs->max_bytes - dbs->iov.size);
+        }
         mem = dma_memory_map(dbs->sg->as, cur_addr, &cur_len, dbs->dir);
         if (!mem)
             break;
@@ -155,7 +170,7 @@ static void dma_blk_cb(void *opaque, int ret)
         trace_dma_map_wait(dbs);
         dbs->bh = aio_bh_new(blk_get_aio_context(dbs->blk),
                              reschedule_dma, dbs);
-        cpu_register_map_client(dbs->bh);
+        address_space_register_map_client(dbs->sg->as, dbs->bh);
         return;
     }
 
@@ -163,6 +178,10 @@ static void dma_blk_cb(void *opaque, int ret)
         qemu_iovec_discard_back(&dbs->iov, dbs->iov.size & ~BDRV_SECTOR_MASK);
     }
 
+    if (dbs->sg_cur_index < dbs->sg->nsg) {
+        trace_dma_blk_split(dbs, dbs->iov.size, at_limit);
+    }
+    dbs->nr_requests++;
     dbs->acb = dbs->io_func(dbs->blk, dbs->sector_num, &dbs->iov,
                             dbs->iov.size / 512, dma_blk_cb, dbs);
     assert(dbs->acb);
@@ -178,7 +197,7 @@ static void dma_aio_cancel(BlockAIOCB *acb)
         blk_aio_cancel_async(dbs->acb);
     }
     if (dbs->bh) {
-        cpu_unregister_map_client(dbs->bh);
+        address_space_unregister_map_client(dbs->sg->as, dbs->bh);
         qemu_bh_delete(dbs->bh);
         dbs->bh = NULL;
     }
@@ -208,6 +227,9 @@ BlockAIOCB *dma_blk_io(
     dbs->dir = dir;
     dbs->io_func = io_func;
     dbs->bh = NULL;
+    dbs->max_bytes = (uint64_t)MAX(blk_get_max_transfer_length(blk), 0)
+                     << BDRV_SECTOR_BITS;
+    dbs->nr_requests = 0;
     qemu_iovec_init(&dbs->iov, sg->nsg);
     dma_blk_cb(dbs, 0);
     return &dbs->common;
@@ -539,6 +539,7 @@ void cpu_exec_init(CPUArchState *env)
 #ifndef CONFIG_USER_ONLY
     cpu->as = &address_space_memory;
     cpu->thread_id = qemu_get_thread_id();
+    tlb_init(cpu);
     cpu_reload_memory_map(cpu);
 #endif
     QTAILQ_INSERT_TAIL(&cpus, cpu, node);
@@ -2505,82 +2506,89 @@ void cpu_flush_icache_range(hwaddr start, int len)
                                            start, NULL, len, FLUSH_CACHE);
 }
 
-typedef struct {
+typedef struct BounceBuffer {
     MemoryRegion *mr;
     void *buffer;
     hwaddr addr;
     hwaddr len;
-    bool in_use;
+    QLIST_ENTRY(BounceBuffer) link;
 } BounceBuffer;
 
-static BounceBuffer bounce;
-
 typedef struct MapClient {
     QEMUBH *bh;
     QLIST_ENTRY(MapClient) link;
 } MapClient;
 
-QemuMutex map_client_list_lock;
-static QLIST_HEAD(map_client_list, MapClient) map_client_list
-    = QLIST_HEAD_INITIALIZER(map_client_list);
-
-static void cpu_unregister_map_client_do(MapClient *client)
+static void address_space_unregister_map_client_do(MapClient *client)
 {
     QLIST_REMOVE(client, link);
     g_free(client);
 }
 
-static void cpu_notify_map_clients_locked(void)
+/* Called with as->bounce_lock held */
+static void address_space_notify_map_clients_locked(AddressSpace *as)
 {
     MapClient *client;
 
-    while (!QLIST_EMPTY(&map_client_list)) {
-        client = QLIST_FIRST(&map_client_list);
+    while (!QLIST_EMPTY(&as->map_clients)) {
+        client = QLIST_FIRST(&as->map_clients);
         qemu_bh_schedule(client->bh);
-        cpu_unregister_map_client_do(client);
+        address_space_unregister_map_client_do(client);
     }
 }
 
-void cpu_register_map_client(QEMUBH *bh)
+void address_space_register_map_client(AddressSpace *as, QEMUBH *bh)
 {
     MapClient *client = g_malloc(sizeof(*client));
 
-    qemu_mutex_lock(&map_client_list_lock);
+    qemu_mutex_lock(&as->bounce_lock);
     client->bh = bh;
-    QLIST_INSERT_HEAD(&map_client_list, client, link);
-    if (!atomic_read(&bounce.in_use)) {
-        cpu_notify_map_clients_locked();
+    QLIST_INSERT_HEAD(&as->map_clients, client, link);
+    if (as->bounce_buffer_size < as->max_bounce_buffer_size) {
+        address_space_notify_map_clients_locked(as);
     }
-    qemu_mutex_unlock(&map_client_list_lock);
-}
-
-void cpu_exec_init_all(void)
-{
-    qemu_mutex_init(&ram_list.mutex);
-    memory_map_init();
-    io_mem_init();
-    qemu_mutex_init(&map_client_list_lock);
+    qemu_mutex_unlock(&as->bounce_lock);
 }
 
-void cpu_unregister_map_client(QEMUBH *bh)
+void address_space_unregister_map_client(AddressSpace *as, QEMUBH *bh)
 {
     MapClient *client;
 
-    qemu_mutex_lock(&map_client_list_lock);
-    QLIST_FOREACH(client, &map_client_list, link) {
+    qemu_mutex_lock(&as->bounce_lock);
+    QLIST_FOREACH(client, &as->map_clients, link) {
         if (client->bh == bh) {
-            cpu_unregister_map_client_do(client);
+            address_space_unregister_map_client_do(client);
             break;
         }
     }
-    qemu_mutex_unlock(&map_client_list_lock);
+    qemu_mutex_unlock(&as->bounce_lock);
+}
+
+void cpu_register_map_client(QEMUBH *bh)
+{
+    address_space_register_map_client(&address_space_memory, bh);
+}
+
+void cpu_unregister_map_client(QEMUBH *bh)
+{
+    address_space_unregister_map_client(&address_space_memory, bh);
+}
+
+void address_space_set_max_bounce_buffer_size(AddressSpace *as, size_t size)
+{
+    qemu_mutex_lock(&as->bounce_lock);
+    as->max_bounce_buffer_size = size;
+    if (as->bounce_buffer_size < size) {
+        address_space_notify_map_clients_locked(as);
+    }
+    qemu_mutex_unlock(&as->bounce_lock);
 }
 
-static void cpu_notify_map_clients(void)
+void cpu_exec_init_all(void)
 {
-    qemu_mutex_lock(&map_client_list_lock);
-    cpu_notify_map_clients_locked();
-    qemu_mutex_unlock(&map_client_list_lock);
+    qemu_mutex_init(&ram_list.mutex);
+    memory_map_init();
+    io_mem_init();
 }
 
 bool address_space_access_valid(AddressSpace *as, hwaddr addr, int len, bool is_write)
@@ -2610,8 +2618,8 @@ bool address_space_access_valid(AddressSpace *as, hwaddr addr, int len, bool is_
  * May map a subset of the requested range, given by and returned in *plen.
  * May return NULL if resources needed to perform the mapping are exhausted.
  * Use only for reads OR writes - not for read-modify-write operations.
- * Use cpu_register_map_client() to know when retrying the map operation is
- * likely to succeed.
+ * Use address_space_register_map_client() to know when retrying the map
+ * operation is likely to succeed.
  */
 void *address_space_map(AddressSpace *as,
                         hwaddr addr,
@@ -2633,26 +2641,39 @@ void *address_space_map(AddressSpace *as,
     mr = address_space_translate(as, addr, &xlat, &l, is_write);
 
     if (!memory_access_is_direct(mr, is_write)) {
-        if (atomic_xchg(&bounce.in_use, true)) {
+        BounceBuffer *bounce;
+
+        /* Avoid unbounded allocations, and leave room for other mappings */
+        l = MIN(l, TARGET_PAGE_SIZE);
+
+        qemu_mutex_lock(&as->bounce_lock);
+        if (as->bounce_buffer_size >= as->max_bounce_buffer_size) {
+            as->bounce_map_failures++;
+            qemu_mutex_unlock(&as->bounce_lock);
             rcu_read_unlock();
             return NULL;
         }
-        /* Avoid unbounded allocations */
-        l = MIN(l, TARGET_PAGE_SIZE);
-        bounce.buffer = qemu_memalign(TARGET_PAGE_SIZE, l);
-        bounce.addr = addr;
-        bounce.len = l;
+        l = MIN(l, as->max_bounce_buffer_size - as->bounce_buffer_size);
+        as->bounce_buffer_size += l;
+        as->bounce_maps++;
+
+        bounce = g_new(BounceBuffer, 1);
+        bounce->buffer = qemu_memalign(TARGET_PAGE_SIZE, l);
+        bounce->addr = addr;
+        bounce->len = l;
+        bounce->mr = mr;
+        QLIST_INSERT_HEAD(&as->bounce_buffers, bounce, link);
+        qemu_mutex_unlock(&as->bounce_lock);
 
         memory_region_ref(mr);
-        bounce.mr = mr;
         if (!is_write) {
             address_space_read(as, addr, MEMTXATTRS_UNSPECIFIED,
-                               bounce.buffer, l);
+                               bounce->buffer, l);
         }
 
         rcu_read_unlock();
         *plen = l;
-        return bounce.buffer;
+        return bounce->buffer;
     }
 
     base = xlat;
@@ -2679,6 +2700,19 @@ void *address_space_map(AddressSpace *as,
     return qemu_ram_ptr_length(raddr + base, plen);
 }
 
+/* Called with as->bounce_lock held */
+static BounceBuffer *address_space_find_bounce(AddressSpace *as, void *buffer)
+{
+    BounceBuffer *bounce;
+
+    QLIST_FOREACH(bounce, &as->bounce_buffers, link) {
+        if (bounce->buffer == buffer) {
+            return bounce;
+        }
+    }
+    return NULL;
+}
+
 /* Unmaps a memory region previously mapped by address_space_map().
  * Will also mark the memory as dirty if is_write == 1.  access_len gives
  * the amount of memory that was actually read or written by the caller.
@@ -2686,7 +2720,21 @@ void *address_space_map(AddressSpace *as,
 void address_space_unmap(AddressSpace *as, void *buffer, hwaddr len,
                          int is_write, hwaddr access_len)
 {
-    if (buffer != bounce.buffer) {
+    BounceBuffer *bounce = NULL;
+
+    /* The list is only walked while bounce buffers are in use; the caller
+     * mapped @buffer, so it sees its own insertion into the list.
+     */
+    if (atomic_read(&as->bounce_buffers.lh_first)) {
+        qemu_mutex_lock(&as->bounce_lock);
+        bounce = address_space_find_bounce(as, buffer);
+        if (bounce) {
+            QLIST_REMOVE(bounce, link);
+        }
+        qemu_mutex_unlock(&as->bounce_lock);
+    }
+
+    if (!bounce) {
         MemoryRegion *mr;
         ram_addr_t addr1;
 
@@ -2702,14 +2750,17 @@ void address_space_unmap(AddressSpace *as, void *buffer, hwaddr len,
         return;
     }
     if (is_write) {
-        address_space_write(as, bounce.addr, MEMTXATTRS_UNSPECIFIED,
-                            bounce.buffer, access_len);
-    }
-    qemu_vfree(bounce.buffer);
-    bounce.buffer = NULL;
-    memory_region_unref(bounce.mr);
-    atomic_mb_set(&bounce.in_use, false);
-    cpu_notify_map_clients();
+        address_space_write(as, bounce->addr, MEMTXATTRS_UNSPECIFIED,
+                            bounce->buffer, access_len);
+    }
+    qemu_vfree(bounce->buffer);
+    memory_region_unref(bounce->mr);
+
+    qemu_mutex_lock(&as->bounce_lock);
+    as->bounce_buffer_size -= bounce->len;
+    address_space_notify_map_clients_locked(as);
+    qemu_mutex_unlock(&as->bounce_lock);
+    g_free(bounce);
 }
 
 void *cpu_physical_memory_map(hwaddr addr,
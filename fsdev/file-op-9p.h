@@ -66,6 +66,20 @@ typedef struct extended_ops {
 
 #define V9FS_SEC_MASK               0x0000003C
 
+/*
+ * Coherency of the local backend's attribute cache:
+ * none    - no caching
+ * timeout - entries expire after cache_timeout milliseconds
+ * strict  - entries live until QEMU itself changes the file, only safe
+ *           when nothing else modifies the export
+ */
+typedef enum V9fsCacheMode {
+    V9FS_CACHE_NONE = 0,
+    V9FS_CACHE_TIMEOUT,
+    V9FS_CACHE_STRICT,
+} V9fsCacheMode;
+
+#define V9FS_CACHE_TIMEOUT_DEFAULT  1000
 
 typedef struct FileOperations FileOperations;
 /*
@@ -75,6 +89,8 @@ typedef struct FsDriverEntry {
     char *fsdev_id;
     char *path;
     int export_flags;
+    V9fsCacheMode cache_mode;
+    int64_t cache_timeout;
     FileOperations *ops;
 } FsDriverEntry;
 
@@ -83,6 +99,8 @@ typedef struct FsContext
     uid_t uid;
     char *fs_root;
     int export_flags;
+    V9fsCacheMode cache_mode;
+    int64_t cache_timeout;
     struct xattr_operations **xops;
     struct extended_ops exops;
     /* fs driver specific data */
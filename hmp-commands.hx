@@ -371,6 +371,44 @@ STEXI
 @findex singlestep
 Run the emulation in single step mode.
 If called with option off, the emulation returns to normal mode.
+ETEXI
+
+    {
+        .name       = "tb-profile",
+        .args_type  = "option:s,period:i?",
+        .params     = "on|off|reset [period_us]",
+        .help       = "start, stop or reset the translated code profiler",
+        .mhandler.cmd = hmp_tb_profile,
+    },
+
+STEXI
+@item tb-profile on|off|reset [@var{period_us}]
+@findex tb-profile
+Control the sampling profiler for translated code (TCG only).  @code{on}
+starts sampling every @var{period_us} microseconds (default 1000) and
+attributes host time to the translation block each vCPU is executing;
+@code{off} stops sampling and @code{reset} discards the samples.  Use
+@code{info tb-profile} to show the results.
+ETEXI
+
+    {
+        .name       = "tb-profile-save",
+        .args_type  = "perfmap:-p,filename:F?",
+        .params     = "[-p] [filename]",
+        .help       = "save the profiler samples in folded stack format "
+                      "(-p: save a perf map of the translated code instead)",
+        .mhandler.cmd = hmp_tb_profile_save,
+    },
+
+STEXI
+@item tb-profile-save [-p] [@var{filename}]
+@findex tb-profile-save
+Save the samples collected by @code{tb-profile} to @var{filename} in the
+folded stack format used by flame graph tools.  With @option{-p}, write a
+perf map describing the host code of every translation block instead, so
+that a host @code{perf report} can resolve translated code to guest
+addresses and symbols; @var{filename} defaults to
+@file{/tmp/perf-@var{pid}.map}.
 ETEXI
 
     {
@@ -1229,7 +1267,7 @@ ETEXI
     {
         .name       = "netdev_add",
         .args_type  = "netdev:O",
-        .params     = "[user|tap|socket|vde|bridge|hubport|netmap|vhost-user],id=str[,prop=value][,...]",
+        .params     = "[user|tap|socket|vde|bridge|hubport|netmap|af-packet|vhost-user],id=str[,prop=value][,...]",
         .help       = "add host network device",
         .mhandler.cmd = hmp_netdev_add,
         .command_completion = netdev_add_completion,
@@ -1744,6 +1782,8 @@ show virtual to physical memory mappings (i386, SH4, SPARC, PPC, and Xtensa only
 show the active virtual memory mappings (i386 only)
 @item info jit
 show dynamic compiler info
+@item info tb-profile [@var{count}]
+show the translation blocks with the most profiler samples
 @item info numa
 show NUMA information
 @item info kvm
@@ -39,6 +39,104 @@ int v9fs_co_readdir_r(V9fsPDU *pdu, V9fsFidState *fidp, struct dirent *dent,
     return err;
 }
 
+/*
+ * Lower bound of the wire size of an entry: in a Rreaddir reply qid[13]
+ * offset[8] type[1] name[s], as in v9fs_readdir_data_size(), or in a Rread
+ * reply a 9P2000.u stat with empty uid/gid/muid/extension strings.
+ */
+static int32_t v9fs_dirent_min_size(struct dirent *dent, bool dostat)
+{
+    return (dostat ? 63 : 24) + strlen(dent->d_name);
+}
+
+/* Runs in the worker thread */
+static int do_readdir_many(V9fsState *s, V9fsFidState *fidp,
+                           V9fsDirEnt **entries, int32_t maxsize, bool dostat)
+{
+    V9fsDirEnt *e, **tail = entries;
+    struct dirent *dent, *result;
+    int32_t size = 0;
+    int n = 0, err = 0;
+
+    dent = g_malloc(sizeof(struct dirent));
+    while (size < maxsize) {
+        errno = 0;
+        err = s->ops->readdir_r(&s->ctx, &fidp->fs, dent, &result);
+        if (!result) {
+            err = errno ? -errno : 0;
+            break;
+        }
+        e = g_new0(V9fsDirEnt, 1);
+        e->dent = g_memdup(dent, sizeof(struct dirent));
+        v9fs_path_init(&e->path);
+        *tail = e;
+        tail = &e->next;
+        n++;
+
+        if (dostat) {
+            e->st = g_new0(struct stat, 1);
+            err = v9fs_name_to_path(s, &fidp->path, dent->d_name, &e->path);
+            if (err < 0) {
+                break;
+            }
+            err = s->ops->lstat(&s->ctx, &e->path, e->st);
+            if (err < 0) {
+                err = -errno;
+                break;
+            }
+        }
+        size += v9fs_dirent_min_size(dent, dostat);
+    }
+    g_free(dent);
+    return err < 0 ? err : n;
+}
+
+/*
+ * Read directory entries in a single worker thread round trip, stopping
+ * once they can no longer fit in @maxsize bytes of reply.  With @dostat,
+ * each entry is also resolved and lstat'ed in the same round trip.
+ *
+ * Returns the number of entries in *@entries (0 at end of directory) or a
+ * negative errno.  The list must be released with v9fs_free_dirents() in
+ * either case.  The directory position ends up after the last entry read,
+ * so callers that cannot use all of them must seek back.
+ */
+int v9fs_co_readdir_many(V9fsPDU *pdu, V9fsFidState *fidp,
+                         V9fsDirEnt **entries, int32_t maxsize, bool dostat)
+{
+    int err;
+    V9fsState *s = pdu->s;
+
+    *entries = NULL;
+    if (v9fs_request_cancelled(pdu)) {
+        return -EINTR;
+    }
+    if (dostat) {
+        v9fs_path_read_lock(s);
+    }
+    v9fs_co_run_in_worker(
+        {
+            err = do_readdir_many(s, fidp, entries, maxsize, dostat);
+        });
+    if (dostat) {
+        v9fs_path_unlock(s);
+    }
+    return err;
+}
+
+void v9fs_free_dirents(V9fsDirEnt *e)
+{
+    V9fsDirEnt *next;
+
+    for (; e; e = next) {
+        next = e->next;
+        g_free(e->dent);
+        g_free(e->st);
+        v9fs_path_free(&e->path);
+        g_free(e);
+    }
+}
+
 off_t v9fs_co_telldir(V9fsPDU *pdu, V9fsFidState *fidp)
 {
     off_t err;
@@ -0,0 +1,176 @@
+/*
+ * Virtio 9p attribute cache
+ *
+ * Caches lstat() results, including ENOENT, by fs path so that walks and
+ * getattr on a busy export do not hit the host for every request.  The
+ * local backend invalidates entries on its own namespace and attribute
+ * changes; changes made behind QEMU's back are only noticed once the
+ * entry times out, or never with cache=strict.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * later.  See the COPYING file in the top-level directory.
+ */
+
+#include "qemu-common.h"
+#include "qemu/queue.h"
+#include "qemu/thread.h"
+#include "qemu/timer.h"
+#include "virtio-9p-attr-cache.h"
+
+typedef struct V9fsAttrCacheEntry {
+    char *path;
+    struct stat st;
+    int err;
+    uint64_t gen;
+    int64_t expires;
+    QTAILQ_ENTRY(V9fsAttrCacheEntry) lru;
+} V9fsAttrCacheEntry;
+
+struct V9fsAttrCache {
+    V9fsCacheMode mode;
+    int64_t timeout_ms;
+    /* lstat runs concurrently in the 9p worker threads */
+    QemuMutex lock;
+    GHashTable *entries;
+    /* most recently used first */
+    QTAILQ_HEAD(V9fsAttrCacheLRU, V9fsAttrCacheEntry) lru;
+    /* bumped by v9fs_attr_cache_inode_changed() */
+    uint64_t gen;
+    /* bumped by every invalidation */
+    uint64_t seq;
+};
+
+V9fsAttrCache *v9fs_attr_cache_new(V9fsCacheMode mode, int64_t timeout_ms)
+{
+    V9fsAttrCache *c = g_new0(V9fsAttrCache, 1);
+
+    c->mode = mode;
+    c->timeout_ms = timeout_ms;
+    qemu_mutex_init(&c->lock);
+    c->entries = g_hash_table_new(g_str_hash, g_str_equal);
+    QTAILQ_INIT(&c->lru);
+    return c;
+}
+
+static void attr_cache_remove(V9fsAttrCache *c, V9fsAttrCacheEntry *e)
+{
+    QTAILQ_REMOVE(&c->lru, e, lru);
+    g_hash_table_remove(c->entries, e->path);
+    g_free(e->path);
+    g_free(e);
+}
+
+static bool attr_cache_entry_valid(V9fsAttrCache *c, V9fsAttrCacheEntry *e)
+{
+    if (!e->err && !S_ISDIR(e->st.st_mode) && e->gen != c->gen) {
+        return false;
+    }
+    if (c->mode == V9FS_CACHE_TIMEOUT && get_clock() >= e->expires) {
+        return false;
+    }
+    return true;
+}
+
+bool v9fs_attr_cache_lookup(V9fsAttrCache *c, const char *path,
+                            struct stat *stbuf, int *err, uint64_t *seq)
+{
+    V9fsAttrCacheEntry *e;
+    bool hit = false;
+
+    qemu_mutex_lock(&c->lock);
+    e = g_hash_table_lookup(c->entries, path);
+    if (e && attr_cache_entry_valid(c, e)) {
+        QTAILQ_REMOVE(&c->lru, e, lru);
+        QTAILQ_INSERT_HEAD(&c->lru, e, lru);
+        *err = e->err;
+        if (!e->err) {
+            *stbuf = e->st;
+        }
+        hit = true;
+    } else if (e) {
+        attr_cache_remove(c, e);
+    }
+    *seq = c->seq;
+    qemu_mutex_unlock(&c->lock);
+    return hit;
+}
+
+void v9fs_attr_cache_insert(V9fsAttrCache *c, const char *path,
+                            const struct stat *stbuf, int err, uint64_t seq)
+{
+    V9fsAttrCacheEntry *e;
+
+    qemu_mutex_lock(&c->lock);
+    if (seq != c->seq) {
+        goto out;
+    }
+    e = g_hash_table_lookup(c->entries, path);
+    if (e) {
+        attr_cache_remove(c, e);
+    } else if (g_hash_table_size(c->entries) >= V9FS_ATTR_CACHE_MAX_ENTRIES) {
+        attr_cache_remove(c, QTAILQ_LAST(&c->lru, V9fsAttrCacheLRU));
+    }
+
+    e = g_new0(V9fsAttrCacheEntry, 1);
+    e->path = g_strdup(path);
+    e->err = err;
+    if (!err) {
+        e->st = *stbuf;
+    }
+    e->gen = c->gen;
+    e->expires = get_clock() + c->timeout_ms * SCALE_MS;
+    g_hash_table_insert(c->entries, e->path, e);
+    QTAILQ_INSERT_HEAD(&c->lru, e, lru);
+out:
+    qemu_mutex_unlock(&c->lock);
+}
+
+void v9fs_attr_cache_invalidate(V9fsAttrCache *c, const char *path)
+{
+    V9fsAttrCacheEntry *e;
+
+    qemu_mutex_lock(&c->lock);
+    c->seq++;
+    e = g_hash_table_lookup(c->entries, path);
+    if (e) {
+        attr_cache_remove(c, e);
+    }
+    qemu_mutex_unlock(&c->lock);
+}
+
+void v9fs_attr_cache_invalidate_parent(V9fsAttrCache *c, const char *path)
+{
+    const char *slash = strrchr(path, '/');
+    char *parent;
+
+    if (!slash) {
+        return;
+    }
+    parent = slash == path ? g_strdup("/") : g_strndup(path, slash - path);
+    v9fs_attr_cache_invalidate(c, parent);
+    g_free(parent);
+}
+
+void v9fs_attr_cache_invalidate_tree(V9fsAttrCache *c, const char *path)
+{
+    V9fsAttrCacheEntry *e, *next;
+    size_t len = strlen(path);
+
+    qemu_mutex_lock(&c->lock);
+    c->seq++;
+    QTAILQ_FOREACH_SAFE(e, &c->lru, lru, next) {
+        if (!strncmp(e->path, path, len) &&
+            (e->path[len] == '\0' || e->path[len] == '/')) {
+            attr_cache_remove(c, e);
+        }
+    }
+    qemu_mutex_unlock(&c->lock);
+}
+
+void v9fs_attr_cache_inode_changed(V9fsAttrCache *c)
+{
+    qemu_mutex_lock(&c->lock);
+    c->seq++;
+    c->gen++;
+    qemu_mutex_unlock(&c->lock);
+}
@@ -0,0 +1,45 @@
+/*
+ * Virtio 9p attribute cache
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * later.  See the COPYING file in the top-level directory.
+ */
+#ifndef _QEMU_VIRTIO_9P_ATTR_CACHE_H
+#define _QEMU_VIRTIO_9P_ATTR_CACHE_H
+
+#include "fsdev/file-op-9p.h"
+
+/* Upper bound on the number of cached paths */
+#define V9FS_ATTR_CACHE_MAX_ENTRIES 8192
+
+typedef struct V9fsAttrCache V9fsAttrCache;
+
+V9fsAttrCache *v9fs_attr_cache_new(V9fsCacheMode mode, int64_t timeout_ms);
+
+/*
+ * On a hit, fill @stbuf or set @err to the cached errno (only ENOENT is
+ * ever cached) and return true.  On a miss, return false and set @seq
+ * to the value v9fs_attr_cache_insert() expects.
+ */
+bool v9fs_attr_cache_lookup(V9fsAttrCache *c, const char *path,
+                            struct stat *stbuf, int *err, uint64_t *seq);
+/*
+ * Insert the outcome of an lstat() started after a lookup miss.  The
+ * result is dropped if anything was invalidated since @seq was taken.
+ */
+void v9fs_attr_cache_insert(V9fsAttrCache *c, const char *path,
+                            const struct stat *stbuf, int err, uint64_t seq);
+
+/* Forget @path only */
+void v9fs_attr_cache_invalidate(V9fsAttrCache *c, const char *path);
+/* Forget the directory containing @path */
+void v9fs_attr_cache_invalidate_parent(V9fsAttrCache *c, const char *path);
+/* Forget @path and everything below it */
+void v9fs_attr_cache_invalidate_tree(V9fsAttrCache *c, const char *path);
+/*
+ * An inode changed in a way that may be visible through another name
+ * (data written, hard link attributes changed): forget every non-directory.
+ */
+void v9fs_attr_cache_inode_changed(V9fsAttrCache *c);
+
+#endif
@@ -59,6 +59,9 @@ extern int v9fs_init_worker_threads(void);
 extern int v9fs_co_readlink(V9fsPDU *, V9fsPath *, V9fsString *);
 extern int v9fs_co_readdir_r(V9fsPDU *, V9fsFidState *,
                            struct dirent *, struct dirent **result);
+extern int v9fs_co_readdir_many(V9fsPDU *, V9fsFidState *,
+                                V9fsDirEnt **, int32_t, bool);
+extern void v9fs_free_dirents(V9fsDirEnt *);
 extern off_t v9fs_co_telldir(V9fsPDU *, V9fsFidState *);
 extern void v9fs_co_seekdir(V9fsPDU *, V9fsFidState *, off_t);
 extern void v9fs_co_rewinddir(V9fsPDU *, V9fsFidState *);
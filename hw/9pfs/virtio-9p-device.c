@@ -84,6 +84,8 @@ static void virtio_9p_device_realize(DeviceState *dev, Error **errp)
 
     s->ctx.export_flags = fse->export_flags;
     s->ctx.fs_root = g_strdup(fse->path);
+    s->ctx.cache_mode = fse->cache_mode;
+    s->ctx.cache_timeout = fse->cache_timeout;
     s->ctx.exops.get_st_gen = NULL;
     len = strlen(s->fsconf.tag);
     if (len > MAX_TAG_LEN - 1) {
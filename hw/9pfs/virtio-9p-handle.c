@@ -660,6 +660,12 @@ static int handle_parse_opts(QemuOpts *opts, struct FsDriverEntry *fse)
         return -1;
     }
 
+    if (qemu_opt_get(opts, "cache") || qemu_opt_get(opts, "cache_timeout")) {
+        fprintf(stderr, "Invalid argument cache specified with handle "
+                "fsdriver\n");
+        return -1;
+    }
+
     if (!path) {
         fprintf(stderr, "fsdev: No path specified.\n");
         return -1;
@@ -14,6 +14,7 @@
 #include "hw/virtio/virtio.h"
 #include "virtio-9p.h"
 #include "virtio-9p-xattr.h"
+#include "virtio-9p-attr-cache.h"
 #include "fsdev/qemu-fsdev.h"   /* local_ops */
 #include <arpa/inet.h>
 #include <pwd.h>
@@ -115,7 +116,8 @@ static void local_mapped_file_attr(FsContext *ctx, const char *path,
     fclose(fp);
 }
 
-static int local_lstat(FsContext *fs_ctx, V9fsPath *fs_path, struct stat *stbuf)
+static int local_do_lstat(FsContext *fs_ctx, V9fsPath *fs_path,
+                          struct stat *stbuf)
 {
     int err;
     char *buffer;
@@ -154,6 +156,68 @@ err_out:
     return err;
 }
 
+static int local_lstat(FsContext *fs_ctx, V9fsPath *fs_path, struct stat *stbuf)
+{
+    V9fsAttrCache *cache = fs_ctx->private;
+    uint64_t seq;
+    int err, serrno;
+
+    if (!cache) {
+        return local_do_lstat(fs_ctx, fs_path, stbuf);
+    }
+    if (v9fs_attr_cache_lookup(cache, fs_path->data, stbuf, &err, &seq)) {
+        if (err) {
+            errno = err;
+            return -1;
+        }
+        return 0;
+    }
+    err = local_do_lstat(fs_ctx, fs_path, stbuf);
+    serrno = errno;
+    if (!err) {
+        v9fs_attr_cache_insert(cache, fs_path->data, stbuf, 0, seq);
+    } else if (serrno == ENOENT) {
+        v9fs_attr_cache_insert(cache, fs_path->data, NULL, ENOENT, seq);
+    }
+    errno = serrno;
+    return err;
+}
+
+/* The attributes of @path changed, maybe under other names too */
+static void local_attr_changed(FsContext *ctx, const char *path)
+{
+    V9fsAttrCache *cache = ctx->private;
+
+    if (cache) {
+        v9fs_attr_cache_invalidate(cache, path);
+        v9fs_attr_cache_inode_changed(cache);
+    }
+}
+
+/* @path was created, which also changes its directory */
+static void local_name_created(FsContext *ctx, const char *path)
+{
+    V9fsAttrCache *cache = ctx->private;
+
+    if (cache) {
+        v9fs_attr_cache_invalidate(cache, path);
+        v9fs_attr_cache_invalidate_parent(cache, path);
+    }
+}
+
+/* @path went away, or was replaced, along with anything below it */
+static void local_name_removed(FsContext *ctx, const char *path)
+{
+    V9fsAttrCache *cache = ctx->private;
+
+    if (cache) {
+        v9fs_attr_cache_invalidate_tree(cache, path);
+        v9fs_attr_cache_invalidate_parent(cache, path);
+        /* the link count of other names for the inode changed */
+        v9fs_attr_cache_inode_changed(cache);
+    }
+}
+
 static int local_create_mapped_attr_dir(FsContext *ctx, const char *path)
 {
     int err;
@@ -358,6 +422,9 @@ static int local_open(FsContext *ctx, V9fsPath *fs_path,
     buffer = rpath(ctx, path);
     fs->fd = open(buffer, flags | O_NOFOLLOW);
     g_free(buffer);
+    if (fs->fd != -1 && (flags & O_TRUNC)) {
+        local_attr_changed(ctx, path);
+    }
     return fs->fd;
 }
 
@@ -455,6 +522,9 @@ static ssize_t local_pwritev(FsContext *ctx, V9fsFidOpenState *fs,
                         SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE);
     }
 #endif
+    if (ret > 0 && ctx->private) {
+        v9fs_attr_cache_inode_changed(ctx->private);
+    }
     return ret;
 }
 
@@ -469,13 +539,14 @@ static int local_chmod(FsContext *fs_ctx, V9fsPath *fs_path, FsCred *credp)
         ret = local_set_xattr(buffer, credp);
         g_free(buffer);
     } else if (fs_ctx->export_flags & V9FS_SM_MAPPED_FILE) {
-        return local_set_mapped_file_attr(fs_ctx, path, credp);
+        ret = local_set_mapped_file_attr(fs_ctx, path, credp);
     } else if ((fs_ctx->export_flags & V9FS_SM_PASSTHROUGH) ||
                (fs_ctx->export_flags & V9FS_SM_NONE)) {
         buffer = rpath(fs_ctx, path);
         ret = chmod(buffer, credp->fc_mode);
         g_free(buffer);
     }
+    local_attr_changed(fs_ctx, path);
     return ret;
 }
 
@@ -535,6 +606,7 @@ err_end:
     remove(buffer);
     errno = serrno;
 out:
+    local_name_created(fs_ctx, fullname.data);
     g_free(buffer);
     v9fs_string_free(&fullname);
     return err;
@@ -597,6 +669,7 @@ err_end:
     remove(buffer);
     errno = serrno;
 out:
+    local_name_created(fs_ctx, fullname.data);
     g_free(buffer);
     v9fs_string_free(&fullname);
     return err;
@@ -714,6 +787,7 @@ err_end:
     remove(buffer);
     errno = serrno;
 out:
+    local_name_created(fs_ctx, fullname.data);
     g_free(buffer);
     v9fs_string_free(&fullname);
     return err;
@@ -818,6 +892,7 @@ err_end:
     remove(buffer);
     errno = serrno;
 out:
+    local_name_created(fs_ctx, fullname.data);
     g_free(buffer);
     v9fs_string_free(&fullname);
     return err;
@@ -856,6 +931,8 @@ static int local_link(FsContext *ctx, V9fsPath *oldpath,
         }
     }
 err_out:
+    local_name_created(ctx, newpath.data);
+    local_attr_changed(ctx, oldpath->data);
     v9fs_string_free(&newpath);
     return ret;
 }
@@ -869,6 +946,7 @@ static int local_truncate(FsContext *ctx, V9fsPath *fs_path, off_t size)
     buffer = rpath(ctx, path);
     ret = truncate(buffer, size);
     g_free(buffer);
+    local_attr_changed(ctx, path);
     return ret;
 }
 
@@ -899,6 +977,8 @@ static int local_rename(FsContext *ctx, const char *oldpath,
     err = rename(buffer, buffer1);
     g_free(buffer);
     g_free(buffer1);
+    local_name_removed(ctx, oldpath);
+    local_name_removed(ctx, newpath);
     return err;
 }
 
@@ -919,8 +999,9 @@ static int local_chown(FsContext *fs_ctx, V9fsPath *fs_path, FsCred *credp)
         ret = local_set_xattr(buffer, credp);
         g_free(buffer);
     } else if (fs_ctx->export_flags & V9FS_SM_MAPPED_FILE) {
-        return local_set_mapped_file_attr(fs_ctx, path, credp);
+        ret = local_set_mapped_file_attr(fs_ctx, path, credp);
     }
+    local_attr_changed(fs_ctx, path);
     return ret;
 }
 
@@ -934,6 +1015,7 @@ static int local_utimensat(FsContext *s, V9fsPath *fs_path,
     buffer = rpath(s, path);
     ret = qemu_utimens(buffer, buf);
     g_free(buffer);
+    local_attr_changed(s, path);
     return ret;
 }
 
@@ -987,6 +1069,7 @@ static int local_remove(FsContext *ctx, const char *path)
     err = remove(buffer);
     g_free(buffer);
 err_out:
+    local_name_removed(ctx, path);
     return err;
 }
 
@@ -1040,16 +1123,22 @@ static int local_lsetxattr(FsContext *ctx, V9fsPath *fs_path, const char *name,
                            void *value, size_t size, int flags)
 {
     char *path = fs_path->data;
+    int ret;
 
-    return v9fs_set_xattr(ctx, path, name, value, size, flags);
+    ret = v9fs_set_xattr(ctx, path, name, value, size, flags);
+    local_attr_changed(ctx, path);
+    return ret;
 }
 
 static int local_lremovexattr(FsContext *ctx, V9fsPath *fs_path,
                               const char *name)
 {
     char *path = fs_path->data;
+    int ret;
 
-    return v9fs_remove_xattr(ctx, path, name);
+    ret = v9fs_remove_xattr(ctx, path, name);
+    local_attr_changed(ctx, path);
+    return ret;
 }
 
 static int local_name_to_path(FsContext *ctx, V9fsPath *dir_path,
@@ -1134,6 +1223,7 @@ static int local_unlinkat(FsContext *ctx, V9fsPath *dir,
     g_free(buffer);
 
 err_out:
+    local_name_removed(ctx, fullname.data);
     v9fs_string_free(&fullname);
     return ret;
 }
@@ -1185,6 +1275,10 @@ static int local_init(FsContext *ctx)
         ctx->xops = passthrough_xattr_ops;
     }
     ctx->export_flags |= V9FS_PATHNAME_FSCONTEXT;
+    if (ctx->cache_mode != V9FS_CACHE_NONE) {
+        ctx->private = v9fs_attr_cache_new(ctx->cache_mode,
+                                           ctx->cache_timeout);
+    }
 #ifdef FS_IOC_GETVERSION
     /*
      * use ioc_getversion only if the iocl is definied
@@ -1208,6 +1302,7 @@ static int local_parse_opts(QemuOpts *opts, struct FsDriverEntry *fse)
 {
     const char *sec_model = qemu_opt_get(opts, "security_model");
     const char *path = qemu_opt_get(opts, "path");
+    const char *cache = qemu_opt_get(opts, "cache");
 
     if (!sec_model) {
         fprintf(stderr, "security model not specified, "
@@ -1232,6 +1327,20 @@ static int local_parse_opts(QemuOpts *opts, struct FsDriverEntry *fse)
         return -1;
     }
 
+    if (!cache || !strcmp(cache, "none")) {
+        fse->cache_mode = V9FS_CACHE_NONE;
+    } else if (!strcmp(cache, "timeout")) {
+        fse->cache_mode = V9FS_CACHE_TIMEOUT;
+    } else if (!strcmp(cache, "strict")) {
+        fse->cache_mode = V9FS_CACHE_STRICT;
+    } else {
+        fprintf(stderr, "Invalid cache mode %s specified, valid options are"
+                "\n\t [none|timeout|strict]\n", cache);
+        return -1;
+    }
+    fse->cache_timeout = qemu_opt_get_number(opts, "cache_timeout",
+                                             V9FS_CACHE_TIMEOUT_DEFAULT);
+
     if (!path) {
         fprintf(stderr, "fsdev: No path specified.\n");
         return -1;
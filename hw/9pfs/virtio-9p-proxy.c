@@ -1136,6 +1136,11 @@ static int proxy_parse_opts(QemuOpts *opts, struct FsDriverEntry *fs)
         fprintf(stderr, "Both socket and sock_fd options specified\n");
         return -1;
     }
+    if (qemu_opt_get(opts, "cache") || qemu_opt_get(opts, "cache_timeout")) {
+        fprintf(stderr, "Invalid argument cache specified with proxy "
+                "fsdriver\n");
+        return -1;
+    }
     if (socket) {
         fs->path = g_strdup(socket);
         fs->export_flags = V9FS_PROXY_SOCK_NAME;
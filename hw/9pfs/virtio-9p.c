@@ -626,7 +626,9 @@ static void complete_pdu(V9fsState *s, V9fsPDU *pdu, ssize_t len)
     pdu->id = id;
 
     /* push onto queue and notify */
-    virtqueue_push(s->vq, &pdu->elem, len);
+    virtqueue_push(s->vq, pdu->elem, len);
+    virtqueue_free_element(s->vq, pdu->elem);
+    pdu->elem = NULL;
 
     /* FIXME: we should batch these completions */
     virtio_notify(VIRTIO_DEVICE(s), s->vq);
@@ -902,14 +904,22 @@ static void v9fs_version(void *opaque)
     V9fsState *s = pdu->s;
     V9fsString version;
     size_t offset = 7;
+    int32_t msize;
 
     v9fs_string_init(&version);
-    err = pdu_unmarshal(pdu, offset, "ds", &s->msize, &version);
+    err = pdu_unmarshal(pdu, offset, "ds", &msize, &version);
     if (err < 0) {
         offset = err;
         goto out;
     }
-    trace_v9fs_version(pdu->tag, pdu->id, s->msize, version.data);
+    trace_v9fs_version(pdu->tag, pdu->id, msize, version.data);
+
+    /* A rejected Tversion leaves the session's msize alone */
+    if (msize < P9_MIN_MSIZE) {
+        offset = -EMSGSIZE;
+        goto out;
+    }
+    s->msize = MIN(msize, V9FS_MAX_MSIZE);
 
     virtfs_reset(pdu);
 
@@ -1575,7 +1585,7 @@ static int v9fs_xattr_read(V9fsState *s, V9fsPDU *pdu, V9fsFidState *fidp,
         return err;
     }
     offset += err;
-    err = v9fs_pack(pdu->elem.in_sg, pdu->elem.in_num, offset,
+    err = v9fs_pack(pdu->elem->in_sg, pdu->elem->in_num, offset,
                     ((char *)fidp->fs.xattr.value) + off,
                     read_count);
     if (err < 0) {
@@ -1588,13 +1598,11 @@ static int v9fs_xattr_read(V9fsState *s, V9fsPDU *pdu, V9fsFidState *fidp,
 static int v9fs_do_readdir_with_stat(V9fsPDU *pdu,
                                      V9fsFidState *fidp, uint32_t max_count)
 {
-    V9fsPath path;
     V9fsStat v9stat;
     int len, err = 0;
     int32_t count = 0;
-    struct stat stbuf;
     off_t saved_dir_pos;
-    struct dirent *dent, *result;
+    V9fsDirEnt *entries, *e;
 
     /* save the directory position */
     saved_dir_pos = v9fs_co_telldir(pdu, fidp);
@@ -1602,50 +1610,99 @@ static int v9fs_do_readdir_with_stat(V9fsPDU *pdu,
         return saved_dir_pos;
     }
 
-    dent = g_malloc(sizeof(struct dirent));
-
     while (1) {
-        v9fs_path_init(&path);
-        err = v9fs_co_readdir_r(pdu, fidp, dent, &result);
-        if (err || !result) {
+        /* Entries come back already lstat'ed, one worker hop per batch */
+        err = v9fs_co_readdir_many(pdu, fidp, &entries,
+                                   max_count - count, true);
+        if (err <= 0) {
+            v9fs_free_dirents(entries);
             break;
         }
-        err = v9fs_co_name_to_path(pdu, &fidp->path, dent->d_name, &path);
-        if (err < 0) {
-            goto out;
-        }
-        err = v9fs_co_lstat(pdu, &path, &stbuf);
-        if (err < 0) {
-            goto out;
-        }
-        err = stat_to_v9stat(pdu, &path, &stbuf, &v9stat);
-        if (err < 0) {
-            goto out;
-        }
-        /* 11 = 7 + 4 (7 = start offset, 4 = space for storing count) */
-        len = pdu_marshal(pdu, 11 + count, "S", &v9stat);
-        if ((len != (v9stat.size + 2)) || ((count + len) > max_count)) {
-            /* Ran out of buffer. Set dir back to old position and return */
-            v9fs_co_seekdir(pdu, fidp, saved_dir_pos);
+        for (e = entries; e; e = e->next) {
+            err = stat_to_v9stat(pdu, &e->path, e->st, &v9stat);
+            if (err < 0) {
+                v9fs_free_dirents(entries);
+                return err;
+            }
+            /* 11 = 7 + 4 (7 = start offset, 4 = space for storing count) */
+            len = pdu_marshal(pdu, 11 + count, "S", &v9stat);
+            if ((len != (v9stat.size + 2)) || ((count + len) > max_count)) {
+                /* Ran out of buffer. Set dir back to old position and return */
+                v9fs_co_seekdir(pdu, fidp, saved_dir_pos);
+                v9fs_stat_free(&v9stat);
+                v9fs_free_dirents(entries);
+                return count;
+            }
+            count += len;
             v9fs_stat_free(&v9stat);
-            v9fs_path_free(&path);
-            g_free(dent);
-            return count;
+            saved_dir_pos = e->dent->d_off;
         }
-        count += len;
-        v9fs_stat_free(&v9stat);
-        v9fs_path_free(&path);
-        saved_dir_pos = dent->d_off;
+        v9fs_free_dirents(entries);
     }
-out:
-    g_free(dent);
-    v9fs_path_free(&path);
     if (err < 0) {
         return err;
     }
     return count;
 }
 
+/*
+ * Read or write @qiov_full from/to the file at @off, looping on short
+ * transfers.  The guest buffers are passed as they are to preadv/pwritev
+ * and a QEMUIOVector for the remainder is only built if the first call
+ * comes back short.
+ *
+ * Returns the number of bytes transferred or a negative errno.
+ */
+static ssize_t v9fs_do_rw_iov(V9fsPDU *pdu, V9fsFidState *fidp,
+                              QEMUIOVector *qiov_full, uint64_t off,
+                              bool is_write)
+{
+    QEMUIOVector qiov;
+    struct iovec *iov = qiov_full->iov;
+    int niov = qiov_full->niov;
+    bool partial = false;
+    size_t total = 0;
+    ssize_t len;
+
+    do {
+        if (0) {
+            print_sg(iov, niov);
+        }
+        /* Loop in case of EINTR */
+        do {
+            if (is_write) {
+                len = v9fs_co_pwritev(pdu, fidp, iov, niov, off);
+            } else {
+                len = v9fs_co_preadv(pdu, fidp, iov, niov, off);
+            }
+            if (len >= 0) {
+                off   += len;
+                total += len;
+            }
+        } while (len == -EINTR && !pdu->cancelled);
+        if (len <= 0 || total == qiov_full->size) {
+            break;
+        }
+        if (!partial) {
+            qemu_iovec_init(&qiov, qiov_full->niov);
+            partial = true;
+        }
+        qemu_iovec_reset(&qiov);
+        qemu_iovec_concat(&qiov, qiov_full, total, qiov_full->size - total);
+        iov = qiov.iov;
+        niov = qiov.niov;
+    } while (1);
+
+    if (partial) {
+        qemu_iovec_destroy(&qiov);
+    }
+    if (len < 0) {
+        /* IO error return the error */
+        return len;
+    }
+    return total;
+}
+
 /*
  * Create a QEMUIOVector for a sub-region of PDU iovecs
  *
@@ -1666,11 +1723,11 @@ static void v9fs_init_qiov_from_pdu(QEMUIOVector *qiov, V9fsPDU *pdu,
     unsigned int niov;
 
     if (is_write) {
-        iov = pdu->elem.out_sg;
-        niov = pdu->elem.out_num;
+        iov = pdu->elem->out_sg;
+        niov = pdu->elem->out_num;
     } else {
-        iov = pdu->elem.in_sg;
-        niov = pdu->elem.in_num;
+        iov = pdu->elem->in_sg;
+        niov = pdu->elem->in_num;
     }
 
     qemu_iovec_init_external(&elem, iov, niov);
@@ -1718,38 +1775,20 @@ static void v9fs_read(void *opaque)
         err += offset + count;
     } else if (fidp->fid_type == P9_FID_FILE) {
         QEMUIOVector qiov_full;
-        QEMUIOVector qiov;
-        int32_t len;
 
+        /* The data goes straight to the guest buffers of the reply */
         v9fs_init_qiov_from_pdu(&qiov_full, pdu, offset + 4, max_count, false);
-        qemu_iovec_init(&qiov, qiov_full.niov);
-        do {
-            qemu_iovec_reset(&qiov);
-            qemu_iovec_concat(&qiov, &qiov_full, count, qiov_full.size - count);
-            if (0) {
-                print_sg(qiov.iov, qiov.niov);
-            }
-            /* Loop in case of EINTR */
-            do {
-                len = v9fs_co_preadv(pdu, fidp, qiov.iov, qiov.niov, off);
-                if (len >= 0) {
-                    off   += len;
-                    count += len;
-                }
-            } while (len == -EINTR && !pdu->cancelled);
-            if (len < 0) {
-                /* IO error return the error */
-                err = len;
-                goto out;
-            }
-        } while (count < max_count && len > 0);
+        err = v9fs_do_rw_iov(pdu, fidp, &qiov_full, off, false);
+        qemu_iovec_destroy(&qiov_full);
+        if (err < 0) {
+            goto out;
+        }
+        count = err;
         err = pdu_marshal(pdu, offset, "d", count);
         if (err < 0) {
             goto out;
         }
         err += offset + count;
-        qemu_iovec_destroy(&qiov);
-        qemu_iovec_destroy(&qiov_full);
     } else if (fidp->fid_type == P9_FID_XATTR) {
         err = v9fs_xattr_read(s, pdu, fidp, off, max_count);
     } else {
@@ -1780,7 +1819,8 @@ static int v9fs_do_readdir(V9fsPDU *pdu,
     int len, err = 0;
     int32_t count = 0;
     off_t saved_dir_pos;
-    struct dirent *dent, *result;
+    struct dirent *dent;
+    V9fsDirEnt *entries, *e;
 
     /* save the directory position */
     saved_dir_pos = v9fs_co_telldir(pdu, fidp);
@@ -1788,48 +1828,51 @@ static int v9fs_do_readdir(V9fsPDU *pdu,
         return saved_dir_pos;
     }
 
-    dent = g_malloc(sizeof(struct dirent));
-
     while (1) {
-        err = v9fs_co_readdir_r(pdu, fidp, dent, &result);
-        if (err || !result) {
+        err = v9fs_co_readdir_many(pdu, fidp, &entries,
+                                   max_count - count, false);
+        if (err <= 0) {
+            v9fs_free_dirents(entries);
             break;
         }
-        v9fs_string_init(&name);
-        v9fs_string_sprintf(&name, "%s", dent->d_name);
-        if ((count + v9fs_readdir_data_size(&name)) > max_count) {
-            /* Ran out of buffer. Set dir back to old position and return */
-            v9fs_co_seekdir(pdu, fidp, saved_dir_pos);
-            v9fs_string_free(&name);
-            g_free(dent);
-            return count;
-        }
-        /*
-         * Fill up just the path field of qid because the client uses
-         * only that. To fill the entire qid structure we will have
-         * to stat each dirent found, which is expensive
-         */
-        size = MIN(sizeof(dent->d_ino), sizeof(qid.path));
-        memcpy(&qid.path, &dent->d_ino, size);
-        /* Fill the other fields with dummy values */
-        qid.type = 0;
-        qid.version = 0;
-
-        /* 11 = 7 + 4 (7 = start offset, 4 = space for storing count) */
-        len = pdu_marshal(pdu, 11 + count, "Qqbs",
-                          &qid, dent->d_off,
-                          dent->d_type, &name);
-        if (len < 0) {
-            v9fs_co_seekdir(pdu, fidp, saved_dir_pos);
+        for (e = entries; e; e = e->next) {
+            dent = e->dent;
+            v9fs_string_init(&name);
+            v9fs_string_sprintf(&name, "%s", dent->d_name);
+            if ((count + v9fs_readdir_data_size(&name)) > max_count) {
+                /* Ran out of buffer. Set dir back to old position and return */
+                v9fs_co_seekdir(pdu, fidp, saved_dir_pos);
+                v9fs_string_free(&name);
+                v9fs_free_dirents(entries);
+                return count;
+            }
+            /*
+             * Fill up just the path field of qid because the client uses
+             * only that. To fill the entire qid structure we will have
+             * to stat each dirent found, which is expensive
+             */
+            size = MIN(sizeof(dent->d_ino), sizeof(qid.path));
+            memcpy(&qid.path, &dent->d_ino, size);
+            /* Fill the other fields with dummy values */
+            qid.type = 0;
+            qid.version = 0;
+
+            /* 11 = 7 + 4 (7 = start offset, 4 = space for storing count) */
+            len = pdu_marshal(pdu, 11 + count, "Qqbs",
+                              &qid, dent->d_off,
+                              dent->d_type, &name);
+            if (len < 0) {
+                v9fs_co_seekdir(pdu, fidp, saved_dir_pos);
+                v9fs_string_free(&name);
+                v9fs_free_dirents(entries);
+                return len;
+            }
+            count += len;
             v9fs_string_free(&name);
-            g_free(dent);
-            return len;
+            saved_dir_pos = dent->d_off;
         }
-        count += len;
-        v9fs_string_free(&name);
-        saved_dir_pos = dent->d_off;
+        v9fs_free_dirents(entries);
     }
-    g_free(dent);
     if (err < 0) {
         return err;
     }
@@ -1939,14 +1982,12 @@ static void v9fs_write(void *opaque)
     int32_t fid;
     uint64_t off;
     uint32_t count;
-    int32_t len = 0;
     int32_t total = 0;
     size_t offset = 7;
     V9fsFidState *fidp;
     V9fsPDU *pdu = opaque;
     V9fsState *s = pdu->s;
     QEMUIOVector qiov_full;
-    QEMUIOVector qiov;
 
     err = pdu_unmarshal(pdu, offset, "dqd", &fid, &off, &count);
     if (err < 0) {
@@ -1978,27 +2019,12 @@ static void v9fs_write(void *opaque)
         err = -EINVAL;
         goto out;
     }
-    qemu_iovec_init(&qiov, qiov_full.niov);
-    do {
-        qemu_iovec_reset(&qiov);
-        qemu_iovec_concat(&qiov, &qiov_full, total, qiov_full.size - total);
-        if (0) {
-            print_sg(qiov.iov, qiov.niov);
-        }
-        /* Loop in case of EINTR */
-        do {
-            len = v9fs_co_pwritev(pdu, fidp, qiov.iov, qiov.niov, off);
-            if (len >= 0) {
-                off   += len;
-                total += len;
-            }
-        } while (len == -EINTR && !pdu->cancelled);
-        if (len < 0) {
-            /* IO error return the error */
-            err = len;
-            goto out_qiov;
-        }
-    } while (total < count && len > 0);
+    /* The data is taken straight from the guest buffers of the request */
+    err = v9fs_do_rw_iov(pdu, fidp, &qiov_full, off, true);
+    if (err < 0) {
+        goto out;
+    }
+    total = err;
 
     offset = 7;
     err = pdu_marshal(pdu, offset, "d", total);
@@ -2007,8 +2033,6 @@ static void v9fs_write(void *opaque)
     }
     err += offset;
     trace_v9fs_write_return(pdu->tag, pdu->id, total, err);
-out_qiov:
-    qemu_iovec_destroy(&qiov);
 out:
     put_fid(pdu, fidp);
 out_nofid:
@@ -3255,17 +3279,18 @@ static void submit_pdu(V9fsState *s, V9fsPDU *pdu)
 void handle_9p_output(VirtIODevice *vdev, VirtQueue *vq)
 {
     V9fsState *s = (V9fsState *)vdev;
+    VirtQueueElement *elem;
     V9fsPDU *pdu;
-    ssize_t len;
 
     while ((pdu = alloc_pdu(s)) &&
-            (len = virtqueue_pop(vq, &pdu->elem)) != 0) {
+            (elem = virtqueue_pop(vq, sizeof(VirtQueueElement))) != NULL) {
         uint8_t *ptr;
         pdu->s = s;
-        BUG_ON(pdu->elem.out_num == 0 || pdu->elem.in_num == 0);
-        BUG_ON(pdu->elem.out_sg[0].iov_len < 7);
+        pdu->elem = elem;
+        BUG_ON(pdu->elem->out_num == 0 || pdu->elem->in_num == 0);
+        BUG_ON(pdu->elem->out_sg[0].iov_len < 7);
 
-        ptr = pdu->elem.out_sg[0].iov_base;
+        ptr = pdu->elem->out_sg[0].iov_base;
 
         pdu->size = le32_to_cpu(*(uint32_t *)ptr);
         pdu->id = ptr[4];
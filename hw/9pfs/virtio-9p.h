@@ -122,6 +122,15 @@ static inline char *rpath(FsContext *ctx, const char *path)
  */
 #define P9_IOHDRSZ 24
 
+/* Smallest msize accepted in Tversion */
+#define P9_MIN_MSIZE    4096
+/*
+ * Largest msize offered in Rversion.  A request is limited to
+ * VIRTQUEUE_MAX_SIZE descriptors in each direction, and a guest doing
+ * zero-copy I/O may need one per page of payload plus one for the header.
+ */
+#define V9FS_MAX_MSIZE  ((VIRTQUEUE_MAX_SIZE - 1) * 4096)
+
 typedef struct V9fsPDU V9fsPDU;
 struct V9fsState;
 
@@ -132,7 +141,7 @@ struct V9fsPDU
     uint8_t id;
     uint8_t cancelled;
     CoQueue complete;
-    VirtQueueElement elem;
+    VirtQueueElement *elem;
     struct V9fsState *s;
     QLIST_ENTRY(V9fsPDU) next;
 };
@@ -197,6 +206,17 @@ struct V9fsFidState
     V9fsFidState *rclm_lst;
 };
 
+/*
+ * Directory entry fetched by v9fs_co_readdir_many(); path and st are
+ * only filled in when the caller asked for the entries to be stat'ed.
+ */
+typedef struct V9fsDirEnt {
+    struct dirent *dent;
+    V9fsPath path;
+    struct stat *st;
+    struct V9fsDirEnt *next;
+} V9fsDirEnt;
+
 typedef struct V9fsState
 {
     VirtIODevice parent_obj;
@@ -383,9 +403,9 @@ extern int v9fs_name_to_path(V9fsState *s, V9fsPath *dirpath,
                              const char *name, V9fsPath *path);
 
 #define pdu_marshal(pdu, offset, fmt, args...)  \
-    v9fs_marshal(pdu->elem.in_sg, pdu->elem.in_num, offset, 1, fmt, ##args)
+    v9fs_marshal(pdu->elem->in_sg, pdu->elem->in_num, offset, 1, fmt, ##args)
 #define pdu_unmarshal(pdu, offset, fmt, args...)  \
-    v9fs_unmarshal(pdu->elem.out_sg, pdu->elem.out_num, offset, 1, fmt, ##args)
+    v9fs_unmarshal(pdu->elem->out_sg, pdu->elem->out_num, offset, 1, fmt, ##args)
 
 #define TYPE_VIRTIO_9P "virtio-9p-device"
 #define VIRTIO_9P(obj) \
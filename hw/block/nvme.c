@@ -18,6 +18,13 @@
  * Usage: add options:
  *      -drive file=<file>,if=none,id=<drive_id>
  *      -device nvme,drive=<drive_id>,serial=<serial>,id=<id[optional]>
+ *
+ * Further namespaces, each backed by its own drive, can be attached with:
+ *      -device nvme-ns,drive=<drive_id>,bus=<id>.0,nsid=<nsid[optional]>
+ *
+ * The I/O queues can be run in an IOThread instead of the main loop:
+ *      -object iothread,id=<iothread_id>
+ *      -device nvme,...,iothread=<iothread_id>
  */
 
 #include <hw/block/block.h>
@@ -27,6 +34,8 @@
 #include "sysemu/sysemu.h"
 #include "qapi/visitor.h"
 #include "sysemu/block-backend.h"
+#include "sysemu/iothread.h"
+#include "sysemu/kvm.h"
 
 #include "nvme.h"
 
@@ -66,6 +75,70 @@ static uint8_t nvme_sq_empty(NvmeSQueue *sq)
     return sq->head == sq->tail;
 }
 
+static AioContext *nvme_queue_ctx(NvmeCtrl *n, uint16_t qid)
+{
+    /* The admin queues are always serviced from the main loop */
+    return qid ? n->ctx : qemu_get_aio_context();
+}
+
+static void nvme_ctx_acquire(NvmeCtrl *n)
+{
+    if (n->iothread) {
+        aio_context_acquire(n->ctx);
+    }
+}
+
+static void nvme_ctx_release(NvmeCtrl *n)
+{
+    if (n->iothread) {
+        aio_context_release(n->ctx);
+    }
+}
+
+static void nvme_update_sq_tail(NvmeSQueue *sq)
+{
+    NvmeCtrl *n = sq->ctrl;
+    uint32_t tail;
+
+    pci_dma_read(&n->parent_obj, n->dbbuf_dbs + (sq->sqid << 3), &tail,
+        sizeof(tail));
+    tail = le32_to_cpu(tail);
+    if (tail < sq->size) {
+        sq->tail = tail;
+    }
+}
+
+static void nvme_update_sq_eventidx(NvmeSQueue *sq)
+{
+    NvmeCtrl *n = sq->ctrl;
+    uint32_t eventidx = cpu_to_le32(sq->tail);
+
+    pci_dma_write(&n->parent_obj, n->dbbuf_eis + (sq->sqid << 3), &eventidx,
+        sizeof(eventidx));
+}
+
+static void nvme_update_cq_head(NvmeCQueue *cq)
+{
+    NvmeCtrl *n = cq->ctrl;
+    uint32_t head;
+
+    pci_dma_read(&n->parent_obj, n->dbbuf_dbs + (cq->cqid << 3) + 4, &head,
+        sizeof(head));
+    head = le32_to_cpu(head);
+    if (head < cq->size) {
+        cq->head = head;
+    }
+}
+
+static void nvme_update_cq_eventidx(NvmeCQueue *cq)
+{
+    NvmeCtrl *n = cq->ctrl;
+    uint32_t eventidx = cpu_to_le32(cq->head);
+
+    pci_dma_write(&n->parent_obj, n->dbbuf_eis + (cq->cqid << 3) + 4,
+        &eventidx, sizeof(eventidx));
+}
+
 static void nvme_isr_notify(NvmeCtrl *n, NvmeCQueue *cq)
 {
     if (cq->irq_enabled) {
@@ -77,6 +150,90 @@ static void nvme_isr_notify(NvmeCtrl *n, NvmeCQueue *cq)
     }
 }
 
+static void nvme_cq_irq_read(EventNotifier *e)
+{
+    NvmeCQueue *cq = container_of(e, NvmeCQueue, irq_notifier);
+
+    if (event_notifier_test_and_clear(e)) {
+        nvme_isr_notify(cq->ctrl, cq);
+    }
+}
+
+static void nvme_cq_notify(NvmeCtrl *n, NvmeCQueue *cq)
+{
+    if (!cq->irq_enabled) {
+        return;
+    }
+    if (cq->cqid && n->iothread) {
+        /* Interrupt injection needs the BQL, bounce it to the main loop */
+        event_notifier_set(&cq->irq_notifier);
+    } else {
+        nvme_isr_notify(n, cq);
+    }
+}
+
+static bool nvme_add_ioeventfd(NvmeCtrl *n, EventNotifier *e, hwaddr offset,
+    EventNotifierHandler *handler)
+{
+    if (!n->ioeventfd || !kvm_eventfds_enabled()) {
+        return false;
+    }
+    if (event_notifier_init(e, 0)) {
+        return false;
+    }
+    memory_region_add_eventfd(&n->iomem, offset, 4, false, 0, e);
+    aio_set_event_notifier(n->ctx, e, handler);
+    return true;
+}
+
+static void nvme_del_ioeventfd(NvmeCtrl *n, EventNotifier *e, hwaddr offset)
+{
+    memory_region_del_eventfd(&n->iomem, offset, 4, false, 0, e);
+    aio_set_event_notifier(n->ctx, e, NULL);
+    event_notifier_cleanup(e);
+}
+
+static void nvme_sq_notifier(EventNotifier *e)
+{
+    NvmeSQueue *sq = container_of(e, NvmeSQueue, notifier);
+
+    if (event_notifier_test_and_clear(e)) {
+        nvme_process_sq(sq);
+    }
+}
+
+static void nvme_cq_notifier(EventNotifier *e)
+{
+    NvmeCQueue *cq = container_of(e, NvmeCQueue, notifier);
+    NvmeSQueue *sq;
+
+    if (!event_notifier_test_and_clear(e)) {
+        return;
+    }
+
+    nvme_update_cq_head(cq);
+    QTAILQ_FOREACH(sq, &cq->sq_list, entry) {
+        qemu_bh_schedule(sq->bh);
+    }
+    qemu_bh_schedule(cq->bh);
+}
+
+static void nvme_init_sq_ioeventfd(NvmeCtrl *n, NvmeSQueue *sq)
+{
+    if (!sq->ioeventfd_enabled) {
+        sq->ioeventfd_enabled = nvme_add_ioeventfd(n, &sq->notifier,
+            0x1000 + (sq->sqid << 3), nvme_sq_notifier);
+    }
+}
+
+static void nvme_init_cq_ioeventfd(NvmeCtrl *n, NvmeCQueue *cq)
+{
+    if (!cq->ioeventfd_enabled) {
+        cq->ioeventfd_enabled = nvme_add_ioeventfd(n, &cq->notifier,
+            0x1000 + (cq->cqid << 3) + 4, nvme_cq_notifier);
+    }
+}
+
 static uint16_t nvme_map_prp(QEMUSGList *qsg, uint64_t prp1, uint64_t prp2,
     uint32_t len, NvmeCtrl *n)
 {
@@ -162,13 +319,30 @@ static void nvme_post_cqes(void *opaque)
     NvmeCQueue *cq = opaque;
     NvmeCtrl *n = cq->ctrl;
     NvmeRequest *req, *next;
+    bool dbbuf = n->dbbuf_enabled && cq->cqid;
+
+    if (dbbuf) {
+        nvme_update_cq_head(cq);
+    }
 
     QTAILQ_FOREACH_SAFE(req, &cq->req_list, entry, next) {
         NvmeSQueue *sq;
         hwaddr addr;
 
         if (nvme_cq_full(cq)) {
-            break;
+            if (!dbbuf) {
+                break;
+            }
+            /*
+             * Ask the host to ring the doorbell once it consumes an entry,
+             * then check again in case it already did.
+             */
+            nvme_update_cq_eventidx(cq);
+            smp_mb();
+            nvme_update_cq_head(cq);
+            if (nvme_cq_full(cq)) {
+                break;
+            }
         }
 
         QTAILQ_REMOVE(&cq->req_list, req, entry);
@@ -182,7 +356,7 @@ static void nvme_post_cqes(void *opaque)
             sizeof(req->cqe));
         QTAILQ_INSERT_TAIL(&sq->req_list, req, entry);
     }
-    nvme_isr_notify(n, cq);
+    nvme_cq_notify(n, cq);
 }
 
 static void nvme_enqueue_req_completion(NvmeCQueue *cq, NvmeRequest *req)
@@ -190,7 +364,7 @@ static void nvme_enqueue_req_completion(NvmeCQueue *cq, NvmeRequest *req)
     assert(cq->cqid == req->sq->cqid);
     QTAILQ_REMOVE(&req->sq->out_req_list, req, entry);
     QTAILQ_INSERT_TAIL(&cq->req_list, req, entry);
-    timer_mod(cq->timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) + 500);
+    qemu_bh_schedule(cq->bh);
 }
 
 static void nvme_rw_cb(void *opaque, int ret)
@@ -200,7 +374,7 @@ static void nvme_rw_cb(void *opaque, int ret)
     NvmeCtrl *n = sq->ctrl;
     NvmeCQueue *cq = n->cq[sq->cqid];
 
-    block_acct_done(blk_get_stats(n->conf.blk), &req->acct);
+    block_acct_done(blk_get_stats(req->ns->blk), &req->acct);
     if (!ret) {
         req->status = NVME_SUCCESS;
     } else {
@@ -211,6 +385,126 @@ static void nvme_rw_cb(void *opaque, int ret)
     nvme_enqueue_req_completion(cq, req);
 }
 
+static void nvme_write_zeroes_cb(void *opaque, int ret)
+{
+    NvmeRequest *req = opaque;
+    NvmeSQueue *sq = req->sq;
+    NvmeCtrl *n = sq->ctrl;
+    NvmeCQueue *cq = n->cq[sq->cqid];
+
+    block_acct_done(blk_get_stats(req->ns->blk), &req->acct);
+    req->status = ret ? NVME_INTERNAL_DEV_ERROR : NVME_SUCCESS;
+    nvme_enqueue_req_completion(cq, req);
+}
+
+static void nvme_dsm_cb(void *opaque, int ret)
+{
+    NvmeRequest *req = opaque;
+    NvmeSQueue *sq = req->sq;
+    NvmeCtrl *n = sq->ctrl;
+    NvmeCQueue *cq = n->cq[sq->cqid];
+    NvmeNamespace *ns = req->ns;
+    uint8_t data_shift =
+        ns->id_ns.lbaf[NVME_ID_NS_FLBAS_INDEX(ns->id_ns.flbas)].ds;
+    uint32_t max_nlb =
+        BDRV_REQUEST_MAX_SECTORS >> (data_shift - BDRV_SECTOR_BITS);
+
+    /*
+     * The ranges are discarded one after the other so that req->aiocb
+     * always names the single request nvme_del_sq() may have to cancel.
+     * Ranges too large for one discard are consumed in chunks.
+     */
+    while (!ret && req->dsm_idx < req->dsm_nr) {
+        NvmeDsmRange *range = &req->dsm_ranges[req->dsm_idx];
+        uint32_t nlb = MIN(range->nlb, max_nlb);
+
+        if (!nlb) {
+            req->dsm_idx++;
+            continue;
+        }
+
+        req->aiocb = blk_aio_discard(ns->blk,
+            range->slba << (data_shift - BDRV_SECTOR_BITS),
+            nlb << (data_shift - BDRV_SECTOR_BITS), nvme_dsm_cb, req);
+        range->slba += nlb;
+        range->nlb -= nlb;
+        return;
+    }
+
+    g_free(req->dsm_ranges);
+    req->dsm_ranges = NULL;
+    req->status = ret ? NVME_INTERNAL_DEV_ERROR : NVME_SUCCESS;
+    nvme_enqueue_req_completion(cq, req);
+}
+
+static uint16_t nvme_dsm(NvmeCtrl *n, NvmeNamespace *ns, NvmeCmd *cmd,
+    NvmeRequest *req)
+{
+    NvmeDsmCmd *dsm = (NvmeDsmCmd *)cmd;
+    uint32_t nr = (le32_to_cpu(dsm->nr) & 0xff) + 1;
+    uint32_t attributes = le32_to_cpu(dsm->attributes);
+    uint64_t prp1 = le64_to_cpu(dsm->prp1);
+    uint64_t prp2 = le64_to_cpu(dsm->prp2);
+    uint64_t nsze = le64_to_cpu(ns->id_ns.nsze);
+    NvmeDsmRange *ranges;
+    uint16_t status;
+    int i;
+
+    /* Only deallocation changes anything; the other attributes are hints */
+    if (!(attributes & NVME_DSMGMT_AD)) {
+        return NVME_SUCCESS;
+    }
+
+    ranges = g_new(NvmeDsmRange, nr);
+    status = nvme_dma_read_prp(n, (uint8_t *)ranges, nr * sizeof(*ranges),
+        prp1, prp2);
+    if (status) {
+        g_free(ranges);
+        return status;
+    }
+
+    for (i = 0; i < nr; i++) {
+        ranges[i].slba = le64_to_cpu(ranges[i].slba);
+        ranges[i].nlb = le32_to_cpu(ranges[i].nlb);
+        if (ranges[i].slba + ranges[i].nlb > nsze) {
+            g_free(ranges);
+            return NVME_LBA_RANGE | NVME_DNR;
+        }
+    }
+
+    req->dsm_ranges = ranges;
+    req->dsm_nr = nr;
+    req->dsm_idx = 0;
+    nvme_dsm_cb(req, 0);
+    return NVME_NO_COMPLETE;
+}
+
+static uint16_t nvme_write_zeroes(NvmeCtrl *n, NvmeNamespace *ns, NvmeCmd *cmd,
+    NvmeRequest *req)
+{
+    NvmeRwCmd *rw = (NvmeRwCmd *)cmd;
+    uint32_t nlb  = le16_to_cpu(rw->nlb) + 1;
+    uint64_t slba = le64_to_cpu(rw->slba);
+    uint16_t control = le16_to_cpu(rw->control);
+
+    uint8_t lba_index  = NVME_ID_NS_FLBAS_INDEX(ns->id_ns.flbas);
+    uint8_t data_shift = ns->id_ns.lbaf[lba_index].ds;
+    uint64_t aio_slba  = slba << (data_shift - BDRV_SECTOR_BITS);
+    int nb_sectors = nlb << (data_shift - BDRV_SECTOR_BITS);
+
+    if ((slba + nlb) > le64_to_cpu(ns->id_ns.nsze)) {
+        return NVME_LBA_RANGE | NVME_DNR;
+    }
+
+    block_acct_start(blk_get_stats(ns->blk), &req->acct,
+                     (uint64_t)nlb << data_shift, BLOCK_ACCT_WRITE);
+    req->aiocb = blk_aio_write_zeroes(ns->blk, aio_slba, nb_sectors,
+        control & NVME_RW_DEAC ? BDRV_REQ_MAY_UNMAP : 0,
+        nvme_write_zeroes_cb, req);
+
+    return NVME_NO_COMPLETE;
+}
+
 static uint16_t nvme_rw(NvmeCtrl *n, NvmeNamespace *ns, NvmeCmd *cmd,
     NvmeRequest *req)
 {
@@ -234,11 +528,11 @@ static uint16_t nvme_rw(NvmeCtrl *n, NvmeNamespace *ns, NvmeCmd *cmd,
     }
     assert((nlb << data_shift) == req->qsg.size);
 
-    dma_acct_start(n->conf.blk, &req->acct, &req->qsg,
+    dma_acct_start(ns->blk, &req->acct, &req->qsg,
                    is_write ? BLOCK_ACCT_WRITE : BLOCK_ACCT_READ);
     req->aiocb = is_write ?
-        dma_blk_write(n->conf.blk, &req->qsg, aio_slba, nvme_rw_cb, req) :
-        dma_blk_read(n->conf.blk, &req->qsg, aio_slba, nvme_rw_cb, req);
+        dma_blk_write(ns->blk, &req->qsg, aio_slba, nvme_rw_cb, req) :
+        dma_blk_read(ns->blk, &req->qsg, aio_slba, nvme_rw_cb, req);
 
     return NVME_NO_COMPLETE;
 }
@@ -252,13 +546,22 @@ static uint16_t nvme_io_cmd(NvmeCtrl *n, NvmeCmd *cmd, NvmeRequest *req)
         return NVME_INVALID_NSID | NVME_DNR;
     }
 
-    ns = &n->namespaces[nsid - 1];
+    ns = n->namespaces[nsid - 1];
+    if (!ns) {
+        return NVME_INVALID_NSID | NVME_DNR;
+    }
+
+    req->ns = ns;
     switch (cmd->opcode) {
     case NVME_CMD_FLUSH:
         return NVME_SUCCESS;
     case NVME_CMD_WRITE:
     case NVME_CMD_READ:
         return nvme_rw(n, ns, cmd, req);
+    case NVME_CMD_DSM:
+        return nvme_dsm(n, ns, cmd, req);
+    case NVME_CMD_WRITE_ZEROS:
+        return nvme_write_zeroes(n, ns, cmd, req);
     default:
         return NVME_INVALID_OPCODE | NVME_DNR;
     }
@@ -267,8 +570,11 @@ static uint16_t nvme_io_cmd(NvmeCtrl *n, NvmeCmd *cmd, NvmeRequest *req)
 static void nvme_free_sq(NvmeSQueue *sq, NvmeCtrl *n)
 {
     n->sq[sq->sqid] = NULL;
-    timer_del(sq->timer);
-    timer_free(sq->timer);
+    if (sq->ioeventfd_enabled) {
+        nvme_del_ioeventfd(n, &sq->notifier, 0x1000 + (sq->sqid << 3));
+        sq->ioeventfd_enabled = false;
+    }
+    qemu_bh_delete(sq->bh);
     g_free(sq->io_req);
     if (sq->sqid) {
         g_free(sq);
@@ -322,7 +628,7 @@ static void nvme_init_sq(NvmeSQueue *sq, NvmeCtrl *n, uint64_t dma_addr,
     sq->size = size;
     sq->cqid = cqid;
     sq->head = sq->tail = 0;
-    sq->io_req = g_new(NvmeRequest, sq->size);
+    sq->io_req = g_new0(NvmeRequest, sq->size);
 
     QTAILQ_INIT(&sq->req_list);
     QTAILQ_INIT(&sq->out_req_list);
@@ -330,12 +636,17 @@ static void nvme_init_sq(NvmeSQueue *sq, NvmeCtrl *n, uint64_t dma_addr,
         sq->io_req[i].sq = sq;
         QTAILQ_INSERT_TAIL(&(sq->req_list), &sq->io_req[i], entry);
     }
-    sq->timer = timer_new_ns(QEMU_CLOCK_VIRTUAL, nvme_process_sq, sq);
+    sq->bh = aio_bh_new(nvme_queue_ctx(n, sqid), nvme_process_sq, sq);
+    sq->ioeventfd_enabled = false;
 
     assert(n->cq[cqid]);
     cq = n->cq[cqid];
     QTAILQ_INSERT_TAIL(&(cq->sq_list), sq, entry);
     n->sq[sqid] = sq;
+
+    if (sqid && n->dbbuf_enabled) {
+        nvme_init_sq_ioeventfd(n, sq);
+    }
 }
 
 static uint16_t nvme_create_sq(NvmeCtrl *n, NvmeCmd *cmd)
@@ -372,8 +683,15 @@ static uint16_t nvme_create_sq(NvmeCtrl *n, NvmeCmd *cmd)
 static void nvme_free_cq(NvmeCQueue *cq, NvmeCtrl *n)
 {
     n->cq[cq->cqid] = NULL;
-    timer_del(cq->timer);
-    timer_free(cq->timer);
+    if (cq->ioeventfd_enabled) {
+        nvme_del_ioeventfd(n, &cq->notifier, 0x1000 + (cq->cqid << 3) + 4);
+        cq->ioeventfd_enabled = false;
+    }
+    if (cq->cqid && n->iothread) {
+        event_notifier_set_handler(&cq->irq_notifier, NULL);
+        event_notifier_cleanup(&cq->irq_notifier);
+    }
+    qemu_bh_delete(cq->bh);
     msix_vector_unuse(&n->parent_obj, cq->vector);
     if (cq->cqid) {
         g_free(cq);
@@ -413,7 +731,15 @@ static void nvme_init_cq(NvmeCQueue *cq, NvmeCtrl *n, uint64_t dma_addr,
     QTAILQ_INIT(&cq->sq_list);
     msix_vector_use(&n->parent_obj, cq->vector);
     n->cq[cqid] = cq;
-    cq->timer = timer_new_ns(QEMU_CLOCK_VIRTUAL, nvme_post_cqes, cq);
+    cq->bh = aio_bh_new(nvme_queue_ctx(n, cqid), nvme_post_cqes, cq);
+    cq->ioeventfd_enabled = false;
+    if (cqid && n->iothread) {
+        event_notifier_init(&cq->irq_notifier, 0);
+        event_notifier_set_handler(&cq->irq_notifier, nvme_cq_irq_read);
+    }
+    if (cqid && n->dbbuf_enabled) {
+        nvme_init_cq_ioeventfd(n, cq);
+    }
 }
 
 static uint16_t nvme_create_cq(NvmeCtrl *n, NvmeCmd *cmd)
@@ -465,7 +791,17 @@ static uint16_t nvme_identify(NvmeCtrl *n, NvmeCmd *cmd)
         return NVME_INVALID_NSID | NVME_DNR;
     }
 
-    ns = &n->namespaces[nsid - 1];
+    ns = n->namespaces[nsid - 1];
+    if (!ns) {
+        /* Inactive namespace IDs report an all-zero structure */
+        NvmeIdNs *id_ns = g_new0(NvmeIdNs, 1);
+        uint16_t ret;
+
+        ret = nvme_dma_read_prp(n, (uint8_t *)id_ns, sizeof(*id_ns),
+            prp1, prp2);
+        g_free(id_ns);
+        return ret;
+    }
     return nvme_dma_read_prp(n, (uint8_t *)&ns->id_ns, sizeof(ns->id_ns),
         prp1, prp2);
 }
@@ -500,6 +836,47 @@ static uint16_t nvme_set_feature(NvmeCtrl *n, NvmeCmd *cmd, NvmeRequest *req)
     return NVME_SUCCESS;
 }
 
+static uint16_t nvme_dbbuf_config(NvmeCtrl *n, NvmeCmd *cmd)
+{
+    uint64_t dbs_addr = le64_to_cpu(cmd->prp1);
+    uint64_t eis_addr = le64_to_cpu(cmd->prp2);
+    int i;
+
+    if (!dbs_addr || !eis_addr ||
+            (dbs_addr | eis_addr) & (n->page_size - 1)) {
+        return NVME_INVALID_FIELD | NVME_DNR;
+    }
+
+    n->dbbuf_dbs = dbs_addr;
+    n->dbbuf_eis = eis_addr;
+    n->dbbuf_enabled = true;
+
+    /*
+     * The admin queues keep using their MMIO doorbells.  Seed the shadow
+     * buffers of any I/O queue created before the command so the host and
+     * the controller agree on where they are.
+     */
+    for (i = 1; i < n->num_queues; i++) {
+        NvmeSQueue *sq = n->sq[i];
+        NvmeCQueue *cq = n->cq[i];
+        uint32_t v;
+
+        if (sq) {
+            v = cpu_to_le32(sq->tail);
+            pci_dma_write(&n->parent_obj, dbs_addr + (i << 3), &v, sizeof(v));
+            nvme_update_sq_eventidx(sq);
+            nvme_init_sq_ioeventfd(n, sq);
+        }
+        if (cq) {
+            v = cpu_to_le32(cq->head);
+            pci_dma_write(&n->parent_obj, dbs_addr + (i << 3) + 4, &v,
+                sizeof(v));
+            nvme_init_cq_ioeventfd(n, cq);
+        }
+    }
+    return NVME_SUCCESS;
+}
+
 static uint16_t nvme_admin_cmd(NvmeCtrl *n, NvmeCmd *cmd, NvmeRequest *req)
 {
     switch (cmd->opcode) {
@@ -517,6 +894,8 @@ static uint16_t nvme_admin_cmd(NvmeCtrl *n, NvmeCmd *cmd, NvmeRequest *req)
         return nvme_set_feature(n, cmd, req);
     case NVME_ADM_CMD_GET_FEATURES:
         return nvme_get_feature(n, cmd, req);
+    case NVME_ADM_CMD_DBBUF_CONFIG:
+        return nvme_dbbuf_config(n, cmd);
     default:
         return NVME_INVALID_OPCODE | NVME_DNR;
     }
@@ -532,24 +911,52 @@ static void nvme_process_sq(void *opaque)
     hwaddr addr;
     NvmeCmd cmd;
     NvmeRequest *req;
+    bool dbbuf;
+
+    /* Admin commands may create and delete the IOThread's queues */
+    if (!sq->sqid) {
+        nvme_ctx_acquire(n);
+    }
 
-    while (!(nvme_sq_empty(sq) || QTAILQ_EMPTY(&sq->req_list))) {
-        addr = sq->dma_addr + sq->head * n->sqe_size;
-        pci_dma_read(&n->parent_obj, addr, (void *)&cmd, sizeof(cmd));
-        nvme_inc_sq_head(sq);
-
-        req = QTAILQ_FIRST(&sq->req_list);
-        QTAILQ_REMOVE(&sq->req_list, req, entry);
-        QTAILQ_INSERT_TAIL(&sq->out_req_list, req, entry);
-        memset(&req->cqe, 0, sizeof(req->cqe));
-        req->cqe.cid = cmd.cid;
-
-        status = sq->sqid ? nvme_io_cmd(n, &cmd, req) :
-            nvme_admin_cmd(n, &cmd, req);
-        if (status != NVME_NO_COMPLETE) {
-            req->status = status;
-            nvme_enqueue_req_completion(cq, req);
+    dbbuf = n->dbbuf_enabled && sq->sqid;
+    if (dbbuf) {
+        nvme_update_sq_tail(sq);
+    }
+
+    do {
+        while (!(nvme_sq_empty(sq) || QTAILQ_EMPTY(&sq->req_list))) {
+            addr = sq->dma_addr + sq->head * n->sqe_size;
+            pci_dma_read(&n->parent_obj, addr, (void *)&cmd, sizeof(cmd));
+            nvme_inc_sq_head(sq);
+
+            req = QTAILQ_FIRST(&sq->req_list);
+            QTAILQ_REMOVE(&sq->req_list, req, entry);
+            QTAILQ_INSERT_TAIL(&sq->out_req_list, req, entry);
+            memset(&req->cqe, 0, sizeof(req->cqe));
+            req->cqe.cid = cmd.cid;
+
+            status = sq->sqid ? nvme_io_cmd(n, &cmd, req) :
+                nvme_admin_cmd(n, &cmd, req);
+            if (status != NVME_NO_COMPLETE) {
+                req->status = status;
+                nvme_enqueue_req_completion(cq, req);
+            }
+        }
+
+        if (!dbbuf) {
+            break;
         }
+        /*
+         * Publish how far we got so the host only rings the doorbell for
+         * new entries, then pick up anything queued in the meantime.
+         */
+        nvme_update_sq_eventidx(sq);
+        smp_mb();
+        nvme_update_sq_tail(sq);
+    } while (!(nvme_sq_empty(sq) || QTAILQ_EMPTY(&sq->req_list)));
+
+    if (!sq->sqid) {
+        nvme_ctx_release(n);
     }
 }
 
@@ -557,6 +964,7 @@ static void nvme_clear_ctrl(NvmeCtrl *n)
 {
     int i;
 
+    nvme_ctx_acquire(n);
     for (i = 0; i < n->num_queues; i++) {
         if (n->sq[i] != NULL) {
             nvme_free_sq(n->sq[i], n);
@@ -567,8 +975,21 @@ static void nvme_clear_ctrl(NvmeCtrl *n)
             nvme_free_cq(n->cq[i], n);
         }
     }
+    n->dbbuf_enabled = false;
+    n->dbbuf_dbs = n->dbbuf_eis = 0;
+
+    for (i = 0; i < n->num_namespaces; i++) {
+        NvmeNamespace *ns = n->namespaces[i];
 
-    blk_flush(n->conf.blk);
+        if (!ns) {
+            continue;
+        }
+        blk_flush(ns->blk);
+        if (blk_get_aio_context(ns->blk) != qemu_get_aio_context()) {
+            blk_set_aio_context(ns->blk, qemu_get_aio_context());
+        }
+    }
+    nvme_ctx_release(n);
     n->bar.cc = 0;
 }
 
@@ -599,6 +1020,17 @@ static int nvme_start_ctrl(NvmeCtrl *n)
     nvme_init_sq(&n->admin_sq, n, n->bar.asq, 0, 0,
         NVME_AQA_ASQS(n->bar.aqa) + 1);
 
+    if (n->iothread) {
+        int i;
+
+        aio_context_acquire(n->ctx);
+        for (i = 0; i < n->num_namespaces; i++) {
+            if (n->namespaces[i]) {
+                blk_set_aio_context(n->namespaces[i]->blk, n->ctx);
+            }
+        }
+        aio_context_release(n->ctx);
+    }
     return 0;
 }
 
@@ -702,9 +1134,9 @@ static void nvme_process_db(NvmeCtrl *n, hwaddr addr, int val)
         if (start_sqs) {
             NvmeSQueue *sq;
             QTAILQ_FOREACH(sq, &cq->sq_list, entry) {
-                timer_mod(sq->timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) + 500);
+                qemu_bh_schedule(sq->bh);
             }
-            timer_mod(cq->timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) + 500);
+            qemu_bh_schedule(cq->bh);
         }
 
         if (cq->tail != cq->head) {
@@ -725,7 +1157,7 @@ static void nvme_process_db(NvmeCtrl *n, hwaddr addr, int val)
         }
 
         sq->tail = new_tail;
-        timer_mod(sq->timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) + 500);
+        qemu_bh_schedule(sq->bh);
     }
 }
 
@@ -736,7 +1168,9 @@ static void nvme_mmio_write(void *opaque, hwaddr addr, uint64_t data,
     if (addr < sizeof(n->bar)) {
         nvme_write_bar(n, addr, data, size);
     } else if (addr >= 0x1000) {
+        nvme_ctx_acquire(n);
         nvme_process_db(n, addr, data);
+        nvme_ctx_release(n);
     }
 }
 
@@ -750,29 +1184,78 @@ static const MemoryRegionOps nvme_mmio_ops = {
     },
 };
 
+static void nvme_ns_init(NvmeCtrl *n, NvmeNamespace *ns, BlockBackend *blk,
+    uint32_t nsid, int64_t size)
+{
+    NvmeIdNs *id_ns = &ns->id_ns;
+    uint8_t lba_index;
+
+    ns->blk = blk;
+    ns->nsid = nsid;
+    id_ns->nsfeat = 0;
+    id_ns->nlbaf = 0;
+    id_ns->flbas = 0;
+    id_ns->mc = 0;
+    id_ns->dpc = 0;
+    id_ns->dps = 0;
+    id_ns->lbaf[0].ds = BDRV_SECTOR_BITS;
+    lba_index = NVME_ID_NS_FLBAS_INDEX(id_ns->flbas);
+    id_ns->ncap  = id_ns->nuse = id_ns->nsze =
+        cpu_to_le64(size >> id_ns->lbaf[lba_index].ds);
+
+    if (n->iothread) {
+        blk_op_block_all(blk, n->blocker);
+        blk_op_unblock(blk, BLOCK_OP_TYPE_DRIVE_DEL, n->blocker);
+        blk_op_unblock(blk, BLOCK_OP_TYPE_BACKUP_SOURCE, n->blocker);
+        blk_op_unblock(blk, BLOCK_OP_TYPE_COMMIT_SOURCE, n->blocker);
+        blk_op_unblock(blk, BLOCK_OP_TYPE_COMMIT_TARGET, n->blocker);
+        blk_op_unblock(blk, BLOCK_OP_TYPE_EXTERNAL_SNAPSHOT, n->blocker);
+        blk_op_unblock(blk, BLOCK_OP_TYPE_INTERNAL_SNAPSHOT, n->blocker);
+        blk_op_unblock(blk, BLOCK_OP_TYPE_INTERNAL_SNAPSHOT_DELETE,
+                       n->blocker);
+        blk_op_unblock(blk, BLOCK_OP_TYPE_MIRROR, n->blocker);
+        blk_op_unblock(blk, BLOCK_OP_TYPE_STREAM, n->blocker);
+        blk_op_unblock(blk, BLOCK_OP_TYPE_REPLACE, n->blocker);
+    }
+
+    n->namespaces[nsid - 1] = ns;
+    if (nsid > n->num_namespaces) {
+        n->num_namespaces = nsid;
+        n->id_ctrl.nn = cpu_to_le32(nsid);
+    }
+}
+
+static void nvme_ns_cleanup(NvmeCtrl *n, NvmeNamespace *ns)
+{
+    n->namespaces[ns->nsid - 1] = NULL;
+    if (n->iothread) {
+        blk_op_unblock_all(ns->blk, n->blocker);
+    }
+}
+
 static int nvme_init(PCIDevice *pci_dev)
 {
     NvmeCtrl *n = NVME(pci_dev);
     NvmeIdCtrl *id = &n->id_ctrl;
 
-    int i;
-    int64_t bs_size;
+    int64_t bs_size = 0;
     uint8_t *pci_conf;
 
-    if (!n->conf.blk) {
-        return -1;
-    }
-
-    bs_size = blk_getlength(n->conf.blk);
-    if (bs_size < 0) {
-        return -1;
+    /*
+     * The drive property is optional now that namespaces can also be
+     * attached as nvme-ns devices, but it still provides namespace 1.
+     */
+    if (n->conf.blk) {
+        bs_size = blk_getlength(n->conf.blk);
+        if (bs_size < 0) {
+            return -1;
+        }
+        blkconf_serial(&n->conf, &n->serial);
+        blkconf_blocksizes(&n->conf);
     }
-
-    blkconf_serial(&n->conf, &n->serial);
     if (!n->serial) {
         return -1;
     }
-    blkconf_blocksizes(&n->conf);
 
     pci_conf = pci_dev->config;
     pci_conf[PCI_INTERRUPT_PIN] = 1;
@@ -780,12 +1263,16 @@ static int nvme_init(PCIDevice *pci_dev)
     pci_config_set_class(pci_dev->config, PCI_CLASS_STORAGE_EXPRESS);
     pcie_endpoint_cap_init(&n->parent_obj, 0x80);
 
-    n->num_namespaces = 1;
+    if (n->iothread) {
+        n->ctx = iothread_get_aio_context(n->iothread);
+        error_setg(&n->blocker, "block device is in use by data plane");
+    } else {
+        n->ctx = qemu_get_aio_context();
+    }
+
     n->num_queues = 64;
     n->reg_size = 1 << qemu_fls(0x1004 + 2 * (n->num_queues + 1) * 4);
-    n->ns_size = bs_size / (uint64_t)n->num_namespaces;
 
-    n->namespaces = g_new0(NvmeNamespace, n->num_namespaces);
     n->sq = g_new0(NvmeSQueue *, n->num_queues);
     n->cq = g_new0(NvmeCQueue *, n->num_queues);
 
@@ -805,12 +1292,12 @@ static int nvme_init(PCIDevice *pci_dev)
     id->ieee[0] = 0x00;
     id->ieee[1] = 0x02;
     id->ieee[2] = 0xb3;
-    id->oacs = cpu_to_le16(0);
+    id->oacs = cpu_to_le16(NVME_OACS_DBBUF);
     id->frmw = 7 << 1;
     id->lpa = 1 << 0;
     id->sqes = (0x6 << 4) | 0x6;
     id->cqes = (0x4 << 4) | 0x4;
-    id->nn = cpu_to_le32(n->num_namespaces);
+    id->oncs = cpu_to_le16(NVME_ONCS_DSM | NVME_ONCS_WRITE_ZEROS);
     id->psd[0].mp = cpu_to_le16(0x9c4);
     id->psd[0].enlat = cpu_to_le32(0x10);
     id->psd[0].exlat = cpu_to_le32(0x4);
@@ -826,19 +1313,10 @@ static int nvme_init(PCIDevice *pci_dev)
     n->bar.vs = 0x00010100;
     n->bar.intmc = n->bar.intms = 0;
 
-    for (i = 0; i < n->num_namespaces; i++) {
-        NvmeNamespace *ns = &n->namespaces[i];
-        NvmeIdNs *id_ns = &ns->id_ns;
-        id_ns->nsfeat = 0;
-        id_ns->nlbaf = 0;
-        id_ns->flbas = 0;
-        id_ns->mc = 0;
-        id_ns->dpc = 0;
-        id_ns->dps = 0;
-        id_ns->lbaf[0].ds = BDRV_SECTOR_BITS;
-        id_ns->ncap  = id_ns->nuse = id_ns->nsze =
-            cpu_to_le64(n->ns_size >>
-                id_ns->lbaf[NVME_ID_NS_FLBAS_INDEX(ns->id_ns.flbas)].ds);
+    qbus_create_inplace(&n->bus, sizeof(n->bus), TYPE_NVME_BUS,
+                        DEVICE(pci_dev), NULL);
+    if (n->conf.blk) {
+        nvme_ns_init(n, &n->drive_ns, n->conf.blk, 1, bs_size);
     }
     return 0;
 }
@@ -848,7 +1326,12 @@ static void nvme_exit(PCIDevice *pci_dev)
     NvmeCtrl *n = NVME(pci_dev);
 
     nvme_clear_ctrl(n);
-    g_free(n->namespaces);
+    if (n->conf.blk) {
+        nvme_ns_cleanup(n, &n->drive_ns);
+    }
+    if (n->iothread) {
+        error_free(n->blocker);
+    }
     g_free(n->cq);
     g_free(n->sq);
     msix_uninit_exclusive_bar(pci_dev);
@@ -857,6 +1340,7 @@ static void nvme_exit(PCIDevice *pci_dev)
 static Property nvme_props[] = {
     DEFINE_BLOCK_PROPERTIES(NvmeCtrl, conf),
     DEFINE_PROP_STRING("serial", NvmeCtrl, serial),
+    DEFINE_PROP_BOOL("ioeventfd", NvmeCtrl, ioeventfd, true),
     DEFINE_PROP_END_OF_LIST(),
 };
 
@@ -923,6 +1407,10 @@ static void nvme_instance_init(Object *obj)
                         nvme_get_bootindex,
                         nvme_set_bootindex, NULL, NULL, NULL);
     object_property_set_int(obj, -1, "bootindex", NULL);
+    object_property_add_link(obj, "iothread", TYPE_IOTHREAD,
+                             (Object **)&NVME(obj)->iothread,
+                             qdev_prop_allow_set_link_before_realize,
+                             OBJ_PROP_LINK_UNREF_ON_RELEASE, NULL);
 }
 
 static const TypeInfo nvme_info = {
@@ -933,9 +1421,95 @@ static const TypeInfo nvme_info = {
     .instance_init = nvme_instance_init,
 };
 
+static const TypeInfo nvme_bus_info = {
+    .name          = TYPE_NVME_BUS,
+    .parent        = TYPE_BUS,
+    .instance_size = sizeof(NvmeBus),
+};
+
+static void nvme_ns_realize(DeviceState *dev, Error **errp)
+{
+    NvmeNamespaceDevice *d = NVME_NS(dev);
+    NvmeCtrl *n = NVME(dev->parent_bus->parent);
+    uint32_t nsid = d->nsid;
+    int64_t size;
+
+    if (!d->conf.blk) {
+        error_setg(errp, "drive property not set");
+        return;
+    }
+
+    if (!nsid) {
+        for (nsid = 1; nsid <= NVME_MAX_NAMESPACES; nsid++) {
+            if (!n->namespaces[nsid - 1]) {
+                break;
+            }
+        }
+    }
+    if (nsid > NVME_MAX_NAMESPACES) {
+        error_setg(errp, "nsid must be between 1 and %d",
+                   NVME_MAX_NAMESPACES);
+        return;
+    }
+    if (n->namespaces[nsid - 1]) {
+        error_setg(errp, "nsid %" PRIu32 " is already in use", nsid);
+        return;
+    }
+
+    size = blk_getlength(d->conf.blk);
+    if (size < 0) {
+        error_setg_errno(errp, -size, "could not get size of drive");
+        return;
+    }
+    blkconf_blocksizes(&d->conf);
+
+    nvme_ns_init(n, &d->ns, d->conf.blk, nsid, size);
+}
+
+static void nvme_ns_unrealize(DeviceState *dev, Error **errp)
+{
+    NvmeNamespaceDevice *d = NVME_NS(dev);
+    NvmeCtrl *n = NVME(dev->parent_bus->parent);
+
+    nvme_ctx_acquire(n);
+    blk_drain_all();
+    if (blk_get_aio_context(d->ns.blk) != qemu_get_aio_context()) {
+        blk_set_aio_context(d->ns.blk, qemu_get_aio_context());
+    }
+    nvme_ns_cleanup(n, &d->ns);
+    nvme_ctx_release(n);
+}
+
+static Property nvme_ns_props[] = {
+    DEFINE_BLOCK_PROPERTIES(NvmeNamespaceDevice, conf),
+    DEFINE_PROP_UINT32("nsid", NvmeNamespaceDevice, nsid, 0),
+    DEFINE_PROP_END_OF_LIST(),
+};
+
+static void nvme_ns_class_init(ObjectClass *oc, void *data)
+{
+    DeviceClass *dc = DEVICE_CLASS(oc);
+
+    dc->bus_type = TYPE_NVME_BUS;
+    dc->realize = nvme_ns_realize;
+    dc->unrealize = nvme_ns_unrealize;
+    set_bit(DEVICE_CATEGORY_STORAGE, dc->categories);
+    dc->desc = "NVMe namespace";
+    dc->props = nvme_ns_props;
+}
+
+static const TypeInfo nvme_ns_info = {
+    .name          = TYPE_NVME_NS,
+    .parent        = TYPE_DEVICE,
+    .instance_size = sizeof(NvmeNamespaceDevice),
+    .class_init    = nvme_ns_class_init,
+};
+
 static void nvme_register_types(void)
 {
     type_register_static(&nvme_info);
+    type_register_static(&nvme_bus_info);
+    type_register_static(&nvme_ns_info);
 }
 
 type_init(nvme_register_types)
@@ -167,6 +167,7 @@ enum NvmeAdminCommands {
     NVME_ADM_CMD_ASYNC_EV_REQ   = 0x0c,
     NVME_ADM_CMD_ACTIVATE_FW    = 0x10,
     NVME_ADM_CMD_DOWNLOAD_FW    = 0x11,
+    NVME_ADM_CMD_DBBUF_CONFIG   = 0x7c,
     NVME_ADM_CMD_FORMAT_NVM     = 0x80,
     NVME_ADM_CMD_SECURITY_SEND  = 0x81,
     NVME_ADM_CMD_SECURITY_RECV  = 0x82,
@@ -178,6 +179,7 @@ enum NvmeIoCommands {
     NVME_CMD_READ               = 0x02,
     NVME_CMD_WRITE_UNCOR        = 0x04,
     NVME_CMD_COMPARE            = 0x05,
+    NVME_CMD_WRITE_ZEROS        = 0x08,
     NVME_CMD_DSM                = 0x09,
 };
 
@@ -281,6 +283,7 @@ enum {
     NVME_RW_DSM_LATENCY_LOW     = 3 << 4,
     NVME_RW_DSM_SEQ_REQ         = 1 << 6,
     NVME_RW_DSM_COMPRESSED      = 1 << 7,
+    NVME_RW_DEAC                = 1 << 9,
     NVME_RW_PRINFO_PRACT        = 1 << 13,
     NVME_RW_PRINFO_PRCHK_GUARD  = 1 << 12,
     NVME_RW_PRINFO_PRCHK_APP    = 1 << 11,
@@ -503,6 +506,7 @@ enum NvmeIdCtrlOacs {
     NVME_OACS_SECURITY  = 1 << 0,
     NVME_OACS_FORMAT    = 1 << 1,
     NVME_OACS_FW        = 1 << 2,
+    NVME_OACS_DBBUF     = 1 << 8,
 };
 
 enum NvmeIdCtrlOncs {
@@ -636,11 +640,15 @@ typedef struct NvmeAsyncEvent {
 
 typedef struct NvmeRequest {
     struct NvmeSQueue       *sq;
+    struct NvmeNamespace    *ns;
     BlockAIOCB              *aiocb;
     uint16_t                status;
     NvmeCqe                 cqe;
     BlockAcctCookie         acct;
     QEMUSGList              qsg;
+    NvmeDsmRange            *dsm_ranges;
+    uint32_t                dsm_nr;
+    uint32_t                dsm_idx;
     QTAILQ_ENTRY(NvmeRequest)entry;
 } NvmeRequest;
 
@@ -652,7 +660,9 @@ typedef struct NvmeSQueue {
     uint32_t    tail;
     uint32_t    size;
     uint64_t    dma_addr;
-    QEMUTimer   *timer;
+    QEMUBH      *bh;
+    EventNotifier notifier;
+    bool        ioeventfd_enabled;
     NvmeRequest *io_req;
     QTAILQ_HEAD(sq_req_list, NvmeRequest) req_list;
     QTAILQ_HEAD(out_req_list, NvmeRequest) out_req_list;
@@ -669,15 +679,39 @@ typedef struct NvmeCQueue {
     uint32_t    vector;
     uint32_t    size;
     uint64_t    dma_addr;
-    QEMUTimer   *timer;
+    QEMUBH      *bh;
+    EventNotifier notifier;
+    EventNotifier irq_notifier;
+    bool        ioeventfd_enabled;
     QTAILQ_HEAD(sq_list, NvmeSQueue) sq_list;
     QTAILQ_HEAD(cq_req_list, NvmeRequest) req_list;
 } NvmeCQueue;
 
+#define NVME_MAX_NAMESPACES 256
+
 typedef struct NvmeNamespace {
+    BlockBackend    *blk;
+    uint32_t        nsid;
     NvmeIdNs        id_ns;
 } NvmeNamespace;
 
+#define TYPE_NVME_BUS "nvme-bus"
+
+typedef struct NvmeBus {
+    BusState parent_bus;
+} NvmeBus;
+
+#define TYPE_NVME_NS "nvme-ns"
+#define NVME_NS(obj) \
+        OBJECT_CHECK(NvmeNamespaceDevice, (obj), TYPE_NVME_NS)
+
+typedef struct NvmeNamespaceDevice {
+    DeviceState     parent_obj;
+    BlockConf       conf;
+    uint32_t        nsid;
+    NvmeNamespace   ns;
+} NvmeNamespaceDevice;
+
 #define TYPE_NVME "nvme"
 #define NVME(obj) \
         OBJECT_CHECK(NvmeCtrl, (obj), TYPE_NVME)
@@ -697,10 +731,20 @@ typedef struct NvmeCtrl {
     uint32_t    num_namespaces;
     uint32_t    num_queues;
     uint32_t    max_q_ents;
-    uint64_t    ns_size;
+    bool        ioeventfd;
+
+    /* Shadow doorbell and event index buffers (Doorbell Buffer Config) */
+    bool        dbbuf_enabled;
+    uint64_t    dbbuf_dbs;
+    uint64_t    dbbuf_eis;
 
+    IOThread        *iothread;
+    AioContext      *ctx;
+    Error           *blocker;
     char            *serial;
-    NvmeNamespace   *namespaces;
+    NvmeBus         bus;
+    NvmeNamespace   drive_ns;
+    NvmeNamespace   *namespaces[NVME_MAX_NAMESPACES];
     NvmeSQueue      **sq;
     NvmeCQueue      **cq;
     NvmeSQueue      admin_sq;
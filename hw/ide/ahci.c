@@ -45,6 +45,7 @@ do { \
 } while (0)
 
 static void check_cmd(AHCIState *s, int port);
+static void ahci_submit_ncq_batch(AHCIDevice *ad);
 static int handle_cmd(AHCIState *s,int port,int slot);
 static void ahci_reset_port(AHCIState *s, int port);
 static void ahci_write_fis_d2h(AHCIDevice *ad, uint8_t *cmd_fis);
@@ -458,6 +459,7 @@ static void check_cmd(AHCIState *s, int port)
                 pr->cmd_issue &= ~(1U << slot);
             }
         }
+        ahci_submit_ncq_batch(&s->dev[port]);
     }
 }
 
@@ -521,17 +523,22 @@ static void ahci_reset_port(AHCIState *s, int port)
         return;
     }
 
-    /* reset ncq queue */
+    /* reset ncq queue, dropping commands that were not submitted yet */
+    d->ncq_batch_len = 0;
     for (i = 0; i < AHCI_MAX_CMDS; i++) {
         NCQTransferState *ncq_tfs = &s->dev[port].ncq_tfs[i];
         if (!ncq_tfs->used) {
             continue;
         }
 
+        /* This also takes care of the commands merged into the request */
         if (ncq_tfs->aiocb) {
             blk_aio_cancel(ncq_tfs->aiocb);
             ncq_tfs->aiocb = NULL;
         }
+    }
+    for (i = 0; i < AHCI_MAX_CMDS; i++) {
+        NCQTransferState *ncq_tfs = &s->dev[port].ncq_tfs[i];
 
         /* Maybe we just finished the request thanks to blk_aio_cancel() */
         if (!ncq_tfs->used) {
@@ -539,6 +546,7 @@ static void ahci_reset_port(AHCIState *s, int port)
         }
 
         qemu_sglist_destroy(&ncq_tfs->sglist);
+        ncq_tfs->next = NULL;
         ncq_tfs->used = 0;
     }
 
@@ -868,33 +876,142 @@ out:
 static void ncq_cb(void *opaque, int ret)
 {
     NCQTransferState *ncq_tfs = (NCQTransferState *)opaque;
-    IDEState *ide_state = &ncq_tfs->drive->port.ifs[0];
+    AHCIDevice *ad = ncq_tfs->drive;
+    IDEState *ide_state = &ad->port.ifs[0];
+    NCQTransferState *next;
+    uint32_t finished = 0;
 
     if (ret == -ECANCELED) {
         return;
     }
-    /* Clear bit for this tag in SActive */
-    ncq_tfs->drive->port_regs.scr_act &= ~(1 << ncq_tfs->tag);
 
     if (ret < 0) {
         /* error */
         ide_state->error = ABRT_ERR;
         ide_state->status = READY_STAT | ERR_STAT;
-        ncq_tfs->drive->port_regs.scr_err |= (1 << ncq_tfs->tag);
     } else {
         ide_state->status = READY_STAT | SEEK_STAT;
     }
 
-    ahci_write_fis_sdb(ncq_tfs->drive->hba, ncq_tfs->drive->port_no,
-                       (1 << ncq_tfs->tag));
+    /* Complete all the commands that were merged into this request */
+    for (; ncq_tfs; ncq_tfs = next) {
+        next = ncq_tfs->next;
+
+        /* Clear bit for this tag in SActive */
+        ad->port_regs.scr_act &= ~(1 << ncq_tfs->tag);
+        if (ret < 0) {
+            ad->port_regs.scr_err |= (1 << ncq_tfs->tag);
+        }
+        finished |= 1 << ncq_tfs->tag;
+
+        DPRINTF(ad->port_no, "NCQ transfer tag %d finished\n", ncq_tfs->tag);
+
+        block_acct_done(blk_get_stats(ide_state->blk), &ncq_tfs->acct);
+        qemu_sglist_destroy(&ncq_tfs->sglist);
+        ncq_tfs->aiocb = NULL;
+        ncq_tfs->next = NULL;
+        ncq_tfs->used = 0;
+    }
+
+    ahci_write_fis_sdb(ad->hba, ad->port_no, finished);
+}
+
+static void ncq_submit(NCQTransferState *ncq_tfs, bool is_write,
+                       int num_merged)
+{
+    BlockBackend *blk = ncq_tfs->drive->port.ifs[0].blk;
+
+    if (num_merged) {
+        DPRINTF(ncq_tfs->drive->port_no, "tag %d merged with %d more tags, "
+                "%"PRId64" bytes\n", ncq_tfs->tag, num_merged,
+                (int64_t)ncq_tfs->sglist.size);
+        block_acct_merge_done(blk_get_stats(blk),
+                              is_write ? BLOCK_ACCT_WRITE : BLOCK_ACCT_READ,
+                              num_merged);
+    }
+
+    if (is_write) {
+        ncq_tfs->aiocb = dma_blk_write(blk, &ncq_tfs->sglist, ncq_tfs->lba,
+                                       ncq_cb, ncq_tfs);
+    } else {
+        ncq_tfs->aiocb = dma_blk_read(blk, &ncq_tfs->sglist, ncq_tfs->lba,
+                                      ncq_cb, ncq_tfs);
+    }
+}
+
+static int ncq_lba_compare(const void *a, const void *b)
+{
+    const NCQTransferState *tfs1 = *(NCQTransferState **)a,
+                           *tfs2 = *(NCQTransferState **)b;
+
+    if (tfs1->lba > tfs2->lba) {
+        return 1;
+    } else if (tfs1->lba < tfs2->lba) {
+        return -1;
+    } else {
+        return 0;
+    }
+}
+
+/* Issue the queued NCQ commands, merging those that are contiguous on disk
+ * into a single host request like virtio-blk does.  The merged command's
+ * sglist is appended to the first one's; completion walks the chain.
+ */
+static void ahci_submit_ncq_batch(AHCIDevice *ad)
+{
+    BlockBackend *blk = ad->port.ifs[0].blk;
+    NCQTransferState *head = NULL, *prev = NULL;
+    uint64_t max_bytes, next_lba = 0;
+    int i, j, num_merged = 0;
+
+    if (ad->ncq_batch_len == 0) {
+        return;
+    }
+
+    max_bytes = MIN_NON_ZERO(blk_get_max_transfer_length(blk),
+                             BDRV_REQUEST_MAX_SECTORS);
+    max_bytes *= BDRV_SECTOR_SIZE;
+
+    qsort(ad->ncq_batch, ad->ncq_batch_len, sizeof(ad->ncq_batch[0]),
+          &ncq_lba_compare);
+
+    for (i = 0; i < ad->ncq_batch_len; i++) {
+        NCQTransferState *ncq_tfs = ad->ncq_batch[i];
+        QEMUSGList *sg = &ncq_tfs->sglist;
 
-    DPRINTF(ncq_tfs->drive->port_no, "NCQ transfer tag %d finished\n",
-            ncq_tfs->tag);
+        if (head && ncq_tfs->lba == next_lba &&
+            !(head->sglist.size % BDRV_SECTOR_SIZE) &&
+            !(sg->size % BDRV_SECTOR_SIZE) &&
+            head->sglist.size + sg->size <= max_bytes &&
+            head->sglist.nsg + sg->nsg <= IOV_MAX) {
+            for (j = 0; j < sg->nsg; j++) {
+                qemu_sglist_add(&head->sglist, sg->sg[j].base, sg->sg[j].len);
+            }
+            prev->next = ncq_tfs;
+            prev = ncq_tfs;
+            num_merged++;
+        } else {
+            if (head) {
+                ncq_submit(head, ad->ncq_batch_write, num_merged);
+            }
+            head = prev = ncq_tfs;
+            num_merged = 0;
+        }
+        next_lba = ncq_tfs->lba + sg->size / BDRV_SECTOR_SIZE;
+    }
+    ad->ncq_batch_len = 0;
+    ncq_submit(head, ad->ncq_batch_write, num_merged);
+}
 
-    block_acct_done(blk_get_stats(ncq_tfs->drive->port.ifs[0].blk),
-                    &ncq_tfs->acct);
-    qemu_sglist_destroy(&ncq_tfs->sglist);
-    ncq_tfs->used = 0;
+static void ahci_queue_ncq(AHCIDevice *ad, NCQTransferState *ncq_tfs,
+                           bool is_write)
+{
+    if (ad->ncq_batch_len && ad->ncq_batch_write != is_write) {
+        ahci_submit_ncq_batch(ad);
+    }
+    ncq_tfs->next = NULL;
+    ad->ncq_batch_write = is_write;
+    ad->ncq_batch[ad->ncq_batch_len++] = ncq_tfs;
 }
 
 static int is_ncq(uint8_t ata_cmd)
@@ -959,9 +1076,7 @@ static void process_ncq_command(AHCIState *s, int port, uint8_t *cmd_fis,
 
             dma_acct_start(ncq_tfs->drive->port.ifs[0].blk, &ncq_tfs->acct,
                            &ncq_tfs->sglist, BLOCK_ACCT_READ);
-            ncq_tfs->aiocb = dma_blk_read(ncq_tfs->drive->port.ifs[0].blk,
-                                          &ncq_tfs->sglist, ncq_tfs->lba,
-                                          ncq_cb, ncq_tfs);
+            ahci_queue_ncq(&s->dev[port], ncq_tfs, false);
             break;
         case WRITE_FPDMA_QUEUED:
             DPRINTF(port, "NCQ writing %d sectors to LBA %"PRId64", tag %d\n",
@@ -972,9 +1087,7 @@ static void process_ncq_command(AHCIState *s, int port, uint8_t *cmd_fis,
 
             dma_acct_start(ncq_tfs->drive->port.ifs[0].blk, &ncq_tfs->acct,
                            &ncq_tfs->sglist, BLOCK_ACCT_WRITE);
-            ncq_tfs->aiocb = dma_blk_write(ncq_tfs->drive->port.ifs[0].blk,
-                                           &ncq_tfs->sglist, ncq_tfs->lba,
-                                           ncq_cb, ncq_tfs);
+            ahci_queue_ncq(&s->dev[port], ncq_tfs, true);
             break;
         default:
             if (is_ncq(cmd_fis[2])) {
@@ -1032,6 +1145,9 @@ static void handle_reg_h2d_fis(AHCIState *s, int port,
         return;
     }
 
+    /* Queued commands go first */
+    ahci_submit_ncq_batch(&s->dev[port]);
+
     /* Decompose the FIS:
      * AHCI does not interpret FIS packets, it only forwards them.
      * SATA 1.0 describes how to decode LBA28 and CHS FIS packets.
@@ -250,6 +250,8 @@ typedef struct AHCIDevice AHCIDevice;
 typedef struct NCQTransferState {
     AHCIDevice *drive;
     BlockAIOCB *aiocb;
+    /* Next command merged into the same host request */
+    struct NCQTransferState *next;
     QEMUSGList sglist;
     BlockAcctCookie acct;
     uint16_t sector_count;
@@ -275,6 +277,10 @@ struct AHCIDevice {
     bool init_d2h_sent;
     AHCICmdHdr *cur_cmd;
     NCQTransferState ncq_tfs[AHCI_MAX_CMDS];
+    /* NCQ commands read by one check_cmd() pass, to be merged */
+    NCQTransferState *ncq_batch[AHCI_MAX_CMDS];
+    int ncq_batch_len;
+    bool ncq_batch_write;
 };
 
 typedef struct AHCIState {
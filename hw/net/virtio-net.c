@@ -15,6 +15,7 @@
 #include "hw/virtio/virtio.h"
 #include "net/net.h"
 #include "net/checksum.h"
+#include "net/eth.h"
 #include "net/tap.h"
 #include "qemu/error-report.h"
 #include "qemu/timer.h"
@@ -24,6 +25,7 @@
 #include "qapi/qmp/qjson.h"
 #include "qapi-event.h"
 #include "hw/virtio/virtio-access.h"
+#include "trace.h"
 
 #define VIRTIO_NET_VM_VERSION    11
 
@@ -52,6 +54,17 @@ static VirtIOFeature feature_sizes[] = {
     {}
 };
 
+/* The key used by the Microsoft RSS verification suite, which drivers
+ * also commonly default to.
+ */
+static const uint8_t rss_default_key[VIRTIO_NET_RSS_MAX_KEY_SIZE] = {
+    0x6d, 0x5a, 0x56, 0xda, 0x25, 0x5b, 0x0e, 0xc2,
+    0x41, 0x67, 0x25, 0x3d, 0x43, 0xa3, 0x8f, 0xb0,
+    0xd0, 0xca, 0x2b, 0xcb, 0xae, 0x7b, 0x30, 0xb4,
+    0x77, 0xcb, 0x2d, 0xa3, 0x80, 0x30, 0xf2, 0x0c,
+    0x6a, 0x42, 0xb7, 0x3b, 0xbe, 0xac, 0x01, 0xfa,
+};
+
 static VirtIONetQueue *virtio_net_get_subqueue(NetClientState *nc)
 {
     VirtIONet *n = qemu_get_nic_opaque(nc);
@@ -79,18 +92,42 @@ static void virtio_net_get_config(VirtIODevice *vdev, uint8_t *config)
     memcpy(config, &netcfg, n->config_size);
 }
 
+/* Main loop code that touches state shared with the queues must hold the
+ * IOThread's AioContext while the dataplane runs.  Returns the context to
+ * pass to virtio_net_release(), or NULL if there is none.
+ */
+static AioContext *virtio_net_acquire(VirtIONet *n)
+{
+    AioContext *ctx = n->dataplane_started ? n->ctx : NULL;
+
+    if (ctx) {
+        aio_context_acquire(ctx);
+    }
+    return ctx;
+}
+
+static void virtio_net_release(AioContext *ctx)
+{
+    if (ctx) {
+        aio_context_release(ctx);
+    }
+}
+
 static void virtio_net_set_config(VirtIODevice *vdev, const uint8_t *config)
 {
     VirtIONet *n = VIRTIO_NET(vdev);
     struct virtio_net_config netcfg = {};
+    AioContext *ctx;
 
     memcpy(&netcfg, config, n->config_size);
 
+    ctx = virtio_net_acquire(n);
     if (!virtio_has_feature(vdev, VIRTIO_NET_F_CTRL_MAC_ADDR) &&
         memcmp(netcfg.mac, n->mac, ETH_ALEN)) {
         memcpy(n->mac, netcfg.mac, ETH_ALEN);
         qemu_format_nic_info_str(qemu_get_queue(n->nic), n->mac);
     }
+    virtio_net_release(ctx);
 }
 
 static bool virtio_net_started(VirtIONet *n, uint8_t status)
@@ -104,12 +141,16 @@ static void virtio_net_announce_timer(void *opaque)
 {
     VirtIONet *n = opaque;
     VirtIODevice *vdev = VIRTIO_DEVICE(n);
+    AioContext *ctx = virtio_net_acquire(n);
 
     n->announce_counter--;
     n->status |= VIRTIO_NET_S_ANNOUNCE;
+    virtio_net_release(ctx);
     virtio_notify_config(vdev);
 }
 
+static void virtio_net_set_queues(VirtIONet *n);
+
 static void virtio_net_vhost_status(VirtIONet *n, uint8_t status)
 {
     VirtIODevice *vdev = VIRTIO_DEVICE(n);
@@ -148,6 +189,9 @@ static void virtio_net_vhost_status(VirtIONet *n, uint8_t status)
             error_report("unable to start vhost net: %d: "
                          "falling back on userspace virtio", -r);
             n->vhost_started = 0;
+        } else {
+            /* vhost-user rings start disabled, enable the active ones */
+            virtio_net_set_queues(n);
         }
     } else {
         vhost_net_stop(vdev, n->nic->ncs, queues);
@@ -155,15 +199,153 @@ static void virtio_net_vhost_status(VirtIONet *n, uint8_t status)
     }
 }
 
+static void virtio_net_tx_bh(void *opaque);
+
+/* Move the virtqueues and their backends to the IOThread.  On failure the
+ * device keeps running in the main loop, like vhost falls back to
+ * userspace virtio.
+ */
+static void virtio_net_dataplane_start(VirtIONet *n)
+{
+    VirtIODevice *vdev = VIRTIO_DEVICE(n);
+    BusState *qbus = BUS(qdev_get_parent_bus(DEVICE(vdev)));
+    VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
+    int queues = n->multiqueue ? n->max_queues : 1;
+    int i, r;
+
+    r = k->set_guest_notifiers(qbus->parent, queues * 2, true);
+    if (r < 0) {
+        error_report("virtio-net: failed to set guest notifiers (%d), "
+                     "ensure -enable-kvm is set", r);
+        goto fail_guest_notifiers;
+    }
+
+    for (i = 0; i < queues * 2; i++) {
+        r = k->set_host_notifier(qbus->parent, i, true);
+        if (r < 0) {
+            error_report("virtio-net: failed to set host notifier (%d)", r);
+            goto fail_host_notifier;
+        }
+    }
+
+    aio_context_acquire(n->ctx);
+    for (i = 0; i < queues; i++) {
+        VirtIONetQueue *q = &n->vqs[i];
+        NetClientState *nc = qemu_get_subqueue(n->nic, i);
+
+        qemu_bh_delete(q->tx_bh);
+        q->tx_bh = aio_bh_new(n->ctx, virtio_net_tx_bh, q);
+        qemu_net_set_aio_context(nc->peer, n->ctx);
+        virtio_queue_aio_set_host_notifier_handler(q->rx_vq, n->ctx,
+                                                   true, true);
+        virtio_queue_aio_set_host_notifier_handler(q->tx_vq, n->ctx,
+                                                   true, true);
+    }
+    n->dataplane_started = true;
+    aio_context_release(n->ctx);
+    trace_virtio_net_dataplane_start(n, queues);
+
+    /* Kick right away to process buffers already in the rings */
+    for (i = 0; i < queues * 2; i++) {
+        event_notifier_set(virtio_queue_get_host_notifier(
+                               virtio_get_queue(vdev, i)));
+    }
+    return;
+
+fail_host_notifier:
+    while (--i >= 0) {
+        k->set_host_notifier(qbus->parent, i, false);
+    }
+    k->set_guest_notifiers(qbus->parent, queues * 2, false);
+fail_guest_notifiers:
+    n->dataplane_disabled = true;
+}
+
+static void virtio_net_dataplane_stop(VirtIONet *n)
+{
+    VirtIODevice *vdev = VIRTIO_DEVICE(n);
+    BusState *qbus = BUS(qdev_get_parent_bus(DEVICE(vdev)));
+    VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
+    int queues = n->multiqueue ? n->max_queues : 1;
+    int i;
+
+    aio_context_acquire(n->ctx);
+    for (i = 0; i < queues; i++) {
+        VirtIONetQueue *q = &n->vqs[i];
+        NetClientState *nc = qemu_get_subqueue(n->nic, i);
+
+        virtio_queue_aio_set_host_notifier_handler(q->rx_vq, n->ctx,
+                                                   false, false);
+        virtio_queue_aio_set_host_notifier_handler(q->tx_vq, n->ctx,
+                                                   false, false);
+        qemu_net_set_aio_context(nc->peer, NULL);
+        qemu_bh_delete(q->tx_bh);
+        q->tx_bh = qemu_bh_new(virtio_net_tx_bh, q);
+    }
+    n->dataplane_started = false;
+    aio_context_release(n->ctx);
+    trace_virtio_net_dataplane_stop(n);
+
+    for (i = 0; i < queues * 2; i++) {
+        k->set_host_notifier(qbus->parent, i, false);
+    }
+    k->set_guest_notifiers(qbus->parent, queues * 2, false);
+}
+
+static void virtio_net_dataplane_status(VirtIONet *n, uint8_t status)
+{
+    if (!n->ctx || n->dataplane_disabled) {
+        return;
+    }
+
+    if (virtio_net_started(n, status) == n->dataplane_started) {
+        return;
+    }
+    if (!n->dataplane_started) {
+        virtio_net_dataplane_start(n);
+    } else {
+        virtio_net_dataplane_stop(n);
+    }
+}
+
+/* Interrupt the guest for a used buffer on an RX or TX queue.  In an
+ * IOThread this must not go through the transport, which needs the
+ * global mutex.
+ */
+static void virtio_net_notify(VirtIONet *n, VirtQueue *vq)
+{
+    if (n->dataplane_started) {
+        virtio_notify_irqfd(VIRTIO_DEVICE(n), vq);
+    } else {
+        virtio_notify(VIRTIO_DEVICE(n), vq);
+    }
+}
+
+/* Drop the TX packets that the peer has queued.  They point into guest
+ * buffers of elements that are still in async_tx, so this must be done
+ * before the device lets go of the rings.
+ */
+static void virtio_net_purge_tx(VirtIONet *n)
+{
+    int i;
+
+    for (i = 0; i < n->max_queues; i++) {
+        qemu_purge_queued_packets(qemu_get_subqueue(n->nic, i));
+    }
+}
+
 static void virtio_net_set_status(struct VirtIODevice *vdev, uint8_t status)
 {
     VirtIONet *n = VIRTIO_NET(vdev);
     VirtIONetQueue *q;
     int i;
     uint8_t queue_status;
+    AioContext *ctx;
 
     virtio_net_vhost_status(n, status);
+    virtio_net_dataplane_status(n, status);
 
+    ctx = virtio_net_acquire(n);
     for (i = 0; i < n->max_queues; i++) {
         q = &n->vqs[i];
 
@@ -192,6 +374,10 @@ static void virtio_net_set_status(struct VirtIODevice *vdev, uint8_t status)
             }
         }
     }
+    if (!(status & VIRTIO_CONFIG_S_DRIVER_OK)) {
+        virtio_net_purge_tx(n);
+    }
+    virtio_net_release(ctx);
 }
 
 static void virtio_net_set_link_status(NetClientState *nc)
@@ -199,11 +385,13 @@ static void virtio_net_set_link_status(NetClientState *nc)
     VirtIONet *n = qemu_get_nic_opaque(nc);
     VirtIODevice *vdev = VIRTIO_DEVICE(n);
     uint16_t old_status = n->status;
+    AioContext *ctx = virtio_net_acquire(n);
 
     if (nc->link_down)
         n->status &= ~VIRTIO_NET_S_LINK_UP;
     else
         n->status |= VIRTIO_NET_S_LINK_UP;
+    virtio_net_release(ctx);
 
     if (n->status != old_status)
         virtio_notify_config(vdev);
@@ -313,10 +501,30 @@ static RxFilterInfo *virtio_net_query_rxfilter(NetClientState *nc)
     return info;
 }
 
+/* Spread all flows over the active queues until the driver configures
+ * its own table.
+ */
+static void virtio_net_rss_reset(VirtIONet *n)
+{
+    VirtioNetRssData *rss = &n->rss_data;
+    int i;
+
+    rss->guest_set = false;
+    rss->hash_types = VIRTIO_NET_RSS_SUPPORTED_HASHES;
+    memcpy(rss->key, rss_default_key, sizeof(rss->key));
+    rss->indirections_len = VIRTIO_NET_RSS_MAX_TABLE_LEN;
+    for (i = 0; i < rss->indirections_len; i++) {
+        rss->indirections[i] = i % n->curr_queues;
+    }
+    rss->default_queue = 0;
+}
+
 static void virtio_net_reset(VirtIODevice *vdev)
 {
     VirtIONet *n = VIRTIO_NET(vdev);
 
+    virtio_net_purge_tx(n);
+
     /* Reset back to compatibility mode */
     n->promisc = 1;
     n->allmulti = 0;
@@ -326,6 +534,7 @@ static void virtio_net_reset(VirtIODevice *vdev)
     n->nobcast = 0;
     /* multiqueue is disabled by default */
     n->curr_queues = 1;
+    virtio_net_rss_reset(n);
     timer_del(n->announce_timer);
     n->announce_counter = 0;
     n->status &= ~VIRTIO_NET_S_ANNOUNCE;
@@ -395,6 +604,10 @@ static int peer_attach(VirtIONet *n, int index)
         return 0;
     }
 
+    if (nc->peer->info->type == NET_CLIENT_OPTIONS_KIND_VHOST_USER) {
+        vhost_set_vring_enable(nc->peer, 1);
+    }
+
     if (nc->peer->info->type != NET_CLIENT_OPTIONS_KIND_TAP) {
         return 0;
     }
@@ -410,6 +623,10 @@ static int peer_detach(VirtIONet *n, int index)
         return 0;
     }
 
+    if (nc->peer->info->type == NET_CLIENT_OPTIONS_KIND_VHOST_USER) {
+        vhost_set_vring_enable(nc->peer, 0);
+    }
+
     if (nc->peer->info->type !=  NET_CLIENT_OPTIONS_KIND_TAP) {
         return 0;
     }
@@ -757,6 +974,79 @@ static int virtio_net_handle_announce(VirtIONet *n, uint8_t cmd,
     }
 }
 
+static int virtio_net_handle_rss(VirtIONet *n,
+                                 struct iovec *iov, unsigned int iov_cnt)
+{
+    VirtIODevice *vdev = VIRTIO_DEVICE(n);
+    VirtioNetRssData rss = { .guest_set = true };
+    struct {
+        uint32_t hash_types;
+        uint16_t indirection_table_mask;
+        uint16_t unclassified_queue;
+    } QEMU_PACKED cfg;
+    struct {
+        uint16_t max_tx_vq;
+        uint8_t hash_key_length;
+    } QEMU_PACKED tail;
+    size_t s, offset;
+    int i;
+
+    if (!n->net_conf.rss || !n->multiqueue) {
+        return VIRTIO_NET_ERR;
+    }
+
+    s = iov_to_buf(iov, iov_cnt, 0, &cfg, sizeof(cfg));
+    if (s != sizeof(cfg)) {
+        return VIRTIO_NET_ERR;
+    }
+    offset = s;
+
+    rss.hash_types = virtio_ldl_p(vdev, &cfg.hash_types) &
+                     VIRTIO_NET_RSS_SUPPORTED_HASHES;
+    rss.indirections_len = virtio_lduw_p(vdev, &cfg.indirection_table_mask);
+    rss.indirections_len++;
+    if (rss.indirections_len > VIRTIO_NET_RSS_MAX_TABLE_LEN ||
+        (rss.indirections_len & (rss.indirections_len - 1))) {
+        return VIRTIO_NET_ERR;
+    }
+    rss.default_queue = virtio_lduw_p(vdev, &cfg.unclassified_queue);
+    if (rss.default_queue >= n->max_queues) {
+        return VIRTIO_NET_ERR;
+    }
+
+    s = iov_to_buf(iov, iov_cnt, offset, rss.indirections,
+                   rss.indirections_len * sizeof(rss.indirections[0]));
+    if (s != rss.indirections_len * sizeof(rss.indirections[0])) {
+        return VIRTIO_NET_ERR;
+    }
+    offset += s;
+    for (i = 0; i < rss.indirections_len; i++) {
+        rss.indirections[i] = virtio_lduw_p(vdev, &rss.indirections[i]);
+        if (rss.indirections[i] >= n->max_queues) {
+            return VIRTIO_NET_ERR;
+        }
+    }
+
+    s = iov_to_buf(iov, iov_cnt, offset, &tail, sizeof(tail));
+    if (s != sizeof(tail)) {
+        return VIRTIO_NET_ERR;
+    }
+    offset += s;
+    if (!tail.hash_key_length ||
+        tail.hash_key_length > VIRTIO_NET_RSS_MAX_KEY_SIZE) {
+        return VIRTIO_NET_ERR;
+    }
+
+    /* Shorter keys are padded with zeroes */
+    s = iov_to_buf(iov, iov_cnt, offset, rss.key, tail.hash_key_length);
+    if (s != tail.hash_key_length) {
+        return VIRTIO_NET_ERR;
+    }
+
+    n->rss_data = rss;
+    return VIRTIO_NET_OK;
+}
+
 static int virtio_net_handle_mq(VirtIONet *n, uint8_t cmd,
                                 struct iovec *iov, unsigned int iov_cnt)
 {
@@ -765,6 +1055,10 @@ static int virtio_net_handle_mq(VirtIONet *n, uint8_t cmd,
     size_t s;
     uint16_t queues;
 
+    if (cmd == VIRTIO_NET_CTRL_MQ_RSS_CONFIG) {
+        return virtio_net_handle_rss(n, iov, iov_cnt);
+    }
+
     s = iov_to_buf(iov, iov_cnt, 0, &mq, sizeof(mq));
     if (s != sizeof(mq)) {
         return VIRTIO_NET_ERR;
@@ -784,6 +1078,9 @@ static int virtio_net_handle_mq(VirtIONet *n, uint8_t cmd,
     }
 
     n->curr_queues = queues;
+    if (!n->rss_data.guest_set) {
+        virtio_net_rss_reset(n);
+    }
     /* stop the backend before changing the number of queues to avoid handling a
      * disabled queue */
     virtio_net_set_status(vdev, vdev->status);
@@ -796,20 +1093,29 @@ static void virtio_net_handle_ctrl(VirtIODevice *vdev, VirtQueue *vq)
     VirtIONet *n = VIRTIO_NET(vdev);
     struct virtio_net_ctrl_hdr ctrl;
     virtio_net_ctrl_ack status = VIRTIO_NET_ERR;
-    VirtQueueElement elem;
+    VirtQueueElement *elem;
     size_t s;
     struct iovec *iov, *iov2;
     unsigned int iov_cnt;
 
-    while (virtqueue_pop(vq, &elem)) {
-        if (iov_size(elem.in_sg, elem.in_num) < sizeof(status) ||
-            iov_size(elem.out_sg, elem.out_num) < sizeof(ctrl)) {
+    /* The RX filters are also used by the IOThread */
+    if (n->ctx) {
+        aio_context_acquire(n->ctx);
+    }
+    for (;;) {
+        elem = virtqueue_pop(vq, sizeof(VirtQueueElement));
+        if (!elem) {
+            break;
+        }
+        if (iov_size(elem->in_sg, elem->in_num) < sizeof(status) ||
+            iov_size(elem->out_sg, elem->out_num) < sizeof(ctrl)) {
             error_report("virtio-net ctrl missing headers");
             exit(1);
         }
 
-        iov_cnt = elem.out_num;
-        iov2 = iov = g_memdup(elem.out_sg, sizeof(struct iovec) * elem.out_num);
+        iov_cnt = elem->out_num;
+        iov2 = iov = g_memdup(elem->out_sg,
+                              sizeof(struct iovec) * elem->out_num);
         s = iov_to_buf(iov, iov_cnt, 0, &ctrl, sizeof(ctrl));
         iov_discard_front(&iov, &iov_cnt, sizeof(ctrl));
         if (s != sizeof(ctrl)) {
@@ -828,12 +1134,17 @@ static void virtio_net_handle_ctrl(VirtIODevice *vdev, VirtQueue *vq)
             status = virtio_net_handle_offloads(n, ctrl.cmd, iov, iov_cnt);
         }
 
-        s = iov_from_buf(elem.in_sg, elem.in_num, 0, &status, sizeof(status));
+        s = iov_from_buf(elem->in_sg, elem->in_num, 0, &status,
+                         sizeof(status));
         assert(s == sizeof(status));
 
-        virtqueue_push(vq, &elem, sizeof(status));
+        virtqueue_push(vq, elem, sizeof(status));
         virtio_notify(vdev, vq);
         g_free(iov2);
+        virtqueue_free_element(vq, elem);
+    }
+    if (n->ctx) {
+        aio_context_release(n->ctx);
     }
 }
 
@@ -997,7 +1308,114 @@ static int receive_filter(VirtIONet *n, const uint8_t *buf, int size)
     return 0;
 }
 
-static ssize_t virtio_net_receive(NetClientState *nc, const uint8_t *buf, size_t size)
+/* Copy to @input the header fields that RSS hashes for the Ethernet
+ * frame in @buf, and return their length.  0 means that none of the
+ * enabled @hash_types applies to the packet.
+ */
+static size_t virtio_net_rss_input(uint32_t hash_types, const uint8_t *buf,
+                                   size_t size, uint8_t *input)
+{
+    size_t l2hdr_len, l3hdr_len;
+    uint8_t l4proto;
+
+    if (size < ETH_MAX_L2_HDR_LEN) {
+        return 0;
+    }
+    l2hdr_len = eth_get_l2_hdr_length(buf);
+
+    switch (eth_get_l3_proto(buf, l2hdr_len)) {
+    case ETH_P_IP: {
+        const struct ip_header *ip = (const void *)(buf + l2hdr_len);
+        bool frag;
+
+        if (size < l2hdr_len + sizeof(*ip) ||
+            IP_HEADER_VERSION(ip) != IP_HEADER_VERSION_4) {
+            return 0;
+        }
+        l3hdr_len = IP_HDR_GET_LEN(ip);
+        l4proto = ip->ip_p;
+        frag = be16_to_cpu(ip->ip_off) & (IP_MF | IP_OFFMASK);
+
+        /* Source and destination address */
+        memcpy(input, &ip->ip_src, 8);
+        if (!frag && size >= l2hdr_len + l3hdr_len + 4 &&
+            ((l4proto == IP_PROTO_TCP &&
+              (hash_types & VIRTIO_NET_RSS_HASH_TYPE_TCPv4)) ||
+             (l4proto == IP_PROTO_UDP &&
+              (hash_types & VIRTIO_NET_RSS_HASH_TYPE_UDPv4)))) {
+            /* Source and destination port */
+            memcpy(input + 8, buf + l2hdr_len + l3hdr_len, 4);
+            return 12;
+        }
+        return hash_types & VIRTIO_NET_RSS_HASH_TYPE_IPv4 ? 8 : 0;
+    }
+    case ETH_P_IPV6: {
+        const struct ip6_header *ip6 = (const void *)(buf + l2hdr_len);
+        struct iovec iov = {
+            .iov_base = (void *)buf,
+            .iov_len = size,
+        };
+
+        if (!eth_parse_ipv6_hdr(&iov, 1, l2hdr_len, &l4proto, &l3hdr_len)) {
+            return 0;
+        }
+
+        memcpy(input, &ip6->ip6_src, 32);
+        /* Ports are only hashed if there are no extension headers */
+        if (l3hdr_len == sizeof(*ip6) &&
+            size >= l2hdr_len + l3hdr_len + 4 &&
+            ((l4proto == IP_PROTO_TCP &&
+              (hash_types & VIRTIO_NET_RSS_HASH_TYPE_TCPv6)) ||
+             (l4proto == IP_PROTO_UDP &&
+              (hash_types & VIRTIO_NET_RSS_HASH_TYPE_UDPv6)))) {
+            memcpy(input + 32, buf + l2hdr_len + l3hdr_len, 4);
+            return 36;
+        }
+        return hash_types & VIRTIO_NET_RSS_HASH_TYPE_IPv6 ? 32 : 0;
+    }
+    default:
+        return 0;
+    }
+}
+
+/* Return the RX queue that RSS picks for a packet that arrived on @q */
+static VirtIONetQueue *virtio_net_rss_steer(VirtIONet *n, VirtIONetQueue *q,
+                                            const uint8_t *buf, size_t size)
+{
+    VirtioNetRssData *rss = &n->rss_data;
+    VirtIONetQueue *target;
+    uint8_t input[36];
+    uint32_t hash = 0;
+    uint16_t index;
+    size_t len;
+
+    len = virtio_net_rss_input(rss->hash_types, buf + n->host_hdr_len,
+                               size - n->host_hdr_len, input);
+    if (len) {
+        hash = eth_toeplitz_hash(rss->key, input, len);
+        index = rss->indirections[hash & (rss->indirections_len - 1)];
+    } else {
+        index = rss->default_queue;
+    }
+
+    if (index >= n->curr_queues) {
+        return q;
+    }
+    target = &n->vqs[index];
+    if (!virtio_queue_ready(target->rx_vq)) {
+        return q;
+    }
+
+    trace_virtio_net_rss(n, hash, q - n->vqs, index);
+    target->rss_packets++;
+    return target;
+}
+
+/* Like virtio_net_receive(), but leaves notifying the guest to the caller.
+ * rx_notify is set on the queue that the buffers were returned to.
+ */
+static ssize_t virtio_net_do_receive(NetClientState *nc, const uint8_t *buf,
+                                     size_t size)
 {
     VirtIONet *n = qemu_get_nic_opaque(nc);
     VirtIONetQueue *q = virtio_net_get_subqueue(nc);
@@ -1011,8 +1429,19 @@ static ssize_t virtio_net_receive(NetClientState *nc, const uint8_t *buf, size_t
         return -1;
     }
 
+    if (n->net_conf.rss && n->curr_queues > 1 && size >= n->host_hdr_len) {
+        q = virtio_net_rss_steer(n, q, buf, size);
+    }
+
     /* hdr_len refers to the header we supply to the guest */
     if (!virtio_net_has_buffers(q, size + n->guest_hdr_len - n->host_hdr_len)) {
+        /* Only the queue of the peer can hold packets back.  If another
+         * queue is full, drop the packet like a NIC whose ring is full.
+         */
+        if (q != virtio_net_get_subqueue(nc)) {
+            q->rss_drops++;
+            return size;
+        }
         return 0;
     }
 
@@ -1022,13 +1451,14 @@ static ssize_t virtio_net_receive(NetClientState *nc, const uint8_t *buf, size_t
     offset = i = 0;
 
     while (offset < size) {
-        VirtQueueElement elem;
+        VirtQueueElement *elem;
         int len, total;
-        const struct iovec *sg = elem.in_sg;
+        const struct iovec *sg;
 
         total = 0;
 
-        if (virtqueue_pop(q->rx_vq, &elem) == 0) {
+        elem = virtqueue_pop(q->rx_vq, sizeof(VirtQueueElement));
+        if (!elem) {
             if (i == 0)
                 return -1;
             error_report("virtio-net unexpected empty queue: "
@@ -1039,21 +1469,23 @@ static ssize_t virtio_net_receive(NetClientState *nc, const uint8_t *buf, size_t
             exit(1);
         }
 
-        if (elem.in_num < 1) {
+        if (elem->in_num < 1) {
             error_report("virtio-net receive queue contains no in buffers");
             exit(1);
         }
 
+        sg = elem->in_sg;
+
         if (i == 0) {
             assert(offset == 0);
             if (n->mergeable_rx_bufs) {
                 mhdr_cnt = iov_copy(mhdr_sg, ARRAY_SIZE(mhdr_sg),
-                                    sg, elem.in_num,
+                                    sg, elem->in_num,
                                     offsetof(typeof(mhdr), num_buffers),
                                     sizeof(mhdr.num_buffers));
             }
 
-            receive_header(n, sg, elem.in_num, buf, size);
+            receive_header(n, sg, elem->in_num, buf, size);
             offset = n->host_hdr_len;
             total += n->guest_hdr_len;
             guest_offset = n->guest_hdr_len;
@@ -1062,7 +1494,7 @@ static ssize_t virtio_net_receive(NetClientState *nc, const uint8_t *buf, size_t
         }
 
         /* copy in packet.  ugh */
-        len = iov_from_buf(sg, elem.in_num, guest_offset,
+        len = iov_from_buf(sg, elem->in_num, guest_offset,
                            buf + offset, size - offset);
         total += len;
         offset += len;
@@ -1077,11 +1509,13 @@ static ssize_t virtio_net_receive(NetClientState *nc, const uint8_t *buf, size_t
                          i, n->mergeable_rx_bufs,
                          offset, size, n->guest_hdr_len, n->host_hdr_len);
 #endif
+            g_free(elem);
             return size;
         }
 
         /* signal other side */
-        virtqueue_fill(q->rx_vq, &elem, total, i++);
+        virtqueue_fill(q->rx_vq, elem, total, i++);
+        virtqueue_free_element(q->rx_vq, elem);
     }
 
     if (mhdr_cnt) {
@@ -1092,98 +1526,216 @@ static ssize_t virtio_net_receive(NetClientState *nc, const uint8_t *buf, size_t
     }
 
     virtqueue_flush(q->rx_vq, i);
-    virtio_notify(vdev, q->rx_vq);
+    q->rx_notify = true;
 
     return size;
 }
 
+/* Notify the guest about the RX queues filled by virtio_net_do_receive() */
+static void virtio_net_rx_notify(VirtIONet *n)
+{
+    int i;
+
+    for (i = 0; i < n->curr_queues; i++) {
+        VirtIONetQueue *q = &n->vqs[i];
+
+        if (q->rx_notify) {
+            q->rx_notify = false;
+            virtio_net_notify(n, q->rx_vq);
+        }
+    }
+}
+
+static ssize_t virtio_net_receive(NetClientState *nc, const uint8_t *buf, size_t size)
+{
+    VirtIONet *n = qemu_get_nic_opaque(nc);
+    ssize_t ret;
+
+    ret = virtio_net_do_receive(nc, buf, size);
+    virtio_net_rx_notify(n);
+
+    return ret;
+}
+
+/* Receive a batch of packets with a single interrupt to the guest */
+static int virtio_net_receive_batch(NetClientState *nc,
+                                    const NetPacketIOV *pkts, int count)
+{
+    VirtIONetQueue *q = virtio_net_get_subqueue(nc);
+    uint8_t buffer[NET_BUFSIZE];
+    int i;
+
+    for (i = 0; i < count; i++) {
+        const uint8_t *buf = buffer;
+        size_t size;
+
+        if (pkts[i].iovcnt == 1) {
+            buf = pkts[i].iov[0].iov_base;
+            size = pkts[i].iov[0].iov_len;
+        } else {
+            size = iov_to_buf(pkts[i].iov, pkts[i].iovcnt, 0,
+                              buffer, sizeof(buffer));
+        }
+        if (virtio_net_do_receive(nc, buf, size) == 0) {
+            break;
+        }
+    }
+
+    trace_virtio_net_rx_batch(q, count, i);
+    virtio_net_rx_notify(q->n);
+
+    return i;
+}
+
 static int32_t virtio_net_flush_tx(VirtIONetQueue *q);
 
 static void virtio_net_tx_complete(NetClientState *nc, ssize_t len)
 {
     VirtIONet *n = qemu_get_nic_opaque(nc);
     VirtIONetQueue *q = virtio_net_get_subqueue(nc);
-    VirtIODevice *vdev = VIRTIO_DEVICE(n);
-
-    virtqueue_push(q->tx_vq, &q->async_tx.elem, 0);
-    virtio_notify(vdev, q->tx_vq);
+    unsigned int i;
 
-    q->async_tx.elem.out_num = q->async_tx.len = 0;
+    for (i = 0; i < q->async_tx.num; i++) {
+        virtqueue_fill(q->tx_vq, q->async_tx.elems[i], 0, i);
+        virtqueue_free_element(q->tx_vq, q->async_tx.elems[i]);
+        q->async_tx.elems[i] = NULL;
+    }
+    virtqueue_flush(q->tx_vq, q->async_tx.num);
+    virtio_net_notify(n, q->tx_vq);
+    q->async_tx.num = 0;
 
     virtio_queue_set_notification(q->tx_vq, 1);
+
+    /* A zero length means the packets were purged because the device is
+     * being stopped; do not start another batch.
+     */
+    if (len == 0) {
+        return;
+    }
     virtio_net_flush_tx(q);
 }
 
+/* Prepare @elem for transmission and describe it in @pkt.  @sg is used
+ * if the header has to be rewritten; returns the number of entries of
+ * @sg that were used.
+ */
+static unsigned int virtio_net_tx_prepare(VirtIONet *n,
+                                          VirtQueueElement *elem,
+                                          struct iovec *sg,
+                                          NetPacketIOV *pkt)
+{
+    VirtIODevice *vdev = VIRTIO_DEVICE(n);
+    unsigned int out_num = elem->out_num;
+    struct iovec *out_sg = elem->out_sg;
+    unsigned int sg_num;
+
+    if (out_num < 1) {
+        error_report("virtio-net header not in first element");
+        exit(1);
+    }
+
+    if (n->has_vnet_hdr) {
+        if (out_sg[0].iov_len < n->guest_hdr_len) {
+            error_report("virtio-net header incorrect");
+            exit(1);
+        }
+        virtio_net_hdr_swap(vdev, (void *) out_sg[0].iov_base);
+    }
+
+    pkt->iov = out_sg;
+    pkt->iovcnt = out_num;
+
+    /*
+     * If host wants to see the guest header as is, we can
+     * pass it on unchanged. Otherwise, copy just the parts
+     * that host is interested in.
+     */
+    assert(n->host_hdr_len <= n->guest_hdr_len);
+    if (n->host_hdr_len == n->guest_hdr_len) {
+        return 0;
+    }
+
+    sg_num = iov_copy(sg, VIRTQUEUE_MAX_SIZE + 1, out_sg, out_num,
+                      0, n->host_hdr_len);
+    sg_num += iov_copy(sg + sg_num, VIRTQUEUE_MAX_SIZE + 1 - sg_num,
+                       out_sg, out_num, n->guest_hdr_len, -1);
+    pkt->iov = sg;
+    pkt->iovcnt = sg_num;
+    return sg_num;
+}
+
 /* TX */
 static int32_t virtio_net_flush_tx(VirtIONetQueue *q)
 {
     VirtIONet *n = q->n;
     VirtIODevice *vdev = VIRTIO_DEVICE(n);
-    VirtQueueElement elem;
+    VirtQueueElement *elems[VIRTIO_NET_TX_BATCH];
+    NetPacketIOV pkts[VIRTIO_NET_TX_BATCH];
+    NetClientState *nc;
     int32_t num_packets = 0;
     int queue_index = vq2q(virtio_get_queue_index(q->tx_vq));
     if (!(vdev->status & VIRTIO_CONFIG_S_DRIVER_OK)) {
         return num_packets;
     }
 
-    if (q->async_tx.elem.out_num) {
+    if (q->async_tx.num) {
         virtio_queue_set_notification(q->tx_vq, 0);
         return num_packets;
     }
 
-    while (virtqueue_pop(q->tx_vq, &elem)) {
-        ssize_t ret, len;
-        unsigned int out_num = elem.out_num;
-        struct iovec *out_sg = &elem.out_sg[0];
-        struct iovec sg[VIRTQUEUE_MAX_SIZE];
+    nc = qemu_get_subqueue(n->nic, queue_index);
 
-        if (out_num < 1) {
-            error_report("virtio-net header not in first element");
-            exit(1);
-        }
+    while (num_packets < n->tx_burst) {
+        unsigned int sg_used = 0;
+        bool empty = false;
+        int count, sent, i;
 
-        if (n->has_vnet_hdr) {
-            if (out_sg[0].iov_len < n->guest_hdr_len) {
-                error_report("virtio-net header incorrect");
-                exit(1);
+        /* Pop a batch, stopping early if the scatter list space for the
+         * next chain might run out.
+         */
+        for (count = 0; count < VIRTIO_NET_TX_BATCH &&
+                        num_packets + count < n->tx_burst &&
+                        sg_used + VIRTQUEUE_MAX_SIZE + 1 <=
+                        VIRTIO_NET_TX_SG_MAX; count++) {
+            elems[count] = virtqueue_pop(q->tx_vq, sizeof(VirtQueueElement));
+            if (!elems[count]) {
+                empty = true;
+                break;
             }
-            virtio_net_hdr_swap(vdev, (void *) out_sg[0].iov_base);
+            sg_used += virtio_net_tx_prepare(n, elems[count],
+                                             q->tx_sg + sg_used,
+                                             &pkts[count]);
+        }
+        if (count == 0) {
+            break;
         }
 
-        /*
-         * If host wants to see the guest header as is, we can
-         * pass it on unchanged. Otherwise, copy just the parts
-         * that host is interested in.
+        /* The elements are only completed in virtio_net_tx_complete(),
+         * so packets that have to be queued can point to guest memory.
          */
-        assert(n->host_hdr_len <= n->guest_hdr_len);
-        if (n->host_hdr_len != n->guest_hdr_len) {
-            unsigned sg_num = iov_copy(sg, ARRAY_SIZE(sg),
-                                       out_sg, out_num,
-                                       0, n->host_hdr_len);
-            sg_num += iov_copy(sg + sg_num, ARRAY_SIZE(sg) - sg_num,
-                             out_sg, out_num,
-                             n->guest_hdr_len, -1);
-            out_num = sg_num;
-            out_sg = sg;
-        }
-
-        len = n->guest_hdr_len;
-
-        ret = qemu_sendv_packet_async(qemu_get_subqueue(n->nic, queue_index),
-                                      out_sg, out_num, virtio_net_tx_complete);
-        if (ret == 0) {
+        sent = qemu_sendv_packet_batch_zerocopy(nc, pkts, count,
+                                                virtio_net_tx_complete);
+        trace_virtio_net_tx_batch(q, count, sent);
+
+        for (i = 0; i < sent; i++) {
+            virtqueue_fill(q->tx_vq, elems[i], 0, i);
+            virtqueue_free_element(q->tx_vq, elems[i]);
+        }
+        if (sent) {
+            virtqueue_flush(q->tx_vq, sent);
+            virtio_net_notify(n, q->tx_vq);
+        }
+        num_packets += sent;
+
+        if (sent < count) {
             virtio_queue_set_notification(q->tx_vq, 0);
-            q->async_tx.elem = elem;
-            q->async_tx.len  = len;
+            q->async_tx.num = count - sent;
+            memcpy(q->async_tx.elems, &elems[sent],
+                   q->async_tx.num * sizeof(elems[0]));
             return -EBUSY;
         }
 
-        len += ret;
-
-        virtqueue_push(q->tx_vq, &elem, 0);
-        virtio_notify(vdev, q->tx_vq);
-
-        if (++num_packets >= n->tx_burst) {
+        if (empty) {
             break;
         }
     }
@@ -1381,6 +1933,21 @@ static void virtio_net_save_device(VirtIODevice *vdev, QEMUFile *f)
     if (virtio_has_feature(vdev, VIRTIO_NET_F_CTRL_GUEST_OFFLOADS)) {
         qemu_put_be64(f, n->curr_guest_offloads);
     }
+
+    if (n->net_conf.rss) {
+        VirtioNetRssData *rss = &n->rss_data;
+
+        qemu_put_byte(f, rss->guest_set);
+        if (rss->guest_set) {
+            qemu_put_be32(f, rss->hash_types);
+            qemu_put_buffer(f, rss->key, sizeof(rss->key));
+            qemu_put_be16(f, rss->indirections_len);
+            for (i = 0; i < rss->indirections_len; i++) {
+                qemu_put_be16(f, rss->indirections[i]);
+            }
+            qemu_put_be16(f, rss->default_queue);
+        }
+    }
 }
 
 static int virtio_net_load(QEMUFile *f, void *opaque, int version_id)
@@ -1492,6 +2059,27 @@ static int virtio_net_load_device(VirtIODevice *vdev, QEMUFile *f,
         n->curr_guest_offloads = virtio_net_supported_guest_offloads(n);
     }
 
+    virtio_net_rss_reset(n);
+    if (n->net_conf.rss && qemu_get_byte(f)) {
+        VirtioNetRssData *rss = &n->rss_data;
+
+        rss->guest_set = true;
+        rss->hash_types = qemu_get_be32(f);
+        qemu_get_buffer(f, rss->key, sizeof(rss->key));
+        rss->indirections_len = qemu_get_be16(f);
+        if (rss->indirections_len > VIRTIO_NET_RSS_MAX_TABLE_LEN ||
+            !rss->indirections_len ||
+            (rss->indirections_len & (rss->indirections_len - 1))) {
+            error_report("virtio-net: invalid RSS table length %d",
+                         rss->indirections_len);
+            return -1;
+        }
+        for (i = 0; i < rss->indirections_len; i++) {
+            rss->indirections[i] = qemu_get_be16(f);
+        }
+        rss->default_queue = qemu_get_be16(f);
+    }
+
     if (peer_has_vnet_hdr(n)) {
         virtio_net_apply_guest_offloads(n);
     }
@@ -1527,6 +2115,7 @@ static NetClientInfo net_virtio_info = {
     .size = sizeof(NICState),
     .can_receive = virtio_net_can_receive,
     .receive = virtio_net_receive,
+    .receive_iov_batch = virtio_net_receive_batch,
     .link_status_changed = virtio_net_set_link_status,
     .query_rx_filter = virtio_net_query_rxfilter,
 };
@@ -1594,6 +2183,9 @@ static void virtio_net_device_realize(DeviceState *dev, Error **errp)
         return;
     }
     n->vqs = g_malloc0(sizeof(VirtIONetQueue) * n->max_queues);
+    for (i = 0; i < n->max_queues; i++) {
+        n->vqs[i].tx_sg = g_new(struct iovec, VIRTIO_NET_TX_SG_MAX);
+    }
     n->vqs[0].rx_vq = virtio_add_queue(vdev, 256, virtio_net_handle_rx);
     n->curr_queues = 1;
     n->vqs[0].n = n;
@@ -1618,6 +2210,35 @@ static void virtio_net_device_realize(DeviceState *dev, Error **errp)
         n->vqs[0].tx_bh = qemu_bh_new(virtio_net_tx_bh, &n->vqs[0]);
     }
     n->ctrl_vq = virtio_add_queue(vdev, 64, virtio_net_handle_ctrl);
+
+    if (n->net_conf.iothread) {
+        BusState *qbus = BUS(qdev_get_parent_bus(dev));
+        VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
+
+        if (n->vqs[0].tx_timer) {
+            error_setg(errp, "iothread is not supported with tx=timer");
+            goto fail_iothread;
+        }
+        if (!k->set_guest_notifiers || !k->set_host_notifier) {
+            error_setg(errp, "device is incompatible with iothread "
+                       "(transport does not support notifiers)");
+            goto fail_iothread;
+        }
+        for (i = 0; i < n->max_queues; i++) {
+            NetClientState *peer = n->nic_conf.peers.ncs[i];
+
+            if (!peer || !peer->info->set_aio_context) {
+                error_setg(errp, "iothread requires a tap netdev");
+                goto fail_iothread;
+            }
+            if (get_vhost_net(peer)) {
+                error_setg(errp, "iothread cannot be used with vhost");
+                goto fail_iothread;
+            }
+        }
+        n->ctx = iothread_get_aio_context(n->net_conf.iothread);
+    }
+
     qemu_macaddr_default_if_unset(&n->nic_conf.macaddr);
     memcpy(&n->mac[0], &n->nic_conf.macaddr, sizeof(n->mac));
     n->status = VIRTIO_NET_S_LINK_UP;
@@ -1659,9 +2280,38 @@ static void virtio_net_device_realize(DeviceState *dev, Error **errp)
     nc = qemu_get_queue(n->nic);
     nc->rxfilter_notify_enabled = 1;
 
+    virtio_net_rss_reset(n);
+    if (n->net_conf.rss) {
+        for (i = 0; i < n->max_queues; i++) {
+            char *name;
+
+            name = g_strdup_printf("rss-queue%d-packets", i);
+            object_property_add_uint64_ptr(OBJECT(n), name,
+                                           &n->vqs[i].rss_packets, NULL);
+            g_free(name);
+            name = g_strdup_printf("rss-queue%d-drops", i);
+            object_property_add_uint64_ptr(OBJECT(n), name,
+                                           &n->vqs[i].rss_drops, NULL);
+            g_free(name);
+        }
+    }
+
     n->qdev = dev;
     register_savevm(dev, "virtio-net", -1, VIRTIO_NET_VM_VERSION,
                     virtio_net_save, virtio_net_load, n);
+    return;
+
+fail_iothread:
+    if (n->vqs[0].tx_timer) {
+        timer_free(n->vqs[0].tx_timer);
+    } else {
+        qemu_bh_delete(n->vqs[0].tx_bh);
+    }
+    for (i = 0; i < n->max_queues; i++) {
+        g_free(n->vqs[i].tx_sg);
+    }
+    g_free(n->vqs);
+    virtio_cleanup(vdev);
 }
 
 static void virtio_net_device_unrealize(DeviceState *dev, Error **errp)
@@ -1686,8 +2336,24 @@ static void virtio_net_device_unrealize(DeviceState *dev, Error **errp)
     for (i = 0; i < n->max_queues; i++) {
         VirtIONetQueue *q = &n->vqs[i];
         NetClientState *nc = qemu_get_subqueue(n->nic, i);
+        unsigned int j;
+
+        if (n->net_conf.rss) {
+            char *name;
+
+            name = g_strdup_printf("rss-queue%d-packets", i);
+            object_property_del(OBJECT(n), name, NULL);
+            g_free(name);
+            name = g_strdup_printf("rss-queue%d-drops", i);
+            object_property_del(OBJECT(n), name, NULL);
+            g_free(name);
+        }
 
         qemu_purge_queued_packets(nc);
+        for (j = 0; j < q->async_tx.num; j++) {
+            g_free(q->async_tx.elems[j]);
+        }
+        g_free(q->tx_sg);
 
         if (q->tx_timer) {
             timer_del(q->tx_timer);
@@ -1716,6 +2382,10 @@ static void virtio_net_instance_init(Object *obj)
     device_add_bootindex_property(obj, &n->nic_conf.bootindex,
                                   "bootindex", "/ethernet-phy@0",
                                   DEVICE(n), NULL);
+    object_property_add_link(obj, "iothread", TYPE_IOTHREAD,
+                             (Object **)&n->net_conf.iothread,
+                             qdev_prop_allow_set_link_before_realize,
+                             OBJ_PROP_LINK_UNREF_ON_RELEASE, NULL);
 }
 
 static Property virtio_net_properties[] = {
@@ -1725,6 +2395,7 @@ static Property virtio_net_properties[] = {
                                                TX_TIMER_INTERVAL),
     DEFINE_PROP_INT32("x-txburst", VirtIONet, net_conf.txburst, TX_BURST),
     DEFINE_PROP_STRING("tx", VirtIONet, net_conf.tx),
+    DEFINE_PROP_BOOL("rss", VirtIONet, net_conf.rss, false),
     DEFINE_PROP_END_OF_LIST(),
 };
 
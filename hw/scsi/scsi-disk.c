@@ -43,6 +43,7 @@ do { printf("scsi-disk: " fmt , ## __VA_ARGS__); } while (0)
 #endif
 
 #define SCSI_WRITE_SAME_MAX         524288
+#define SCSI_DISCARD_MAX            (1 << 30)   /* per UNMAP/WRITE SAME I/O */
 #define SCSI_DMA_BUF_SIZE           131072
 #define SCSI_MAX_INQUIRY_LEN        256
 #define SCSI_MAX_MODE_LEN           256
@@ -88,6 +89,7 @@ struct SCSIDiskState
     char *product;
     bool tray_open;
     bool tray_locked;
+    bool image_discard_granularity;
 };
 
 static int scsi_handle_rw_error(SCSIDiskReq *r, int error);
@@ -639,6 +641,13 @@ static int scsi_disk_emulate_inquiry(SCSIRequest *req, uint8_t *outbuf)
                     s->max_unmap_size / s->qdev.blocksize;
             unsigned int max_io_sectors =
                     s->max_io_size / s->qdev.blocksize;
+            uint64_t max_discard = blk_get_max_discard(s->qdev.conf.blk);
+
+            /* Do not advertise more than the backend can unmap at once */
+            max_discard = max_discard * 512 / s->qdev.blocksize;
+            if (max_discard) {
+                max_unmap_sectors = MIN(max_unmap_sectors, max_discard);
+            }
 
             if (s->qdev.type == TYPE_ROM) {
                 DPRINTF("Inquiry (EVPD[%02X] not supported for CDROM\n",
@@ -1537,10 +1546,17 @@ static inline bool check_lba_range(SCSIDiskState *s,
             sector_num + nb_sectors <= s->qdev.max_lba + 1);
 }
 
+/* A range to discard, in terms of qemu 512 byte blocks.  */
+typedef struct UnmapExtent {
+    uint64_t sector;
+    uint64_t nb_sectors;
+} UnmapExtent;
+
 typedef struct UnmapCBData {
     SCSIDiskReq *r;
-    uint8_t *inbuf;
+    UnmapExtent *extents;
     int count;
+    int next;
 } UnmapCBData;
 
 static void scsi_unmap_complete(void *opaque, int ret)
@@ -1548,8 +1564,8 @@ static void scsi_unmap_complete(void *opaque, int ret)
     UnmapCBData *data = opaque;
     SCSIDiskReq *r = data->r;
     SCSIDiskState *s = DO_UPCAST(SCSIDiskState, qdev, r->req.dev);
-    uint64_t sector_num;
-    uint32_t nb_sectors;
+    UnmapExtent *ext;
+    int nb_sectors;
 
     r->req.aiocb = NULL;
     if (r->req.io_canceled) {
@@ -1563,20 +1579,16 @@ static void scsi_unmap_complete(void *opaque, int ret)
         }
     }
 
-    if (data->count > 0) {
-        sector_num = ldq_be_p(&data->inbuf[0]);
-        nb_sectors = ldl_be_p(&data->inbuf[8]) & 0xffffffffULL;
-        if (!check_lba_range(s, sector_num, nb_sectors)) {
-            scsi_check_condition(r, SENSE_CODE(LBA_OUT_OF_RANGE));
-            goto done;
+    if (data->next < data->count) {
+        ext = &data->extents[data->next];
+        nb_sectors = MIN(ext->nb_sectors, SCSI_DISCARD_MAX / 512);
+        r->req.aiocb = blk_aio_discard(s->qdev.conf.blk, ext->sector,
+                                       nb_sectors, scsi_unmap_complete, data);
+        ext->sector += nb_sectors;
+        ext->nb_sectors -= nb_sectors;
+        if (ext->nb_sectors == 0) {
+            data->next++;
         }
-
-        r->req.aiocb = blk_aio_discard(s->qdev.conf.blk,
-                                       sector_num * (s->qdev.blocksize / 512),
-                                       nb_sectors * (s->qdev.blocksize / 512),
-                                       scsi_unmap_complete, data);
-        data->count--;
-        data->inbuf += 16;
         return;
     }
 
@@ -1584,15 +1596,33 @@ static void scsi_unmap_complete(void *opaque, int ret)
 
 done:
     scsi_req_unref(&r->req);
+    g_free(data->extents);
     g_free(data);
 }
 
+static int unmap_extent_compare(const void *a, const void *b)
+{
+    const UnmapExtent *ext1 = a, *ext2 = b;
+
+    if (ext1->sector > ext2->sector) {
+        return 1;
+    } else if (ext1->sector < ext2->sector) {
+        return -1;
+    } else {
+        return 0;
+    }
+}
+
 static void scsi_disk_emulate_unmap(SCSIDiskReq *r, uint8_t *inbuf)
 {
     SCSIDiskState *s = DO_UPCAST(SCSIDiskState, qdev, r->req.dev);
     uint8_t *p = inbuf;
     int len = r->req.cmd.xfer;
     UnmapCBData *data;
+    UnmapExtent *ext;
+    uint64_t sector_num, end;
+    uint32_t nb_sectors;
+    int i, j, count;
 
     /* Reject ANCHOR=1.  */
     if (r->req.cmd.buf[1] & 0x1) {
@@ -1617,10 +1647,47 @@ static void scsi_disk_emulate_unmap(SCSIDiskReq *r, uint8_t *inbuf)
         return;
     }
 
+    /* Check every descriptor before discarding anything, then sort them
+     * and merge adjacent or overlapping ones so that the backend sees as
+     * few requests as possible.
+     */
+    count = lduw_be_p(&p[2]) >> 4;
+    ext = g_new(UnmapExtent, count);
+    for (i = j = 0; i < count; i++) {
+        sector_num = ldq_be_p(&p[8 + i * 16]);
+        nb_sectors = ldl_be_p(&p[8 + i * 16 + 8]) & 0xffffffffULL;
+        if (!check_lba_range(s, sector_num, nb_sectors)) {
+            g_free(ext);
+            scsi_check_condition(r, SENSE_CODE(LBA_OUT_OF_RANGE));
+            return;
+        }
+        if (nb_sectors == 0) {
+            continue;
+        }
+        ext[j].sector = sector_num * (s->qdev.blocksize / 512);
+        ext[j].nb_sectors = (uint64_t)nb_sectors * (s->qdev.blocksize / 512);
+        j++;
+    }
+    count = j;
+
+    qsort(ext, count, sizeof(ext[0]), unmap_extent_compare);
+    for (i = 1, j = 0; i < count; i++) {
+        end = ext[j].sector + ext[j].nb_sectors;
+        if (ext[i].sector <= end) {
+            end = MAX(end, ext[i].sector + ext[i].nb_sectors);
+            ext[j].nb_sectors = end - ext[j].sector;
+        } else {
+            ext[++j] = ext[i];
+        }
+    }
+    if (count) {
+        count = j + 1;
+    }
+
     data = g_new0(UnmapCBData, 1);
     data->r = r;
-    data->inbuf = &p[8];
-    data->count = lduw_be_p(&p[2]) >> 4;
+    data->extents = ext;
+    data->count = count;
 
     /* The matching unref is in scsi_unmap_complete, before data is freed.  */
     scsi_req_ref(&r->req);
@@ -1638,11 +1705,36 @@ invalid_field:
 typedef struct WriteSameCBData {
     SCSIDiskReq *r;
     int64_t sector;
-    int nb_sectors;
+    int64_t nb_sectors;
+    int flags;
     QEMUIOVector qiov;
     struct iovec iov;
 } WriteSameCBData;
 
+static void scsi_write_same_complete(void *opaque, int ret);
+
+/* Write the next iov.iov_len bytes, either by replicating the block in
+ * iov.iov_base or, if there is none, as zeroes.
+ */
+static void scsi_write_same_submit(WriteSameCBData *data)
+{
+    SCSIDiskReq *r = data->r;
+    SCSIDiskState *s = DO_UPCAST(SCSIDiskState, qdev, r->req.dev);
+
+    block_acct_start(blk_get_stats(s->qdev.conf.blk), &r->acct,
+                     data->iov.iov_len, BLOCK_ACCT_WRITE);
+    if (data->iov.iov_base) {
+        r->req.aiocb = blk_aio_writev(s->qdev.conf.blk, data->sector,
+                                      &data->qiov, data->iov.iov_len / 512,
+                                      scsi_write_same_complete, data);
+    } else {
+        r->req.aiocb = blk_aio_write_zeroes(s->qdev.conf.blk, data->sector,
+                                            data->iov.iov_len / 512,
+                                            data->flags,
+                                            scsi_write_same_complete, data);
+    }
+}
+
 static void scsi_write_same_complete(void *opaque, int ret)
 {
     WriteSameCBData *data = opaque;
@@ -1667,11 +1759,7 @@ static void scsi_write_same_complete(void *opaque, int ret)
     data->sector += data->iov.iov_len / 512;
     data->iov.iov_len = MIN(data->nb_sectors * 512, data->iov.iov_len);
     if (data->iov.iov_len) {
-        block_acct_start(blk_get_stats(s->qdev.conf.blk), &r->acct,
-                         data->iov.iov_len, BLOCK_ACCT_WRITE);
-        r->req.aiocb = blk_aio_writev(s->qdev.conf.blk, data->sector,
-                                      &data->qiov, data->iov.iov_len / 512,
-                                      scsi_write_same_complete, data);
+        scsi_write_same_submit(data);
         return;
     }
 
@@ -1707,40 +1795,31 @@ static void scsi_disk_emulate_write_same(SCSIDiskReq *r, uint8_t *inbuf)
         return;
     }
 
-    if (buffer_is_zero(inbuf, s->qdev.blocksize)) {
-        int flags = (req->cmd.buf[1] & 0x8) ? BDRV_REQ_MAY_UNMAP : 0;
-
-        /* The request is used as the AIO opaque value, so add a ref.  */
-        scsi_req_ref(&r->req);
-        block_acct_start(blk_get_stats(s->qdev.conf.blk), &r->acct,
-                         nb_sectors * s->qdev.blocksize,
-                        BLOCK_ACCT_WRITE);
-        r->req.aiocb = blk_aio_write_zeroes(s->qdev.conf.blk,
-                                r->req.cmd.lba * (s->qdev.blocksize / 512),
-                                nb_sectors * (s->qdev.blocksize / 512),
-                                flags, scsi_aio_complete, r);
-        return;
-    }
-
     data = g_new0(WriteSameCBData, 1);
     data->r = r;
     data->sector = r->req.cmd.lba * (s->qdev.blocksize / 512);
-    data->nb_sectors = nb_sectors * (s->qdev.blocksize / 512);
-    data->iov.iov_len = MIN(data->nb_sectors * 512, SCSI_WRITE_SAME_MAX);
-    data->iov.iov_base = buf = blk_blockalign(s->qdev.conf.blk,
-                                              data->iov.iov_len);
-    qemu_iovec_init_external(&data->qiov, &data->iov, 1);
+    data->nb_sectors = (int64_t)nb_sectors * (s->qdev.blocksize / 512);
 
-    for (i = 0; i < data->iov.iov_len; i += s->qdev.blocksize) {
-        memcpy(&buf[i], inbuf, s->qdev.blocksize);
+    if (buffer_is_zero(inbuf, s->qdev.blocksize)) {
+        /* Nothing to replicate; let the backend zero the range, or
+         * deallocate it if UNMAP=1, in chunks that fit one request.
+         */
+        data->flags = (req->cmd.buf[1] & 0x8) ? BDRV_REQ_MAY_UNMAP : 0;
+        data->iov.iov_len = MIN(data->nb_sectors * 512, SCSI_DISCARD_MAX);
+    } else {
+        data->iov.iov_len = MIN(data->nb_sectors * 512, SCSI_WRITE_SAME_MAX);
+        data->iov.iov_base = buf = blk_blockalign(s->qdev.conf.blk,
+                                                  data->iov.iov_len);
+        qemu_iovec_init_external(&data->qiov, &data->iov, 1);
+
+        for (i = 0; i < data->iov.iov_len; i += s->qdev.blocksize) {
+            memcpy(&buf[i], inbuf, s->qdev.blocksize);
+        }
     }
 
+    /* The matching unref is in scsi_write_same_complete.  */
     scsi_req_ref(&r->req);
-    block_acct_start(blk_get_stats(s->qdev.conf.blk), &r->acct,
-                     data->iov.iov_len, BLOCK_ACCT_WRITE);
-    r->req.aiocb = blk_aio_writev(s->qdev.conf.blk, data->sector,
-                                  &data->qiov, data->iov.iov_len / 512,
-                                  scsi_write_same_complete, data);
+    scsi_write_same_submit(data);
 }
 
 static void scsi_disk_emulate_write_data(SCSIRequest *req)
@@ -2261,8 +2340,24 @@ static void scsi_realize(SCSIDevice *dev, Error **errp)
     }
 
     if (s->qdev.conf.discard_granularity == -1) {
-        s->qdev.conf.discard_granularity =
-            MAX(s->qdev.conf.logical_block_size, DEFAULT_DISCARD_GRANULARITY);
+        BlockBackend *blk = s->qdev.conf.blk;
+        BlockDriverInfo bdi;
+        uint32_t granularity;
+
+        granularity = MAX(s->qdev.conf.logical_block_size,
+                          DEFAULT_DISCARD_GRANULARITY);
+        /* Unmapping less than the image's allocation unit (for example
+         * a qcow2 cluster) frees nothing, so advertise that by default.
+         * Older machine types keep the 4 KiB the guest saw before.
+         */
+        if (s->image_discard_granularity) {
+            granularity = MAX(granularity,
+                              blk_get_write_zeroes_alignment(blk) * 512);
+            if (blk_get_info(blk, &bdi) == 0) {
+                granularity = MAX(granularity, bdi.cluster_size);
+            }
+        }
+        s->qdev.conf.discard_granularity = granularity;
     }
 
     if (!s->version) {
@@ -2594,7 +2689,9 @@ static int scsi_block_parse_cdb(SCSIDevice *d, SCSICommand *cmd,
     DEFINE_PROP_STRING("ver", SCSIDiskState, version),               \
     DEFINE_PROP_STRING("serial", SCSIDiskState, serial),             \
     DEFINE_PROP_STRING("vendor", SCSIDiskState, vendor),             \
-    DEFINE_PROP_STRING("product", SCSIDiskState, product)
+    DEFINE_PROP_STRING("product", SCSIDiskState, product),           \
+    DEFINE_PROP_BOOL("image_discard_granularity", SCSIDiskState,     \
+                     image_discard_granularity, true)
 
 static Property scsi_hd_properties[] = {
     DEFINE_SCSI_DISK_PROPERTIES(),
@@ -18,30 +18,122 @@
 #include <block/scsi.h>
 #include <hw/virtio/virtio-bus.h>
 #include "hw/virtio/virtio-access.h"
+#include "qemu/iov.h"
 #include "stdio.h"
 
+static void virtio_scsi_iothread_handoff_bh(void *opaque);
+
 /* Context: QEMU global mutex held */
-void virtio_scsi_set_iothread(VirtIOSCSI *s, IOThread *iothread)
+void virtio_scsi_dataplane_init(VirtIOSCSI *s, Error **errp)
 {
     BusState *qbus = BUS(qdev_get_parent_bus(DEVICE(s)));
     VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
     VirtIOSCSICommon *vs = VIRTIO_SCSI_COMMON(s);
+    IOThread **iothreads;
+    char **ids = NULL;
+    int i, n;
 
     assert(!s->ctx);
-    s->ctx = iothread_get_aio_context(vs->conf.iothread);
 
     /* Don't try if transport does not support notifiers. */
     if (!k->set_guest_notifiers || !k->set_host_notifier) {
-        fprintf(stderr, "virtio-scsi: Failed to set iothread "
+        error_setg(errp, "virtio-scsi: Failed to set iothread "
                    "(transport does not support notifiers)");
-        exit(1);
+        return;
+    }
+
+    if (vs->conf.iothreads) {
+        if (vs->conf.iothread) {
+            error_setg(errp, "iothread and iothreads are mutually exclusive");
+            return;
+        }
+        ids = g_strsplit(vs->conf.iothreads, ":", 0);
+        n = g_strv_length(ids);
+        if (n == 0) {
+            error_setg(errp, "iothreads must name at least one IOThread");
+            g_strfreev(ids);
+            return;
+        }
+        iothreads = g_new(IOThread *, n);
+        for (i = 0; i < n; i++) {
+            iothreads[i] = iothread_find(ids[i]);
+            if (!iothreads[i]) {
+                error_setg(errp, "iothread '%s' not found", ids[i]);
+                g_free(iothreads);
+                g_strfreev(ids);
+                return;
+            }
+        }
+        g_strfreev(ids);
+    } else {
+        n = 1;
+        iothreads = g_new(IOThread *, 1);
+        iothreads[0] = vs->conf.iothread;
+    }
+
+    s->threads = g_new0(VirtIOSCSIThread, n);
+    for (i = 0; i < n; i++) {
+        VirtIOSCSIThread *t = &s->threads[i];
+
+        t->parent = s;
+        t->iothread = iothreads[i];
+        object_ref(OBJECT(t->iothread));
+        t->ctx = iothread_get_aio_context(t->iothread);
+        t->bh = aio_bh_new(t->ctx, virtio_scsi_iothread_handoff_bh, t);
+        qemu_mutex_init(&t->lock);
+        QTAILQ_INIT(&t->reqs);
+    }
+    s->num_threads = n;
+    s->ctx = s->threads[0].ctx;
+    g_free(iothreads);
+}
+
+/* Context: QEMU global mutex held */
+void virtio_scsi_dataplane_cleanup(VirtIOSCSI *s)
+{
+    int i;
+
+    for (i = 0; i < s->num_threads; i++) {
+        VirtIOSCSIThread *t = &s->threads[i];
+
+        assert(QTAILQ_EMPTY(&t->reqs));
+        qemu_bh_delete(t->bh);
+        qemu_mutex_destroy(&t->lock);
+        object_unref(OBJECT(t->iothread));
+    }
+    g_free(s->threads);
+    s->threads = NULL;
+    s->num_threads = 0;
+    s->ctx = NULL;
+}
+
+AioContext *virtio_scsi_target_ctx(VirtIOSCSI *s, int target)
+{
+    return s->threads[target % s->num_threads].ctx;
+}
+
+static void virtio_scsi_acquire_all(VirtIOSCSI *s)
+{
+    int i;
+
+    for (i = 0; i < s->num_threads; i++) {
+        aio_context_acquire(s->threads[i].ctx);
+    }
+}
+
+static void virtio_scsi_release_all(VirtIOSCSI *s)
+{
+    int i;
+
+    for (i = s->num_threads - 1; i >= 0; i--) {
+        aio_context_release(s->threads[i].ctx);
     }
 }
 
 static VirtIOSCSIVring *virtio_scsi_vring_init(VirtIOSCSI *s,
                                                VirtQueue *vq,
                                                EventNotifierHandler *handler,
-                                               int n)
+                                               int n, AioContext *ctx)
 {
     BusState *qbus = BUS(qdev_get_parent_bus(DEVICE(s)));
     VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
@@ -60,7 +152,9 @@ static VirtIOSCSIVring *virtio_scsi_vring_init(VirtIOSCSI *s,
     r = g_slice_new(VirtIOSCSIVring);
     r->host_notifier = *virtio_queue_get_host_notifier(vq);
     r->guest_notifier = *virtio_queue_get_guest_notifier(vq);
-    aio_set_event_notifier(s->ctx, &r->host_notifier, handler);
+    r->ctx = ctx;
+    qemu_mutex_init(&r->lock);
+    aio_set_event_notifier(ctx, &r->host_notifier, handler);
 
     r->parent = s;
 
@@ -71,23 +165,32 @@ static VirtIOSCSIVring *virtio_scsi_vring_init(VirtIOSCSI *s,
     return r;
 
 fail_vring:
-    aio_set_event_notifier(s->ctx, &r->host_notifier, NULL);
+    aio_set_event_notifier(ctx, &r->host_notifier, NULL);
     k->set_host_notifier(qbus->parent, n, false);
+    qemu_mutex_destroy(&r->lock);
     g_slice_free(VirtIOSCSIVring, r);
     return NULL;
 }
 
+static void virtio_scsi_vring_free(VirtIOSCSIVring *r)
+{
+    qemu_mutex_destroy(&r->lock);
+    g_slice_free(VirtIOSCSIVring, r);
+}
+
 VirtIOSCSIReq *virtio_scsi_pop_req_vring(VirtIOSCSI *s,
                                          VirtIOSCSIVring *vring)
 {
-    VirtIOSCSIReq *req = virtio_scsi_init_req(s, NULL);
-    int r;
+    VirtIOSCSICommon *vs = VIRTIO_SCSI_COMMON(s);
+    VirtIOSCSIReq *req;
 
-    req->vring = vring;
-    r = vring_pop((VirtIODevice *)s, &vring->vring, &req->elem);
-    if (r < 0) {
-        virtio_scsi_free_req(req);
-        req = NULL;
+    qemu_mutex_lock(&vring->lock);
+    req = vring_pop((VirtIODevice *)s, &vring->vring,
+                    sizeof(VirtIOSCSIReq) + vs->cdb_size);
+    qemu_mutex_unlock(&vring->lock);
+    if (req) {
+        virtio_scsi_init_req(s, NULL, req);
+        req->vring = vring;
     }
     return req;
 }
@@ -95,12 +198,75 @@ VirtIOSCSIReq *virtio_scsi_pop_req_vring(VirtIOSCSI *s,
 void virtio_scsi_vring_push_notify(VirtIOSCSIReq *req)
 {
     VirtIODevice *vdev = VIRTIO_DEVICE(req->vring->parent);
+    VirtIOSCSIVring *vring = req->vring;
+    bool notify;
 
-    vring_push(vdev, &req->vring->vring, &req->elem,
+    qemu_mutex_lock(&vring->lock);
+    vring_push(vdev, &vring->vring, &req->elem,
                req->qsgl.size + req->resp_iov.size);
+    notify = vring_should_notify(vdev, &vring->vring);
+    qemu_mutex_unlock(&vring->lock);
+
+    if (notify) {
+        event_notifier_set(&vring->guest_notifier);
+    }
+}
 
-    if (vring_should_notify(vdev, &req->vring->vring)) {
-        event_notifier_set(&req->vring->guest_notifier);
+/* Find the IOThread that owns the target addressed by the request, or NULL
+ * if the request can be handled where it was popped.
+ */
+static VirtIOSCSIThread *virtio_scsi_req_thread(VirtIOSCSI *s,
+                                                VirtIOSCSIReq *req,
+                                                size_t lun_offset)
+{
+    VirtIOSCSIThread *t;
+    uint8_t lun[8];
+
+    if (s->num_threads == 1 ||
+        iov_to_buf(req->elem.out_sg, req->elem.out_num, lun_offset,
+                   lun, sizeof(lun)) < sizeof(lun)) {
+        return NULL;
+    }
+
+    t = &s->threads[lun[1] % s->num_threads];
+    return t->ctx == req->vring->ctx ? NULL : t;
+}
+
+static void virtio_scsi_handoff_req(VirtIOSCSIThread *t, VirtIOSCSIReq *req)
+{
+    qemu_mutex_lock(&t->lock);
+    QTAILQ_INSERT_TAIL(&t->reqs, req, next);
+    qemu_mutex_unlock(&t->lock);
+    qemu_bh_schedule(t->bh);
+}
+
+/* Run requests handed over by other queues in the target's own IOThread */
+static void virtio_scsi_iothread_handoff_bh(void *opaque)
+{
+    VirtIOSCSIThread *t = opaque;
+    VirtIOSCSI *s = t->parent;
+    VirtIOSCSIReq *req, *next;
+    QTAILQ_HEAD(, VirtIOSCSIReq) reqs = QTAILQ_HEAD_INITIALIZER(reqs);
+    QTAILQ_HEAD(, VirtIOSCSIReq) cmds = QTAILQ_HEAD_INITIALIZER(cmds);
+
+    qemu_mutex_lock(&t->lock);
+    QTAILQ_FOREACH_SAFE(req, &t->reqs, next, next) {
+        QTAILQ_REMOVE(&t->reqs, req, next);
+        QTAILQ_INSERT_TAIL(&reqs, req, next);
+    }
+    qemu_mutex_unlock(&t->lock);
+
+    QTAILQ_FOREACH_SAFE(req, &reqs, next, next) {
+        QTAILQ_REMOVE(&reqs, req, next);
+        if (req->vring == s->ctrl_vring) {
+            virtio_scsi_handle_ctrl_req(s, req);
+        } else if (virtio_scsi_handle_cmd_req_prepare(s, req)) {
+            QTAILQ_INSERT_TAIL(&cmds, req, next);
+        }
+    }
+
+    QTAILQ_FOREACH_SAFE(req, &cmds, next, next) {
+        virtio_scsi_handle_cmd_req_submit(s, req);
     }
 }
 
@@ -109,11 +275,26 @@ static void virtio_scsi_iothread_handle_ctrl(EventNotifier *notifier)
     VirtIOSCSIVring *vring = container_of(notifier,
                                           VirtIOSCSIVring, host_notifier);
     VirtIOSCSI *s = VIRTIO_SCSI(vring->parent);
+    VirtIODevice *vdev = VIRTIO_DEVICE(s);
+    VirtIOSCSIThread *t;
     VirtIOSCSIReq *req;
+    uint32_t type;
 
     event_notifier_test_and_clear(notifier);
     while ((req = virtio_scsi_pop_req_vring(s, vring))) {
-        virtio_scsi_handle_ctrl_req(s, req);
+        /* Task management functions must run where the target lives */
+        t = NULL;
+        if (iov_to_buf(req->elem.out_sg, req->elem.out_num, 0,
+                       &type, sizeof(type)) == sizeof(type) &&
+            virtio_tswap32(vdev, type) == VIRTIO_SCSI_T_TMF) {
+            t = virtio_scsi_req_thread(s, req,
+                    offsetof(VirtIOSCSICtrlTMFReq, lun));
+        }
+        if (t) {
+            virtio_scsi_handoff_req(t, req);
+        } else {
+            virtio_scsi_handle_ctrl_req(s, req);
+        }
     }
 }
 
@@ -143,9 +324,14 @@ static void virtio_scsi_iothread_handle_cmd(EventNotifier *notifier)
     VirtIOSCSIReq *req, *next;
     QTAILQ_HEAD(, VirtIOSCSIReq) reqs = QTAILQ_HEAD_INITIALIZER(reqs);
 
+    VirtIOSCSIThread *t;
+
     event_notifier_test_and_clear(notifier);
     while ((req = virtio_scsi_pop_req_vring(s, vring))) {
-        if (virtio_scsi_handle_cmd_req_prepare(s, req)) {
+        t = virtio_scsi_req_thread(s, req, offsetof(VirtIOSCSICmdReq, lun));
+        if (t) {
+            virtio_scsi_handoff_req(t, req);
+        } else if (virtio_scsi_handle_cmd_req_prepare(s, req)) {
             QTAILQ_INSERT_TAIL(&reqs, req, next);
         }
     }
@@ -155,21 +341,25 @@ static void virtio_scsi_iothread_handle_cmd(EventNotifier *notifier)
     }
 }
 
-/* assumes s->ctx held */
+/* assumes all contexts held */
 static void virtio_scsi_clear_aio(VirtIOSCSI *s)
 {
     VirtIOSCSICommon *vs = VIRTIO_SCSI_COMMON(s);
+    VirtIOSCSIVring *r;
     int i;
 
     if (s->ctrl_vring) {
-        aio_set_event_notifier(s->ctx, &s->ctrl_vring->host_notifier, NULL);
+        r = s->ctrl_vring;
+        aio_set_event_notifier(r->ctx, &r->host_notifier, NULL);
     }
     if (s->event_vring) {
-        aio_set_event_notifier(s->ctx, &s->event_vring->host_notifier, NULL);
+        r = s->event_vring;
+        aio_set_event_notifier(r->ctx, &r->host_notifier, NULL);
     }
     if (s->cmd_vrings) {
         for (i = 0; i < vs->conf.num_queues && s->cmd_vrings[i]; i++) {
-            aio_set_event_notifier(s->ctx, &s->cmd_vrings[i]->host_notifier, NULL);
+            r = s->cmd_vrings[i];
+            aio_set_event_notifier(r->ctx, &r->host_notifier, NULL);
         }
     }
 }
@@ -182,21 +372,21 @@ static void virtio_scsi_vring_teardown(VirtIOSCSI *s)
 
     if (s->ctrl_vring) {
         vring_teardown(&s->ctrl_vring->vring, vdev, 0);
-        g_slice_free(VirtIOSCSIVring, s->ctrl_vring);
+        virtio_scsi_vring_free(s->ctrl_vring);
         s->ctrl_vring = NULL;
     }
     if (s->event_vring) {
         vring_teardown(&s->event_vring->vring, vdev, 1);
-        g_slice_free(VirtIOSCSIVring, s->event_vring);
+        virtio_scsi_vring_free(s->event_vring);
         s->event_vring = NULL;
     }
     if (s->cmd_vrings) {
         for (i = 0; i < vs->conf.num_queues && s->cmd_vrings[i]; i++) {
             vring_teardown(&s->cmd_vrings[i]->vring, vdev, 2 + i);
-            g_slice_free(VirtIOSCSIVring, s->cmd_vrings[i]);
+            virtio_scsi_vring_free(s->cmd_vrings[i]);
             s->cmd_vrings[i] = NULL;
         }
-        free(s->cmd_vrings);
+        g_free(s->cmd_vrings);
         s->cmd_vrings = NULL;
     }
 }
@@ -213,7 +403,7 @@ void virtio_scsi_dataplane_start(VirtIOSCSI *s)
     if (s->dataplane_started ||
         s->dataplane_starting ||
         s->dataplane_fenced ||
-        s->ctx != iothread_get_aio_context(vs->conf.iothread)) {
+        !s->ctx) {
         return;
     }
 
@@ -228,25 +418,26 @@ void virtio_scsi_dataplane_start(VirtIOSCSI *s)
         goto fail_guest_notifiers;
     }
 
-    aio_context_acquire(s->ctx);
+    virtio_scsi_acquire_all(s);
     s->ctrl_vring = virtio_scsi_vring_init(s, vs->ctrl_vq,
                                            virtio_scsi_iothread_handle_ctrl,
-                                           0);
+                                           0, s->ctx);
     if (!s->ctrl_vring) {
         goto fail_vrings;
     }
     s->event_vring = virtio_scsi_vring_init(s, vs->event_vq,
                                             virtio_scsi_iothread_handle_event,
-                                            1);
+                                            1, s->ctx);
     if (!s->event_vring) {
         goto fail_vrings;
     }
-    s->cmd_vrings = g_new(VirtIOSCSIVring *, vs->conf.num_queues);
+    s->cmd_vrings = g_new0(VirtIOSCSIVring *, vs->conf.num_queues);
     for (i = 0; i < vs->conf.num_queues; i++) {
         s->cmd_vrings[i] =
             virtio_scsi_vring_init(s, vs->cmd_vqs[i],
                                    virtio_scsi_iothread_handle_cmd,
-                                   i + 2);
+                                   i + 2,
+                                   s->threads[i % s->num_threads].ctx);
         if (!s->cmd_vrings[i]) {
             goto fail_vrings;
         }
@@ -254,12 +445,12 @@ void virtio_scsi_dataplane_start(VirtIOSCSI *s)
 
     s->dataplane_starting = false;
     s->dataplane_started = true;
-    aio_context_release(s->ctx);
+    virtio_scsi_release_all(s);
     return;
 
 fail_vrings:
     virtio_scsi_clear_aio(s);
-    aio_context_release(s->ctx);
+    virtio_scsi_release_all(s);
     virtio_scsi_vring_teardown(s);
     for (i = 0; i < vs->conf.num_queues + 2; i++) {
         k->set_host_notifier(qbus->parent, i, false);
@@ -286,19 +477,20 @@ void virtio_scsi_dataplane_stop(VirtIOSCSI *s)
         return;
     }
     s->dataplane_stopping = true;
-    assert(s->ctx == iothread_get_aio_context(vs->conf.iothread));
+    assert(s->ctx);
 
-    aio_context_acquire(s->ctx);
+    virtio_scsi_acquire_all(s);
 
-    aio_set_event_notifier(s->ctx, &s->ctrl_vring->host_notifier, NULL);
-    aio_set_event_notifier(s->ctx, &s->event_vring->host_notifier, NULL);
-    for (i = 0; i < vs->conf.num_queues; i++) {
-        aio_set_event_notifier(s->ctx, &s->cmd_vrings[i]->host_notifier, NULL);
+    virtio_scsi_clear_aio(s);
+
+    /* Submit what other queues handed over before draining */
+    for (i = 0; i < s->num_threads; i++) {
+        virtio_scsi_iothread_handoff_bh(&s->threads[i]);
     }
 
     blk_drain_all(); /* ensure there are no in-flight requests */
 
-    aio_context_release(s->ctx);
+    virtio_scsi_release_all(s);
 
     /* Sync vring state back to virtqueue so that non-dataplane request
      * processing can continue when we disable the host notifier below.
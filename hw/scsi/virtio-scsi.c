@@ -40,29 +40,35 @@ static inline SCSIDevice *virtio_scsi_device_find(VirtIOSCSI *s, uint8_t *lun)
     return scsi_device_find(&s->bus, 0, lun[1], virtio_scsi_get_lun(lun));
 }
 
-VirtIOSCSIReq *virtio_scsi_init_req(VirtIOSCSI *s, VirtQueue *vq)
+/* Requests are allocated by virtqueue_pop with room for the CDB */
+static size_t virtio_scsi_req_size(VirtIOSCSI *s)
 {
-    VirtIOSCSIReq *req;
     VirtIOSCSICommon *vs = (VirtIOSCSICommon *)s;
-    const size_t zero_skip = offsetof(VirtIOSCSIReq, elem)
-                             + sizeof(VirtQueueElement);
 
-    req = g_slice_alloc(sizeof(*req) + vs->cdb_size);
+    return sizeof(VirtIOSCSIReq) + vs->cdb_size;
+}
+
+void virtio_scsi_init_req(VirtIOSCSI *s, VirtQueue *vq, VirtIOSCSIReq *req)
+{
+    const size_t zero_skip = offsetof(VirtIOSCSIReq, vring);
+
     req->vq = vq;
     req->dev = s;
     qemu_sglist_init(&req->qsgl, DEVICE(s), 8, &address_space_memory);
     qemu_iovec_init(&req->resp_iov, 1);
     memset((uint8_t *)req + zero_skip, 0, sizeof(*req) - zero_skip);
-    return req;
 }
 
 void virtio_scsi_free_req(VirtIOSCSIReq *req)
 {
-    VirtIOSCSICommon *vs = (VirtIOSCSICommon *)req->dev;
-
     qemu_iovec_destroy(&req->resp_iov);
     qemu_sglist_destroy(&req->qsgl);
-    g_slice_free1(sizeof(*req) + vs->cdb_size, req);
+    /* Dataplane requests have no VirtQueue and complete in the IOThread */
+    if (req->vq) {
+        virtqueue_free_element(req->vq, req);
+    } else {
+        g_free(req);
+    }
 }
 
 static void virtio_scsi_complete_req(VirtIOSCSIReq *req)
@@ -176,10 +182,10 @@ static int virtio_scsi_parse_req(VirtIOSCSIReq *req,
 
 static VirtIOSCSIReq *virtio_scsi_pop_req(VirtIOSCSI *s, VirtQueue *vq)
 {
-    VirtIOSCSIReq *req = virtio_scsi_init_req(s, vq);
-    if (!virtqueue_pop(vq, &req->elem)) {
-        virtio_scsi_free_req(req);
-        return NULL;
+    VirtIOSCSIReq *req = virtqueue_pop(vq, virtio_scsi_req_size(s));
+
+    if (req) {
+        virtio_scsi_init_req(s, vq, req);
     }
     return req;
 }
@@ -192,7 +198,7 @@ static void virtio_scsi_save_request(QEMUFile *f, SCSIRequest *sreq)
 
     assert(n < vs->conf.num_queues);
     qemu_put_be32s(f, &n);
-    qemu_put_buffer(f, (unsigned char *)&req->elem, sizeof(req->elem));
+    qemu_put_virtqueue_element(f, &req->elem);
 }
 
 static void *virtio_scsi_load_request(QEMUFile *f, SCSIRequest *sreq)
@@ -205,17 +211,8 @@ static void *virtio_scsi_load_request(QEMUFile *f, SCSIRequest *sreq)
 
     qemu_get_be32s(f, &n);
     assert(n < vs->conf.num_queues);
-    req = virtio_scsi_init_req(s, vs->cmd_vqs[n]);
-    qemu_get_buffer(f, (unsigned char *)&req->elem, sizeof(req->elem));
-    /* TODO: add a way for SCSIBusInfo's load_request to fail,
-     * and fail migration instead of asserting here.
-     * When we do, we might be able to re-enable NDEBUG below.
-     */
-#ifdef NDEBUG
-#error building with NDEBUG is not supported
-#endif
-    assert(req->elem.in_num <= ARRAY_SIZE(req->elem.in_sg));
-    assert(req->elem.out_num <= ARRAY_SIZE(req->elem.out_sg));
+    req = qemu_get_virtqueue_element(f, virtio_scsi_req_size(s));
+    virtio_scsi_init_req(s, vs->cmd_vqs[n], req);
 
     if (virtio_scsi_parse_req(req, sizeof(VirtIOSCSICmdReq) + vs->cdb_size,
                               sizeof(VirtIOSCSICmdResp) + vs->sense_size) < 0) {
@@ -260,7 +257,8 @@ static int virtio_scsi_do_tmf(VirtIOSCSI *s, VirtIOSCSIReq *req)
     int ret = 0;
 
     if (s->dataplane_started) {
-        assert(blk_get_aio_context(d->conf.blk) == s->ctx);
+        assert(blk_get_aio_context(d->conf.blk) ==
+               virtio_scsi_target_ctx(s, d->id));
     }
     /* Here VIRTIO_SCSI_S_OK means "FUNCTION COMPLETE".  */
     req->resp.tmf.response = VIRTIO_SCSI_S_OK;
@@ -544,7 +542,8 @@ bool virtio_scsi_handle_cmd_req_prepare(VirtIOSCSI *s, VirtIOSCSIReq *req)
         return false;
     }
     if (s->dataplane_started) {
-        assert(blk_get_aio_context(d->conf.blk) == s->ctx);
+        assert(blk_get_aio_context(d->conf.blk) ==
+               virtio_scsi_target_ctx(s, d->id));
     }
     req->sreq = scsi_req_new(d, req->req.cmd.tag,
                              virtio_scsi_get_lun(req->req.cmd.lun),
@@ -768,13 +767,15 @@ static void virtio_scsi_hotplug(HotplugHandler *hotplug_dev, DeviceState *dev,
     SCSIDevice *sd = SCSI_DEVICE(dev);
 
     if (s->ctx && !s->dataplane_disabled) {
+        AioContext *ctx = virtio_scsi_target_ctx(s, sd->id);
+
         if (blk_op_is_blocked(sd->conf.blk, BLOCK_OP_TYPE_DATAPLANE, errp)) {
             return;
         }
         blk_op_block_all(sd->conf.blk, s->blocker);
-        aio_context_acquire(s->ctx);
-        blk_set_aio_context(sd->conf.blk, s->ctx);
-        aio_context_release(s->ctx);
+        aio_context_acquire(ctx);
+        blk_set_aio_context(sd->conf.blk, ctx);
+        aio_context_release(ctx);
     }
 
     if (virtio_has_feature(vdev, VIRTIO_SCSI_F_HOTPLUG)) {
@@ -849,10 +850,6 @@ void virtio_scsi_common_realize(DeviceState *dev, Error **errp,
         s->cmd_vqs[i] = virtio_add_queue(vdev, VIRTIO_SCSI_VQ_SIZE,
                                          cmd);
     }
-
-    if (s->conf.iothread) {
-        virtio_scsi_set_iothread(VIRTIO_SCSI(s), s->conf.iothread);
-    }
 }
 
 /* Disable dataplane thread during live migration since it does not
@@ -895,6 +892,15 @@ static void virtio_scsi_device_realize(DeviceState *dev, Error **errp)
         return;
     }
 
+    if (s->parent_obj.conf.iothread || s->parent_obj.conf.iothreads) {
+        virtio_scsi_dataplane_init(s, &err);
+        if (err != NULL) {
+            error_propagate(errp, err);
+            virtio_scsi_common_unrealize(dev, NULL);
+            return;
+        }
+    }
+
     scsi_bus_new(&s->bus, sizeof(s->bus), dev,
                  &virtio_scsi_scsi_info, vdev->bus_name);
     /* override default SCSI bus hotplug-handler, with virtio-scsi's one */
@@ -944,12 +950,16 @@ static void virtio_scsi_device_unrealize(DeviceState *dev, Error **errp)
     unregister_savevm(dev, "virtio-scsi", s);
     remove_migration_state_change_notifier(&s->migration_state_notifier);
 
+    if (s->ctx) {
+        virtio_scsi_dataplane_cleanup(s);
+    }
     virtio_scsi_common_unrealize(dev, errp);
 }
 
 static Property virtio_scsi_properties[] = {
     DEFINE_VIRTIO_SCSI_PROPERTIES(VirtIOSCSI, parent_obj.conf),
     DEFINE_VIRTIO_SCSI_FEATURES(VirtIOSCSI, host_features),
+    DEFINE_PROP_STRING("iothreads", VirtIOSCSI, parent_obj.conf.iothreads),
     DEFINE_PROP_END_OF_LIST(),
 };
 
@@ -157,36 +157,34 @@ bool vring_should_notify(VirtIODevice *vdev, Vring *vring)
 }
 
 
-static int get_desc(Vring *vring, VirtQueueElement *elem,
+static int get_desc(Vring *vring, unsigned *out_num, unsigned *in_num,
+                    struct iovec *iov, hwaddr *addr,
                     struct vring_desc *desc)
 {
     unsigned *num;
-    struct iovec *iov;
-    hwaddr *addr;
+    unsigned total = *out_num + *in_num;
     MemoryRegion *mr;
 
     if (desc->flags & VRING_DESC_F_WRITE) {
-        num = &elem->in_num;
-        iov = &elem->in_sg[*num];
-        addr = &elem->in_addr[*num];
+        num = in_num;
     } else {
-        num = &elem->out_num;
-        iov = &elem->out_sg[*num];
-        addr = &elem->out_addr[*num];
+        num = out_num;
 
         /* If it's an output descriptor, they're all supposed
          * to come before any input descriptors. */
-        if (unlikely(elem->in_num)) {
+        if (unlikely(*in_num)) {
             error_report("Descriptor has out after in");
             return -EFAULT;
         }
     }
 
     /* Stop for now if there are not enough iovecs available. */
-    if (*num >= VIRTQUEUE_MAX_SIZE) {
-        error_report("Invalid SG num: %u", *num);
+    if (total >= VIRTQUEUE_MAX_SIZE) {
+        error_report("Invalid SG num: %u", total);
         return -EFAULT;
     }
+    iov += total;
+    addr += total;
 
     /* TODO handle non-contiguous memory across region boundaries */
     iov->iov_base = vring_map(&mr, desc->addr, desc->len,
@@ -217,7 +215,9 @@ static void copy_in_vring_desc(VirtIODevice *vdev,
 
 /* This is stolen from linux/drivers/vhost/vhost.c. */
 static int get_indirect(VirtIODevice *vdev, Vring *vring,
-                        VirtQueueElement *elem, struct vring_desc *indirect)
+                        unsigned *out_num, unsigned *in_num,
+                        struct iovec *iov, hwaddr *addr,
+                        struct vring_desc *indirect)
 {
     struct vring_desc desc;
     unsigned int i = 0, count, found = 0;
@@ -276,7 +276,7 @@ static int get_indirect(VirtIODevice *vdev, Vring *vring,
             return -EFAULT;
         }
 
-        ret = get_desc(vring, elem, &desc);
+        ret = get_desc(vring, out_num, in_num, iov, addr, &desc);
         if (ret < 0) {
             vring->broken |= (ret == -EFAULT);
             return ret;
@@ -286,7 +286,8 @@ static int get_indirect(VirtIODevice *vdev, Vring *vring,
     return 0;
 }
 
-static void vring_unmap_element(VirtQueueElement *elem)
+static void vring_unmap_iov(struct iovec *out_sg, unsigned out_num,
+                            struct iovec *in_sg, unsigned in_num)
 {
     int i;
 
@@ -294,37 +295,42 @@ static void vring_unmap_element(VirtQueueElement *elem)
      * the end of the valid area.  This is true if iovec manipulations
      * are done with iov_discard_front and iov_discard_back.
      */
-    for (i = 0; i < elem->out_num; i++) {
-        vring_unmap(elem->out_sg[i].iov_base, false);
+    for (i = 0; i < out_num; i++) {
+        vring_unmap(out_sg[i].iov_base, false);
     }
 
-    for (i = 0; i < elem->in_num; i++) {
-        vring_unmap(elem->in_sg[i].iov_base, true);
+    for (i = 0; i < in_num; i++) {
+        vring_unmap(in_sg[i].iov_base, true);
     }
 }
 
+static void vring_unmap_element(VirtQueueElement *elem)
+{
+    vring_unmap_iov(elem->out_sg, elem->out_num, elem->in_sg, elem->in_num);
+}
+
 /* This looks in the virtqueue and for the first available buffer, and converts
  * it to an iovec for convenient access.  Since descriptors consist of some
  * number of output then some number of input descriptors, it's actually two
  * iovecs, but we pack them into one and note how many of each there were.
  *
- * This function returns the descriptor number found, or vq->num (which is
- * never a valid descriptor number) if none was found.  A negative code is
- * returned on error.
+ * This function returns a newly allocated structure of sz bytes starting
+ * with the VirtQueueElement, or NULL if the ring is empty or an error
+ * occurred.  After a fatal error vring->broken is set.
  *
  * Stolen from linux/drivers/vhost/vhost.c.
  */
-int vring_pop(VirtIODevice *vdev, Vring *vring,
-              VirtQueueElement *elem)
+void *vring_pop(VirtIODevice *vdev, Vring *vring, size_t sz)
 {
     struct vring_desc desc;
     unsigned int i, head, found = 0, num = vring->vr.num;
     uint16_t avail_idx, last_avail_idx;
+    VirtQueueElement *elem;
+    unsigned out_num = 0, in_num = 0;
+    struct iovec iov[VIRTQUEUE_MAX_SIZE];
+    hwaddr addr[VIRTQUEUE_MAX_SIZE];
     int ret;
 
-    /* Initialize elem so it can be safely unmapped */
-    elem->in_num = elem->out_num = 0;
-
     /* If there was a fatal error then refuse operation */
     if (vring->broken) {
         ret = -EFAULT;
@@ -356,8 +362,6 @@ int vring_pop(VirtIODevice *vdev, Vring *vring,
      * the index we've seen. */
     head = vring_get_avail_ring(vdev, vring, last_avail_idx % num);
 
-    elem->index = head;
-
     /* If their number is silly, that's an error. */
     if (unlikely(head >= num)) {
         error_report("Guest says index %u > %u is available", head, num);
@@ -384,14 +388,15 @@ int vring_pop(VirtIODevice *vdev, Vring *vring,
         barrier();
 
         if (desc.flags & VRING_DESC_F_INDIRECT) {
-            ret = get_indirect(vdev, vring, elem, &desc);
+            ret = get_indirect(vdev, vring, &out_num, &in_num, iov, addr,
+                               &desc);
             if (ret < 0) {
                 goto out;
             }
             continue;
         }
 
-        ret = get_desc(vring, elem, &desc);
+        ret = get_desc(vring, &out_num, &in_num, iov, addr, &desc);
         if (ret < 0) {
             goto out;
         }
@@ -405,15 +410,25 @@ int vring_pop(VirtIODevice *vdev, Vring *vring,
         vring_avail_event(&vring->vr) = vring->last_avail_idx;
     }
 
-    return head;
+    elem = virtqueue_alloc_element(sz, out_num, in_num);
+    elem->index = head;
+    for (i = 0; i < out_num; i++) {
+        elem->out_sg[i] = iov[i];
+        elem->out_addr[i] = addr[i];
+    }
+    for (i = 0; i < in_num; i++) {
+        elem->in_sg[i] = iov[out_num + i];
+        elem->in_addr[i] = addr[out_num + i];
+    }
+    return elem;
 
 out:
     assert(ret < 0);
     if (ret == -EFAULT) {
         vring->broken = true;
     }
-    vring_unmap_element(elem);
-    return ret;
+    vring_unmap_iov(iov, out_num, iov + out_num, in_num);
+    return NULL;
 }
 
 /* After we've used one of their buffers, we tell them about it.
@@ -24,6 +24,13 @@
 #include <linux/vhost.h>
 
 #define VHOST_MEMORY_MAX_NREGIONS    8
+#define VHOST_USER_F_PROTOCOL_FEATURES 30
+
+#define VHOST_USER_PROTOCOL_F_MQ    0
+#define VHOST_USER_PROTOCOL_F_LOG_SHMFD 1
+#define VHOST_USER_PROTOCOL_FEATURE_MASK \
+    ((1ULL << VHOST_USER_PROTOCOL_F_MQ) | \
+     (1ULL << VHOST_USER_PROTOCOL_F_LOG_SHMFD))
 
 typedef enum VhostUserRequest {
     VHOST_USER_NONE = 0,
@@ -41,6 +48,10 @@ typedef enum VhostUserRequest {
     VHOST_USER_SET_VRING_KICK = 12,
     VHOST_USER_SET_VRING_CALL = 13,
     VHOST_USER_SET_VRING_ERR = 14,
+    VHOST_USER_GET_PROTOCOL_FEATURES = 15,
+    VHOST_USER_SET_PROTOCOL_FEATURES = 16,
+    VHOST_USER_GET_QUEUE_NUM = 17,
+    VHOST_USER_SET_VRING_ENABLE = 18,
     VHOST_USER_MAX
 } VhostUserRequest;
 
@@ -57,6 +68,11 @@ typedef struct VhostUserMemory {
     VhostUserMemoryRegion regions[VHOST_MEMORY_MAX_NREGIONS];
 } VhostUserMemory;
 
+typedef struct VhostUserLog {
+    uint64_t mmap_size;
+    uint64_t mmap_offset;
+} VhostUserLog;
+
 typedef struct VhostUserMsg {
     VhostUserRequest request;
 
@@ -71,6 +87,7 @@ typedef struct VhostUserMsg {
         struct vhost_vring_state state;
         struct vhost_vring_addr addr;
         VhostUserMemory memory;
+        VhostUserLog log;
     };
 } QEMU_PACKED VhostUserMsg;
 
@@ -104,7 +121,11 @@ static unsigned long int ioctl_to_vhost_user_request[VHOST_USER_MAX] = {
     VHOST_GET_VRING_BASE,   /* VHOST_USER_GET_VRING_BASE */
     VHOST_SET_VRING_KICK,   /* VHOST_USER_SET_VRING_KICK */
     VHOST_SET_VRING_CALL,   /* VHOST_USER_SET_VRING_CALL */
-    VHOST_SET_VRING_ERR     /* VHOST_USER_SET_VRING_ERR */
+    VHOST_SET_VRING_ERR,    /* VHOST_USER_SET_VRING_ERR */
+    -1,                     /* VHOST_USER_GET_PROTOCOL_FEATURES */
+    -1,                     /* VHOST_USER_SET_PROTOCOL_FEATURES */
+    -1,                     /* VHOST_USER_GET_QUEUE_NUM */
+    -1                      /* VHOST_USER_SET_VRING_ENABLE */
 };
 
 static VhostUserRequest vhost_user_request_translate(unsigned long int request)
@@ -120,6 +141,23 @@ static VhostUserRequest vhost_user_request_translate(unsigned long int request)
     return (idx == VHOST_USER_MAX) ? VHOST_USER_NONE : idx;
 }
 
+/* All the queue pairs of a multiqueue device share one connection, so
+ * requests that apply to the whole device are only sent by the vhost
+ * device of the first queue pair.
+ */
+static bool vhost_user_one_time_request(VhostUserRequest request)
+{
+    switch (request) {
+    case VHOST_USER_SET_OWNER:
+    case VHOST_USER_RESET_OWNER:
+    case VHOST_USER_SET_MEM_TABLE:
+    case VHOST_USER_GET_QUEUE_NUM:
+        return true;
+    default:
+        return false;
+    }
+}
+
 static int vhost_user_read(struct vhost_dev *dev, VhostUserMsg *msg)
 {
     CharDriverState *chr = dev->opaque;
@@ -194,6 +232,10 @@ static int vhost_user_call(struct vhost_dev *dev, unsigned long int request,
     assert(dev->vhost_ops->backend_type == VHOST_BACKEND_TYPE_USER);
 
     msg_request = vhost_user_request_translate(request);
+    if (vhost_user_one_time_request(msg_request) && dev->vq_index != 0) {
+        return 0;
+    }
+
     msg.request = msg_request;
     msg.flags = VHOST_USER_VERSION;
     msg.size = 0;
@@ -286,12 +328,12 @@ static int vhost_user_call(struct vhost_dev *dev, unsigned long int request,
     }
 
     if (vhost_user_write(dev, &msg, fds, fd_num) < 0) {
-        return 0;
+        return -1;
     }
 
     if (need_reply) {
         if (vhost_user_read(dev, &msg) < 0) {
-            return 0;
+            return -1;
         }
 
         if (msg_request != msg.request) {
@@ -307,6 +349,11 @@ static int vhost_user_call(struct vhost_dev *dev, unsigned long int request,
                 return -1;
             }
             *((__u64 *) arg) = msg.u64;
+            /* The slave can only log to memory that it can map */
+            if (!(dev->protocol_features &
+                  (1ULL << VHOST_USER_PROTOCOL_F_LOG_SHMFD))) {
+                *((__u64 *) arg) &= ~(1ULL << VHOST_F_LOG_ALL);
+            }
             break;
         case VHOST_USER_GET_VRING_BASE:
             if (msg.size != sizeof(m.state)) {
@@ -325,11 +372,97 @@ static int vhost_user_call(struct vhost_dev *dev, unsigned long int request,
     return 0;
 }
 
+static int vhost_user_get_u64(struct vhost_dev *dev, VhostUserRequest request,
+                              uint64_t *u64)
+{
+    VhostUserMsg msg = {
+        .request = request,
+        .flags = VHOST_USER_VERSION,
+    };
+
+    if (vhost_user_one_time_request(request) && dev->vq_index != 0) {
+        return 0;
+    }
+
+    if (vhost_user_write(dev, &msg, NULL, 0) < 0) {
+        return -1;
+    }
+
+    if (vhost_user_read(dev, &msg) < 0) {
+        return -1;
+    }
+
+    if (msg.request != request) {
+        error_report("Received unexpected msg type."
+                     " Expected %d received %d", request, msg.request);
+        return -1;
+    }
+
+    if (msg.size != sizeof(m.u64)) {
+        error_report("Received bad msg size.");
+        return -1;
+    }
+
+    *u64 = msg.u64;
+    return 0;
+}
+
+static int vhost_user_set_u64(struct vhost_dev *dev, VhostUserRequest request,
+                              uint64_t u64)
+{
+    VhostUserMsg msg = {
+        .request = request,
+        .flags = VHOST_USER_VERSION,
+        .size = sizeof(m.u64),
+    };
+
+    msg.u64 = u64;
+    return vhost_user_write(dev, &msg, NULL, 0);
+}
+
 static int vhost_user_init(struct vhost_dev *dev, void *opaque)
 {
+    uint64_t features;
+    int err;
+
     assert(dev->vhost_ops->backend_type == VHOST_BACKEND_TYPE_USER);
 
     dev->opaque = opaque;
+    dev->protocol_features = 0;
+    dev->max_queues = 1;
+
+    err = vhost_user_get_u64(dev, VHOST_USER_GET_FEATURES, &features);
+    if (err < 0) {
+        return err;
+    }
+
+    if (features & (1ULL << VHOST_USER_F_PROTOCOL_FEATURES)) {
+        dev->backend_features |= 1ULL << VHOST_USER_F_PROTOCOL_FEATURES;
+
+        err = vhost_user_get_u64(dev, VHOST_USER_GET_PROTOCOL_FEATURES,
+                                 &features);
+        if (err < 0) {
+            return err;
+        }
+
+        dev->protocol_features = features & VHOST_USER_PROTOCOL_FEATURE_MASK;
+        err = vhost_user_set_u64(dev, VHOST_USER_SET_PROTOCOL_FEATURES,
+                                 dev->protocol_features);
+        if (err < 0) {
+            return err;
+        }
+
+        if (dev->protocol_features & (1ULL << VHOST_USER_PROTOCOL_F_MQ)) {
+            err = vhost_user_get_u64(dev, VHOST_USER_GET_QUEUE_NUM,
+                                     &features);
+            if (err < 0) {
+                return err;
+            }
+            if (dev->vq_index == 0) {
+                dev->max_queues = features;
+            }
+        }
+    }
 
     return 0;
 }
@@ -343,9 +476,89 @@ static int vhost_user_cleanup(struct vhost_dev *dev)
     return 0;
 }
 
+static int vhost_user_get_vq_index(struct vhost_dev *dev, int idx)
+{
+    assert(idx >= dev->vq_index && idx < dev->vq_index + dev->nvqs);
+
+    /* The slave sees the rings of all queue pairs on one connection */
+    return idx;
+}
+
+static int vhost_user_set_vring_enable(struct vhost_dev *dev, int enable)
+{
+    int i;
+
+    /* Without protocol features, rings are enabled as soon as they start */
+    if (!(dev->backend_features & (1ULL << VHOST_USER_F_PROTOCOL_FEATURES))) {
+        return 0;
+    }
+
+    for (i = 0; i < dev->nvqs; ++i) {
+        VhostUserMsg msg = {
+            .request = VHOST_USER_SET_VRING_ENABLE,
+            .flags = VHOST_USER_VERSION,
+            .size = sizeof(m.state),
+        };
+
+        msg.state.index = dev->vq_index + i;
+        msg.state.num = enable;
+        if (vhost_user_write(dev, &msg, NULL, 0) < 0) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static bool vhost_user_requires_shm_log(struct vhost_dev *dev)
+{
+    return dev->protocol_features & (1ULL << VHOST_USER_PROTOCOL_F_LOG_SHMFD);
+}
+
+static int vhost_user_set_log_base(struct vhost_dev *dev, uint64_t base,
+                                   struct vhost_log *log)
+{
+    int fds[1];
+    VhostUserMsg msg = {
+        .request = VHOST_USER_SET_LOG_BASE,
+        .flags = VHOST_USER_VERSION,
+        .size = sizeof(m.log),
+    };
+
+    if (!vhost_user_requires_shm_log(dev) || log->fd == -1) {
+        return vhost_user_call(dev, VHOST_SET_LOG_BASE, &base);
+    }
+
+    fds[0] = log->fd;
+    msg.log.mmap_size = log->size * sizeof(*log->log);
+    msg.log.mmap_offset = 0;
+
+    if (vhost_user_write(dev, &msg, fds, 1) < 0) {
+        return -1;
+    }
+
+    /* The old log may only be released once the slave stopped using it */
+    if (vhost_user_read(dev, &msg) < 0) {
+        return -1;
+    }
+
+    if (msg.request != VHOST_USER_SET_LOG_BASE) {
+        error_report("Received unexpected msg type."
+                     " Expected %d received %d",
+                     VHOST_USER_SET_LOG_BASE, msg.request);
+        return -1;
+    }
+
+    return 0;
+}
+
 const VhostOps user_ops = {
         .backend_type = VHOST_BACKEND_TYPE_USER,
         .vhost_call = vhost_user_call,
         .vhost_backend_init = vhost_user_init,
-        .vhost_backend_cleanup = vhost_user_cleanup
+        .vhost_backend_cleanup = vhost_user_cleanup,
+        .vhost_backend_get_vq_index = vhost_user_get_vq_index,
+        .vhost_backend_set_vring_enable = vhost_user_set_vring_enable,
+        .vhost_requires_shm_log = vhost_user_requires_shm_log,
+        .vhost_set_log_base = vhost_user_set_log_base,
         };
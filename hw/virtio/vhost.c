@@ -17,6 +17,8 @@
 #include "hw/hw.h"
 #include "qemu/atomic.h"
 #include "qemu/range.h"
+#include "qemu/error-report.h"
+#include "qemu/memfd.h"
 #include <linux/vhost.h>
 #include "exec/address-spaces.h"
 #include "hw/virtio/virtio-bus.h"
@@ -29,8 +31,8 @@ static void vhost_dev_sync_region(struct vhost_dev *dev,
 {
     uint64_t start = MAX(mfirst, rfirst);
     uint64_t end = MIN(mlast, rlast);
-    vhost_log_chunk_t *from = dev->log + start / VHOST_LOG_CHUNK;
-    vhost_log_chunk_t *to = dev->log + end / VHOST_LOG_CHUNK + 1;
+    vhost_log_chunk_t *from = dev->log->log + start / VHOST_LOG_CHUNK;
+    vhost_log_chunk_t *to = dev->log->log + end / VHOST_LOG_CHUNK + 1;
     uint64_t addr = (start / VHOST_LOG_CHUNK) * VHOST_LOG_CHUNK;
 
     if (end < start) {
@@ -281,23 +283,131 @@ static uint64_t vhost_get_log_size(struct vhost_dev *dev)
     return log_size;
 }
 
-static inline void vhost_dev_log_resize(struct vhost_dev* dev, uint64_t size)
+static struct vhost_log *vhost_log;
+static struct vhost_log *vhost_log_shm;
+
+static bool vhost_dev_log_is_shared(struct vhost_dev *dev)
 {
-    vhost_log_chunk_t *log;
-    uint64_t log_base;
-    int r;
+    return dev->vhost_ops->vhost_requires_shm_log &&
+           dev->vhost_ops->vhost_requires_shm_log(dev);
+}
+
+/* Returns NULL, after reporting the error, if the log cannot be
+ * allocated.
+ */
+static struct vhost_log *vhost_log_alloc(uint64_t size, bool share)
+{
+    struct vhost_log *log;
+    uint64_t logsize = size * sizeof(*log->log);
+    int fd = -1;
+
+    if (!size) {
+        error_report("vhost: cannot allocate an empty dirty log");
+        return NULL;
+    }
+
+    log = g_new0(struct vhost_log, 1);
+    if (share) {
+        log->log = qemu_memfd_alloc("vhost-log", logsize, &fd);
+        if (!log->log) {
+            g_free(log);
+            return NULL;
+        }
+    } else {
+        log->log = g_malloc0(logsize);
+    }
+
+    log->size = size;
+    log->refcnt = 1;
+    log->fd = fd;
+
+    return log;
+}
+
+/* All the devices log to the same memory as long as they need the same
+ * size, so that there is only one log to sync and, for backends in other
+ * processes, to pass around.
+ */
+static struct vhost_log *vhost_log_get(uint64_t size, bool share)
+{
+    struct vhost_log *log = share ? vhost_log_shm : vhost_log;
+
+    if (!log || log->size != size) {
+        log = vhost_log_alloc(size, share);
+        if (!log) {
+            return NULL;
+        }
+        if (share) {
+            vhost_log_shm = log;
+        } else {
+            vhost_log = log;
+        }
+    } else {
+        ++log->refcnt;
+    }
+
+    return log;
+}
+
+static void vhost_log_put(struct vhost_dev *dev, bool sync)
+{
+    struct vhost_log *log = dev->log;
+
+    if (!log) {
+        return;
+    }
 
-    log = g_malloc0(size * sizeof *log);
-    log_base = (uintptr_t)log;
-    r = dev->vhost_ops->vhost_call(dev, VHOST_SET_LOG_BASE, &log_base);
-    assert(r >= 0);
     /* Sync only the range covered by the old log */
-    if (dev->log_size) {
+    if (sync && dev->log_size) {
         vhost_log_sync_range(dev, 0, dev->log_size * VHOST_LOG_CHUNK - 1);
     }
-    g_free(dev->log);
+    dev->log = NULL;
+    dev->log_size = 0;
+
+    if (--log->refcnt == 0) {
+        if (vhost_log == log) {
+            vhost_log = NULL;
+        } else if (vhost_log_shm == log) {
+            vhost_log_shm = NULL;
+        }
+
+        if (log->fd != -1) {
+            qemu_memfd_free(log->log, log->size * sizeof(*log->log), log->fd);
+        } else {
+            g_free(log->log);
+        }
+        g_free(log);
+    }
+}
+
+static int vhost_dev_set_log_base(struct vhost_dev *dev, struct vhost_log *log)
+{
+    uint64_t log_base = (uintptr_t)log->log;
+
+    if (dev->vhost_ops->vhost_set_log_base) {
+        return dev->vhost_ops->vhost_set_log_base(dev, log_base, log);
+    }
+    return dev->vhost_ops->vhost_call(dev, VHOST_SET_LOG_BASE, &log_base);
+}
+
+static inline int vhost_dev_log_resize(struct vhost_dev* dev, uint64_t size)
+{
+    struct vhost_log *log = vhost_log_get(size, vhost_dev_log_is_shared(dev));
+    int r;
+
+    if (!log) {
+        return -ENOMEM;
+    }
+
+    /* The backend must switch to the new log before the old one is
+     * synced and released, or dirty pages could be lost.
+     */
+    r = vhost_dev_set_log_base(dev, log);
+    assert(r >= 0);
+    vhost_log_put(dev, true);
     dev->log = log;
     dev->log_size = size;
+    return 0;
 }
 
 static int vhost_verify_ring_mappings(struct vhost_dev *dev,
@@ -466,15 +576,18 @@ static void vhost_commit(MemoryListener *listener)
     log_size = vhost_get_log_size(dev);
     /* We allocate an extra 4K bytes to log,
      * to reduce the * number of reallocations. */
-#define VHOST_LOG_BUFFER (0x1000 / sizeof *dev->log)
+#define VHOST_LOG_BUFFER (0x1000 / sizeof(vhost_log_chunk_t))
     /* To log more, must increase log size before table update. */
     if (dev->log_size < log_size) {
-        vhost_dev_log_resize(dev, log_size + VHOST_LOG_BUFFER);
+        /* The backend would write past the end of the old log */
+        r = vhost_dev_log_resize(dev, log_size + VHOST_LOG_BUFFER);
+        assert(r >= 0);
     }
     r = dev->vhost_ops->vhost_call(dev, VHOST_SET_MEM_TABLE, dev->mem);
     assert(r >= 0);
     /* To log less, can only decrease log size after table update. */
     if (dev->log_size > log_size + VHOST_LOG_BUFFER) {
+        /* Keeping the larger log is harmless */
         vhost_dev_log_resize(dev, log_size);
     }
     dev->memory_changed = false;
@@ -565,7 +678,10 @@ static int vhost_dev_set_log(struct vhost_dev *dev, bool enable_log)
         goto err_features;
     }
     for (i = 0; i < dev->nvqs; ++i) {
-        r = vhost_virtqueue_set_addr(dev, dev->vqs + i, i,
+        int idx = dev->vhost_ops->vhost_backend_get_vq_index(dev,
+                                                             dev->vq_index + i);
+
+        r = vhost_virtqueue_set_addr(dev, dev->vqs + i, idx,
                                      enable_log);
         if (r < 0) {
             goto err_vq;
@@ -574,7 +690,10 @@ static int vhost_dev_set_log(struct vhost_dev *dev, bool enable_log)
     return 0;
 err_vq:
     for (; i >= 0; --i) {
-        t = vhost_virtqueue_set_addr(dev, dev->vqs + i, i,
+        int idx = dev->vhost_ops->vhost_backend_get_vq_index(dev,
+                                                             dev->vq_index + i);
+
+        t = vhost_virtqueue_set_addr(dev, dev->vqs + i, idx,
                                      dev->log_enabled);
         assert(t >= 0);
     }
@@ -601,11 +720,12 @@ static int vhost_migration_log(MemoryListener *listener, int enable)
         if (r < 0) {
             return r;
         }
-        g_free(dev->log);
-        dev->log = NULL;
-        dev->log_size = 0;
+        vhost_log_put(dev, false);
     } else {
-        vhost_dev_log_resize(dev, vhost_get_log_size(dev));
+        r = vhost_dev_log_resize(dev, vhost_get_log_size(dev));
+        if (r < 0) {
+            return r;
+        }
         r = vhost_dev_set_log(dev, true);
         if (r < 0) {
             return r;
@@ -654,7 +774,7 @@ static int vhost_virtqueue_start(struct vhost_dev *dev,
 {
     hwaddr s, l, a;
     int r;
-    int vhost_vq_index = idx - dev->vq_index;
+    int vhost_vq_index = dev->vhost_ops->vhost_backend_get_vq_index(dev, idx);
     struct vhost_vring_file file = {
         .index = vhost_vq_index
     };
@@ -748,18 +868,22 @@ static void vhost_virtqueue_stop(struct vhost_dev *dev,
                                     unsigned idx)
 {
     struct vhost_vring_state state = {
-        .index = idx - dev->vq_index
+        .index = dev->vhost_ops->vhost_backend_get_vq_index(dev, idx)
     };
     int r;
     assert(idx >= dev->vq_index && idx < dev->vq_index + dev->nvqs);
     r = dev->vhost_ops->vhost_call(dev, VHOST_GET_VRING_BASE, &state);
     if (r < 0) {
-        fprintf(stderr, "vhost VQ %d ring restore failed: %d\n", idx, r);
-        fflush(stderr);
+        /* The backend is gone, e.g. a vhost-user process exited.  Resume
+         * from what the guest has seen completed, so that a new backend
+         * picks up the buffers that were still in flight.
+         */
+        error_report("vhost VQ %d ring restore failed: %d", idx, r);
+        virtio_queue_restore_last_avail_idx(vdev, idx);
+    } else {
+        virtio_queue_set_last_avail_idx(vdev, idx, state.num);
     }
-    virtio_queue_set_last_avail_idx(vdev, idx, state.num);
     virtio_queue_invalidate_signalled_used(vdev, idx);
-    assert (r >= 0);
     cpu_physical_memory_unmap(vq->ring, virtio_queue_get_ring_size(vdev, idx),
                               0, virtio_queue_get_ring_size(vdev, idx));
     cpu_physical_memory_unmap(vq->used, virtio_queue_get_used_size(vdev, idx),
@@ -786,7 +910,7 @@ static int vhost_virtqueue_init(struct vhost_dev *dev,
                                 struct vhost_virtqueue *vq, int n)
 {
     struct vhost_vring_file file = {
-        .index = n,
+        .index = dev->vhost_ops->vhost_backend_get_vq_index(dev, n),
     };
     int r = event_notifier_init(&vq->masked_notifier, 0);
     if (r < 0) {
@@ -837,7 +961,7 @@ int vhost_dev_init(struct vhost_dev *hdev, void *opaque,
     }
 
     for (i = 0; i < hdev->nvqs; ++i) {
-        r = vhost_virtqueue_init(hdev, hdev->vqs + i, i);
+        r = vhost_virtqueue_init(hdev, hdev->vqs + i, hdev->vq_index + i);
         if (r < 0) {
             goto fail_vq;
         }
@@ -992,7 +1116,7 @@ void vhost_virtqueue_mask(struct vhost_dev *hdev, VirtIODevice *vdev, int n,
     assert(n >= hdev->vq_index && n < hdev->vq_index + hdev->nvqs);
 
     struct vhost_vring_file file = {
-        .index = index
+        .index = hdev->vhost_ops->vhost_backend_get_vq_index(hdev, n)
     };
     if (mask) {
         file.fd = event_notifier_get_fd(&hdev->vqs[index].masked_notifier);
@@ -1000,7 +1124,9 @@ void vhost_virtqueue_mask(struct vhost_dev *hdev, VirtIODevice *vdev, int n,
         file.fd = event_notifier_get_fd(virtio_queue_get_guest_notifier(vvq));
     }
     r = hdev->vhost_ops->vhost_call(hdev, VHOST_SET_VRING_CALL, &file);
-    assert(r >= 0);
+    if (r < 0) {
+        error_report("vhost VQ %d call notifier update failed: %d", n, r);
+    }
 }
 
 unsigned vhost_get_features(struct vhost_dev *hdev, const int *feature_bits,
@@ -1008,7 +1134,7 @@ unsigned vhost_get_features(struct vhost_dev *hdev, const int *feature_bits,
 {
     const int *bit = feature_bits;
     while (*bit != VHOST_INVALID_FEATURE_BIT) {
-        unsigned bit_mask = (1 << *bit);
+        unsigned bit_mask = (1U << *bit);
         if (!(hdev->features & bit_mask)) {
             features &= ~bit_mask;
         }
@@ -1022,7 +1148,7 @@ void vhost_ack_features(struct vhost_dev *hdev, const int *feature_bits,
 {
     const int *bit = feature_bits;
     while (*bit != VHOST_INVALID_FEATURE_BIT) {
-        unsigned bit_mask = (1 << *bit);
+        unsigned bit_mask = (1U << *bit);
         if (features & bit_mask) {
             hdev->acked_features |= bit_mask;
         }
@@ -1057,13 +1183,14 @@ int vhost_dev_start(struct vhost_dev *hdev, VirtIODevice *vdev)
     }
 
     if (hdev->log_enabled) {
-        uint64_t log_base;
-
         hdev->log_size = vhost_get_log_size(hdev);
-        hdev->log = hdev->log_size ?
-            g_malloc0(hdev->log_size * sizeof *hdev->log) : NULL;
-        log_base = (uintptr_t)hdev->log;
-        r = hdev->vhost_ops->vhost_call(hdev, VHOST_SET_LOG_BASE, &log_base);
+        hdev->log = vhost_log_get(hdev->log_size,
+                                  vhost_dev_log_is_shared(hdev));
+        if (!hdev->log) {
+            r = -ENOMEM;
+            goto fail_log;
+        }
+        r = vhost_dev_set_log_base(hdev, hdev->log);
         if (r < 0) {
             r = -errno;
             goto fail_log;
@@ -1072,6 +1199,7 @@ int vhost_dev_start(struct vhost_dev *hdev, VirtIODevice *vdev)
 
     return 0;
 fail_log:
+    vhost_log_put(hdev, false);
 fail_vq:
     while (--i >= 0) {
         vhost_virtqueue_stop(hdev,
@@ -1101,8 +1229,6 @@ void vhost_dev_stop(struct vhost_dev *hdev, VirtIODevice *vdev)
     vhost_log_sync_range(hdev, 0, ~0x0ull);
 
     hdev->started = false;
-    g_free(hdev->log);
-    hdev->log = NULL;
-    hdev->log_size = 0;
+    vhost_log_put(hdev, false);
 }
 
@@ -21,6 +21,7 @@
 #include "hw/virtio/virtio-bus.h"
 #include "migration/migration.h"
 #include "hw/virtio/virtio-access.h"
+#include "block/aio.h"
 
 /*
  * The alignment to use between consumer and producer parts of vring.
@@ -29,6 +30,12 @@
  */
 #define VIRTIO_PCI_VRING_ALIGN         4096
 
+/* Number of freed elements kept by each queue for reuse, and the number
+ * of descriptors they have room for.
+ */
+#define VIRTQUEUE_ELEM_POOL_SIZE       16
+#define VIRTQUEUE_ELEM_POOL_SG         8
+
 typedef struct VRingDesc
 {
     uint64_t addr;
@@ -66,6 +73,19 @@ typedef struct VRing
     hwaddr used;
 } VRing;
 
+/* Host mapping for one part of a vring.  It is established on first
+ * access and dropped whenever the ring moves or the guest memory map
+ * changes.  If valid is set but ptr is NULL, the ring is not in RAM and
+ * is accessed with the (slow) physical memory accessors.
+ */
+typedef struct VRingCache
+{
+    void *ptr;
+    MemoryRegion *mr;
+    hwaddr mr_offset;
+    bool valid;
+} VRingCache;
+
 struct VirtQueue
 {
     VRing vring;
@@ -84,14 +104,68 @@ struct VirtQueue
 
     int inuse;
 
+    VRingCache desc_cache;
+    VRingCache avail_cache;
+    VRingCache used_cache;
+
+    /* Recently freed elements, all of elem_pool_size bytes */
+    void *elem_pool[VIRTQUEUE_ELEM_POOL_SIZE];
+    unsigned int elem_pool_count;
+    size_t elem_pool_size;
+
     uint16_t vector;
     void (*handle_output)(VirtIODevice *vdev, VirtQueue *vq);
     VirtIODevice *vdev;
     EventNotifier guest_notifier;
     EventNotifier host_notifier;
+    /* AioContext that handles host notifications, if not the main loop */
+    AioContext *ctx;
     QLIST_ENTRY(VirtQueue) node;
 };
 
+static void vring_cache_reset(VRingCache *c)
+{
+    memory_region_unref(c->mr);
+    c->ptr = NULL;
+    c->mr = NULL;
+    c->valid = false;
+}
+
+static void *vring_cache_map(VRingCache *c, hwaddr pa, hwaddr len,
+                             bool is_write)
+{
+    MemoryRegionSection section;
+
+    if (likely(c->valid)) {
+        return c->ptr;
+    }
+
+    c->valid = true;
+    section = memory_region_find(get_system_memory(), pa, len);
+    if (!section.mr) {
+        return NULL;
+    }
+    if (int128_get64(section.size) < len ||
+        !memory_region_is_ram(section.mr) ||
+        (is_write && section.readonly)) {
+        memory_region_unref(section.mr);
+        return NULL;
+    }
+
+    c->mr = section.mr;
+    c->mr_offset = section.offset_within_region;
+    c->ptr = memory_region_get_ram_ptr(section.mr) +
+             section.offset_within_region;
+    return c->ptr;
+}
+
+static void virtqueue_reset_caches(VirtQueue *vq)
+{
+    vring_cache_reset(&vq->desc_cache);
+    vring_cache_reset(&vq->avail_cache);
+    vring_cache_reset(&vq->used_cache);
+}
+
 /* virt queue functions */
 static void virtqueue_init(VirtQueue *vq)
 {
@@ -102,58 +176,149 @@ static void virtqueue_init(VirtQueue *vq)
     vq->vring.used = vring_align(vq->vring.avail +
                                  offsetof(VRingAvail, ring[vq->vring.num]),
                                  vq->vring.align);
+    virtqueue_reset_caches(vq);
 }
 
-static inline uint64_t vring_desc_addr(VirtIODevice *vdev, hwaddr desc_pa,
-                                       int i)
+/* Only the ring's own descriptor table is cached, indirect tables are
+ * read through the slow path.  An indirect table can alias the ring but
+ * be larger than it, so check the index too.
+ */
+static inline VRingDesc *vring_desc_cached(VirtQueue *vq, hwaddr desc_pa,
+                                           int i)
 {
+    VRingDesc *desc;
+
+    if (desc_pa != vq->vring.desc || i >= vq->vring.num) {
+        return NULL;
+    }
+    desc = vring_cache_map(&vq->desc_cache, desc_pa,
+                           vq->vring.num * sizeof(VRingDesc), false);
+    return desc ? &desc[i] : NULL;
+}
+
+static inline uint64_t vring_desc_addr(VirtQueue *vq, hwaddr desc_pa, int i)
+{
+    VRingDesc *desc = vring_desc_cached(vq, desc_pa, i);
     hwaddr pa;
+
+    if (desc) {
+        return virtio_ldq_p(vq->vdev, &desc->addr);
+    }
     pa = desc_pa + sizeof(VRingDesc) * i + offsetof(VRingDesc, addr);
-    return virtio_ldq_phys(vdev, pa);
+    return virtio_ldq_phys(vq->vdev, pa);
 }
 
-static inline uint32_t vring_desc_len(VirtIODevice *vdev, hwaddr desc_pa, int i)
+static inline uint32_t vring_desc_len(VirtQueue *vq, hwaddr desc_pa, int i)
 {
+    VRingDesc *desc = vring_desc_cached(vq, desc_pa, i);
     hwaddr pa;
+
+    if (desc) {
+        return virtio_ldl_p(vq->vdev, &desc->len);
+    }
     pa = desc_pa + sizeof(VRingDesc) * i + offsetof(VRingDesc, len);
-    return virtio_ldl_phys(vdev, pa);
+    return virtio_ldl_phys(vq->vdev, pa);
 }
 
-static inline uint16_t vring_desc_flags(VirtIODevice *vdev, hwaddr desc_pa,
-                                        int i)
+static inline uint16_t vring_desc_flags(VirtQueue *vq, hwaddr desc_pa, int i)
 {
+    VRingDesc *desc = vring_desc_cached(vq, desc_pa, i);
     hwaddr pa;
+
+    if (desc) {
+        return virtio_lduw_p(vq->vdev, &desc->flags);
+    }
     pa = desc_pa + sizeof(VRingDesc) * i + offsetof(VRingDesc, flags);
-    return virtio_lduw_phys(vdev, pa);
+    return virtio_lduw_phys(vq->vdev, pa);
 }
 
-static inline uint16_t vring_desc_next(VirtIODevice *vdev, hwaddr desc_pa,
-                                       int i)
+static inline uint16_t vring_desc_next(VirtQueue *vq, hwaddr desc_pa, int i)
 {
+    VRingDesc *desc = vring_desc_cached(vq, desc_pa, i);
     hwaddr pa;
+
+    if (desc) {
+        return virtio_lduw_p(vq->vdev, &desc->next);
+    }
     pa = desc_pa + sizeof(VRingDesc) * i + offsetof(VRingDesc, next);
-    return virtio_lduw_phys(vdev, pa);
+    return virtio_lduw_phys(vq->vdev, pa);
+}
+
+/* The avail ring including used_event */
+static inline uint8_t *vring_avail_cached(VirtQueue *vq)
+{
+    return vring_cache_map(&vq->avail_cache, vq->vring.avail,
+                           offsetof(VRingAvail, ring[vq->vring.num + 1]),
+                           false);
+}
+
+static inline uint16_t vring_avail_lduw(VirtQueue *vq, hwaddr offset)
+{
+    uint8_t *avail = vring_avail_cached(vq);
+
+    if (avail) {
+        return virtio_lduw_p(vq->vdev, avail + offset);
+    }
+    return virtio_lduw_phys(vq->vdev, vq->vring.avail + offset);
+}
+
+/* The used ring including avail_event */
+static inline uint8_t *vring_used_cached(VirtQueue *vq)
+{
+    return vring_cache_map(&vq->used_cache, vq->vring.used,
+                           offsetof(VRingUsed, ring[vq->vring.num]) +
+                           sizeof(uint16_t), true);
+}
+
+static inline uint16_t vring_used_lduw(VirtQueue *vq, hwaddr offset)
+{
+    uint8_t *used = vring_used_cached(vq);
+
+    if (used) {
+        return virtio_lduw_p(vq->vdev, used + offset);
+    }
+    return virtio_lduw_phys(vq->vdev, vq->vring.used + offset);
+}
+
+static inline void vring_used_stw(VirtQueue *vq, hwaddr offset, uint16_t val)
+{
+    uint8_t *used = vring_used_cached(vq);
+
+    if (used) {
+        virtio_stw_p(vq->vdev, used + offset, val);
+        memory_region_set_dirty(vq->used_cache.mr,
+                                vq->used_cache.mr_offset + offset, 2);
+        return;
+    }
+    virtio_stw_phys(vq->vdev, vq->vring.used + offset, val);
+}
+
+static inline void vring_used_stl(VirtQueue *vq, hwaddr offset, uint32_t val)
+{
+    uint8_t *used = vring_used_cached(vq);
+
+    if (used) {
+        virtio_stl_p(vq->vdev, used + offset, val);
+        memory_region_set_dirty(vq->used_cache.mr,
+                                vq->used_cache.mr_offset + offset, 4);
+        return;
+    }
+    virtio_stl_phys(vq->vdev, vq->vring.used + offset, val);
 }
 
 static inline uint16_t vring_avail_flags(VirtQueue *vq)
 {
-    hwaddr pa;
-    pa = vq->vring.avail + offsetof(VRingAvail, flags);
-    return virtio_lduw_phys(vq->vdev, pa);
+    return vring_avail_lduw(vq, offsetof(VRingAvail, flags));
 }
 
 static inline uint16_t vring_avail_idx(VirtQueue *vq)
 {
-    hwaddr pa;
-    pa = vq->vring.avail + offsetof(VRingAvail, idx);
-    return virtio_lduw_phys(vq->vdev, pa);
+    return vring_avail_lduw(vq, offsetof(VRingAvail, idx));
 }
 
 static inline uint16_t vring_avail_ring(VirtQueue *vq, int i)
 {
-    hwaddr pa;
-    pa = vq->vring.avail + offsetof(VRingAvail, ring[i]);
-    return virtio_lduw_phys(vq->vdev, pa);
+    return vring_avail_lduw(vq, offsetof(VRingAvail, ring[i]));
 }
 
 static inline uint16_t vring_get_used_event(VirtQueue *vq)
@@ -163,56 +328,44 @@ static inline uint16_t vring_get_used_event(VirtQueue *vq)
 
 static inline void vring_used_ring_id(VirtQueue *vq, int i, uint32_t val)
 {
-    hwaddr pa;
-    pa = vq->vring.used + offsetof(VRingUsed, ring[i].id);
-    virtio_stl_phys(vq->vdev, pa, val);
+    vring_used_stl(vq, offsetof(VRingUsed, ring[i].id), val);
 }
 
 static inline void vring_used_ring_len(VirtQueue *vq, int i, uint32_t val)
 {
-    hwaddr pa;
-    pa = vq->vring.used + offsetof(VRingUsed, ring[i].len);
-    virtio_stl_phys(vq->vdev, pa, val);
+    vring_used_stl(vq, offsetof(VRingUsed, ring[i].len), val);
 }
 
 static uint16_t vring_used_idx(VirtQueue *vq)
 {
-    hwaddr pa;
-    pa = vq->vring.used + offsetof(VRingUsed, idx);
-    return virtio_lduw_phys(vq->vdev, pa);
+    return vring_used_lduw(vq, offsetof(VRingUsed, idx));
 }
 
 static inline void vring_used_idx_set(VirtQueue *vq, uint16_t val)
 {
-    hwaddr pa;
-    pa = vq->vring.used + offsetof(VRingUsed, idx);
-    virtio_stw_phys(vq->vdev, pa, val);
+    vring_used_stw(vq, offsetof(VRingUsed, idx), val);
 }
 
 static inline void vring_used_flags_set_bit(VirtQueue *vq, int mask)
 {
-    VirtIODevice *vdev = vq->vdev;
-    hwaddr pa;
-    pa = vq->vring.used + offsetof(VRingUsed, flags);
-    virtio_stw_phys(vdev, pa, virtio_lduw_phys(vdev, pa) | mask);
+    hwaddr offset = offsetof(VRingUsed, flags);
+
+    vring_used_stw(vq, offset, vring_used_lduw(vq, offset) | mask);
 }
 
 static inline void vring_used_flags_unset_bit(VirtQueue *vq, int mask)
 {
-    VirtIODevice *vdev = vq->vdev;
-    hwaddr pa;
-    pa = vq->vring.used + offsetof(VRingUsed, flags);
-    virtio_stw_phys(vdev, pa, virtio_lduw_phys(vdev, pa) & ~mask);
+    hwaddr offset = offsetof(VRingUsed, flags);
+
+    vring_used_stw(vq, offset, vring_used_lduw(vq, offset) & ~mask);
 }
 
 static inline void vring_set_avail_event(VirtQueue *vq, uint16_t val)
 {
-    hwaddr pa;
     if (!vq->notification) {
         return;
     }
-    pa = vq->vring.used + offsetof(VRingUsed, ring[vq->vring.num]);
-    virtio_stw_phys(vq->vdev, pa, val);
+    vring_used_stw(vq, offsetof(VRingUsed, ring[vq->vring.num]), val);
 }
 
 void virtio_queue_set_notification(VirtQueue *vq, int enable)
@@ -329,18 +482,18 @@ static unsigned int virtqueue_get_head(VirtQueue *vq, unsigned int idx)
     return head;
 }
 
-static unsigned virtqueue_next_desc(VirtIODevice *vdev, hwaddr desc_pa,
+static unsigned virtqueue_next_desc(VirtQueue *vq, hwaddr desc_pa,
                                     unsigned int i, unsigned int max)
 {
     unsigned int next;
 
     /* If this descriptor says it doesn't chain, we're done. */
-    if (!(vring_desc_flags(vdev, desc_pa, i) & VRING_DESC_F_NEXT)) {
+    if (!(vring_desc_flags(vq, desc_pa, i) & VRING_DESC_F_NEXT)) {
         return max;
     }
 
     /* Check they're not leading us off end of descriptors. */
-    next = vring_desc_next(vdev, desc_pa, i);
+    next = vring_desc_next(vq, desc_pa, i);
     /* Make sure compiler knows to grab that: we don't want it changing! */
     smp_wmb();
 
@@ -363,7 +516,6 @@ void virtqueue_get_avail_bytes(VirtQueue *vq, unsigned int *in_bytes,
 
     total_bufs = in_total = out_total = 0;
     while (virtqueue_num_heads(vq, idx)) {
-        VirtIODevice *vdev = vq->vdev;
         unsigned int max, num_bufs, indirect = 0;
         hwaddr desc_pa;
         int i;
@@ -373,8 +525,8 @@ void virtqueue_get_avail_bytes(VirtQueue *vq, unsigned int *in_bytes,
         i = virtqueue_get_head(vq, idx++);
         desc_pa = vq->vring.desc;
 
-        if (vring_desc_flags(vdev, desc_pa, i) & VRING_DESC_F_INDIRECT) {
-            if (vring_desc_len(vdev, desc_pa, i) % sizeof(VRingDesc)) {
+        if (vring_desc_flags(vq, desc_pa, i) & VRING_DESC_F_INDIRECT) {
+            if (vring_desc_len(vq, desc_pa, i) % sizeof(VRingDesc)) {
                 error_report("Invalid size for indirect buffer table");
                 exit(1);
             }
@@ -387,8 +539,8 @@ void virtqueue_get_avail_bytes(VirtQueue *vq, unsigned int *in_bytes,
 
             /* loop over the indirect descriptor table */
             indirect = 1;
-            max = vring_desc_len(vdev, desc_pa, i) / sizeof(VRingDesc);
-            desc_pa = vring_desc_addr(vdev, desc_pa, i);
+            max = vring_desc_len(vq, desc_pa, i) / sizeof(VRingDesc);
+            desc_pa = vring_desc_addr(vq, desc_pa, i);
             num_bufs = i = 0;
         }
 
@@ -399,15 +551,15 @@ void virtqueue_get_avail_bytes(VirtQueue *vq, unsigned int *in_bytes,
                 exit(1);
             }
 
-            if (vring_desc_flags(vdev, desc_pa, i) & VRING_DESC_F_WRITE) {
-                in_total += vring_desc_len(vdev, desc_pa, i);
+            if (vring_desc_flags(vq, desc_pa, i) & VRING_DESC_F_WRITE) {
+                in_total += vring_desc_len(vq, desc_pa, i);
             } else {
-                out_total += vring_desc_len(vdev, desc_pa, i);
+                out_total += vring_desc_len(vq, desc_pa, i);
             }
             if (in_total >= max_in_bytes && out_total >= max_out_bytes) {
                 goto done;
             }
-        } while ((i = virtqueue_next_desc(vdev, desc_pa, i, max)) != max);
+        } while ((i = virtqueue_next_desc(vq, desc_pa, i, max)) != max);
 
         if (!indirect)
             total_bufs = num_bufs;
@@ -454,17 +606,123 @@ void virtqueue_map_sg(struct iovec *sg, hwaddr *addr,
     }
 }
 
-int virtqueue_pop(VirtQueue *vq, VirtQueueElement *elem)
+static size_t virtqueue_elem_in_sg_offset(size_t sz, unsigned int max)
+{
+    VirtQueueElement *elem;
+    size_t in_addr_ofs = QEMU_ALIGN_UP(sz, __alignof__(elem->in_addr[0]));
+
+    return QEMU_ALIGN_UP(in_addr_ofs + max * sizeof(elem->in_addr[0]),
+                         __alignof__(elem->in_sg[0]));
+}
+
+static size_t virtqueue_elem_size(size_t sz, unsigned int max)
+{
+    VirtQueueElement *elem;
+
+    return virtqueue_elem_in_sg_offset(sz, max) + max * sizeof(elem->in_sg[0]);
+}
+
+/* Lay out the arrays of an element whose allocation has room for max
+ * descriptors after the sz bytes of the embedding structure.
+ */
+static void virtqueue_elem_layout(VirtQueueElement *elem, size_t sz,
+                                  unsigned int max,
+                                  unsigned out_num, unsigned in_num)
+{
+    uint8_t *base = (uint8_t *)elem;
+
+    assert(sz >= sizeof(VirtQueueElement));
+    assert(out_num + in_num <= max);
+
+    elem->out_num = out_num;
+    elem->in_num = in_num;
+    elem->in_addr = (hwaddr *)(base + QEMU_ALIGN_UP(sz,
+                                   __alignof__(elem->in_addr[0])));
+    elem->out_addr = elem->in_addr + in_num;
+    elem->in_sg = (struct iovec *)(base +
+                                   virtqueue_elem_in_sg_offset(sz, max));
+    elem->out_sg = elem->in_sg + in_num;
+}
+
+void *virtqueue_alloc_element(size_t sz, unsigned out_num, unsigned in_num)
+{
+    size_t size = virtqueue_elem_size(sz, out_num + in_num);
+    VirtQueueElement *elem = g_malloc(size);
+
+    elem->alloc_size = size;
+    virtqueue_elem_layout(elem, sz, out_num + in_num, out_num, in_num);
+    return elem;
+}
+
+static void virtqueue_drain_elem_pool(VirtQueue *vq)
+{
+    while (vq->elem_pool_count) {
+        g_free(vq->elem_pool[--vq->elem_pool_count]);
+    }
+}
+
+/* Most requests use only a handful of descriptors.  Give them an element
+ * with room for VIRTQUEUE_ELEM_POOL_SG descriptors, so that it can be
+ * recycled through the queue pool by virtqueue_free_element().
+ */
+static VirtQueueElement *virtqueue_get_element(VirtQueue *vq, size_t sz,
+                                               unsigned out_num,
+                                               unsigned in_num)
+{
+    VirtQueueElement *elem;
+    size_t size;
+
+    if (out_num + in_num > VIRTQUEUE_ELEM_POOL_SG) {
+        return virtqueue_alloc_element(sz, out_num, in_num);
+    }
+
+    size = virtqueue_elem_size(sz, VIRTQUEUE_ELEM_POOL_SG);
+    if (size != vq->elem_pool_size) {
+        virtqueue_drain_elem_pool(vq);
+        vq->elem_pool_size = size;
+    }
+    if (vq->elem_pool_count) {
+        elem = vq->elem_pool[--vq->elem_pool_count];
+    } else {
+        elem = g_malloc(size);
+        elem->alloc_size = size;
+    }
+    virtqueue_elem_layout(elem, sz, VIRTQUEUE_ELEM_POOL_SG, out_num, in_num);
+    return elem;
+}
+
+void virtqueue_free_element(VirtQueue *vq, void *opaque)
+{
+    VirtQueueElement *elem = opaque;
+
+    if (elem->alloc_size == vq->elem_pool_size &&
+        vq->elem_pool_count < VIRTQUEUE_ELEM_POOL_SIZE) {
+        vq->elem_pool[vq->elem_pool_count++] = elem;
+    } else {
+        g_free(elem);
+    }
+}
+
+/* Pop a buffer from the queue and return it in a newly allocated structure
+ * of sz bytes, which must start with a VirtQueueElement.  Returns NULL if
+ * the queue is empty.
+ */
+void *virtqueue_pop(VirtQueue *vq, size_t sz)
 {
     unsigned int i, head, max;
     hwaddr desc_pa = vq->vring.desc;
     VirtIODevice *vdev = vq->vdev;
+    VirtQueueElement *elem;
+    unsigned out_num, in_num;
+    hwaddr addr[VIRTQUEUE_MAX_SIZE];
+    struct iovec iov[VIRTQUEUE_MAX_SIZE];
 
-    if (!virtqueue_num_heads(vq, vq->last_avail_idx))
-        return 0;
+    if (!virtqueue_num_heads(vq, vq->last_avail_idx)) {
+        return NULL;
+    }
 
     /* When we start there are none of either input nor output. */
-    elem->out_num = elem->in_num = 0;
+    out_num = in_num = 0;
 
     max = vq->vring.num;
 
@@ -473,57 +731,133 @@ int virtqueue_pop(VirtQueue *vq, VirtQueueElement *elem)
         vring_set_avail_event(vq, vq->last_avail_idx);
     }
 
-    if (vring_desc_flags(vdev, desc_pa, i) & VRING_DESC_F_INDIRECT) {
-        if (vring_desc_len(vdev, desc_pa, i) % sizeof(VRingDesc)) {
+    if (vring_desc_flags(vq, desc_pa, i) & VRING_DESC_F_INDIRECT) {
+        if (vring_desc_len(vq, desc_pa, i) % sizeof(VRingDesc)) {
             error_report("Invalid size for indirect buffer table");
             exit(1);
         }
 
         /* loop over the indirect descriptor table */
-        max = vring_desc_len(vdev, desc_pa, i) / sizeof(VRingDesc);
-        desc_pa = vring_desc_addr(vdev, desc_pa, i);
+        max = vring_desc_len(vq, desc_pa, i) / sizeof(VRingDesc);
+        desc_pa = vring_desc_addr(vq, desc_pa, i);
         i = 0;
     }
 
-    /* Collect all the descriptors */
+    /* Collect all the descriptors.  Device-writable descriptors must come
+     * after all the device-readable ones.
+     */
     do {
-        struct iovec *sg;
+        unsigned int n = out_num + in_num;
 
-        if (vring_desc_flags(vdev, desc_pa, i) & VRING_DESC_F_WRITE) {
-            if (elem->in_num >= ARRAY_SIZE(elem->in_sg)) {
-                error_report("Too many write descriptors in indirect table");
-                exit(1);
-            }
-            elem->in_addr[elem->in_num] = vring_desc_addr(vdev, desc_pa, i);
-            sg = &elem->in_sg[elem->in_num++];
+        if (n >= VIRTQUEUE_MAX_SIZE) {
+            error_report("Too many descriptors in indirect table");
+            exit(1);
+        }
+
+        if (vring_desc_flags(vq, desc_pa, i) & VRING_DESC_F_WRITE) {
+            in_num++;
         } else {
-            if (elem->out_num >= ARRAY_SIZE(elem->out_sg)) {
-                error_report("Too many read descriptors in indirect table");
+            if (in_num) {
+                error_report("Incorrect order for descriptors");
                 exit(1);
             }
-            elem->out_addr[elem->out_num] = vring_desc_addr(vdev, desc_pa, i);
-            sg = &elem->out_sg[elem->out_num++];
+            out_num++;
         }
-
-        sg->iov_len = vring_desc_len(vdev, desc_pa, i);
+        addr[n] = vring_desc_addr(vq, desc_pa, i);
+        iov[n].iov_len = vring_desc_len(vq, desc_pa, i);
 
         /* If we've got too many, that implies a descriptor loop. */
-        if ((elem->in_num + elem->out_num) > max) {
+        if ((in_num + out_num) > max) {
             error_report("Looped descriptor");
             exit(1);
         }
-    } while ((i = virtqueue_next_desc(vdev, desc_pa, i, max)) != max);
+    } while ((i = virtqueue_next_desc(vq, desc_pa, i, max)) != max);
 
-    /* Now map what we have collected */
+    /* Now copy what we have collected and mapped */
+    elem = virtqueue_get_element(vq, sz, out_num, in_num);
+    elem->index = head;
+    for (i = 0; i < out_num; i++) {
+        elem->out_addr[i] = addr[i];
+        elem->out_sg[i] = iov[i];
+    }
+    for (i = 0; i < in_num; i++) {
+        elem->in_addr[i] = addr[out_num + i];
+        elem->in_sg[i] = iov[out_num + i];
+    }
     virtqueue_map_sg(elem->in_sg, elem->in_addr, elem->in_num, 1);
     virtqueue_map_sg(elem->out_sg, elem->out_addr, elem->out_num, 0);
 
-    elem->index = head;
-
     vq->inuse++;
 
     trace_virtqueue_pop(vq, elem, elem->in_num, elem->out_num);
-    return elem->in_num + elem->out_num;
+    return elem;
+}
+
+/* Reading and writing a structure directly to QEMUFile is *awful*, but
+ * it is what the device models have always done for in-flight requests.
+ * Since the in-memory layout of VirtQueueElement has changed, marshal to
+ * and from the layout that was used before the change.
+ */
+typedef struct VirtQueueElementOld {
+    unsigned int index;
+    unsigned int out_num;
+    unsigned int in_num;
+    hwaddr in_addr[VIRTQUEUE_MAX_SIZE];
+    hwaddr out_addr[VIRTQUEUE_MAX_SIZE];
+    struct iovec in_sg[VIRTQUEUE_MAX_SIZE];
+    struct iovec out_sg[VIRTQUEUE_MAX_SIZE];
+} VirtQueueElementOld;
+
+void *qemu_get_virtqueue_element(QEMUFile *f, size_t sz)
+{
+    VirtQueueElementOld *data = g_new(VirtQueueElementOld, 1);
+    VirtQueueElement *elem;
+    int i;
+
+    qemu_get_buffer(f, (uint8_t *)data, sizeof(VirtQueueElementOld));
+    if (data->in_num > VIRTQUEUE_MAX_SIZE ||
+        data->out_num > VIRTQUEUE_MAX_SIZE) {
+        error_report("virtio: invalid element in migration stream");
+        exit(1);
+    }
+
+    elem = virtqueue_alloc_element(sz, data->out_num, data->in_num);
+    elem->index = data->index;
+
+    for (i = 0; i < elem->in_num; i++) {
+        elem->in_addr[i] = data->in_addr[i];
+        elem->in_sg[i].iov_len = data->in_sg[i].iov_len;
+    }
+    for (i = 0; i < elem->out_num; i++) {
+        elem->out_addr[i] = data->out_addr[i];
+        elem->out_sg[i].iov_len = data->out_sg[i].iov_len;
+    }
+    g_free(data);
+
+    virtqueue_map_sg(elem->in_sg, elem->in_addr, elem->in_num, 1);
+    virtqueue_map_sg(elem->out_sg, elem->out_addr, elem->out_num, 0);
+    return elem;
+}
+
+void qemu_put_virtqueue_element(QEMUFile *f, VirtQueueElement *elem)
+{
+    VirtQueueElementOld *data = g_new0(VirtQueueElementOld, 1);
+    int i;
+
+    data->index = elem->index;
+    data->in_num = elem->in_num;
+    data->out_num = elem->out_num;
+
+    for (i = 0; i < elem->in_num; i++) {
+        data->in_addr[i] = elem->in_addr[i];
+        data->in_sg[i] = elem->in_sg[i];
+    }
+    for (i = 0; i < elem->out_num; i++) {
+        data->out_addr[i] = elem->out_addr[i];
+        data->out_sg[i] = elem->out_sg[i];
+    }
+    qemu_put_buffer(f, (uint8_t *)data, sizeof(VirtQueueElementOld));
+    g_free(data);
 }
 
 /* virtio device */
@@ -606,6 +940,7 @@ void virtio_reset(void *opaque)
         vdev->vq[i].vring.used = 0;
         vdev->vq[i].last_avail_idx = 0;
         vdev->vq[i].pa = 0;
+        virtqueue_reset_caches(&vdev->vq[i]);
         virtio_queue_set_vector(vdev, i, VIRTIO_NO_VECTOR);
         vdev->vq[i].signalled_used = 0;
         vdev->vq[i].signalled_used_valid = false;
@@ -833,6 +1168,7 @@ void virtio_del_queue(VirtIODevice *vdev, int n)
     }
 
     vdev->vq[n].vring.num = 0;
+    virtqueue_reset_caches(&vdev->vq[n]);
 }
 
 void virtio_irq(VirtQueue *vq)
@@ -876,6 +1212,20 @@ void virtio_notify(VirtIODevice *vdev, VirtQueue *vq)
     virtio_notify_vector(vdev, vq->vector);
 }
 
+/* Notify through the guest notifier instead of the transport.  This does
+ * not need the global mutex, so it can be used by devices that process a
+ * queue in an IOThread after setting up the guest notifiers.
+ */
+void virtio_notify_irqfd(VirtIODevice *vdev, VirtQueue *vq)
+{
+    if (!vring_notify(vdev, vq)) {
+        return;
+    }
+
+    trace_virtio_notify_irqfd(vdev, vq);
+    event_notifier_set(&vq->guest_notifier);
+}
+
 void virtio_notify_config(VirtIODevice *vdev)
 {
     if (!(vdev->status & VIRTIO_CONFIG_S_DRIVER_OK))
@@ -1107,7 +1457,13 @@ int virtio_load(VirtIODevice *vdev, QEMUFile *f, int version_id)
 
 void virtio_cleanup(VirtIODevice *vdev)
 {
+    int i;
+
     qemu_del_vm_change_state_handler(vdev->vmstate);
+    for (i = 0; i < VIRTIO_PCI_QUEUE_MAX; i++) {
+        virtqueue_reset_caches(&vdev->vq[i]);
+        virtqueue_drain_elem_pool(&vdev->vq[i]);
+    }
     g_free(vdev->config);
     g_free(vdev->vq);
     g_free(vdev->vector_queues);
@@ -1236,6 +1592,20 @@ void virtio_queue_set_last_avail_idx(VirtIODevice *vdev, int n, uint16_t idx)
     vdev->vq[n].last_avail_idx = idx;
 }
 
+/* Used when the backend that processed the queue went away without
+ * reporting its position: assuming in-order completion, the buffers
+ * after the last used one are those it had not completed yet.
+ */
+void virtio_queue_restore_last_avail_idx(VirtIODevice *vdev, int n)
+{
+    VirtQueue *vq = &vdev->vq[n];
+
+    if (!vq->vring.desc) {
+        return;
+    }
+    vq->last_avail_idx = vring_used_idx(vq);
+}
+
 void virtio_queue_invalidate_signalled_used(VirtIODevice *vdev, int n)
 {
     vdev->vq[n].signalled_used_valid = false;
@@ -1304,6 +1674,24 @@ void virtio_queue_set_host_notifier_fd_handler(VirtQueue *vq, bool assign,
     }
 }
 
+void virtio_queue_aio_set_host_notifier_handler(VirtQueue *vq, AioContext *ctx,
+                                                bool assign, bool set_handler)
+{
+    if (assign && set_handler) {
+        aio_set_event_notifier(ctx, &vq->host_notifier,
+                               virtio_queue_host_notifier_read);
+        vq->ctx = ctx;
+    } else {
+        aio_set_event_notifier(ctx, &vq->host_notifier, NULL);
+        vq->ctx = NULL;
+    }
+    if (!assign) {
+        /* Test and clear notifier before after disabling event,
+         * in case poll callback didn't have time to run. */
+        virtio_queue_host_notifier_read(&vq->host_notifier);
+    }
+}
+
 EventNotifier *virtio_queue_get_host_notifier(VirtQueue *vq)
 {
     return &vq->host_notifier;
@@ -1315,6 +1703,31 @@ void virtio_device_set_child_bus_name(VirtIODevice *vdev, char *bus_name)
     vdev->bus_name = g_strdup(bus_name);
 }
 
+/* Any change to the guest memory map may invalidate the vring mappings;
+ * they are reestablished lazily on the next access.  A queue that runs
+ * in an IOThread may be using them right now, so take its AioContext
+ * before dropping the mappings and the memory region references.
+ */
+static void virtio_memory_region_del(MemoryListener *listener,
+                                     MemoryRegionSection *section)
+{
+    VirtIODevice *vdev = container_of(listener, VirtIODevice, listener);
+    int i;
+
+    for (i = 0; i < VIRTIO_PCI_QUEUE_MAX; i++) {
+        VirtQueue *vq = &vdev->vq[i];
+        AioContext *ctx = vq->ctx;
+
+        if (ctx) {
+            aio_context_acquire(ctx);
+        }
+        virtqueue_reset_caches(vq);
+        if (ctx) {
+            aio_context_release(ctx);
+        }
+    }
+}
+
 static void virtio_device_realize(DeviceState *dev, Error **errp)
 {
     VirtIODevice *vdev = VIRTIO_DEVICE(dev);
@@ -1329,6 +1742,11 @@ static void virtio_device_realize(DeviceState *dev, Error **errp)
         }
     }
     virtio_bus_device_plugged(vdev);
+
+    vdev->listener = (MemoryListener) {
+        .region_del = virtio_memory_region_del,
+    };
+    memory_listener_register(&vdev->listener, &address_space_memory);
 }
 
 static void virtio_device_unrealize(DeviceState *dev, Error **errp)
@@ -1337,6 +1755,7 @@ static void virtio_device_unrealize(DeviceState *dev, Error **errp)
     VirtioDeviceClass *vdc = VIRTIO_DEVICE_GET_CLASS(dev);
     Error *err = NULL;
 
+    memory_listener_unregister(&vdev->listener);
     virtio_bus_device_unplugged(vdev);
 
     if (vdc->unrealize != NULL) {
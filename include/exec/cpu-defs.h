@@ -72,6 +72,16 @@ typedef uint64_t target_ulong;
 #if !defined(CONFIG_USER_ONLY)
 #define CPU_TLB_BITS 8
 #define CPU_TLB_SIZE (1 << CPU_TLB_BITS)
+
+/* The TCG backends for these hosts load the size mask and the address of
+   the TLB from the CPU state, so the TLB of each MMU mode can be resized
+   at flush time according to its use.  CPU_TLB_BITS is the initial size;
+   everywhere else it is the fixed size.  */
+#if defined(__i386__) || defined(__x86_64__) || defined(__aarch64__)
+#define CPU_TLB_DYN
+#define CPU_TLB_DYN_MIN_BITS 6
+#define CPU_TLB_DYN_MAX_BITS 18
+#endif
 /* use a fully associative victim tlb of 8 entries */
 #define CPU_VTLB_SIZE 8
 
@@ -113,14 +123,33 @@ typedef struct CPUIOTLBEntry {
     MemTxAttrs attrs;
 } CPUIOTLBEntry;
 
+#ifdef CPU_TLB_DYN
+/* The tables belong to cputlb.c, which reloads these fields on every
+   full flush.  tlb_mask is (number of entries - 1) << CPU_TLB_ENTRY_BITS,
+   ready to be applied to the address shifted by the TCG fast path.  */
+#define CPU_TLB_TABLES \
+    uintptr_t tlb_mask[NB_MMU_MODES];                                   \
+    CPUTLBEntry *tlb_table[NB_MMU_MODES];                               \
+    CPUIOTLBEntry *iotlb[NB_MMU_MODES];                                 \
+
+#else
+#define CPU_TLB_TABLES \
+    CPUTLBEntry tlb_table[NB_MMU_MODES][CPU_TLB_SIZE];                  \
+    CPUIOTLBEntry iotlb[NB_MMU_MODES][CPU_TLB_SIZE];                    \
+
+#endif
+
 #define CPU_COMMON_TLB \
     /* The meaning of the MMU modes is defined in the target code. */   \
-    CPUTLBEntry tlb_table[NB_MMU_MODES][CPU_TLB_SIZE];                  \
+    CPU_TLB_TABLES                                                      \
     CPUTLBEntry tlb_v_table[NB_MMU_MODES][CPU_VTLB_SIZE];               \
-    CPUIOTLBEntry iotlb[NB_MMU_MODES][CPU_TLB_SIZE];                    \
     CPUIOTLBEntry iotlb_v[NB_MMU_MODES][CPU_VTLB_SIZE];                 \
-    target_ulong tlb_flush_addr;                                        \
-    target_ulong tlb_flush_mask;                                        \
+    /* Entries filled since the last flush, an estimate. */             \
+    size_t tlb_n_used[NB_MMU_MODES];                                    \
+    /* Area covered by large pages, and mask of the largest one. */     \
+    target_ulong tlb_flush_addr[NB_MMU_MODES];                          \
+    target_ulong tlb_flush_mask[NB_MMU_MODES];                          \
+    target_ulong tlb_large_page_mask[NB_MMU_MODES];                     \
     target_ulong vtlb_index;                                            \
 
 #else
@@ -29,6 +29,11 @@ void tlb_reset_dirty_range(CPUTLBEntry *tlb_entry, uintptr_t start,
 void cpu_tlb_reset_dirty_all(ram_addr_t start1, ram_addr_t length);
 void tlb_set_dirty(CPUArchState *env, target_ulong vaddr);
 extern int tlb_flush_count;
+extern int tlb_flush_page_count;
+extern int tlb_flush_large_count;
+extern int tlb_refill_count;
+extern int tlb_victim_hit_count;
+extern int tlb_resize_count;
 
 /* exec.c */
 void tb_flush_jmp_cache(CPUState *cpu, target_ulong addr);
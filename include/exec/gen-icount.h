@@ -21,6 +21,13 @@ static inline void gen_tb_start(TranslationBlock *tb)
     tcg_gen_brcondi_i32(TCG_COND_NE, flag, 0, exitreq_label);
     tcg_temp_free_i32(flag);
 
+    if (tb->cflags & CF_PROFILE) {
+        TCGv_ptr ptr = tcg_const_ptr(tb);
+        tcg_gen_st_ptr(ptr, cpu_env,
+                       offsetof(CPUState, profile_tb) - ENV_OFFSET);
+        tcg_temp_free_ptr(ptr);
+    }
+
     if (!(tb->cflags & CF_USE_ICOUNT)) {
         return;
     }
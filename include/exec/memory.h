@@ -35,6 +35,7 @@
 #include "qapi/error.h"
 #include "qom/object.h"
 #include "qemu/rcu.h"
+#include "qemu/thread.h"
 
 #define MAX_PHYS_ADDR_SPACE_BITS 62
 #define MAX_PHYS_ADDR            (((hwaddr)1 << MAX_PHYS_ADDR_SPACE_BITS) - 1)
@@ -225,6 +226,9 @@ struct MemoryListener {
     QTAILQ_ENTRY(MemoryListener) link;
 };
 
+/* Default limit for the bounce buffers of one address space */
+#define DEFAULT_MAX_BOUNCE_BUFFER_SIZE (64 * 1024)
+
 /**
  * AddressSpace: describes a mapping of addresses to #MemoryRegion objects
  */
@@ -243,6 +247,15 @@ struct AddressSpace {
     struct AddressSpaceDispatch *next_dispatch;
     MemoryListener dispatch_listener;
 
+    /* Bounce buffers for address_space_map() of non-RAM memory */
+    QemuMutex bounce_lock;
+    size_t max_bounce_buffer_size;
+    size_t bounce_buffer_size;          /* bytes currently allocated */
+    uint64_t bounce_maps;
+    uint64_t bounce_map_failures;
+    QLIST_HEAD(, BounceBuffer) bounce_buffers;
+    QLIST_HEAD(, MapClient) map_clients;
+
     QTAILQ_ENTRY(AddressSpace) address_spaces_link;
 };
 
@@ -1265,13 +1278,43 @@ MemoryRegion *address_space_translate(AddressSpace *as, hwaddr addr,
  */
 bool address_space_access_valid(AddressSpace *as, hwaddr addr, int len, bool is_write);
 
+/* address_space_set_max_bounce_buffer_size: limit the memory used for
+ * bounce buffers
+ *
+ * address_space_map() of memory that is not RAM allocates a bounce buffer
+ * from a pool of at most @size bytes.  Several mappings can use the pool
+ * at the same time, and each mapping holds at most one page.
+ *
+ * @as: #AddressSpace to be configured
+ * @size: maximum number of bytes allocated for bounce buffers
+ */
+void address_space_set_max_bounce_buffer_size(AddressSpace *as, size_t size);
+
+/* address_space_register_map_client: wait for bounce buffers
+ *
+ * Schedules @bh when a bounce buffer of @as is freed, or right away if
+ * the pool is not full.  A client is only notified once.
+ *
+ * @as: #AddressSpace whose mappings failed
+ * @bh: bottom half to schedule
+ */
+void address_space_register_map_client(AddressSpace *as, QEMUBH *bh);
+
+/* address_space_unregister_map_client: cancel
+ * address_space_register_map_client()
+ *
+ * @as: #AddressSpace passed to address_space_register_map_client()
+ * @bh: bottom half passed to address_space_register_map_client()
+ */
+void address_space_unregister_map_client(AddressSpace *as, QEMUBH *bh);
+
 /* address_space_map: map a physical memory region into a host virtual address
  *
  * May map a subset of the requested range, given by and returned in @plen.
  * May return %NULL if resources needed to perform the mapping are exhausted.
  * Use only for reads OR writes - not for read-modify-write operations.
- * Use cpu_register_map_client() to know when retrying the map operation is
- * likely to succeed.
+ * Use address_space_register_map_client() to know when retrying the map
+ * operation is likely to succeed.
  *
  * @as: #AddressSpace to be accessed
  * @addr: address within that address space
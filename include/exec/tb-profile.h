@@ -0,0 +1,22 @@
+/*
+ * Sampling profiler for translated code
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#ifndef TB_PROFILE_H
+#define TB_PROFILE_H
+
+#include "qemu-common.h"
+#include "qapi/error.h"
+
+extern bool tb_profile_enabled;
+
+void tb_profile_start(int64_t period_us, Error **errp);
+void tb_profile_stop(void);
+void tb_profile_reset(void);
+void tb_profile_report(FILE *f, fprintf_function cpu_fprintf, int max_entries);
+void tb_profile_save_folded(const char *filename, Error **errp);
+void tb_profile_save_perf_map(const char *filename, Error **errp);
+
+#endif
@@ -1,7 +1,26 @@
 #ifndef HW_COMPAT_H
 #define HW_COMPAT_H
 
+#define HW_COMPAT_2_3 \
+        {\
+            .driver   = "scsi-hd",\
+            .property = "image_discard_granularity",\
+            .value    = "off",\
+        },{\
+            .driver   = "scsi-cd",\
+            .property = "image_discard_granularity",\
+            .value    = "off",\
+        },{\
+            .driver   = "scsi-disk",\
+            .property = "image_discard_granularity",\
+            .value    = "off",\
+        }
+
+#define HW_COMPAT_2_2 \
+        HW_COMPAT_2_3
+
 #define HW_COMPAT_2_1 \
+        HW_COMPAT_2_2, \
         {\
             .driver   = "intel-hda",\
             .property = "old_msi_addr",\
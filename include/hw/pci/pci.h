@@ -246,6 +246,7 @@ struct PCIDevice {
     char name[64];
     PCIIORegion io_regions[PCI_NUM_REGIONS];
     AddressSpace bus_master_as;
+    uint64_t max_bounce_buffer_size;
     MemoryRegion bus_master_enable_region;
 
     /* do not access the following fields */
@@ -19,17 +19,28 @@ typedef enum VhostBackendType {
 } VhostBackendType;
 
 struct vhost_dev;
+struct vhost_log;
 
 typedef int (*vhost_call)(struct vhost_dev *dev, unsigned long int request,
              void *arg);
 typedef int (*vhost_backend_init)(struct vhost_dev *dev, void *opaque);
 typedef int (*vhost_backend_cleanup)(struct vhost_dev *dev);
+typedef int (*vhost_backend_get_vq_index)(struct vhost_dev *dev, int idx);
+typedef int (*vhost_backend_set_vring_enable)(struct vhost_dev *dev,
+                                              int enable);
+typedef bool (*vhost_requires_shm_log)(struct vhost_dev *dev);
+typedef int (*vhost_set_log_base)(struct vhost_dev *dev, uint64_t base,
+                                  struct vhost_log *log);
 
 typedef struct VhostOps {
     VhostBackendType backend_type;
     vhost_call vhost_call;
     vhost_backend_init vhost_backend_init;
     vhost_backend_cleanup vhost_backend_cleanup;
+    vhost_backend_get_vq_index vhost_backend_get_vq_index;
+    vhost_backend_set_vring_enable vhost_backend_set_vring_enable;
+    vhost_requires_shm_log vhost_requires_shm_log;
+    vhost_set_log_base vhost_set_log_base;
 } VhostOps;
 
 extern const VhostOps user_ops;
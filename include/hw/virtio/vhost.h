@@ -28,6 +28,17 @@ typedef unsigned long vhost_log_chunk_t;
 #define VHOST_LOG_CHUNK (VHOST_LOG_PAGE * VHOST_LOG_BITS)
 #define VHOST_INVALID_FEATURE_BIT   (0xff)
 
+/* The dirty log is shared by all the vhost devices that use the same kind
+ * of memory for it.  Backends that run in another process need it in
+ * shared memory, whose file descriptor is @fd (-1 otherwise).
+ */
+struct vhost_log {
+    unsigned long long size;
+    int refcnt;
+    int fd;
+    vhost_log_chunk_t *log;
+};
+
 struct vhost_memory;
 struct vhost_dev {
     MemoryListener memory_listener;
@@ -41,9 +52,12 @@ struct vhost_dev {
     unsigned long long features;
     unsigned long long acked_features;
     unsigned long long backend_features;
+    /* vhost-user protocol features and number of queue pairs */
+    unsigned long long protocol_features;
+    unsigned long long max_queues;
     bool started;
     bool log_enabled;
-    vhost_log_chunk_t *log;
+    struct vhost_log *log;
     unsigned long long log_size;
     Error *migration_blocker;
     bool force;
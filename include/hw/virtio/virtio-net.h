@@ -16,6 +16,7 @@
 
 #include "standard-headers/linux/virtio_net.h"
 #include "hw/virtio/virtio.h"
+#include "sysemu/iothread.h"
 
 #define TYPE_VIRTIO_NET "virtio-net-device"
 #define VIRTIO_NET(obj) \
@@ -33,13 +34,57 @@
  * and latency. */
 #define TX_BURST 256
 
+/* Number of packets popped from the TX queue and handed to the peer
+ * with a single qemu_sendv_packet_batch_async() call.
+ */
+#define VIRTIO_NET_TX_BATCH 32
+
+/* Room for the rewritten scatter lists of a TX batch when the guest and
+ * host headers differ.  One descriptor chain never needs more than
+ * VIRTQUEUE_MAX_SIZE + 1 entries.
+ */
+#define VIRTIO_NET_TX_SG_MAX (2 * (VIRTQUEUE_MAX_SIZE + 1))
+
 typedef struct virtio_net_conf
 {
     uint32_t txtimer;
     int32_t txburst;
     char *tx;
+    IOThread *iothread;
+    bool rss;
 } virtio_net_conf;
 
+/*
+ * Receive Side Scaling
+ *
+ * With the "rss" property set, QEMU picks the RX queue of each packet from
+ * a Toeplitz hash of its headers instead of using the queue of the peer
+ * it came from.  The driver can replace the default key and indirection
+ * table with the VIRTIO_NET_CTRL_MQ_RSS_CONFIG command, which takes a
+ * struct virtio_net_rss_config as laid out by the virtio specification.
+ */
+#define VIRTIO_NET_CTRL_MQ_RSS_CONFIG          1
+
+#define VIRTIO_NET_RSS_HASH_TYPE_IPv4          (1 << 0)
+#define VIRTIO_NET_RSS_HASH_TYPE_TCPv4         (1 << 1)
+#define VIRTIO_NET_RSS_HASH_TYPE_UDPv4         (1 << 2)
+#define VIRTIO_NET_RSS_HASH_TYPE_IPv6          (1 << 3)
+#define VIRTIO_NET_RSS_HASH_TYPE_TCPv6         (1 << 4)
+#define VIRTIO_NET_RSS_HASH_TYPE_UDPv6         (1 << 5)
+#define VIRTIO_NET_RSS_SUPPORTED_HASHES        0x3f
+
+#define VIRTIO_NET_RSS_MAX_KEY_SIZE            40
+#define VIRTIO_NET_RSS_MAX_TABLE_LEN           128
+
+typedef struct VirtioNetRssData {
+    bool guest_set;             /* false while using the default table */
+    uint32_t hash_types;
+    uint8_t key[VIRTIO_NET_RSS_MAX_KEY_SIZE];
+    uint16_t indirections_len;
+    uint16_t indirections[VIRTIO_NET_RSS_MAX_TABLE_LEN];
+    uint16_t default_queue;
+} VirtioNetRssData;
+
 /* Maximum packet size we can receive from tap device: header + 64k */
 #define VIRTIO_NET_MAX_BUFSIZE (sizeof(struct virtio_net_hdr) + (64 << 10))
 
@@ -50,9 +95,13 @@ typedef struct VirtIONetQueue {
     QEMUBH *tx_bh;
     int tx_waiting;
     struct {
-        VirtQueueElement elem;
-        ssize_t len;
+        VirtQueueElement *elems[VIRTIO_NET_TX_BATCH];
+        unsigned int num;
     } async_tx;
+    struct iovec *tx_sg;
+    bool rx_notify;
+    uint64_t rss_packets;       /* packets steered to this queue */
+    uint64_t rss_drops;         /* ...and dropped for lack of buffers */
     struct VirtIONet *n;
 } VirtIONetQueue;
 
@@ -98,6 +147,10 @@ typedef struct VirtIONet {
     uint64_t curr_guest_offloads;
     QEMUTimer *announce_timer;
     int announce_counter;
+    AioContext *ctx;            /* non-NULL if queues run in an IOThread */
+    bool dataplane_started;
+    bool dataplane_disabled;    /* set if starting the IOThread failed */
+    VirtioNetRssData rss_data;
 } VirtIONet;
 
 /*
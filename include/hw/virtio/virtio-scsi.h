@@ -54,17 +54,31 @@ struct VirtIOSCSIConf {
     char *wwpn;
     uint32_t boot_tpgt;
     IOThread *iothread;
+    char *iothreads;
 };
 
 struct VirtIOSCSI;
 
 typedef struct {
     struct VirtIOSCSI *parent;
+    AioContext *ctx;
+    /* Requests may complete in another IOThread than the one popping them */
+    QemuMutex lock;
     Vring vring;
     EventNotifier host_notifier;
     EventNotifier guest_notifier;
 } VirtIOSCSIVring;
 
+typedef struct {
+    struct VirtIOSCSI *parent;
+    IOThread *iothread;
+    AioContext *ctx;
+    QEMUBH *bh;
+    /* Requests popped by a queue serviced in another IOThread */
+    QemuMutex lock;
+    QTAILQ_HEAD(, VirtIOSCSIReq) reqs;
+} VirtIOSCSIThread;
+
 typedef struct VirtIOSCSICommon {
     VirtIODevice parent_obj;
     VirtIOSCSIConf conf;
@@ -84,7 +98,12 @@ typedef struct VirtIOSCSI {
     bool events_dropped;
 
     /* Fields for dataplane below */
-    AioContext *ctx; /* one iothread per virtio-scsi-pci for now */
+    AioContext *ctx; /* control and event queues, same as threads[0].ctx */
+
+    /* Request queue i runs in threads[i % num_threads], and the devices of
+     * target t live in threads[t % num_threads]. */
+    VirtIOSCSIThread *threads;
+    int num_threads;
 
     /* Vring is used instead of vq in dataplane code, because of the underlying
      * memory layer thread safety */
@@ -102,18 +121,18 @@ typedef struct VirtIOSCSI {
 } VirtIOSCSI;
 
 typedef struct VirtIOSCSIReq {
+    /* Note:
+     * - elem is filled in by virtqueue_pop or vring_pop;
+     * - fields up to resp_iov are initialized by virtio_scsi_init_req;
+     * - fields starting at vring are zeroed by virtio_scsi_init_req.
+     * */
+    VirtQueueElement elem;
+
     VirtIOSCSI *dev;
     VirtQueue *vq;
     QEMUSGList qsgl;
     QEMUIOVector resp_iov;
 
-    /* Note:
-     * - fields before elem are initialized by virtio_scsi_init_req;
-     * - elem is uninitialized at the time of allocation.
-     * - fields after elem are zeroed by virtio_scsi_init_req.
-     * */
-
-    VirtQueueElement elem;
     /* Set by dataplane code. */
     VirtIOSCSIVring *vring;
 
@@ -164,12 +183,14 @@ void virtio_scsi_common_unrealize(DeviceState *dev, Error **errp);
 void virtio_scsi_handle_ctrl_req(VirtIOSCSI *s, VirtIOSCSIReq *req);
 bool virtio_scsi_handle_cmd_req_prepare(VirtIOSCSI *s, VirtIOSCSIReq *req);
 void virtio_scsi_handle_cmd_req_submit(VirtIOSCSI *s, VirtIOSCSIReq *req);
-VirtIOSCSIReq *virtio_scsi_init_req(VirtIOSCSI *s, VirtQueue *vq);
+void virtio_scsi_init_req(VirtIOSCSI *s, VirtQueue *vq, VirtIOSCSIReq *req);
 void virtio_scsi_free_req(VirtIOSCSIReq *req);
 void virtio_scsi_push_event(VirtIOSCSI *s, SCSIDevice *dev,
                             uint32_t event, uint32_t reason);
 
-void virtio_scsi_set_iothread(VirtIOSCSI *s, IOThread *iothread);
+void virtio_scsi_dataplane_init(VirtIOSCSI *s, Error **errp);
+void virtio_scsi_dataplane_cleanup(VirtIOSCSI *s);
+AioContext *virtio_scsi_target_ctx(VirtIOSCSI *s, int target);
 void virtio_scsi_dataplane_start(VirtIOSCSI *s);
 void virtio_scsi_dataplane_stop(VirtIOSCSI *s);
 void virtio_scsi_vring_push_notify(VirtIOSCSIReq *req);
@@ -344,4 +344,10 @@ eth_parse_ipv6_hdr(struct iovec *pkt, int pkt_frags,
                    size_t ip6hdr_off, uint8_t *l4proto,
                    size_t *full_hdr_len);
 
+/* Toeplitz hash of @len bytes of @input, as used for Receive Side Scaling.
+ * @key must be at least @len + 4 bytes long.
+ */
+uint32_t
+eth_toeplitz_hash(const uint8_t *key, const uint8_t *input, size_t len);
+
 #endif
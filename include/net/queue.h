@@ -31,8 +31,19 @@ typedef struct NetQueue NetQueue;
 
 typedef void (NetPacketSent) (NetClientState *sender, ssize_t ret);
 
+/* One packet of a batch passed to qemu_net_queue_send_iov_batch() */
+typedef struct NetPacketIOV {
+    const struct iovec *iov;
+    int iovcnt;
+} NetPacketIOV;
+
 #define QEMU_NET_PACKET_FLAG_NONE  0
 #define QEMU_NET_PACKET_FLAG_RAW  (1<<0)
+/* The packet data stays valid until the sent callback has been called,
+ * so a packet that has to be queued references it instead of copying it.
+ * Only for the iovec send functions, and only together with a callback.
+ */
+#define QEMU_NET_PACKET_FLAG_ZEROCOPY  (1<<1)
 
 NetQueue *qemu_new_net_queue(void *opaque);
 
@@ -52,6 +63,13 @@ ssize_t qemu_net_queue_send_iov(NetQueue *queue,
                                 int iovcnt,
                                 NetPacketSent *sent_cb);
 
+int qemu_net_queue_send_iov_batch(NetQueue *queue,
+                                  NetClientState *sender,
+                                  unsigned flags,
+                                  const NetPacketIOV *pkts,
+                                  int count,
+                                  NetPacketSent *sent_cb);
+
 void qemu_net_queue_purge(NetQueue *queue, NetClientState *from);
 bool qemu_net_queue_flush(NetQueue *queue);
 
@@ -0,0 +1,21 @@
+/*
+ * Anonymous shared memory that can be passed to other processes
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef QEMU_MEMFD_H
+#define QEMU_MEMFD_H
+
+#include <stddef.h>
+
+/* Allocate @size bytes of zeroed memory backed by a file that has no name
+ * in the filesystem, and return it mapped shared.  The file descriptor is
+ * returned in @fd so that it can be sent to another process.  Returns
+ * NULL on failure.
+ */
+void *qemu_memfd_alloc(const char *name, size_t size, int *fd);
+void qemu_memfd_free(void *ptr, size_t size, int fd);
+
+#endif /* QEMU_MEMFD_H */
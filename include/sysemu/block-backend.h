@@ -134,6 +134,9 @@ void blk_lock_medium(BlockBackend *blk, bool locked);
 void blk_eject(BlockBackend *blk, bool eject_flag);
 int blk_get_flags(BlockBackend *blk);
 int blk_get_max_transfer_length(BlockBackend *blk);
+int blk_get_max_discard(BlockBackend *blk);
+int64_t blk_get_write_zeroes_alignment(BlockBackend *blk);
+int blk_get_info(BlockBackend *blk, BlockDriverInfo *bdi);
 void blk_set_guest_block_size(BlockBackend *blk, int align);
 void *blk_blockalign(BlockBackend *blk, size_t size);
 bool blk_op_is_blocked(BlockBackend *blk, BlockOpType op, Error **errp);
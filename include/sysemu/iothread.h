@@ -35,5 +35,6 @@ typedef struct {
 
 char *iothread_get_id(IOThread *iothread);
 AioContext *iothread_get_aio_context(IOThread *iothread);
+IOThread *iothread_find(const char *id);
 
 #endif /* IOTHREAD_H */
@@ -2028,6 +2028,13 @@ void address_space_init(AddressSpace *as, MemoryRegion *root, const char *name)
     flatview_init(as->current_map);
     as->ioeventfd_nb = 0;
     as->ioeventfds = NULL;
+    qemu_mutex_init(&as->bounce_lock);
+    as->max_bounce_buffer_size = DEFAULT_MAX_BOUNCE_BUFFER_SIZE;
+    as->bounce_buffer_size = 0;
+    as->bounce_maps = 0;
+    as->bounce_map_failures = 0;
+    QLIST_INIT(&as->bounce_buffers);
+    QLIST_INIT(&as->map_clients);
     QTAILQ_INSERT_TAIL(&address_spaces, as, address_spaces_link);
     as->name = g_strdup(name ? name : "anonymous");
     address_space_init_dispatch(as);
@@ -2045,6 +2052,8 @@ static void do_address_space_destroy(AddressSpace *as)
         assert(listener->address_space_filter != as);
     }
 
+    qemu_mutex_destroy(&as->bounce_lock);
+
     flatview_unref(as->current_map);
     g_free(as->name);
     g_free(as->ioeventfds);
@@ -2188,6 +2197,14 @@ void mtree_info(fprintf_function mon_printf, void *f)
 
     QTAILQ_FOREACH(as, &address_spaces, address_spaces_link) {
         mon_printf(f, "address-space: %s\n", as->name);
+        qemu_mutex_lock(&as->bounce_lock);
+        if (as->bounce_maps || as->bounce_map_failures) {
+            mon_printf(f, "  bounce buffers: %zu/%zu bytes in use, "
+                       "%" PRIu64 " maps, %" PRIu64 " failed\n",
+                       as->bounce_buffer_size, as->max_bounce_buffer_size,
+                       as->bounce_maps, as->bounce_map_failures);
+        }
+        qemu_mutex_unlock(&as->bounce_lock);
         mtree_print_mr(mon_printf, f, as->root, 1, 0, &ml_head);
         mon_printf(f, "\n");
     }
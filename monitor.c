@@ -67,6 +67,7 @@
 #endif
 #include "exec/memory.h"
 #include "exec/cpu_ldst.h"
+#include "exec/tb-profile.h"
 #include "qmp-commands.h"
 #include "hmp.h"
 #include "qemu/thread.h"
@@ -1040,6 +1041,13 @@ static void hmp_info_jit(Monitor *mon, const QDict *qdict)
     dump_drift_info((FILE *)mon, monitor_fprintf);
 }
 
+static void hmp_info_tb_profile(Monitor *mon, const QDict *qdict)
+{
+    int count = qdict_get_try_int(qdict, "count", 20);
+
+    tb_profile_report((FILE *)mon, monitor_fprintf, count);
+}
+
 static void hmp_info_opcount(Monitor *mon, const QDict *qdict)
 {
     dump_opcount_info((FILE *)mon, monitor_fprintf);
@@ -1142,6 +1150,52 @@ static void hmp_log(Monitor *mon, const QDict *qdict)
     qemu_set_log(mask);
 }
 
+static void hmp_tb_profile(Monitor *mon, const QDict *qdict)
+{
+    const char *option = qdict_get_str(qdict, "option");
+    int64_t period = qdict_get_try_int(qdict, "period", 1000);
+    Error *err = NULL;
+
+    if (!tcg_enabled()) {
+        monitor_printf(mon, "The TB profiler requires TCG\n");
+        return;
+    }
+    if (!strcmp(option, "on")) {
+        tb_profile_start(period, &err);
+    } else if (!strcmp(option, "off")) {
+        tb_profile_stop();
+    } else if (!strcmp(option, "reset")) {
+        tb_profile_reset();
+    } else {
+        monitor_printf(mon, "unexpected option %s\n", option);
+        return;
+    }
+    if (err) {
+        monitor_printf(mon, "%s\n", error_get_pretty(err));
+        error_free(err);
+    }
+}
+
+static void hmp_tb_profile_save(Monitor *mon, const QDict *qdict)
+{
+    bool perfmap = qdict_get_try_bool(qdict, "perfmap", false);
+    const char *filename = qdict_get_try_str(qdict, "filename");
+    Error *err = NULL;
+
+    if (perfmap) {
+        tb_profile_save_perf_map(filename, &err);
+    } else if (filename) {
+        tb_profile_save_folded(filename, &err);
+    } else {
+        monitor_printf(mon, "a filename is required\n");
+        return;
+    }
+    if (err) {
+        monitor_printf(mon, "%s\n", error_get_pretty(err));
+        error_free(err);
+    }
+}
+
 static void hmp_singlestep(Monitor *mon, const QDict *qdict)
 {
     const char *option = qdict_get_try_str(qdict, "option");
@@ -2728,6 +2782,13 @@ static mon_cmd_t info_cmds[] = {
         .help       = "show dynamic compiler info",
         .mhandler.cmd = hmp_info_jit,
     },
+    {
+        .name       = "tb-profile",
+        .args_type  = "count:i?",
+        .params     = "[count]",
+        .help       = "show the translation blocks with the most profiler samples",
+        .mhandler.cmd = hmp_info_tb_profile,
+    },
     {
         .name       = "opcount",
         .args_type  = "",
@@ -0,0 +1,600 @@
+/*
+ * AF_PACKET mmap ring network backend
+ *
+ * Copyright (c) 2015 QEMU contributors
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+/*
+ * Frames are exchanged with the host kernel through two memory-mapped
+ * packet rings, so that no system call is needed per packet:
+ *
+ * - RX uses a TPACKET_V3 ring, where the kernel packs variable-sized
+ *   packets into blocks and hands a whole block over at once.  All the
+ *   packets of a block are passed to the peer in batches.
+ *
+ * - TX uses a TPACKET_V2 ring on a second socket (TPACKET_V3 TX rings
+ *   need a much newer kernel).  Frames are filled in and a single send()
+ *   asks the kernel to transmit everything that is pending.
+ *
+ * The TX socket is bound with ETH_P_ALL, which the kernel uses as the
+ * protocol of the frames it sends, and a filter makes it receive nothing.
+ * Packets that the RX socket sees going out of the interface are skipped.
+ *
+ * The kernel strips the VLAN tag of received frames and may leave their
+ * checksum to be completed, as for a locally sent packet; both are
+ * restored before the frame is passed to the peer.
+ */
+
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <net/if.h>
+#include <linux/filter.h>
+#include <linux/if_ether.h>
+#include <linux/if_packet.h>
+
+#include "net/net.h"
+#include "net/checksum.h"
+#include "clients.h"
+#include "qemu-common.h"
+#include "qemu/bswap.h"
+#include "qemu/error-report.h"
+#include "qemu/iov.h"
+#include "qemu/main-loop.h"
+#include "qemu/sockets.h"
+#include "qemu/atomic.h"
+
+/* Both rings are made of blocks of this size */
+#define AF_PACKET_BLOCK_SIZE        (1 << 17)
+#define AF_PACKET_FRAME_SIZE        2048
+#define AF_PACKET_FRAMES_PER_BLOCK \
+    (AF_PACKET_BLOCK_SIZE / AF_PACKET_FRAME_SIZE)
+#define AF_PACKET_DEFAULT_FRAMES    1024
+
+/* Offset of the packet data in a TX frame, and the largest packet that
+ * fits in one.
+ */
+#define AF_PACKET_TX_DATA_OFFSET \
+    (TPACKET2_HDRLEN - sizeof(struct sockaddr_ll))
+#define AF_PACKET_TX_MAX_LEN \
+    (AF_PACKET_FRAME_SIZE - AF_PACKET_TX_DATA_OFFSET)
+
+/* Milliseconds after which the kernel hands over a partially filled RX
+ * block.  This bounds the latency added by the block-based ring.
+ */
+#define AF_PACKET_RX_TIMEOUT        1
+
+/* Number of packets passed to the peer in one call */
+#define AF_PACKET_RX_BATCH          64
+
+/* A received packet is split around its VLAN tag if it had one */
+#define AF_PACKET_RX_IOV            3
+#define AF_PACKET_VLAN_HLEN         4
+
+typedef struct AFPacketRing {
+    uint8_t *map;
+    size_t size;
+    unsigned int nr;            /* blocks for RX, frames for TX */
+    unsigned int head;
+} AFPacketRing;
+
+typedef struct AFPacketPriv {
+    int rx_fd;
+    int tx_fd;
+    unsigned int mtu;
+    AFPacketRing rx;
+    AFPacketRing tx;
+} AFPacketPriv;
+
+typedef struct AFPacketState {
+    NetClientState nc;
+    AFPacketPriv me;
+    bool read_poll;
+    bool write_poll;
+    struct iovec iov[AF_PACKET_RX_BATCH * AF_PACKET_RX_IOV];
+    uint8_t vlan[AF_PACKET_RX_BATCH][AF_PACKET_VLAN_HLEN];
+    NetPacketIOV pkts[AF_PACKET_RX_BATCH];
+} AFPacketState;
+
+static int af_packet_can_send(void *opaque);
+static void af_packet_send(void *opaque);
+static void af_packet_writable(void *opaque);
+
+static void af_packet_update_fd_handler(AFPacketState *s)
+{
+    qemu_set_fd_handler2(s->me.rx_fd,
+                         s->read_poll ? af_packet_can_send : NULL,
+                         s->read_poll ? af_packet_send : NULL,
+                         NULL,
+                         s);
+    qemu_set_fd_handler(s->me.tx_fd,
+                        NULL,
+                        s->write_poll ? af_packet_writable : NULL,
+                        s);
+}
+
+static void af_packet_read_poll(AFPacketState *s, bool enable)
+{
+    if (s->read_poll != enable) {
+        s->read_poll = enable;
+        af_packet_update_fd_handler(s);
+    }
+}
+
+static void af_packet_write_poll(AFPacketState *s, bool enable)
+{
+    if (s->write_poll != enable) {
+        s->write_poll = enable;
+        af_packet_update_fd_handler(s);
+    }
+}
+
+static void af_packet_poll(NetClientState *nc, bool enable)
+{
+    AFPacketState *s = DO_UPCAST(AFPacketState, nc, nc);
+
+    if (s->read_poll != enable || s->write_poll != enable) {
+        s->read_poll = enable;
+        s->write_poll = enable;
+        af_packet_update_fd_handler(s);
+    }
+}
+
+/* TX (guest --> host) */
+
+static void af_packet_writable(void *opaque)
+{
+    AFPacketState *s = opaque;
+
+    af_packet_write_poll(s, false);
+    qemu_flush_queued_packets(&s->nc);
+}
+
+/* Copy a packet into the next TX frame.  Returns false if the ring is
+ * full; packets that are too large are dropped.
+ */
+static bool af_packet_tx_put(AFPacketState *s, const struct iovec *iov,
+                             int iovcnt)
+{
+    struct tpacket2_hdr *hdr;
+    size_t size = iov_size(iov, iovcnt);
+
+    hdr = (struct tpacket2_hdr *)(s->me.tx.map + s->me.tx.head *
+                                  AF_PACKET_FRAME_SIZE);
+    if (atomic_read(&hdr->tp_status) &
+        (TP_STATUS_SEND_REQUEST | TP_STATUS_SENDING)) {
+        return false;
+    }
+    smp_rmb();
+
+    if (size > AF_PACKET_TX_MAX_LEN) {
+        return true;
+    }
+
+    iov_to_buf(iov, iovcnt, 0, (uint8_t *)hdr + AF_PACKET_TX_DATA_OFFSET,
+               size);
+    hdr->tp_len = size;
+    smp_wmb();
+    atomic_set(&hdr->tp_status, TP_STATUS_SEND_REQUEST);
+
+    s->me.tx.head = (s->me.tx.head + 1) % s->me.tx.nr;
+    return true;
+}
+
+/* Ask the kernel to transmit all pending frames */
+static void af_packet_tx_kick(AFPacketState *s)
+{
+    ssize_t ret;
+
+    do {
+        ret = send(s->me.tx_fd, NULL, 0, MSG_DONTWAIT);
+    } while (ret == -1 && errno == EINTR);
+}
+
+static ssize_t af_packet_receive_iov(NetClientState *nc,
+                                     const struct iovec *iov, int iovcnt)
+{
+    AFPacketState *s = DO_UPCAST(AFPacketState, nc, nc);
+
+    if (!af_packet_tx_put(s, iov, iovcnt)) {
+        af_packet_write_poll(s, true);
+        return 0;
+    }
+    af_packet_tx_kick(s);
+
+    return iov_size(iov, iovcnt);
+}
+
+static ssize_t af_packet_receive(NetClientState *nc,
+                                 const uint8_t *buf, size_t size)
+{
+    struct iovec iov = {
+        .iov_base = (void *)buf,
+        .iov_len = size,
+    };
+
+    return af_packet_receive_iov(nc, &iov, 1);
+}
+
+static int af_packet_receive_batch(NetClientState *nc,
+                                   const NetPacketIOV *pkts, int count)
+{
+    AFPacketState *s = DO_UPCAST(AFPacketState, nc, nc);
+    int i;
+
+    for (i = 0; i < count; i++) {
+        if (!af_packet_tx_put(s, pkts[i].iov, pkts[i].iovcnt)) {
+            af_packet_write_poll(s, true);
+            break;
+        }
+    }
+    if (i) {
+        af_packet_tx_kick(s);
+    }
+
+    return i;
+}
+
+/* RX (host --> guest) */
+
+static int af_packet_can_send(void *opaque)
+{
+    AFPacketState *s = opaque;
+
+    return qemu_can_send_packet(&s->nc);
+}
+
+static void af_packet_send_completed(NetClientState *nc, ssize_t len)
+{
+    AFPacketState *s = DO_UPCAST(AFPacketState, nc, nc);
+
+    af_packet_read_poll(s, true);
+}
+
+/* Returns false if part of the batch had to be queued */
+static bool af_packet_send_batch(AFPacketState *s, int count)
+{
+    return qemu_sendv_packet_batch_async(&s->nc, s->pkts, count,
+                                         af_packet_send_completed) == count;
+}
+
+/* Describe the packet at @hdr in s->pkts[@n].  Returns false if it must
+ * be dropped.
+ */
+static bool af_packet_rx_prepare(AFPacketState *s, struct tpacket3_hdr *hdr,
+                                 int n)
+{
+    uint8_t *data = (uint8_t *)hdr + hdr->tp_mac;
+    uint32_t status = hdr->tp_status;
+    NetPacketIOV *pkt = &s->pkts[n];
+    struct iovec *iov = &s->iov[n * AF_PACKET_RX_IOV];
+    uint16_t tpid = ETH_P_8021Q;
+
+    /* Truncated to the ring frame, or merged by GRO beyond the MTU */
+    if (hdr->tp_snaplen < hdr->tp_len || hdr->tp_len < ETH_HLEN ||
+        hdr->tp_len > s->me.mtu + ETH_HLEN) {
+        return false;
+    }
+
+    if (status & TP_STATUS_CSUMNOTREADY) {
+        net_checksum_calculate(data, hdr->tp_len);
+    }
+
+    if (!(status & TP_STATUS_VLAN_VALID) && !hdr->hv1.tp_vlan_tci) {
+        iov[0].iov_base = data;
+        iov[0].iov_len = hdr->tp_len;
+        pkt->iovcnt = 1;
+        return true;
+    }
+
+#ifdef TP_STATUS_VLAN_TPID_VALID
+    if (status & TP_STATUS_VLAN_TPID_VALID) {
+        tpid = hdr->hv1.tp_vlan_tpid;
+    }
+#endif
+    stw_be_p(s->vlan[n], tpid);
+    stw_be_p(s->vlan[n] + 2, hdr->hv1.tp_vlan_tci);
+
+    iov[0].iov_base = data;
+    iov[0].iov_len = 2 * ETH_ALEN;
+    iov[1].iov_base = s->vlan[n];
+    iov[1].iov_len = AF_PACKET_VLAN_HLEN;
+    iov[2].iov_base = data + 2 * ETH_ALEN;
+    iov[2].iov_len = hdr->tp_len - 2 * ETH_ALEN;
+    pkt->iovcnt = 3;
+    return true;
+}
+
+/* Pass one RX block to the peer.  The block can be returned to the kernel
+ * afterwards even if the peer stalled, because the packets it did not take
+ * have been copied to its queue.
+ */
+static void af_packet_send(void *opaque)
+{
+    AFPacketState *s = opaque;
+    struct tpacket_block_desc *desc;
+    struct tpacket3_hdr *hdr;
+    unsigned int i, num;
+    bool stalled = false;
+    int count = 0;
+
+    desc = (struct tpacket_block_desc *)(s->me.rx.map + s->me.rx.head *
+                                         AF_PACKET_BLOCK_SIZE);
+    if (!(atomic_read(&desc->hdr.bh1.block_status) & TP_STATUS_USER)) {
+        return;
+    }
+    smp_rmb();
+
+    num = desc->hdr.bh1.num_pkts;
+    hdr = (struct tpacket3_hdr *)((uint8_t *)desc +
+                                  desc->hdr.bh1.offset_to_first_pkt);
+    for (i = 0; i < num; i++) {
+        struct sockaddr_ll *sll;
+
+        sll = (struct sockaddr_ll *)((uint8_t *)hdr +
+                                     TPACKET_ALIGN(sizeof(*hdr)));
+        if (sll->sll_pkttype != PACKET_OUTGOING &&
+            af_packet_rx_prepare(s, hdr, count)) {
+            count++;
+        }
+        if (count == AF_PACKET_RX_BATCH) {
+            stalled |= !af_packet_send_batch(s, count);
+            count = 0;
+        }
+        hdr = (struct tpacket3_hdr *)((uint8_t *)hdr + hdr->tp_next_offset);
+    }
+    if (count) {
+        stalled |= !af_packet_send_batch(s, count);
+    }
+
+    smp_mb();
+    atomic_set(&desc->hdr.bh1.block_status, TP_STATUS_KERNEL);
+    s->me.rx.head = (s->me.rx.head + 1) % s->me.rx.nr;
+
+    if (stalled) {
+        /* Resume in af_packet_send_completed() */
+        af_packet_read_poll(s, false);
+    }
+}
+
+static void af_packet_cleanup(NetClientState *nc)
+{
+    AFPacketState *s = DO_UPCAST(AFPacketState, nc, nc);
+
+    qemu_purge_queued_packets(nc);
+
+    af_packet_poll(nc, false);
+    munmap(s->me.rx.map, s->me.rx.size);
+    munmap(s->me.tx.map, s->me.tx.size);
+    close(s->me.rx_fd);
+    close(s->me.tx_fd);
+    s->me.rx_fd = -1;
+    s->me.tx_fd = -1;
+}
+
+static NetClientInfo net_af_packet_info = {
+    .type = NET_CLIENT_OPTIONS_KIND_AF_PACKET,
+    .size = sizeof(AFPacketState),
+    .receive = af_packet_receive,
+    .receive_iov = af_packet_receive_iov,
+    .receive_iov_batch = af_packet_receive_batch,
+    .poll = af_packet_poll,
+    .cleanup = af_packet_cleanup,
+};
+
+/* Set up and map a ring.  @opt is PACKET_RX_RING or PACKET_TX_RING. */
+static int af_packet_map_ring(int fd, int opt, int version,
+                              unsigned int frames, AFPacketRing *ring)
+{
+    unsigned int blocks = frames / AF_PACKET_FRAMES_PER_BLOCK;
+    struct tpacket_req3 req = {
+        .tp_block_size = AF_PACKET_BLOCK_SIZE,
+        .tp_block_nr = blocks,
+        .tp_frame_size = AF_PACKET_FRAME_SIZE,
+        .tp_frame_nr = frames,
+    };
+    socklen_t len = sizeof(struct tpacket_req);
+
+    if (setsockopt(fd, SOL_PACKET, PACKET_VERSION,
+                   &version, sizeof(version)) < 0) {
+        error_report("af-packet: cannot select TPACKET_V%d: %s",
+                     version + 1, strerror(errno));
+        return -1;
+    }
+
+    /* tpacket_req is a prefix of tpacket_req3 */
+    if (version == TPACKET_V3) {
+        req.tp_retire_blk_tov = AF_PACKET_RX_TIMEOUT;
+        len = sizeof(req);
+    }
+    if (setsockopt(fd, SOL_PACKET, opt, &req, len) < 0) {
+        error_report("af-packet: cannot set up %s ring: %s",
+                     opt == PACKET_RX_RING ? "RX" : "TX", strerror(errno));
+        return -1;
+    }
+
+    ring->size = (size_t)blocks * AF_PACKET_BLOCK_SIZE;
+    ring->map = mmap(NULL, ring->size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                     fd, 0);
+    if (ring->map == MAP_FAILED) {
+        error_report("af-packet: cannot map %s ring: %s",
+                     opt == PACKET_RX_RING ? "RX" : "TX", strerror(errno));
+        ring->map = NULL;
+        return -1;
+    }
+    ring->nr = version == TPACKET_V3 ? blocks : frames;
+    ring->head = 0;
+
+    return 0;
+}
+
+static int af_packet_bind(int fd, int ifindex, uint16_t protocol)
+{
+    struct sockaddr_ll sll = {
+        .sll_family = AF_PACKET,
+        .sll_protocol = htons(protocol),
+        .sll_ifindex = ifindex,
+    };
+
+    if (bind(fd, (struct sockaddr *)&sll, sizeof(sll)) < 0) {
+        error_report("af-packet: cannot bind socket: %s", strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Keep @fd from queueing any received packet */
+static int af_packet_drop_all(int fd)
+{
+    struct sock_filter code[] = {
+        BPF_STMT(BPF_RET | BPF_K, 0),
+    };
+    struct sock_fprog prog = {
+        .len = ARRAY_SIZE(code),
+        .filter = code,
+    };
+
+    if (setsockopt(fd, SOL_SOCKET, SO_ATTACH_FILTER,
+                   &prog, sizeof(prog)) < 0) {
+        error_report("af-packet: cannot attach socket filter: %s",
+                     strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+static int af_packet_open(AFPacketPriv *me, const char *ifname,
+                          unsigned int frames)
+{
+    struct packet_mreq mreq = {
+        .mr_type = PACKET_MR_PROMISC,
+    };
+    struct ifreq ifr;
+    int ifindex;
+
+    memset(me, 0, sizeof(*me));
+    me->rx_fd = -1;
+    me->tx_fd = -1;
+
+    ifindex = if_nametoindex(ifname);
+    if (!ifindex) {
+        error_report("af-packet: unknown interface '%s'", ifname);
+        return -1;
+    }
+    mreq.mr_ifindex = ifindex;
+
+    /* Created with protocol 0 so that nothing is queued before the
+     * ring exists.  The binds below set ETH_P_ALL on both sockets, which
+     * starts reception on the RX socket.
+     */
+    me->rx_fd = qemu_socket(AF_PACKET, SOCK_RAW, 0);
+    me->tx_fd = qemu_socket(AF_PACKET, SOCK_RAW, 0);
+    if (me->rx_fd < 0 || me->tx_fd < 0) {
+        error_report("af-packet: cannot create socket: %s", strerror(errno));
+        goto fail;
+    }
+
+    memset(&ifr, 0, sizeof(ifr));
+    pstrcpy(ifr.ifr_name, sizeof(ifr.ifr_name), ifname);
+    if (ioctl(me->rx_fd, SIOCGIFMTU, &ifr) < 0) {
+        error_report("af-packet: cannot get the MTU of '%s': %s",
+                     ifname, strerror(errno));
+        goto fail;
+    }
+    me->mtu = ifr.ifr_mtu;
+
+    if (af_packet_map_ring(me->rx_fd, PACKET_RX_RING, TPACKET_V3,
+                           frames, &me->rx) < 0 ||
+        af_packet_map_ring(me->tx_fd, PACKET_TX_RING, TPACKET_V2,
+                           frames, &me->tx) < 0) {
+        goto fail;
+    }
+
+#ifdef PACKET_QDISC_BYPASS
+    {
+        int one = 1;
+
+        /* Best effort; older kernels do not know about it */
+        setsockopt(me->tx_fd, SOL_PACKET, PACKET_QDISC_BYPASS,
+                   &one, sizeof(one));
+    }
+#endif
+
+    if (setsockopt(me->rx_fd, SOL_PACKET, PACKET_ADD_MEMBERSHIP,
+                   &mreq, sizeof(mreq)) < 0) {
+        error_report("af-packet: cannot enable promiscuous mode on '%s': %s",
+                     ifname, strerror(errno));
+        goto fail;
+    }
+
+    if (af_packet_drop_all(me->tx_fd) < 0 ||
+        af_packet_bind(me->tx_fd, ifindex, ETH_P_ALL) < 0 ||
+        af_packet_bind(me->rx_fd, ifindex, ETH_P_ALL) < 0) {
+        goto fail;
+    }
+
+    qemu_set_nonblock(me->rx_fd);
+    qemu_set_nonblock(me->tx_fd);
+    return 0;
+
+fail:
+    if (me->rx.map) {
+        munmap(me->rx.map, me->rx.size);
+    }
+    if (me->tx.map) {
+        munmap(me->tx.map, me->tx.size);
+    }
+    if (me->rx_fd >= 0) {
+        close(me->rx_fd);
+    }
+    if (me->tx_fd >= 0) {
+        close(me->tx_fd);
+    }
+    return -1;
+}
+
+int net_init_af_packet(const NetClientOptions *opts, const char *name,
+                       NetClientState *peer)
+{
+    const NetdevAFPacketOptions *af_packet = opts->af_packet;
+    unsigned int frames = AF_PACKET_DEFAULT_FRAMES;
+    NetClientState *nc;
+    AFPacketPriv me;
+    AFPacketState *s;
+    int i;
+
+    if (af_packet->has_frames) {
+        frames = af_packet->frames;
+        if (frames == 0 || frames % AF_PACKET_FRAMES_PER_BLOCK ||
+            frames > 65536) {
+            error_report("af-packet: frames must be a multiple of %d "
+                         "between %d and 65536",
+                         AF_PACKET_FRAMES_PER_BLOCK,
+                         AF_PACKET_FRAMES_PER_BLOCK);
+            return -1;
+        }
+    }
+
+    if (af_packet_open(&me, af_packet->ifname, frames) < 0) {
+        return -1;
+    }
+
+    nc = qemu_new_net_client(&net_af_packet_info, peer, "af-packet", name);
+    s = DO_UPCAST(AFPacketState, nc, nc);
+    s->me = me;
+
+    for (i = 0; i < AF_PACKET_RX_BATCH; i++) {
+        s->pkts[i].iov = &s->iov[i * AF_PACKET_RX_IOV];
+    }
+    snprintf(nc->info_str, sizeof(nc->info_str), "ifname=%s,frames=%u",
+             af_packet->ifname, frames);
+
+    af_packet_read_poll(s, true);
+
+    return 0;
+}
@@ -209,9 +209,32 @@ bool eth_parse_ipv6_hdr(struct iovec *pkt, int pkt_frags,
     do {
         bytes_read = iov_to_buf(pkt, pkt_frags, ip6hdr_off + *full_hdr_len,
                                 &ext_hdr, sizeof(ext_hdr));
+        if (bytes_read < sizeof(ext_hdr)) {
+            return false;
+        }
         *full_hdr_len += (ext_hdr.ip6r_len + 1) * IP6_EXT_GRANULARITY;
     } while (eth_is_ip6_extension_header_type(ext_hdr.ip6r_nxt));
 
     *l4proto = ext_hdr.ip6r_nxt;
     return true;
 }
+
+uint32_t
+eth_toeplitz_hash(const uint8_t *key, const uint8_t *input, size_t len)
+{
+    uint32_t window = ldl_be_p(key);
+    uint32_t hash = 0;
+    size_t i;
+    int bit;
+
+    for (i = 0; i < len; i++) {
+        for (bit = 7; bit >= 0; bit--) {
+            if (input[i] & (1 << bit)) {
+                hash ^= window;
+            }
+            window = (window << 1) | ((key[i + 4] >> bit) & 1);
+        }
+    }
+
+    return hash;
+}
@@ -459,6 +459,20 @@ void qemu_set_vnet_hdr_len(NetClientState *nc, int len)
     nc->info->set_vnet_hdr_len(nc, len);
 }
 
+/* Move the backend's file descriptor handlers to @ctx, or back to the main
+ * loop if @ctx is NULL.  Only backends that implement set_aio_context can
+ * be used by a device that runs in an IOThread.
+ */
+void qemu_net_set_aio_context(NetClientState *nc, AioContext *ctx)
+{
+    if (!nc || !nc->info->set_aio_context) {
+        return;
+    }
+
+    nc->info->set_aio_context(nc, ctx);
+    nc->ctx = ctx;
+}
+
 int qemu_can_send_packet(NetClientState *sender)
 {
     int vm_running = runstate_is_running();
@@ -626,6 +640,45 @@ ssize_t qemu_deliver_packet_iov(NetClientState *sender,
     return ret;
 }
 
+/* Returns the number of packets the receiver accepted.  Packets on which
+ * the receiver reported an error count as accepted, as they do for
+ * qemu_deliver_packet_iov().
+ */
+int qemu_deliver_packet_iov_batch(NetClientState *sender,
+                                  unsigned flags,
+                                  const NetPacketIOV *pkts,
+                                  int count,
+                                  void *opaque)
+{
+    NetClientState *nc = opaque;
+    int ret;
+
+    if (nc->link_down) {
+        return count;
+    }
+
+    if (nc->receive_disabled) {
+        return 0;
+    }
+
+    if (!nc->info->receive_iov_batch) {
+        for (ret = 0; ret < count; ret++) {
+            if (qemu_deliver_packet_iov(sender, flags, pkts[ret].iov,
+                                        pkts[ret].iovcnt, opaque) == 0) {
+                break;
+            }
+        }
+        return ret;
+    }
+
+    ret = nc->info->receive_iov_batch(nc, pkts, count);
+    if (ret < count) {
+        nc->receive_disabled = 1;
+    }
+
+    return ret;
+}
+
 ssize_t qemu_sendv_packet_async(NetClientState *sender,
                                 const struct iovec *iov, int iovcnt,
                                 NetPacketSent *sent_cb)
@@ -649,6 +702,52 @@ qemu_sendv_packet(NetClientState *nc, const struct iovec *iov, int iovcnt)
     return qemu_sendv_packet_async(nc, iov, iovcnt, NULL);
 }
 
+/* Send @count packets to the peer in one go.  Returns the number of
+ * packets that were delivered right away.  If that is less than @count,
+ * the remaining packets have been queued and @sent_cb is invoked once the
+ * last of them has left the queue; until then the caller must not send
+ * any more packets.
+ */
+static int qemu_sendv_packet_batch_async_with_flags(NetClientState *sender,
+                                                    unsigned flags,
+                                                    const NetPacketIOV *pkts,
+                                                    int count,
+                                                    NetPacketSent *sent_cb)
+{
+    NetQueue *queue;
+
+    if (sender->link_down || !sender->peer) {
+        return count;
+    }
+
+    queue = sender->peer->incoming_queue;
+
+    return qemu_net_queue_send_iov_batch(queue, sender, flags,
+                                         pkts, count, sent_cb);
+}
+
+int qemu_sendv_packet_batch_async(NetClientState *sender,
+                                  const NetPacketIOV *pkts, int count,
+                                  NetPacketSent *sent_cb)
+{
+    return qemu_sendv_packet_batch_async_with_flags(sender,
+                                                    QEMU_NET_PACKET_FLAG_NONE,
+                                                    pkts, count, sent_cb);
+}
+
+/* Like qemu_sendv_packet_batch_async(), but packets that have to be queued
+ * keep pointing to the caller's buffers, which must stay valid until
+ * @sent_cb has been called.
+ */
+int qemu_sendv_packet_batch_zerocopy(NetClientState *sender,
+                                     const NetPacketIOV *pkts, int count,
+                                     NetPacketSent *sent_cb)
+{
+    return qemu_sendv_packet_batch_async_with_flags(sender,
+                                                QEMU_NET_PACKET_FLAG_ZEROCOPY,
+                                                pkts, count, sent_cb);
+}
+
 NetClientState *qemu_find_netdev(const char *id)
 {
     NetClientState *nc;
@@ -833,6 +932,9 @@ static int (* const net_client_init_fun[NET_CLIENT_OPTIONS_KIND_MAX])(
 #ifdef CONFIG_L2TPV3
         [NET_CLIENT_OPTIONS_KIND_L2TPV3]    = net_init_l2tpv3,
 #endif
+#ifdef CONFIG_AF_PACKET
+        [NET_CLIENT_OPTIONS_KIND_AF_PACKET] = net_init_af_packet,
+#endif
 };
 
 
@@ -871,6 +973,9 @@ static int net_client_init1(const void *object, int is_netdev, Error **errp)
 #endif
 #ifdef CONFIG_L2TPV3
         case NET_CLIENT_OPTIONS_KIND_L2TPV3:
+#endif
+#ifdef CONFIG_AF_PACKET
+        case NET_CLIENT_OPTIONS_KIND_AF_PACKET:
 #endif
             break;
 
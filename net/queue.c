@@ -23,6 +23,7 @@
 
 #include "net/queue.h"
 #include "qemu/queue.h"
+#include "qemu/iov.h"
 #include "net/net.h"
 
 /* The delivery handler may only return zero if it will call
@@ -45,6 +46,8 @@ struct NetPacket {
     unsigned flags;
     int size;
     NetPacketSent *sent_cb;
+    int iovcnt;
+    struct iovec *iov;          /* non-NULL if the data was not copied */
     uint8_t data[0];
 };
 
@@ -104,26 +107,36 @@ static void qemu_net_queue_append(NetQueue *queue,
     packet->flags = flags;
     packet->size = size;
     packet->sent_cb = sent_cb;
+    packet->iov = NULL;
     memcpy(packet->data, buf, size);
 
     queue->nq_count++;
     QTAILQ_INSERT_TAIL(&queue->packets, packet, entry);
 }
 
-static void qemu_net_queue_append_iov(NetQueue *queue,
-                                      NetClientState *sender,
-                                      unsigned flags,
-                                      const struct iovec *iov,
-                                      int iovcnt,
-                                      NetPacketSent *sent_cb)
+static NetPacket *qemu_net_packet_new_iov(NetClientState *sender,
+                                          unsigned flags,
+                                          const struct iovec *iov,
+                                          int iovcnt,
+                                          NetPacketSent *sent_cb)
 {
     NetPacket *packet;
     size_t max_len = 0;
     int i;
 
-    if (queue->nq_count >= queue->nq_maxlen && !sent_cb) {
-        return; /* drop if queue full and no callback */
+    if (flags & QEMU_NET_PACKET_FLAG_ZEROCOPY) {
+        /* Only the scatter list is copied; the sender keeps the data */
+        packet = g_malloc(sizeof(NetPacket) + iovcnt * sizeof(*iov));
+        packet->sender = sender;
+        packet->sent_cb = sent_cb;
+        packet->flags = flags;
+        packet->size = iov_size(iov, iovcnt);
+        packet->iov = (struct iovec *)packet->data;
+        packet->iovcnt = iovcnt;
+        memcpy(packet->iov, iov, iovcnt * sizeof(*iov));
+        return packet;
     }
+
     for (i = 0; i < iovcnt; i++) {
         max_len += iov[i].iov_len;
     }
@@ -133,6 +146,7 @@ static void qemu_net_queue_append_iov(NetQueue *queue,
     packet->sent_cb = sent_cb;
     packet->flags = flags;
     packet->size = 0;
+    packet->iov = NULL;
 
     for (i = 0; i < iovcnt; i++) {
         size_t len = iov[i].iov_len;
@@ -141,10 +155,53 @@ static void qemu_net_queue_append_iov(NetQueue *queue,
         packet->size += len;
     }
 
+    return packet;
+}
+
+static void qemu_net_queue_append_iov(NetQueue *queue,
+                                      NetClientState *sender,
+                                      unsigned flags,
+                                      const struct iovec *iov,
+                                      int iovcnt,
+                                      NetPacketSent *sent_cb)
+{
+    NetPacket *packet;
+
+    if (queue->nq_count >= queue->nq_maxlen && !sent_cb) {
+        return; /* drop if queue full and no callback */
+    }
+    packet = qemu_net_packet_new_iov(sender, flags, iov, iovcnt, sent_cb);
+
     queue->nq_count++;
     QTAILQ_INSERT_TAIL(&queue->packets, packet, entry);
 }
 
+/* Only the last packet of the batch carries the callback, but the sender
+ * waits for all of them, so none may be dropped if there is a callback.
+ * Without one, the packets that do not fit in the queue are dropped.
+ */
+static void qemu_net_queue_append_iov_batch(NetQueue *queue,
+                                            NetClientState *sender,
+                                            unsigned flags,
+                                            const NetPacketIOV *pkts,
+                                            int count,
+                                            NetPacketSent *sent_cb)
+{
+    NetPacket *packet;
+    int i;
+
+    for (i = 0; i < count; i++) {
+        if (queue->nq_count >= queue->nq_maxlen && !sent_cb) {
+            return; /* drop if queue full and no callback */
+        }
+        packet = qemu_net_packet_new_iov(sender, flags,
+                                         pkts[i].iov, pkts[i].iovcnt,
+                                         i == count - 1 ? sent_cb : NULL);
+        queue->nq_count++;
+        QTAILQ_INSERT_TAIL(&queue->packets, packet, entry);
+    }
+}
+
 static ssize_t qemu_net_queue_deliver(NetQueue *queue,
                                       NetClientState *sender,
                                       unsigned flags,
@@ -175,6 +232,22 @@ static ssize_t qemu_net_queue_deliver_iov(NetQueue *queue,
     return ret;
 }
 
+static int qemu_net_queue_deliver_iov_batch(NetQueue *queue,
+                                            NetClientState *sender,
+                                            unsigned flags,
+                                            const NetPacketIOV *pkts,
+                                            int count)
+{
+    int ret;
+
+    queue->delivering = 1;
+    ret = qemu_deliver_packet_iov_batch(sender, flags, pkts, count,
+                                        queue->opaque);
+    queue->delivering = 0;
+
+    return ret;
+}
+
 ssize_t qemu_net_queue_send(NetQueue *queue,
                             NetClientState *sender,
                             unsigned flags,
@@ -209,6 +282,8 @@ ssize_t qemu_net_queue_send_iov(NetQueue *queue,
 {
     ssize_t ret;
 
+    assert(sent_cb || !(flags & QEMU_NET_PACKET_FLAG_ZEROCOPY));
+
     if (queue->delivering || !qemu_can_send_packet(sender)) {
         qemu_net_queue_append_iov(queue, sender, flags, iov, iovcnt, sent_cb);
         return 0;
@@ -225,6 +300,38 @@ ssize_t qemu_net_queue_send_iov(NetQueue *queue,
     return ret;
 }
 
+/* Returns the number of packets delivered; the rest of the batch is
+ * queued and @sent_cb is called when the last packet has been sent.
+ */
+int qemu_net_queue_send_iov_batch(NetQueue *queue,
+                                  NetClientState *sender,
+                                  unsigned flags,
+                                  const NetPacketIOV *pkts,
+                                  int count,
+                                  NetPacketSent *sent_cb)
+{
+    int ret;
+
+    assert(sent_cb || !(flags & QEMU_NET_PACKET_FLAG_ZEROCOPY));
+
+    if (queue->delivering || !qemu_can_send_packet(sender)) {
+        qemu_net_queue_append_iov_batch(queue, sender, flags, pkts, count,
+                                        sent_cb);
+        return 0;
+    }
+
+    ret = qemu_net_queue_deliver_iov_batch(queue, sender, flags, pkts, count);
+    if (ret < count) {
+        qemu_net_queue_append_iov_batch(queue, sender, flags, pkts + ret,
+                                        count - ret, sent_cb);
+        return ret;
+    }
+
+    qemu_net_queue_flush(queue);
+
+    return ret;
+}
+
 void qemu_net_queue_purge(NetQueue *queue, NetClientState *from)
 {
     NetPacket *packet, *next;
@@ -251,11 +358,19 @@ bool qemu_net_queue_flush(NetQueue *queue)
         QTAILQ_REMOVE(&queue->packets, packet, entry);
         queue->nq_count--;
 
-        ret = qemu_net_queue_deliver(queue,
-                                     packet->sender,
-                                     packet->flags,
-                                     packet->data,
-                                     packet->size);
+        if (packet->iov) {
+            ret = qemu_net_queue_deliver_iov(queue,
+                                             packet->sender,
+                                             packet->flags,
+                                             packet->iov,
+                                             packet->iovcnt);
+        } else {
+            ret = qemu_net_queue_deliver(queue,
+                                         packet->sender,
+                                         packet->flags,
+                                         packet->data,
+                                         packet->size);
+        }
         if (ret == 0) {
             queue->nq_count++;
             QTAILQ_INSERT_HEAD(&queue->packets, packet, entry);
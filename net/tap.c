@@ -39,17 +39,23 @@
 #include "sysemu/sysemu.h"
 #include "qemu-common.h"
 #include "qemu/error-report.h"
+#include "block/aio.h"
 
 #include "net/tap.h"
 
 #include "net/vhost_net.h"
 
+/* Number of packets read from the tap device before they are passed
+ * to the peer as one batch
+ */
+#define TAP_RX_BATCH 8
+
 typedef struct TAPState {
     NetClientState nc;
     int fd;
     char down_script[1024];
     char down_script_arg[128];
-    uint8_t buf[NET_BUFSIZE];
+    uint8_t buf[TAP_RX_BATCH][NET_BUFSIZE];
     bool read_poll;
     bool write_poll;
     bool using_vnet_hdr;
@@ -57,6 +63,7 @@ typedef struct TAPState {
     bool enabled;
     VHostNetState *vhost_net;
     unsigned host_vnet_hdr_len;
+    AioContext *ctx;
 } TAPState;
 
 static int launch_script(const char *setup_script, const char *ifname, int fd);
@@ -67,6 +74,13 @@ static void tap_writable(void *opaque);
 
 static void tap_update_fd_handler(TAPState *s)
 {
+    if (s->ctx) {
+        aio_set_fd_handler(s->ctx, s->fd,
+                           s->read_poll && s->enabled ? tap_send : NULL,
+                           s->write_poll && s->enabled ? tap_writable : NULL,
+                           s);
+        return;
+    }
     qemu_set_fd_handler2(s->fd,
                          s->read_poll && s->enabled ? tap_can_send : NULL,
                          s->read_poll && s->enabled ? tap_send     : NULL,
@@ -188,28 +202,54 @@ static void tap_send_completed(NetClientState *nc, ssize_t len)
 static void tap_send(void *opaque)
 {
     TAPState *s = opaque;
-    int size;
+    NetPacketIOV pkts[TAP_RX_BATCH];
+    struct iovec iov[TAP_RX_BATCH];
     int packets = 0;
 
-    while (qemu_can_send_packet(&s->nc)) {
-        uint8_t *buf = s->buf;
+    /* An AioContext has no can_read callback, so in an IOThread always
+     * read a batch.  What the peer cannot take is queued, and reading
+     * stops until tap_send_completed() runs.  Nothing may be read while
+     * the VM is stopped: drop the read handler, it is installed again
+     * when the backend moves back to the main loop.
+     */
+    if (s->ctx && !runstate_is_running()) {
+        aio_set_fd_handler(s->ctx, s->fd, NULL,
+                           s->write_poll && s->enabled ? tap_writable : NULL,
+                           s);
+        return;
+    }
 
-        size = tap_read_packet(s->fd, s->buf, sizeof(s->buf));
-        if (size <= 0) {
-            break;
-        }
+    while (s->ctx || qemu_can_send_packet(&s->nc)) {
+        int count, sent;
+
+        for (count = 0; count < TAP_RX_BATCH; count++) {
+            uint8_t *buf = s->buf[count];
+            int size;
+
+            size = tap_read_packet(s->fd, buf, NET_BUFSIZE);
+            if (size <= 0) {
+                break;
+            }
 
-        if (s->host_vnet_hdr_len && !s->using_vnet_hdr) {
-            buf  += s->host_vnet_hdr_len;
-            size -= s->host_vnet_hdr_len;
+            if (s->host_vnet_hdr_len && !s->using_vnet_hdr) {
+                buf  += s->host_vnet_hdr_len;
+                size -= s->host_vnet_hdr_len;
+            }
+
+            iov[count].iov_base = buf;
+            iov[count].iov_len = size;
+            pkts[count].iov = &iov[count];
+            pkts[count].iovcnt = 1;
+        }
+        if (count == 0) {
+            break;
         }
 
-        size = qemu_send_packet_async(&s->nc, buf, size, tap_send_completed);
-        if (size == 0) {
+        sent = qemu_sendv_packet_batch_async(&s->nc, pkts, count,
+                                             tap_send_completed);
+        if (sent < count) {
             tap_read_poll(s, false);
             break;
-        } else if (size < 0) {
-            break;
         }
 
         /*
@@ -218,8 +258,8 @@ static void tap_send(void *opaque)
          * packets that are processed per tap_send() callback to prevent
          * stalling the guest.
          */
-        packets++;
-        if (packets >= 50) {
+        packets += count;
+        if (count < TAP_RX_BATCH || packets >= 50) {
             break;
         }
     }
@@ -312,6 +352,26 @@ static void tap_poll(NetClientState *nc, bool enable)
     tap_write_poll(s, enable);
 }
 
+static void tap_set_aio_context(NetClientState *nc, AioContext *ctx)
+{
+    TAPState *s = DO_UPCAST(TAPState, nc, nc);
+    bool read_poll = s->read_poll;
+    bool write_poll = s->write_poll;
+
+    assert(nc->info->type == NET_CLIENT_OPTIONS_KIND_TAP);
+
+    if (s->ctx == ctx) {
+        return;
+    }
+
+    tap_read_poll(s, false);
+    tap_write_poll(s, false);
+    s->ctx = ctx;
+    s->read_poll = read_poll;
+    s->write_poll = write_poll;
+    tap_update_fd_handler(s);
+}
+
 int tap_get_fd(NetClientState *nc)
 {
     TAPState *s = DO_UPCAST(TAPState, nc, nc);
@@ -335,6 +395,7 @@ static NetClientInfo net_tap_info = {
     .using_vnet_hdr = tap_using_vnet_hdr,
     .set_offload = tap_set_offload,
     .set_vnet_hdr_len = tap_set_vnet_hdr_len,
+    .set_aio_context = tap_set_aio_context,
 };
 
 static TAPState *net_tap_fd_init(NetClientState *peer,
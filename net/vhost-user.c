@@ -14,11 +14,14 @@
 #include "sysemu/char.h"
 #include "qemu/config-file.h"
 #include "qemu/error-report.h"
+#include "qmp-commands.h"
 
 typedef struct VhostUserState {
     NetClientState nc;
     CharDriverState *chr;
     VHostNetState *vhost_net;
+    /* Features the guest acked, kept across reconnections of the slave */
+    unsigned acked_features;
 } VhostUserState;
 
 typedef struct VhostUserChardevProps {
@@ -39,38 +42,77 @@ static int vhost_user_running(VhostUserState *s)
     return (s->vhost_net) ? 1 : 0;
 }
 
-static int vhost_user_start(VhostUserState *s)
+static void vhost_user_stop(int queues, NetClientState *ncs[])
 {
-    VhostNetOptions options;
+    VhostUserState *s;
+    int i;
 
-    if (vhost_user_running(s)) {
-        return 0;
-    }
+    for (i = 0; i < queues; i++) {
+        assert(ncs[i]->info->type == NET_CLIENT_OPTIONS_KIND_VHOST_USER);
 
-    options.backend_type = VHOST_BACKEND_TYPE_USER;
-    options.net_backend = &s->nc;
-    options.opaque = s->chr;
-    options.force = true;
-
-    s->vhost_net = vhost_net_init(&options);
+        s = DO_UPCAST(VhostUserState, nc, ncs[i]);
+        if (vhost_user_running(s)) {
+            s->acked_features = vhost_net_get_acked_features(s->vhost_net);
+            vhost_net_cleanup(s->vhost_net);
+        }
 
-    return vhost_user_running(s) ? 0 : -1;
+        s->vhost_net = 0;
+    }
 }
 
-static void vhost_user_stop(VhostUserState *s)
+static int vhost_user_start(int queues, NetClientState *ncs[])
 {
-    if (vhost_user_running(s)) {
-        vhost_net_cleanup(s->vhost_net);
+    VhostNetOptions options;
+    VhostUserState *s;
+    int i;
+
+    options.backend_type = VHOST_BACKEND_TYPE_USER;
+    options.force = true;
+
+    for (i = 0; i < queues; i++) {
+        assert(ncs[i]->info->type == NET_CLIENT_OPTIONS_KIND_VHOST_USER);
+
+        s = DO_UPCAST(VhostUserState, nc, ncs[i]);
+        if (vhost_user_running(s)) {
+            continue;
+        }
+
+        options.net_backend = ncs[i];
+        options.opaque = s->chr;
+        s->vhost_net = vhost_net_init(&options);
+        if (!s->vhost_net) {
+            error_report("failed to init vhost_net for queue %d", i);
+            goto err;
+        }
+
+        /* After a reconnection, restore what the guest negotiated */
+        if (s->acked_features) {
+            vhost_net_ack_features(s->vhost_net, s->acked_features);
+        }
+
+        if (i == 0 && queues > vhost_net_get_max_queues(s->vhost_net)) {
+            error_report("vhost-user backend supports only %" PRIu64
+                         " queues, %d requested",
+                         vhost_net_get_max_queues(s->vhost_net), queues);
+            goto err;
+        }
     }
 
-    s->vhost_net = 0;
+    return 0;
+
+err:
+    vhost_user_stop(i + 1, ncs);
+    return -1;
 }
 
 static void vhost_user_cleanup(NetClientState *nc)
 {
     VhostUserState *s = DO_UPCAST(VhostUserState, nc, nc);
 
-    vhost_user_stop(s);
+    if (vhost_user_running(s)) {
+        vhost_net_cleanup(s->vhost_net);
+        s->vhost_net = 0;
+    }
     qemu_purge_queued_packets(nc);
 }
 
@@ -96,58 +138,74 @@ static NetClientInfo net_vhost_user_info = {
         .has_ufo = vhost_user_has_ufo,
 };
 
-static void net_vhost_link_down(VhostUserState *s, bool link_down)
-{
-    s->nc.link_down = link_down;
-
-    if (s->nc.peer) {
-        s->nc.peer->link_down = link_down;
-    }
-
-    if (s->nc.info->link_status_changed) {
-        s->nc.info->link_status_changed(&s->nc);
-    }
-
-    if (s->nc.peer && s->nc.peer->info->link_status_changed) {
-        s->nc.peer->info->link_status_changed(s->nc.peer);
-    }
-}
-
+/* All the queues of the netdev share the chardev.  When the slave goes
+ * away, taking the link down stops vhost in the frontend, which saves the
+ * ring positions; when it comes back, vhost is restarted from them.
+ */
 static void net_vhost_user_event(void *opaque, int event)
 {
     VhostUserState *s = opaque;
+    const char *name = s->nc.name;
+    NetClientState *ncs[MAX_QUEUE_NUM];
+    Error *err = NULL;
+    int queues;
+
+    queues = qemu_find_net_clients_except(name, ncs,
+                                          NET_CLIENT_OPTIONS_KIND_NIC,
+                                          MAX_QUEUE_NUM);
+    assert(queues > 0);
 
     switch (event) {
     case CHR_EVENT_OPENED:
-        vhost_user_start(s);
-        net_vhost_link_down(s, false);
+        if (vhost_user_start(queues, ncs) < 0) {
+            error_report("chardev \"%s\" went up, but vhost-user could not"
+                         " be started", s->chr->label);
+            break;
+        }
+        qmp_set_link(name, true, &err);
         error_report("chardev \"%s\" went up", s->chr->label);
         break;
     case CHR_EVENT_CLOSED:
-        net_vhost_link_down(s, true);
-        vhost_user_stop(s);
+        qmp_set_link(name, false, &err);
+        vhost_user_stop(queues, ncs);
         error_report("chardev \"%s\" went down", s->chr->label);
         break;
     }
+
+    if (err) {
+        error_report_err(err);
+    }
 }
 
 static int net_vhost_user_init(NetClientState *peer, const char *device,
-                               const char *name, CharDriverState *chr)
+                               const char *name, CharDriverState *chr,
+                               int queues)
 {
-    NetClientState *nc;
+    NetClientState *nc, *nc0 = NULL;
     VhostUserState *s;
+    int i;
+
+    for (i = 0; i < queues; i++) {
+        nc = qemu_new_net_client(&net_vhost_user_info, peer, device, name);
 
-    nc = qemu_new_net_client(&net_vhost_user_info, peer, device, name);
+        snprintf(nc->info_str, sizeof(nc->info_str), "vhost-user%d to %s",
+                 i, chr->label);
 
-    snprintf(nc->info_str, sizeof(nc->info_str), "vhost-user to %s",
-             chr->label);
+        /* The queue pair of the frontend that this client drives */
+        nc->queue_index = i;
 
-    s = DO_UPCAST(VhostUserState, nc, nc);
+        s = DO_UPCAST(VhostUserState, nc, nc);
 
-    /* We don't provide a receive callback */
-    s->nc.receive_disabled = 1;
-    s->chr = chr;
+        /* We don't provide a receive callback */
+        s->nc.receive_disabled = 1;
+        s->chr = chr;
 
+        if (!nc0) {
+            nc0 = nc;
+        }
+    }
+
+    s = DO_UPCAST(VhostUserState, nc, nc0);
     qemu_chr_add_handlers(s->chr, NULL, NULL, net_vhost_user_event, s);
 
     return 0;
@@ -164,6 +222,8 @@ static int net_vhost_chardev_opts(const char *name, const char *value,
         props->is_unix = true;
     } else if (strcmp(name, "server") == 0) {
         props->is_server = true;
+    } else if (strcmp(name, "reconnect") == 0) {
+        /* the slave may be restarted, see net_vhost_user_event */
     } else {
         error_report("vhost-user does not support a chardev"
                      " with the following option:\n %s = %s",
@@ -227,10 +287,20 @@ int net_init_vhost_user(const NetClientOptions *opts, const char *name,
 {
     const NetdevVhostUserOptions *vhost_user_opts;
     CharDriverState *chr;
+    int queues;
 
     assert(opts->kind == NET_CLIENT_OPTIONS_KIND_VHOST_USER);
     vhost_user_opts = opts->vhost_user;
 
+    if (vhost_user_opts->has_queues &&
+        (vhost_user_opts->queues < 1 ||
+         vhost_user_opts->queues > MAX_QUEUE_NUM)) {
+        error_report("vhost-user: queues must be between 1 and %d",
+                     MAX_QUEUE_NUM);
+        return -1;
+    }
+    queues = vhost_user_opts->has_queues ? vhost_user_opts->queues : 1;
+
     chr = net_vhost_parse_chardev(vhost_user_opts);
     if (!chr) {
         error_report("No suitable chardev found");
@@ -244,5 +314,5 @@ int net_init_vhost_user(const NetClientOptions *opts, const char *name,
     }
 
 
-    return net_vhost_user_init(peer, "vhost_user", name, chr);
+    return net_vhost_user_init(peer, "vhost_user", name, chr, queues);
 }
@@ -667,12 +667,13 @@ ETEXI
 
 DEF("fsdev", HAS_ARG, QEMU_OPTION_fsdev,
     "-fsdev fsdriver,id=id[,path=path,][security_model={mapped-xattr|mapped-file|passthrough|none}]\n"
-    " [,writeout=immediate][,readonly][,socket=socket|sock_fd=sock_fd]\n",
+    " [,writeout=immediate][,readonly][,socket=socket|sock_fd=sock_fd]\n"
+    " [,cache={none|timeout|strict}][,cache_timeout=msecs]\n",
     QEMU_ARCH_ALL)
 
 STEXI
 
-@item -fsdev @var{fsdriver},id=@var{id},path=@var{path},[security_model=@var{security_model}][,writeout=@var{writeout}][,readonly][,socket=@var{socket}|sock_fd=@var{sock_fd}]
+@item -fsdev @var{fsdriver},id=@var{id},path=@var{path},[security_model=@var{security_model}][,writeout=@var{writeout}][,readonly][,socket=@var{socket}|sock_fd=@var{sock_fd}][,cache=@var{cache}][,cache_timeout=@var{msecs}]
 @findex -fsdev
 Define a new file system device. Valid options are:
 @table @option
@@ -713,6 +714,14 @@ with virtfs-proxy-helper
 Enables proxy filesystem driver to use passed socket descriptor for
 communicating with virtfs-proxy-helper. Usually a helper like libvirt
 will create socketpair and pass one of the fds as sock_fd
+@item cache=@var{cache}
+Caches file attributes and failed lookups of the "local" fsdriver. "none"
+(the default) disables the cache. With "timeout", cached attributes are
+used for up to @var{cache_timeout} milliseconds (1000 by default), so
+changes made on the host outside QEMU may take that long to be seen by
+the guest. "strict" keeps attributes until the guest changes the file,
+and must only be used when nothing else modifies the exported directory.
+The other fsdrivers do not accept this option.
 @end table
 
 -fsdev option is used along with -device driver "virtio-9p-pci".
@@ -729,12 +738,13 @@ ETEXI
 
 DEF("virtfs", HAS_ARG, QEMU_OPTION_virtfs,
     "-virtfs local,path=path,mount_tag=tag,security_model=[mapped-xattr|mapped-file|passthrough|none]\n"
-    "        [,writeout=immediate][,readonly][,socket=socket|sock_fd=sock_fd]\n",
+    "        [,writeout=immediate][,readonly][,socket=socket|sock_fd=sock_fd]\n"
+    "        [,cache={none|timeout|strict}][,cache_timeout=msecs]\n",
     QEMU_ARCH_ALL)
 
 STEXI
 
-@item -virtfs @var{fsdriver}[,path=@var{path}],mount_tag=@var{mount_tag}[,security_model=@var{security_model}][,writeout=@var{writeout}][,readonly][,socket=@var{socket}|sock_fd=@var{sock_fd}]
+@item -virtfs @var{fsdriver}[,path=@var{path}],mount_tag=@var{mount_tag}[,security_model=@var{security_model}][,writeout=@var{writeout}][,readonly][,socket=@var{socket}|sock_fd=@var{sock_fd}][,cache=@var{cache}][,cache_timeout=@var{msecs}]
 @findex -virtfs
 
 The general form of a Virtual File system pass-through options are:
@@ -776,6 +786,14 @@ will create socketpair and pass one of the fds as sock_fd
 @item sock_fd
 Enables proxy filesystem driver to use passed 'sock_fd' as the socket
 descriptor for interfacing with virtfs-proxy-helper
+@item cache=@var{cache}
+Caches file attributes and failed lookups of the "local" fsdriver. "none"
+(the default) disables the cache. With "timeout", cached attributes are
+used for up to @var{cache_timeout} milliseconds (1000 by default), so
+changes made on the host outside QEMU may take that long to be seen by
+the guest. "strict" keeps attributes until the guest changes the file,
+and must only be used when nothing else modifies the exported directory.
+The other fsdrivers do not accept this option.
 @end table
 ETEXI
 
@@ -1533,6 +1551,11 @@ DEF("net", HAS_ARG, QEMU_OPTION_net,
     "                attach to the existing netmap-enabled network interface 'name', or to a\n"
     "                VALE port (created on the fly) called 'name' ('nmname' is name of the \n"
     "                netmap device, defaults to '/dev/netmap')\n"
+#endif
+#ifdef CONFIG_AF_PACKET
+    "-net af-packet[,vlan=n][,name=str],ifname=name[,frames=n]\n"
+    "                attach to the host network interface 'name' through\n"
+    "                memory-mapped AF_PACKET rings of 'n' frames each\n"
 #endif
     "-net dump[,vlan=n][,file=f][,len=n]\n"
     "                dump traffic on vlan 'n' to file 'f' (max n bytes per packet)\n"
@@ -1550,6 +1573,9 @@ DEF("netdev", HAS_ARG, QEMU_OPTION_netdev,
 #endif
 #ifdef CONFIG_NETMAP
     "netmap|"
+#endif
+#ifdef CONFIG_AF_PACKET
+    "af-packet|"
 #endif
     "vhost-user|"
     "socket|"
@@ -1942,13 +1968,34 @@ The hubport netdev lets you connect a NIC to a QEMU "vlan" instead of a single
 netdev.  @code{-net} and @code{-device} with parameter @option{vlan} create the
 required hub automatically.
 
-@item -netdev vhost-user,chardev=@var{id}[,vhostforce=on|off]
+@item -netdev af-packet,id=@var{id},ifname=@var{name}[,frames=@var{n}]
+@item -net af-packet[,vlan=@var{n}][,name=@var{name}],ifname=@var{name}[,frames=@var{n}]
+Connect VLAN @var{n} to the host network interface @var{name} through a pair
+of memory-mapped AF_PACKET rings, without a system call per packet.  The
+interface is put in promiscuous mode, and QEMU needs the CAP_NET_RAW
+capability.  Each ring has @var{n} frames of 2048 bytes (1024 by default),
+which must be a multiple of 64.  Checksum and segmentation offloads are not
+available, so frames longer than the ring frames are dropped.  This option is
+only available on Linux hosts.
+
+Example:
+@example
+qemu-system-x86_64 linux.img -netdev af-packet,id=net0,ifname=eth1 \
+                   -device virtio-net-pci,netdev=net0
+@end example
+
+@item -netdev vhost-user,chardev=@var{id}[,vhostforce=on|off][,queues=n]
 
 Establish a vhost-user netdev, backed by a chardev @var{id}. The chardev should
 be a unix domain socket backed one. The vhost-user uses a specifically defined
 protocol to pass vhost ioctl replacement messages to an application on the other
 end of the socket. On non-MSIX guests, the feature can be forced with
-@var{vhostforce}.
+@var{vhostforce}. Use 'queues=@var{n}' to specify the number of queue pairs to
+be created for multiqueue vhost-user.
+
+If the application on the other end of the socket exits, the link goes down
+until it connects again (or, with a client chardev using @option{reconnect},
+until QEMU reconnects to it); the rings are then resumed where they stopped.
 
 Example:
 @example
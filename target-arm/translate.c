@@ -88,6 +88,7 @@ void arm_translate_init(void)
     int i;
 
     cpu_env = tcg_global_reg_new_ptr(TCG_AREG0, "env");
+    tcg_ctx.tcg_env = cpu_env;
 
     for (i = 0; i < 16; i++) {
         cpu_R[i] = tcg_global_mem_new_i32(TCG_AREG0,
@@ -5164,6 +5165,47 @@ static int disas_neon_data_insn(DisasContext *s, uint32_t insn)
             tcg_temp_free_i32(tmp3);
             return 0;
         }
+        if (op == NEON_3R_VADD_VSUB) {
+            /* Lane-wise on the whole register, see tcg_gen_vec_add.  */
+            if (u) {
+                tcg_gen_vec_sub(size, cpu_env, vfp_reg_offset(1, rd),
+                                vfp_reg_offset(1, rn), vfp_reg_offset(1, rm),
+                                q ? 16 : 8);
+            } else {
+                tcg_gen_vec_add(size, cpu_env, vfp_reg_offset(1, rd),
+                                vfp_reg_offset(1, rn), vfp_reg_offset(1, rm),
+                                q ? 16 : 8);
+            }
+            return 0;
+        }
+        if (op == NEON_3R_LOGIC && !u && size != 3) {
+            /* VAND, VBIC, VORR */
+            switch (size) {
+            case 0:
+                tcg_gen_vec_and(cpu_env, vfp_reg_offset(1, rd),
+                                vfp_reg_offset(1, rn), vfp_reg_offset(1, rm),
+                                q ? 16 : 8);
+                break;
+            case 1:
+                tcg_gen_vec_andc(cpu_env, vfp_reg_offset(1, rd),
+                                 vfp_reg_offset(1, rn), vfp_reg_offset(1, rm),
+                                 q ? 16 : 8);
+                break;
+            case 2:
+                tcg_gen_vec_or(cpu_env, vfp_reg_offset(1, rd),
+                               vfp_reg_offset(1, rn), vfp_reg_offset(1, rm),
+                               q ? 16 : 8);
+                break;
+            }
+            return 0;
+        }
+        if (op == NEON_3R_LOGIC && u && size == 0) {
+            /* VEOR */
+            tcg_gen_vec_xor(cpu_env, vfp_reg_offset(1, rd),
+                            vfp_reg_offset(1, rn), vfp_reg_offset(1, rm),
+                            q ? 16 : 8);
+            return 0;
+        }
         if (size == 3 && op != NEON_3R_LOGIC) {
             /* 64-bit element instructions. */
             for (pass = 0; pass < (q ? 2 : 1); pass++) {
@@ -7425,10 +7467,68 @@ static void gen_clrex(DisasContext *s)
     tcg_gen_movi_i64(cpu_exclusive_addr, -1);
 }
 
+/* Store exclusive of a byte, halfword or word, done as an atomic
+   compare-and-swap against the value read by the load exclusive:
+   if (env->exclusive_addr == addr && env->exclusive_val == [addr]) {
+       [addr] = {Rt};
+       {Rd} = 0;
+   } else {
+       {Rd} = 1;
+   } */
+static void gen_store_exclusive_cmpxchg(DisasContext *s, int rd, int rt,
+                                        TCGv_i32 addr, int size)
+{
+    TCGv_i32 cmp, val, old;
+    TCGv_i64 extaddr;
+    TCGv taddr;
+    TCGLabel *done_label;
+    TCGLabel *fail_label;
+
+    fail_label = gen_new_label();
+    done_label = gen_new_label();
+    extaddr = tcg_temp_new_i64();
+    tcg_gen_extu_i32_i64(extaddr, addr);
+    tcg_gen_brcond_i64(TCG_COND_NE, extaddr, cpu_exclusive_addr, fail_label);
+    tcg_temp_free_i64(extaddr);
+
+#ifdef CONFIG_USER_ONLY
+    /* A fault in the helper cannot be traced back to this insn.  */
+    gen_set_pc_im(s, s->pc - 4);
+#endif
+    taddr = tcg_temp_new();
+#if TARGET_LONG_BITS == 32
+    tcg_gen_mov_i32(taddr, addr);
+#else
+    tcg_gen_extu_i32_i64(taddr, addr);
+#endif
+    cmp = tcg_temp_new_i32();
+    tcg_gen_trunc_i64_i32(cmp, cpu_exclusive_val);
+    val = load_reg(s, rt);
+    old = tcg_temp_new_i32();
+    tcg_gen_atomic_cmpxchg_i32(old, taddr, cmp, val, get_mem_index(s),
+                               size | MO_TE);
+    tcg_gen_setcond_i32(TCG_COND_NE, cpu_R[rd], old, cmp);
+    tcg_temp_free_i32(old);
+    tcg_temp_free_i32(val);
+    tcg_temp_free_i32(cmp);
+    tcg_temp_free(taddr);
+    tcg_gen_br(done_label);
+    gen_set_label(fail_label);
+    tcg_gen_movi_i32(cpu_R[rd], 1);
+    gen_set_label(done_label);
+    tcg_gen_movi_i64(cpu_exclusive_addr, -1);
+}
+
 #ifdef CONFIG_USER_ONLY
 static void gen_store_exclusive(DisasContext *s, int rd, int rt, int rt2,
                                 TCGv_i32 addr, int size)
 {
+    /* Doubleword accesses, and accesses in an IT block (whose state
+       could not be restored on a fault), stop the other CPUs instead.  */
+    if (size < 3 && !s->condexec_mask) {
+        gen_store_exclusive_cmpxchg(s, rd, rt, addr, size);
+        return;
+    }
     tcg_gen_extu_i32_i64(cpu_exclusive_test, addr);
     tcg_gen_movi_i32(cpu_exclusive_info,
                      size | (rd << 4) | (rt << 8) | (rt2 << 12));
@@ -7443,8 +7543,13 @@ static void gen_store_exclusive(DisasContext *s, int rd, int rt, int rt2,
     TCGLabel *done_label;
     TCGLabel *fail_label;
 
+    if (size < 3) {
+        gen_store_exclusive_cmpxchg(s, rd, rt, addr, size);
+        return;
+    }
+
     /* if (env->exclusive_addr == addr && env->exclusive_val == [addr]) {
-         [addr] = {Rt};
+         [addr] = {Rt, Rt2};
          {Rd} = 0;
        } else {
          {Rd} = 1;
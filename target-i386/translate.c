@@ -2973,6 +2973,47 @@ static const struct SSEOpHelper_eppi sse_op_table7[256] = {
     [0xdf] = AESNI_OP(aeskeygenassist),
 };
 
+/* Expand the integer lane-wise MMX/SSE operations inline instead of
+   calling the helper from sse_op_table1.  Return false if B is not one
+   of them.  */
+static bool gen_sse_vec_op(int b, int op1_offset, int op2_offset, int oprsz)
+{
+    switch (b) {
+    case 0xfc: /* paddb */
+    case 0xfd: /* paddw */
+    case 0xfe: /* paddl */
+        tcg_gen_vec_add(b - 0xfc, cpu_env, op1_offset, op1_offset,
+                        op2_offset, oprsz);
+        break;
+    case 0xd4: /* paddq */
+        tcg_gen_vec_add(MO_64, cpu_env, op1_offset, op1_offset,
+                        op2_offset, oprsz);
+        break;
+    case 0xf8: /* psubb */
+    case 0xf9: /* psubw */
+    case 0xfa: /* psubl */
+    case 0xfb: /* psubq */
+        tcg_gen_vec_sub(b - 0xf8, cpu_env, op1_offset, op1_offset,
+                        op2_offset, oprsz);
+        break;
+    case 0xdb: /* pand */
+        tcg_gen_vec_and(cpu_env, op1_offset, op1_offset, op2_offset, oprsz);
+        break;
+    case 0xdf: /* pandn */
+        tcg_gen_vec_andc(cpu_env, op1_offset, op2_offset, op1_offset, oprsz);
+        break;
+    case 0xeb: /* por */
+        tcg_gen_vec_or(cpu_env, op1_offset, op1_offset, op2_offset, oprsz);
+        break;
+    case 0xef: /* pxor */
+        tcg_gen_vec_xor(cpu_env, op1_offset, op1_offset, op2_offset, oprsz);
+        break;
+    default:
+        return false;
+    }
+    return true;
+}
+
 static void gen_sse(CPUX86State *env, DisasContext *s, int b,
                     target_ulong pc_start, int rex_r)
 {
@@ -4389,6 +4430,9 @@ static void gen_sse(CPUX86State *env, DisasContext *s, int b,
             sse_fn_eppt(cpu_env, cpu_ptr0, cpu_ptr1, cpu_A0);
             break;
         default:
+            if (gen_sse_vec_op(b, op1_offset, op2_offset, is_xmm ? 16 : 8)) {
+                break;
+            }
             tcg_gen_addi_ptr(cpu_ptr0, cpu_env, op1_offset);
             tcg_gen_addi_ptr(cpu_ptr1, cpu_env, op2_offset);
             sse_fn_epp(cpu_env, cpu_ptr0, cpu_ptr1);
@@ -4400,6 +4444,17 @@ static void gen_sse(CPUX86State *env, DisasContext *s, int b,
     }
 }
 
+/* In user mode the atomic helpers access guest memory directly, and a
+   fault there cannot be traced back to the guest instruction: save the
+   CPU state beforehand.  */
+static inline void gen_atomic_prepare(DisasContext *s, target_ulong pc_start)
+{
+#ifdef CONFIG_USER_ONLY
+    gen_update_cc_op(s);
+    gen_jmp_im(pc_start - s->cs_base);
+#endif
+}
+
 /* convert one instruction. s->is_jmp is set if the translation must
    be stopped. Return the next pc value */
 static target_ulong disas_insn(CPUX86State *env, DisasContext *s,
@@ -5138,10 +5193,11 @@ static target_ulong disas_insn(CPUX86State *env, DisasContext *s,
             gen_op_mov_reg_v(ot, rm, cpu_T[0]);
         } else {
             gen_lea_modrm(env, s, modrm);
+            gen_atomic_prepare(s, pc_start);
             gen_op_mov_v_reg(ot, cpu_T[0], reg);
-            gen_op_ld_v(s, ot, cpu_T[1], cpu_A0);
+            tcg_gen_atomic_fetch_add_tl(cpu_T[1], cpu_A0, cpu_T[0],
+                                        s->mem_index, ot | MO_LE);
             tcg_gen_add_tl(cpu_T[0], cpu_T[0], cpu_T[1]);
-            gen_op_st_v(s, ot, cpu_T[0], cpu_A0);
             gen_op_mov_reg_v(ot, reg, cpu_T[1]);
         }
         gen_op_update2_cc();
@@ -5162,37 +5218,32 @@ static target_ulong disas_insn(CPUX86State *env, DisasContext *s,
             t2 = tcg_temp_local_new();
             a0 = tcg_temp_local_new();
             gen_op_mov_v_reg(ot, t1, reg);
-            if (mod == 3) {
-                rm = (modrm & 7) | REX_B(s);
-                gen_op_mov_v_reg(ot, t0, rm);
-            } else {
-                gen_lea_modrm(env, s, modrm);
-                tcg_gen_mov_tl(a0, cpu_A0);
-                gen_op_ld_v(s, ot, t0, a0);
-                rm = 0; /* avoid warning */
-            }
-            label1 = gen_new_label();
             tcg_gen_mov_tl(t2, cpu_regs[R_EAX]);
-            gen_extu(ot, t0);
             gen_extu(ot, t2);
-            tcg_gen_brcond_tl(TCG_COND_EQ, t2, t0, label1);
-            label2 = gen_new_label();
+            label1 = gen_new_label();
             if (mod == 3) {
+                rm = (modrm & 7) | REX_B(s);
+                gen_op_mov_v_reg(ot, t0, rm);
+                gen_extu(ot, t0);
+                tcg_gen_brcond_tl(TCG_COND_EQ, t2, t0, label1);
+                label2 = gen_new_label();
                 gen_op_mov_reg_v(ot, R_EAX, t0);
                 tcg_gen_br(label2);
                 gen_set_label(label1);
                 gen_op_mov_reg_v(ot, rm, t1);
+                gen_set_label(label2);
             } else {
-                /* perform no-op store cycle like physical cpu; must be
-                   before changing accumulator to ensure idempotency if
-                   the store faults and the instruction is restarted */
-                gen_op_st_v(s, ot, t0, a0);
+                /* the helper performs the store cycle even if the
+                   comparison fails, like a physical cpu */
+                gen_lea_modrm(env, s, modrm);
+                gen_atomic_prepare(s, pc_start);
+                tcg_gen_mov_tl(a0, cpu_A0);
+                tcg_gen_atomic_cmpxchg_tl(t0, a0, t2, t1, s->mem_index,
+                                          ot | MO_LE);
+                tcg_gen_brcond_tl(TCG_COND_EQ, t2, t0, label1);
                 gen_op_mov_reg_v(ot, R_EAX, t0);
-                tcg_gen_br(label2);
                 gen_set_label(label1);
-                gen_op_st_v(s, ot, t1, a0);
             }
-            gen_set_label(label2);
             tcg_gen_mov_tl(cpu_cc_src, t0);
             tcg_gen_mov_tl(cpu_cc_srcT, t2);
             tcg_gen_sub_tl(cpu_cc_dst, t2, t0);
@@ -5567,11 +5618,13 @@ static target_ulong disas_insn(CPUX86State *env, DisasContext *s,
         } else {
             gen_lea_modrm(env, s, modrm);
             gen_op_mov_v_reg(ot, cpu_T[0], reg);
-            /* for xchg, lock is implicit */
+            /* for xchg, lock is implicit; the lock still serializes
+               against the other LOCK-prefixed instructions */
             if (!(prefixes & PREFIX_LOCK))
                 gen_helper_lock();
-            gen_op_ld_v(s, ot, cpu_T[1], cpu_A0);
-            gen_op_st_v(s, ot, cpu_T[0], cpu_A0);
+            gen_atomic_prepare(s, pc_start);
+            tcg_gen_atomic_xchg_tl(cpu_T[1], cpu_A0, cpu_T[0],
+                                   s->mem_index, ot | MO_LE);
             if (!(prefixes & PREFIX_LOCK))
                 gen_helper_unlock();
             gen_op_mov_reg_v(ot, reg, cpu_T[1]);
@@ -7885,6 +7938,7 @@ void optimize_flags_init(void)
     int i;
 
     cpu_env = tcg_global_reg_new_ptr(TCG_AREG0, "env");
+    tcg_ctx.tcg_env = cpu_env;
     cpu_cc_op = tcg_global_mem_new_i32(TCG_AREG0,
                                        offsetof(CPUX86State, cc_op), "cc_op");
     cpu_cc_dst = tcg_global_mem_new(TCG_AREG0, offsetof(CPUX86State, cc_dst),
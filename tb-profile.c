@@ -0,0 +1,335 @@
+/*
+ * Sampling profiler for translated code
+ *
+ * Copyright (c) 2015 QEMU contributors
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * While the profiler is active every TB is translated with CF_PROFILE,
+ * which makes its prologue store the TB pointer in CPUState::profile_tb.
+ * A sampler thread wakes up every period and charges one sample to the
+ * TB each vCPU is executing, so time spent in helpers called from a TB
+ * is attributed to that TB.  Samples are aggregated by guest PC, which
+ * keeps them meaningful across tb_flush().
+ *
+ * When the profiler is off, TBs are translated without the store and the
+ * only remaining cost is one flag test per translation.
+ */
+
+#include "qemu-common.h"
+#include "cpu.h"
+#include "disas/disas.h"
+#include "tcg.h"
+#include "qemu/thread.h"
+#include "qemu/atomic.h"
+#include "exec/tb-profile.h"
+
+typedef struct TBProfileEntry {
+    uint64_t pc;
+    uint64_t samples;
+} TBProfileEntry;
+
+bool tb_profile_enabled;
+
+static QemuThread tb_profile_thread;
+static QemuMutex tb_profile_lock;
+static bool tb_profile_lock_inited;
+static bool tb_profile_stopping;
+static int64_t tb_profile_period_us;
+
+/* Protected by tb_profile_lock */
+static GHashTable *tb_profile_table;
+static uint64_t tb_profile_total;
+static uint64_t tb_profile_outside;
+static uint64_t tb_profile_idle;
+
+static void tb_profile_account(target_ulong pc)
+{
+    TBProfileEntry *e;
+    uint64_t key = pc;
+
+    e = g_hash_table_lookup(tb_profile_table, &key);
+    if (!e) {
+        e = g_new0(TBProfileEntry, 1);
+        e->pc = pc;
+        g_hash_table_insert(tb_profile_table, &e->pc, e);
+    }
+    e->samples++;
+}
+
+static void tb_profile_sample(void)
+{
+    CPUState *cpu;
+    TranslationBlock *tb;
+
+    CPU_FOREACH(cpu) {
+        if (!cpu->created) {
+            continue;
+        }
+        tb_profile_total++;
+        /* current_tb is only non-NULL while cpu_exec() runs translated
+         * code; profile_tb is the exact TB within a chain of linked TBs.
+         * Both may be stale by the time we read them, but the TB array
+         * is never freed so the worst case is a misattributed sample.
+         */
+        tb = atomic_read(&cpu->current_tb);
+        if (!tb) {
+            if (cpu->halted) {
+                tb_profile_idle++;
+            } else {
+                tb_profile_outside++;
+            }
+            continue;
+        }
+        tb = atomic_read(&cpu->profile_tb) ?: tb;
+        tb_profile_account(tb->pc);
+    }
+}
+
+static void *tb_profile_thread_fn(void *opaque)
+{
+    while (!atomic_read(&tb_profile_stopping)) {
+        g_usleep(tb_profile_period_us);
+        qemu_mutex_lock(&tb_profile_lock);
+        tb_profile_sample();
+        qemu_mutex_unlock(&tb_profile_lock);
+    }
+    return NULL;
+}
+
+static void tb_profile_init(void)
+{
+    if (tb_profile_lock_inited) {
+        return;
+    }
+    qemu_mutex_init(&tb_profile_lock);
+    tb_profile_table = g_hash_table_new_full(g_int64_hash, g_int64_equal,
+                                             NULL, g_free);
+    tb_profile_lock_inited = true;
+}
+
+/* Must be called with the vCPUs outside of cpu_exec(), e.g. from the
+ * monitor with the iothread lock held.
+ */
+void tb_profile_start(int64_t period_us, Error **errp)
+{
+    CPUState *cpu;
+
+    if (tb_profile_enabled) {
+        error_setg(errp, "TB profiler is already running");
+        return;
+    }
+    if (period_us <= 0) {
+        error_setg(errp, "Invalid sampling period %" PRId64, period_us);
+        return;
+    }
+    tb_profile_init();
+    tb_profile_period_us = period_us;
+
+    /* Retranslate everything so that the TBs record themselves */
+    CPU_FOREACH(cpu) {
+        cpu->profile_tb = NULL;
+    }
+    tb_profile_enabled = true;
+    if (first_cpu) {
+        tb_flush(first_cpu->env_ptr);
+    }
+
+    atomic_set(&tb_profile_stopping, false);
+    qemu_thread_create(&tb_profile_thread, "tb-profile", tb_profile_thread_fn,
+                       NULL, QEMU_THREAD_JOINABLE);
+}
+
+void tb_profile_stop(void)
+{
+    CPUState *cpu;
+
+    if (!tb_profile_enabled) {
+        return;
+    }
+    atomic_set(&tb_profile_stopping, true);
+    qemu_thread_join(&tb_profile_thread);
+
+    tb_profile_enabled = false;
+    if (first_cpu) {
+        tb_flush(first_cpu->env_ptr);
+    }
+    CPU_FOREACH(cpu) {
+        cpu->profile_tb = NULL;
+    }
+}
+
+void tb_profile_reset(void)
+{
+    if (!tb_profile_lock_inited) {
+        return;
+    }
+    qemu_mutex_lock(&tb_profile_lock);
+    g_hash_table_remove_all(tb_profile_table);
+    tb_profile_total = 0;
+    tb_profile_outside = 0;
+    tb_profile_idle = 0;
+    qemu_mutex_unlock(&tb_profile_lock);
+}
+
+static gint tb_profile_cmp(gconstpointer a, gconstpointer b)
+{
+    const TBProfileEntry *ea = a;
+    const TBProfileEntry *eb = b;
+
+    if (ea->samples != eb->samples) {
+        return ea->samples < eb->samples ? 1 : -1;
+    }
+    return ea->pc < eb->pc ? -1 : ea->pc > eb->pc;
+}
+
+/* Return the entries sorted by decreasing sample count.  The caller
+ * must hold tb_profile_lock and free the list with g_list_free().
+ */
+static GList *tb_profile_sorted(void)
+{
+    return g_list_sort(g_hash_table_get_values(tb_profile_table),
+                       tb_profile_cmp);
+}
+
+static const char *tb_profile_symbol(uint64_t pc)
+{
+    const char *sym = lookup_symbol(pc);
+
+    return sym[0] ? sym : NULL;
+}
+
+void tb_profile_report(FILE *f, fprintf_function cpu_fprintf, int max_entries)
+{
+    GList *list, *l;
+    double total;
+    int n = 0;
+
+    if (!tb_profile_lock_inited) {
+        cpu_fprintf(f, "TB profiler has not been started\n");
+        return;
+    }
+    qemu_mutex_lock(&tb_profile_lock);
+    total = tb_profile_total ? tb_profile_total : 1;
+    cpu_fprintf(f, "TB profiler %s, period %" PRId64 " us\n",
+                tb_profile_enabled ? "running" : "stopped",
+                tb_profile_period_us);
+    cpu_fprintf(f, "samples             %" PRIu64 "\n", tb_profile_total);
+    cpu_fprintf(f, "  translated code   %" PRIu64 " (%0.1f%%)\n",
+                tb_profile_total - tb_profile_outside - tb_profile_idle,
+                (tb_profile_total - tb_profile_outside - tb_profile_idle)
+                * 100 / total);
+    cpu_fprintf(f, "  outside TBs       %" PRIu64 " (%0.1f%%)\n",
+                tb_profile_outside, tb_profile_outside * 100 / total);
+    cpu_fprintf(f, "  idle              %" PRIu64 " (%0.1f%%)\n",
+                tb_profile_idle, tb_profile_idle * 100 / total);
+
+    list = tb_profile_sorted();
+    cpu_fprintf(f, "\n%-18s %10s %6s %10s  %s\n",
+                "guest PC", "samples", "%", "time (ms)", "symbol");
+    for (l = list; l && n < max_entries; l = l->next, n++) {
+        TBProfileEntry *e = l->data;
+        const char *sym = tb_profile_symbol(e->pc);
+
+        cpu_fprintf(f, "0x%016" PRIx64 " %10" PRIu64 " %6.2f %10.1f  %s\n",
+                    e->pc, e->samples, e->samples * 100 / total,
+                    (double)e->samples * tb_profile_period_us / 1000,
+                    sym ? sym : "");
+    }
+    g_list_free(list);
+    qemu_mutex_unlock(&tb_profile_lock);
+}
+
+/* Write the samples in the "folded stacks" format understood by
+ * flamegraph.pl: one "frame;frame count" line per guest PC, grouped
+ * under the guest symbol when one is known.
+ */
+void tb_profile_save_folded(const char *filename, Error **errp)
+{
+    GList *list, *l;
+    FILE *f;
+
+    if (!tb_profile_lock_inited) {
+        error_setg(errp, "TB profiler has not been started");
+        return;
+    }
+    f = fopen(filename, "w");
+    if (!f) {
+        error_setg_file_open(errp, errno, filename);
+        return;
+    }
+
+    qemu_mutex_lock(&tb_profile_lock);
+    list = tb_profile_sorted();
+    for (l = list; l; l = l->next) {
+        TBProfileEntry *e = l->data;
+        const char *sym = tb_profile_symbol(e->pc);
+
+        if (sym) {
+            fprintf(f, "guest;%s;0x%" PRIx64 " %" PRIu64 "\n",
+                    sym, e->pc, e->samples);
+        } else {
+            fprintf(f, "guest;0x%" PRIx64 " %" PRIu64 "\n",
+                    e->pc, e->samples);
+        }
+    }
+    if (tb_profile_outside) {
+        fprintf(f, "qemu %" PRIu64 "\n", tb_profile_outside);
+    }
+    if (tb_profile_idle) {
+        fprintf(f, "idle %" PRIu64 "\n", tb_profile_idle);
+    }
+    g_list_free(list);
+    qemu_mutex_unlock(&tb_profile_lock);
+
+    fclose(f);
+}
+
+/* Write a perf map (see tools/perf/Documentation/jit-interface.txt in
+ * Linux) describing the host code of every live TB, so that a host-side
+ * "perf report" can resolve samples in the code buffer to guest code.
+ * Must be called with the vCPUs outside of cpu_exec().
+ */
+void tb_profile_save_perf_map(const char *filename, Error **errp)
+{
+    char *path;
+    FILE *f;
+    int i;
+
+    path = filename ? g_strdup(filename)
+                    : g_strdup_printf("/tmp/perf-%d.map", getpid());
+    f = fopen(path, "w");
+    if (!f) {
+        error_setg_file_open(errp, errno, path);
+        g_free(path);
+        return;
+    }
+
+    for (i = 0; i < tcg_ctx.tb_ctx.nb_tbs; i++) {
+        TranslationBlock *tb = &tcg_ctx.tb_ctx.tbs[i];
+        void *end = i + 1 < tcg_ctx.tb_ctx.nb_tbs
+                    ? tcg_ctx.tb_ctx.tbs[i + 1].tc_ptr
+                    : tcg_ctx.code_gen_ptr;
+        const char *sym = tb_profile_symbol(tb->pc);
+
+        fprintf(f, "%" PRIxPTR " %tx guest:0x" TARGET_FMT_lx "%s%s\n",
+                (uintptr_t)tb->tc_ptr, (uint8_t *)end - (uint8_t *)tb->tc_ptr,
+                tb->pc, sym ? " " : "", sym ? sym : "");
+    }
+
+    fclose(f);
+    g_free(path);
+}
@@ -124,6 +124,16 @@ static int target_parse_constraint(TCGArgConstraint *ct,
         tcg_regset_reset_reg(ct->u.regs, TCG_REG_X3);
 #endif
         break;
+    case 'a': /* atomic operations: address, data_reg */
+        ct->ct |= TCG_CT_REG;
+        tcg_regset_set32(ct->u.regs, 0, (1ULL << TCG_TARGET_NB_REGS) - 1);
+        /* x0 to x3 are scratch registers of the exclusive load/store
+           loop, and the first helper arguments of the slow path.  */
+        tcg_regset_reset_reg(ct->u.regs, TCG_REG_X0);
+        tcg_regset_reset_reg(ct->u.regs, TCG_REG_X1);
+        tcg_regset_reset_reg(ct->u.regs, TCG_REG_X2);
+        tcg_regset_reset_reg(ct->u.regs, TCG_REG_X3);
+        break;
     case 'A': /* Valid for arithmetic immediate (positive or negative).  */
         ct->ct |= TCG_CT_CONST_AIMM;
         break;
@@ -261,6 +271,10 @@ typedef enum {
     I3207_BLR       = 0xd63f0000,
     I3207_RET       = 0xd65f0000,
 
+    /* Load/store exclusive, with acquire and release semantics.  */
+    I3306_LDAXR     = 0x085ffc00,
+    I3306_STLXR     = 0x0800fc00,
+
     /* Load/store register.  Described here as 3.3.12, but the helper
        that emits them can transform to 3.3.10 or 3.3.13.  */
     I3312_STRB      = 0x38000000 | LDST_ST << 22 | MO_8 << 30,
@@ -359,6 +373,13 @@ typedef enum {
     I3510_EOR       = 0x4a000000,
     I3510_EON       = 0x4a200000,
     I3510_ANDS      = 0x6a000000,
+
+    /* Logical shifted register instructions (with a shift).  */
+    I3502S_AND_LSR  = I3510_AND | (1 << 22),
+
+    /* System instructions.  */
+    DMB_ISH         = 0xd5033bbf,
+    CLREX           = 0xd503305f,
 } AArch64Insn;
 
 static inline uint32_t tcg_in32(TCGContext *s)
@@ -393,6 +414,12 @@ static void tcg_out_insn_3207(TCGContext *s, AArch64Insn insn, TCGReg rn)
     tcg_out32(s, insn | rn << 5);
 }
 
+static void tcg_out_insn_3306(TCGContext *s, AArch64Insn insn, TCGMemOp size,
+                              TCGReg rs, TCGReg rt, TCGReg rn)
+{
+    tcg_out32(s, insn | size << 30 | rs << 16 | rn << 5 | rt);
+}
+
 static void tcg_out_insn_3314(TCGContext *s, AArch64Insn insn,
                               TCGReg r1, TCGReg r2, TCGReg rn,
                               tcg_target_long ofs, bool pre, bool w)
@@ -1031,6 +1058,27 @@ static void tcg_out_qemu_st_slow_path(TCGContext *s, TCGLabelQemuLdst *lb)
     tcg_out_goto(s, lb->raddr);
 }
 
+static void tcg_out_atomic_slow_path(TCGContext *s, TCGLabelQemuLdst *lb)
+{
+    TCGReg val_arg = TCG_REG_X2;
+
+    reloc_pc19(lb->label_ptr[0], s->code_ptr);
+
+    tcg_out_mov(s, TCG_TYPE_PTR, TCG_REG_X0, TCG_AREG0);
+    tcg_out_mov(s, TARGET_LONG_BITS == 64, TCG_REG_X1, lb->addrlo_reg);
+    if (lb->opc == INDEX_op_atomic_cmpxchg_i32
+        || lb->opc == INDEX_op_atomic_cmpxchg_i64) {
+        tcg_out_mov(s, lb->type, TCG_REG_X2, lb->cmpv_reg);
+        val_arg = TCG_REG_X3;
+    }
+    tcg_out_mov(s, lb->type, val_arg, lb->val_reg);
+    tcg_out_movi(s, TCG_TYPE_I32, val_arg + 1, lb->oi);
+    tcg_out_adr(s, val_arg + 2, lb->raddr);
+    tcg_out_call(s, atomic_slow_path_helper(lb->opc));
+    tcg_out_mov(s, lb->type, lb->datalo_reg, TCG_REG_X0);
+    tcg_out_goto(s, lb->raddr);
+}
+
 static void add_qemu_ldst_label(TCGContext *s, bool is_ld, TCGMemOpIdx oi,
                                 TCGType ext, TCGReg data_reg, TCGReg addr_reg,
                                 tcg_insn_unit *raddr, tcg_insn_unit *label_ptr)
@@ -1054,6 +1102,33 @@ static void tcg_out_tlb_read(TCGContext *s, TCGReg addr_reg, TCGMemOp s_bits,
                              tcg_insn_unit **label_ptr, int mem_index,
                              bool is_read)
 {
+#ifdef CPU_TLB_DYN
+    int tlb_offset = is_read ?
+        offsetof(CPUTLBEntry, addr_read)
+        : offsetof(CPUTLBEntry, addr_write);
+
+    /* Load the size mask and the address of the TLB for this MMU mode.
+       X0 = env->tlb_mask[mem_index], X2 = env->tlb_table[mem_index] */
+    tcg_out_ld(s, TCG_TYPE_I64, TCG_REG_X0, TCG_AREG0,
+               offsetof(CPUArchState, tlb_mask[mem_index]));
+    tcg_out_ld(s, TCG_TYPE_I64, TCG_REG_X2, TCG_AREG0,
+               offsetof(CPUArchState, tlb_table[mem_index]));
+
+    /* Extract the TLB entry offset from the address into X0.
+       X0 = X0 & (addr_reg >> (TARGET_PAGE_BITS - CPU_TLB_ENTRY_BITS)) */
+    tcg_out_insn(s, 3502S, AND_LSR, TARGET_LONG_BITS == 64, TCG_REG_X0,
+                 TCG_REG_X0, addr_reg, TARGET_PAGE_BITS - CPU_TLB_ENTRY_BITS);
+
+    /* Store the page mask part of the address and the low s_bits into X3.
+       Later this allows checking for equality and alignment at the same time.
+       X3 = addr_reg & (PAGE_MASK | ((1 << s_bits) - 1)) */
+    tcg_out_logicali(s, I3404_ANDI, TARGET_LONG_BITS == 64, TCG_REG_X3,
+                     addr_reg, TARGET_PAGE_MASK | ((1 << s_bits) - 1));
+
+    /* X2 = X2 + X0, the address of the TLB entry */
+    tcg_out_insn(s, 3502, ADD, TCG_TYPE_I64, TCG_REG_X2, TCG_REG_X2,
+                 TCG_REG_X0);
+#else
     TCGReg base = TCG_AREG0;
     int tlb_offset = is_read ?
         offsetof(CPUArchState, tlb_table[mem_index][0].addr_read)
@@ -1084,6 +1159,7 @@ static void tcg_out_tlb_read(TCGContext *s, TCGReg addr_reg, TCGMemOp s_bits,
        X2 = X2 + (X0 << CPU_TLB_ENTRY_BITS) */
     tcg_out_insn(s, 3502S, ADD_LSL, TCG_TYPE_I64, TCG_REG_X2, base,
                  TCG_REG_X0, CPU_TLB_ENTRY_BITS);
+#endif
 
     /* Merge "low bits" from tlb offset, load the tlb comparator into X0.
        X0 = load [X2 + (tlb_offset & 0x000fff)] */
@@ -1235,6 +1311,80 @@ static void tcg_out_qemu_st(TCGContext *s, TCGReg data_reg, TCGReg addr_reg,
 #endif /* CONFIG_SOFTMMU */
 }
 
+/* Atomic operations are a loop of LDAXR and STLXR on the host address,
+   followed by a full barrier like the GCC __sync builtins.  The fast path
+   checks the TLB entry for writing only.  */
+static void tcg_out_atomic(TCGContext *s, TCGOpcode opc, TCGType ext,
+                           const TCGArg *args)
+{
+    bool is_cmpxchg = (opc == INDEX_op_atomic_cmpxchg_i32
+                       || opc == INDEX_op_atomic_cmpxchg_i64);
+    TCGReg data_reg = args[0];
+    TCGReg addr_reg = args[1];
+    TCGReg cmpv_reg = is_cmpxchg ? args[2] : TCG_REG_XZR;
+    TCGReg val_reg = args[is_cmpxchg ? 3 : 2];
+    TCGMemOpIdx oi = args[is_cmpxchg ? 4 : 3];
+    TCGMemOp s_bits = get_memop(oi) & MO_SIZE;
+    TCGReg haddr = TCG_REG_X1;
+    TCGReg new_reg = val_reg;
+    tcg_insn_unit *loop, *done = NULL;
+#ifdef CONFIG_SOFTMMU
+    tcg_insn_unit *label_ptr;
+    TCGLabelQemuLdst *label;
+
+    tcg_out_tlb_read(s, addr_reg, s_bits, &label_ptr, get_mmuidx(oi), 0);
+    /* X1 = addr_reg + addend */
+    tcg_out_insn(s, 3502, ADD, TCG_TYPE_I64, haddr, TCG_REG_X1, addr_reg);
+#else /* !CONFIG_SOFTMMU */
+    if (GUEST_BASE) {
+        tcg_out_insn(s, 3502, ADD, TCG_TYPE_I64, haddr,
+                     TCG_REG_GUEST_BASE, addr_reg);
+    } else {
+        haddr = addr_reg;
+    }
+#endif /* CONFIG_SOFTMMU */
+
+    /* X0 = old value, X2 = new value for fetch-add, X3 = store status */
+    loop = s->code_ptr;
+    tcg_out_insn(s, 3306, LDAXR, s_bits, TCG_REG_XZR, TCG_REG_X0, haddr);
+    if (is_cmpxchg) {
+        tcg_out_cmp(s, s_bits == MO_64, TCG_REG_X0, cmpv_reg, 0);
+        done = s->code_ptr;
+        tcg_out_goto_cond_noaddr(s, TCG_COND_NE);
+    } else if (opc == INDEX_op_atomic_add_i32
+               || opc == INDEX_op_atomic_add_i64) {
+        tcg_out_insn(s, 3502, ADD, s_bits == MO_64, TCG_REG_X2,
+                     TCG_REG_X0, val_reg);
+        new_reg = TCG_REG_X2;
+    }
+    tcg_out_insn(s, 3306, STLXR, s_bits, TCG_REG_X3, new_reg, haddr);
+    tcg_out_insn(s, 3201, CBNZ, TCG_TYPE_I32, TCG_REG_X3, loop - s->code_ptr);
+    if (done) {
+        /* A failed compare skips the STLXR; clear the exclusive monitor
+           that the LDAXR left armed.  */
+        reloc_pc19(done, s->code_ptr);
+        tcg_out32(s, CLREX);
+    }
+    tcg_out32(s, DMB_ISH);
+
+    /* LDAXR zero-extends the old value.  */
+    tcg_out_mov(s, ext, data_reg, TCG_REG_X0);
+
+#ifdef CONFIG_SOFTMMU
+    label = new_ldst_label(s);
+    label->is_atomic = true;
+    label->opc = opc;
+    label->oi = oi;
+    label->type = ext;
+    label->datalo_reg = data_reg;
+    label->cmpv_reg = cmpv_reg;
+    label->val_reg = val_reg;
+    label->addrlo_reg = addr_reg;
+    label->raddr = s->code_ptr;
+    label->label_ptr[0] = label_ptr;
+#endif
+}
+
 static tcg_insn_unit *tb_ret_addr;
 
 static void tcg_out_op(TCGContext *s, TCGOpcode opc,
@@ -1527,6 +1677,15 @@ static void tcg_out_op(TCGContext *s, TCGOpcode opc,
         tcg_out_qemu_st(s, REG0(0), a1, a2);
         break;
 
+    case INDEX_op_atomic_cmpxchg_i32:
+    case INDEX_op_atomic_cmpxchg_i64:
+    case INDEX_op_atomic_xchg_i32:
+    case INDEX_op_atomic_xchg_i64:
+    case INDEX_op_atomic_add_i32:
+    case INDEX_op_atomic_add_i64:
+        tcg_out_atomic(s, opc, ext, args);
+        break;
+
     case INDEX_op_bswap64_i64:
         tcg_out_rev64(s, a0, a1);
         break;
@@ -1686,6 +1845,13 @@ static const TCGTargetOpDef aarch64_op_defs[] = {
     { INDEX_op_qemu_st_i32, { "lZ", "l" } },
     { INDEX_op_qemu_st_i64, { "lZ", "l" } },
 
+    { INDEX_op_atomic_cmpxchg_i32, { "a", "a", "a", "a" } },
+    { INDEX_op_atomic_xchg_i32, { "a", "a", "a" } },
+    { INDEX_op_atomic_add_i32, { "a", "a", "a" } },
+    { INDEX_op_atomic_cmpxchg_i64, { "a", "a", "a", "a" } },
+    { INDEX_op_atomic_xchg_i64, { "a", "a", "a" } },
+    { INDEX_op_atomic_add_i64, { "a", "a", "a" } },
+
     { INDEX_op_bswap16_i32, { "r", "r" } },
     { INDEX_op_bswap32_i32, { "r", "r" } },
     { INDEX_op_bswap16_i64, { "r", "r" } },
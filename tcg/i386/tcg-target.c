@@ -310,6 +310,8 @@ static inline int tcg_target_const_match(tcg_target_long val, TCGType type,
 #define OPC_CALL_Jz	(0xe8)
 #define OPC_CMOVCC      (0x40 | P_EXT)  /* ... plus condition code */
 #define OPC_CMP_GvEv	(OPC_ARITH_GvEv | (ARITH_CMP << 3))
+#define OPC_CMPXCHGB_EvGv (0xb0 | P_EXT)
+#define OPC_CMPXCHG_EvGv (0xb1 | P_EXT)
 #define OPC_DEC_r32	(0x48)
 #define OPC_IMUL_GvEv	(0xaf | P_EXT)
 #define OPC_IMUL_GvEvIb	(0x6b)
@@ -346,8 +348,14 @@ static inline int tcg_target_const_match(tcg_target_long val, TCGType type,
 #define OPC_SHLX        (0xf7 | P_EXT38 | P_DATA16)
 #define OPC_SHRX        (0xf7 | P_EXT38 | P_SIMDF2)
 #define OPC_TESTL	(0x85)
+#define OPC_XADDB_EvGv  (0xc0 | P_EXT)
+#define OPC_XADD_EvGv   (0xc1 | P_EXT)
+#define OPC_XCHGB_EvGv  (0x86)
+#define OPC_XCHG_EvGv   (0x87)
 #define OPC_XCHG_ax_r32	(0x90)
 
+#define OPC_LOCK_PREFIX (0xf0)
+
 #define OPC_GRP3_Ev	(0xf7)
 #define OPC_GRP5	(0xff)
 
@@ -1200,15 +1208,23 @@ static inline void tcg_out_tlb_load(TCGContext *s, TCGReg addrlo, TCGReg addrhi,
 
     tgen_arithi(s, ARITH_AND + trexw, r1,
                 TARGET_PAGE_MASK | ((1 << s_bits) - 1), 0);
+#ifdef CPU_TLB_DYN
+    /* and tlb_mask(env), r0; add tlb_table(env), r0 */
+    tcg_out_modrm_offset(s, OPC_ARITH_GvEv + (ARITH_AND << 3) + hrexw, r0,
+                         TCG_AREG0, offsetof(CPUArchState,
+                                             tlb_mask[mem_index]));
+    tcg_out_modrm_offset(s, OPC_ADD_GvEv + hrexw, r0, TCG_AREG0,
+                         offsetof(CPUArchState, tlb_table[mem_index]));
+#else
     tgen_arithi(s, ARITH_AND + hrexw, r0,
                 (CPU_TLB_SIZE - 1) << CPU_TLB_ENTRY_BITS, 0);
 
     tcg_out_modrm_sib_offset(s, OPC_LEA + hrexw, r0, TCG_AREG0, r0, 0,
-                             offsetof(CPUArchState, tlb_table[mem_index][0])
-                             + which);
+                             offsetof(CPUArchState, tlb_table[mem_index][0]));
+#endif
 
-    /* cmp 0(r0), r1 */
-    tcg_out_modrm_offset(s, OPC_CMP_GvEv + trexw, r1, r0, 0);
+    /* cmp which(r0), r1 */
+    tcg_out_modrm_offset(s, OPC_CMP_GvEv + trexw, r1, r0, which);
 
     /* Prepare for both the fast path add of the tlb addend, and the slow
        path function argument setup.  There are two cases worth note:
@@ -1224,8 +1240,8 @@ static inline void tcg_out_tlb_load(TCGContext *s, TCGReg addrlo, TCGReg addrhi,
     s->code_ptr += 4;
 
     if (TARGET_LONG_BITS > TCG_TARGET_REG_BITS) {
-        /* cmp 4(r0), addrhi */
-        tcg_out_modrm_offset(s, OPC_CMP_GvEv, addrhi, r0, 4);
+        /* cmp which+4(r0), addrhi */
+        tcg_out_modrm_offset(s, OPC_CMP_GvEv, addrhi, r0, which + 4);
 
         /* jne slow_path */
         tcg_out_opc(s, OPC_JCC_long + JCC_JNE, 0, 0, 0);
@@ -1237,7 +1253,7 @@ static inline void tcg_out_tlb_load(TCGContext *s, TCGReg addrlo, TCGReg addrhi,
 
     /* add addend(r0), r1 */
     tcg_out_modrm_offset(s, OPC_ADD_GvEv + hrexw, r1, r0,
-                         offsetof(CPUTLBEntry, addend) - which);
+                         offsetof(CPUTLBEntry, addend));
 }
 
 /*
@@ -1415,6 +1431,40 @@ static void tcg_out_qemu_st_slow_path(TCGContext *s, TCGLabelQemuLdst *l)
     tcg_out_push(s, retaddr);
     tcg_out_jmp(s, qemu_st_helpers[opc]);
 }
+
+#if TCG_TARGET_HAS_atomic
+/*
+ * Generate code for the slow path of an atomic operation at the end of block
+ */
+static void tcg_out_atomic_slow_path(TCGContext *s, TCGLabelQemuLdst *l)
+{
+    int arg;
+
+    /* resolve label address */
+    tcg_patch32(l->label_ptr[0], s->code_ptr - l->label_ptr[0] - 4);
+
+    tcg_out_mov(s, TCG_TYPE_PTR, tcg_target_call_iarg_regs[0], TCG_AREG0);
+    /* The second argument is already loaded with addrlo.  */
+    if (l->opc == INDEX_op_atomic_cmpxchg_i32
+        || l->opc == INDEX_op_atomic_cmpxchg_i64) {
+        /* The new value may be in the register of the third argument,
+           move it first.  The compared value is in EAX.  */
+        tcg_out_mov(s, l->type, tcg_target_call_iarg_regs[3], l->val_reg);
+        tcg_out_mov(s, l->type, tcg_target_call_iarg_regs[2], l->cmpv_reg);
+        arg = 4;
+    } else {
+        tcg_out_mov(s, l->type, tcg_target_call_iarg_regs[2], l->val_reg);
+        arg = 3;
+    }
+    tcg_out_movi(s, TCG_TYPE_I32, tcg_target_call_iarg_regs[arg], l->oi);
+    tcg_out_movi(s, TCG_TYPE_PTR, tcg_target_call_iarg_regs[arg + 1],
+                 (uintptr_t)l->raddr);
+
+    tcg_out_call(s, atomic_slow_path_helper(l->opc));
+    tcg_out_mov(s, l->type, l->datalo_reg, TCG_REG_RAX);
+    tcg_out_jmp(s, l->raddr);
+}
+#endif
 #elif defined(__x86_64__) && defined(__linux__)
 # include <asm/prctl.h>
 # include <sys/prctl.h>
@@ -1717,6 +1767,116 @@ static void tcg_out_qemu_st(TCGContext *s, const TCGArg *args, bool is64)
 #endif
 }
 
+#if TCG_TARGET_HAS_atomic
+/* Atomic operations use LOCK CMPXCHG, XCHG (which is implicitly locked
+   with a memory operand) and LOCK XADD on the host address.  The fast
+   path checks the TLB entry for writing only; a page that is writable
+   but not readable for the guest is not handled specially.  */
+static void tcg_out_atomic(TCGContext *s, TCGOpcode opc, const TCGArg *args)
+{
+    bool is_cmpxchg = (opc == INDEX_op_atomic_cmpxchg_i32
+                       || opc == INDEX_op_atomic_cmpxchg_i64);
+    TCGReg addr = args[1];
+    TCGReg val = args[is_cmpxchg ? 3 : 2];
+    TCGMemOpIdx oi = args[is_cmpxchg ? 4 : 3];
+    TCGMemOp s_bits = get_memop(oi) & MO_SIZE;
+    bool lock = true;
+    int insn;
+#if defined(CONFIG_SOFTMMU)
+    tcg_insn_unit *label_ptr[2];
+    TCGLabelQemuLdst *label;
+#else
+    int32_t offset = GUEST_BASE;
+    TCGReg base = addr;
+    int seg = 0;
+#endif
+
+    switch (opc) {
+    case INDEX_op_atomic_cmpxchg_i32:
+    case INDEX_op_atomic_cmpxchg_i64:
+        insn = (s_bits == MO_8 ? OPC_CMPXCHGB_EvGv : OPC_CMPXCHG_EvGv);
+        break;
+    case INDEX_op_atomic_xchg_i32:
+    case INDEX_op_atomic_xchg_i64:
+        insn = (s_bits == MO_8 ? OPC_XCHGB_EvGv : OPC_XCHG_EvGv);
+        lock = false;
+        break;
+    case INDEX_op_atomic_add_i32:
+    case INDEX_op_atomic_add_i64:
+        insn = (s_bits == MO_8 ? OPC_XADDB_EvGv : OPC_XADD_EvGv);
+        break;
+    default:
+        tcg_abort();
+    }
+
+    switch (s_bits) {
+    case MO_8:
+        insn |= P_REXB_R;
+        break;
+    case MO_16:
+        insn |= P_DATA16;
+        break;
+    case MO_64:
+        insn |= P_REXW;
+        break;
+    default:
+        break;
+    }
+
+#if defined(CONFIG_SOFTMMU)
+    tcg_out_tlb_load(s, addr, 0, get_mmuidx(oi), s_bits,
+                     label_ptr, offsetof(CPUTLBEntry, addr_write));
+
+    /* TLB Hit.  */
+    if (lock) {
+        tcg_out8(s, OPC_LOCK_PREFIX);
+    }
+    tcg_out_modrm_offset(s, insn, val, TCG_REG_L1, 0);
+#else
+    /* As for qemu_ld/st, assume that the address is zero extended.  */
+    if (GUEST_BASE && guest_base_flags) {
+        seg = guest_base_flags;
+        offset = 0;
+    } else if (offset != GUEST_BASE) {
+        tcg_out_movi(s, TCG_TYPE_I64, TCG_REG_L1, GUEST_BASE);
+        tgen_arithr(s, ARITH_ADD + P_REXW, TCG_REG_L1, base);
+        base = TCG_REG_L1;
+        offset = 0;
+    }
+    if (lock) {
+        tcg_out8(s, OPC_LOCK_PREFIX);
+    }
+    tcg_out_modrm_offset(s, insn + seg, val, base, offset);
+#endif
+
+    /* CMPXCHG returns the old value in EAX, which held the zero-extended
+       compared value; XCHG and XADD only write the low part of VAL.  */
+    if (!is_cmpxchg) {
+        if (s_bits == MO_8) {
+            tcg_out_ext8u(s, val, val);
+        } else if (s_bits == MO_16) {
+            tcg_out_ext16u(s, val, val);
+        }
+    }
+
+#if defined(CONFIG_SOFTMMU)
+    /* Record the current context of the operation into ldst label */
+    label = new_ldst_label(s);
+    label->is_atomic = true;
+    label->opc = opc;
+    label->oi = oi;
+    label->type = (tcg_op_defs[opc].flags & TCG_OPF_64BIT
+                   ? TCG_TYPE_I64 : TCG_TYPE_I32);
+    label->datalo_reg = is_cmpxchg ? TCG_REG_EAX : val;
+    label->cmpv_reg = TCG_REG_EAX;
+    label->val_reg = val;
+    label->addrlo_reg = addr;
+    label->raddr = s->code_ptr;
+    label->label_ptr[0] = label_ptr[0];
+#endif
+}
+#endif /* TCG_TARGET_HAS_atomic */
+
 static inline void tcg_out_op(TCGContext *s, TCGOpcode opc,
                               const TCGArg *args, const int *const_args)
 {
@@ -1962,6 +2122,16 @@ static inline void tcg_out_op(TCGContext *s, TCGOpcode opc,
     case INDEX_op_qemu_st_i64:
         tcg_out_qemu_st(s, args, 1);
         break;
+#if TCG_TARGET_HAS_atomic
+    case INDEX_op_atomic_cmpxchg_i32:
+    case INDEX_op_atomic_cmpxchg_i64:
+    case INDEX_op_atomic_xchg_i32:
+    case INDEX_op_atomic_xchg_i64:
+    case INDEX_op_atomic_add_i32:
+    case INDEX_op_atomic_add_i64:
+        tcg_out_atomic(s, opc, args);
+        break;
+#endif
 
     OP_32_64(mulu2):
         tcg_out_modrm(s, OPC_GRP3_Ev + rexw, EXT3_MUL, args[3]);
@@ -2185,6 +2355,14 @@ static const TCGTargetOpDef x86_op_defs[] = {
     { INDEX_op_qemu_st_i32, { "L", "L" } },
     { INDEX_op_qemu_ld_i64, { "r", "L" } },
     { INDEX_op_qemu_st_i64, { "L", "L" } },
+#if TCG_TARGET_HAS_atomic
+    { INDEX_op_atomic_cmpxchg_i32, { "a", "L", "0", "L" } },
+    { INDEX_op_atomic_xchg_i32, { "L", "L", "0" } },
+    { INDEX_op_atomic_add_i32, { "L", "L", "0" } },
+    { INDEX_op_atomic_cmpxchg_i64, { "a", "L", "0", "L" } },
+    { INDEX_op_atomic_xchg_i64, { "L", "L", "0" } },
+    { INDEX_op_atomic_add_i64, { "L", "L", "0" } },
+#endif
 #elif TARGET_LONG_BITS <= TCG_TARGET_REG_BITS
     { INDEX_op_qemu_ld_i32, { "r", "L" } },
     { INDEX_op_qemu_st_i32, { "L", "L" } },
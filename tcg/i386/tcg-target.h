@@ -130,6 +130,12 @@ extern bool have_bmi1;
 #define TCG_TARGET_HAS_mulsh_i64        0
 #endif
 
+/* The slow path of the atomic operations passes all helper arguments
+   in registers.  */
+#if TCG_TARGET_REG_BITS == 64 && !defined(_WIN64)
+#define TCG_TARGET_HAS_atomic           1
+#endif
+
 #define TCG_TARGET_deposit_i32_valid(ofs, len) \
     (((ofs) == 0 && (len) == 8) || ((ofs) == 8 && (len) == 8) || \
      ((ofs) == 0 && (len) == 16))
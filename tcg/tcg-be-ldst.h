@@ -24,12 +24,16 @@
 
 typedef struct TCGLabelQemuLdst {
     bool is_ld;             /* qemu_ld: true, qemu_st: false */
+    bool is_atomic;         /* atomic operation OPC, is_ld is unused */
+    TCGOpcode opc;
     TCGMemOpIdx oi;
     TCGType type;           /* result type of a load */
     TCGReg addrlo_reg;      /* reg index for low word of guest virtual addr */
     TCGReg addrhi_reg;      /* reg index for high word of guest virtual addr */
     TCGReg datalo_reg;      /* reg index for low word to be loaded or stored */
     TCGReg datahi_reg;      /* reg index for high word to be loaded or stored */
+    TCGReg cmpv_reg;        /* reg index for the value compared by cmpxchg */
+    TCGReg val_reg;         /* reg index for the value stored by an atomic */
     tcg_insn_unit *raddr;   /* gen code addr of the next IR of qemu_ld/st IR */
     tcg_insn_unit *label_ptr[2]; /* label pointers to be updated */
     struct TCGLabelQemuLdst *next;
@@ -55,13 +59,22 @@ static inline void tcg_out_tb_init(TCGContext *s)
 
 static void tcg_out_qemu_ld_slow_path(TCGContext *s, TCGLabelQemuLdst *l);
 static void tcg_out_qemu_st_slow_path(TCGContext *s, TCGLabelQemuLdst *l);
+#if TCG_TARGET_HAS_atomic
+static void tcg_out_atomic_slow_path(TCGContext *s, TCGLabelQemuLdst *l);
+#endif
 
 static void tcg_out_tb_finalize(TCGContext *s)
 {
     TCGLabelQemuLdst *lb;
 
-    /* qemu_ld/st slow paths */
+    /* qemu_ld/st and atomic slow paths */
     for (lb = s->be->labels; lb != NULL; lb = lb->next) {
+#if TCG_TARGET_HAS_atomic
+        if (lb->is_atomic) {
+            tcg_out_atomic_slow_path(s, lb);
+            continue;
+        }
+#endif
         if (lb->is_ld) {
             tcg_out_qemu_ld_slow_path(s, lb);
         } else {
@@ -79,10 +92,34 @@ static inline TCGLabelQemuLdst *new_ldst_label(TCGContext *s)
     TCGBackendData *be = s->be;
     TCGLabelQemuLdst *l = tcg_malloc(sizeof(*l));
 
+    l->is_atomic = false;
     l->next = be->labels;
     be->labels = l;
     return l;
 }
+
+#if TCG_TARGET_HAS_atomic
+/*
+ * Return the function called by the slow path of an atomic operation.
+ */
+
+static inline void *atomic_slow_path_helper(TCGOpcode opc)
+{
+    switch (opc) {
+    case INDEX_op_atomic_cmpxchg_i32:
+    case INDEX_op_atomic_cmpxchg_i64:
+        return helper_atomic_cmpxchg_mmu;
+    case INDEX_op_atomic_xchg_i32:
+    case INDEX_op_atomic_xchg_i64:
+        return helper_atomic_xchg_mmu;
+    case INDEX_op_atomic_add_i32:
+    case INDEX_op_atomic_add_i64:
+        return helper_atomic_fetch_add_mmu;
+    default:
+        tcg_abort();
+    }
+}
+#endif
 #else
 #include "tcg-be-null.h"
 #endif /* CONFIG_SOFTMMU */
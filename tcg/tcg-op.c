@@ -24,6 +24,8 @@
 
 #include "tcg.h"
 #include "tcg-op.h"
+#include "exec/helper-proto.h"
+#include "exec/helper-gen.h"
 
 /* Reduce the number of ifdefs below.  This assumes that all uses of
    TCGV_HIGH and TCGV_LOW are properly protected by a conditional that
@@ -1831,6 +1833,175 @@ void tcg_gen_extr32_i64(TCGv_i64 lo, TCGv_i64 hi, TCGv_i64 arg)
     tcg_gen_shri_i64(hi, arg, 32);
 }
 
+/* Lane-wise vector operations.
+
+   The operands live in memory at offsets from a base pointer (normally
+   cpu_env) and are OPRSZ bytes long, a multiple of 8.  The lanes are
+   VECE (MO_8 ... MO_64) wide.  The operations are expanded inline to
+   64-bit integer operations, handling all the lanes of a 64-bit chunk
+   at once, instead of calling a helper per element.  The destination
+   may overlap any of the sources as long as the offsets are equal.  */
+
+static inline uint64_t vec_dup_const(unsigned vece, uint64_t c)
+{
+    switch (vece) {
+    case MO_8:
+        return 0x0101010101010101ull * (uint8_t)c;
+    case MO_16:
+        return 0x0001000100010001ull * (uint16_t)c;
+    case MO_32:
+        return 0x0000000100000001ull * (uint32_t)c;
+    default:
+        return c;
+    }
+}
+
+/* Add the lanes of A and B without propagating carries across lane
+   boundaries: add with the top bit of each lane cleared, then fix up
+   the top bits with the xor of the original ones.  */
+static void gen_vec_add_i64(unsigned vece, TCGv_i64 d, TCGv_i64 a, TCGv_i64 b)
+{
+    TCGv_i64 t1, t2, t3;
+
+    if (vece == MO_64) {
+        tcg_gen_add_i64(d, a, b);
+        return;
+    }
+
+    t1 = tcg_temp_new_i64();
+    t2 = tcg_temp_new_i64();
+    t3 = tcg_temp_new_i64();
+    tcg_gen_movi_i64(t3, vec_dup_const(vece, 1ull << ((8 << vece) - 1)));
+    tcg_gen_andc_i64(t1, a, t3);
+    tcg_gen_andc_i64(t2, b, t3);
+    tcg_gen_xor_i64(d, a, b);
+    tcg_gen_and_i64(t3, d, t3);
+    tcg_gen_add_i64(d, t1, t2);
+    tcg_gen_xor_i64(d, d, t3);
+    tcg_temp_free_i64(t1);
+    tcg_temp_free_i64(t2);
+    tcg_temp_free_i64(t3);
+}
+
+/* Likewise for subtraction: set the top bit of each lane of A so that
+   no borrow crosses a lane boundary.  */
+static void gen_vec_sub_i64(unsigned vece, TCGv_i64 d, TCGv_i64 a, TCGv_i64 b)
+{
+    TCGv_i64 t1, t2, t3;
+
+    if (vece == MO_64) {
+        tcg_gen_sub_i64(d, a, b);
+        return;
+    }
+
+    t1 = tcg_temp_new_i64();
+    t2 = tcg_temp_new_i64();
+    t3 = tcg_temp_new_i64();
+    tcg_gen_movi_i64(t3, vec_dup_const(vece, 1ull << ((8 << vece) - 1)));
+    tcg_gen_or_i64(t1, a, t3);
+    tcg_gen_andc_i64(t2, b, t3);
+    tcg_gen_eqv_i64(d, a, b);
+    tcg_gen_and_i64(t3, d, t3);
+    tcg_gen_sub_i64(d, t1, t2);
+    tcg_gen_xor_i64(d, d, t3);
+    tcg_temp_free_i64(t1);
+    tcg_temp_free_i64(t2);
+    tcg_temp_free_i64(t3);
+}
+
+static void gen_vec_3(unsigned vece, TCGv_ptr base, tcg_target_long dofs,
+                      tcg_target_long aofs, tcg_target_long bofs,
+                      unsigned oprsz,
+                      void (*fni)(unsigned, TCGv_i64, TCGv_i64, TCGv_i64))
+{
+    TCGv_i64 t0 = tcg_temp_new_i64();
+    TCGv_i64 t1 = tcg_temp_new_i64();
+    unsigned i;
+
+    tcg_debug_assert(oprsz % 8 == 0);
+    for (i = 0; i < oprsz; i += 8) {
+        tcg_gen_ld_i64(t0, base, aofs + i);
+        tcg_gen_ld_i64(t1, base, bofs + i);
+        fni(vece, t0, t0, t1);
+        tcg_gen_st_i64(t0, base, dofs + i);
+    }
+    tcg_temp_free_i64(t0);
+    tcg_temp_free_i64(t1);
+}
+
+static void gen_vec_and_i64(unsigned vece, TCGv_i64 d, TCGv_i64 a, TCGv_i64 b)
+{
+    tcg_gen_and_i64(d, a, b);
+}
+
+static void gen_vec_or_i64(unsigned vece, TCGv_i64 d, TCGv_i64 a, TCGv_i64 b)
+{
+    tcg_gen_or_i64(d, a, b);
+}
+
+static void gen_vec_xor_i64(unsigned vece, TCGv_i64 d, TCGv_i64 a, TCGv_i64 b)
+{
+    tcg_gen_xor_i64(d, a, b);
+}
+
+static void gen_vec_andc_i64(unsigned vece, TCGv_i64 d, TCGv_i64 a, TCGv_i64 b)
+{
+    tcg_gen_andc_i64(d, a, b);
+}
+
+void tcg_gen_vec_add(unsigned vece, TCGv_ptr base, tcg_target_long dofs,
+                     tcg_target_long aofs, tcg_target_long bofs,
+                     unsigned oprsz)
+{
+    gen_vec_3(vece, base, dofs, aofs, bofs, oprsz, gen_vec_add_i64);
+}
+
+void tcg_gen_vec_sub(unsigned vece, TCGv_ptr base, tcg_target_long dofs,
+                     tcg_target_long aofs, tcg_target_long bofs,
+                     unsigned oprsz)
+{
+    gen_vec_3(vece, base, dofs, aofs, bofs, oprsz, gen_vec_sub_i64);
+}
+
+void tcg_gen_vec_and(TCGv_ptr base, tcg_target_long dofs,
+                     tcg_target_long aofs, tcg_target_long bofs,
+                     unsigned oprsz)
+{
+    gen_vec_3(MO_64, base, dofs, aofs, bofs, oprsz, gen_vec_and_i64);
+}
+
+void tcg_gen_vec_or(TCGv_ptr base, tcg_target_long dofs,
+                    tcg_target_long aofs, tcg_target_long bofs,
+                    unsigned oprsz)
+{
+    gen_vec_3(MO_64, base, dofs, aofs, bofs, oprsz, gen_vec_or_i64);
+}
+
+void tcg_gen_vec_xor(TCGv_ptr base, tcg_target_long dofs,
+                     tcg_target_long aofs, tcg_target_long bofs,
+                     unsigned oprsz)
+{
+    if (aofs == bofs) {
+        /* Common idiom to clear a register.  */
+        TCGv_i64 t0 = tcg_const_i64(0);
+        unsigned i;
+
+        for (i = 0; i < oprsz; i += 8) {
+            tcg_gen_st_i64(t0, base, dofs + i);
+        }
+        tcg_temp_free_i64(t0);
+        return;
+    }
+    gen_vec_3(MO_64, base, dofs, aofs, bofs, oprsz, gen_vec_xor_i64);
+}
+
+void tcg_gen_vec_andc(TCGv_ptr base, tcg_target_long dofs,
+                      tcg_target_long aofs, tcg_target_long bofs,
+                      unsigned oprsz)
+{
+    gen_vec_3(MO_64, base, dofs, aofs, bofs, oprsz, gen_vec_andc_i64);
+}
+
 /* QEMU specific operations.  */
 
 void tcg_gen_goto_tb(unsigned idx)
@@ -1943,3 +2114,213 @@ void tcg_gen_qemu_st_i64(TCGv_i64 val, TCGv addr, TCGArg idx, TCGMemOp memop)
     memop = tcg_canonicalize_memop(memop, 1, 1);
     gen_ldst_i64(INDEX_op_qemu_st_i64, val, addr, memop, idx);
 }
+
+/* Atomic read-modify-write operations.  The old value of the memory
+   location is returned, extended as specified by MEMOP.  Backends that
+   define TCG_TARGET_HAS_atomic emit them inline with host atomic
+   instructions, and only call helper_atomic_*_mmu when the softmmu TLB
+   lookup fails.  Otherwise, and for guest accesses whose endianness does
+   not match the host, they are implemented by helpers that use host
+   atomic instructions on the guest RAM found through the softmmu TLB (or
+   directly in user mode).  */
+
+static bool tcg_atomic_inline(TCGMemOp memop)
+{
+    return TCG_TARGET_HAS_atomic && !(memop & MO_BSWAP);
+}
+
+static inline TCGArg tcg_atomic_addr(TCGv addr)
+{
+#if TARGET_LONG_BITS == 32
+    return GET_TCGV_I32(addr);
+#else
+    return GET_TCGV_I64(addr);
+#endif
+}
+
+static TCGv_i32 tcg_atomic_memop_idx(TCGMemOp memop, TCGArg idx)
+{
+    return tcg_const_i32(make_memop_idx(memop & ~MO_SIGN, idx));
+}
+
+static void tcg_gen_atomic_ext_i32(TCGv_i32 ret, TCGMemOp memop)
+{
+    switch (memop & MO_SSIZE) {
+    case MO_SB:
+        tcg_gen_ext8s_i32(ret, ret);
+        break;
+    case MO_SW:
+        tcg_gen_ext16s_i32(ret, ret);
+        break;
+    default:
+        break;
+    }
+}
+
+static void tcg_gen_atomic_ext_i64(TCGv_i64 ret, TCGMemOp memop)
+{
+    switch (memop & MO_SSIZE) {
+    case MO_SB:
+        tcg_gen_ext8s_i64(ret, ret);
+        break;
+    case MO_SW:
+        tcg_gen_ext16s_i64(ret, ret);
+        break;
+    case MO_SL:
+        tcg_gen_ext32s_i64(ret, ret);
+        break;
+    default:
+        break;
+    }
+}
+
+/* The inline compare-and-swap compares whole registers, so the value
+   compared with memory must be zero-extended from the size of the
+   access first.  */
+
+static void tcg_gen_atomic_zext_i32(TCGv_i32 ret, TCGv_i32 val,
+                                    TCGMemOp memop)
+{
+    switch (memop & MO_SIZE) {
+    case MO_8:
+        tcg_gen_ext8u_i32(ret, val);
+        break;
+    case MO_16:
+        tcg_gen_ext16u_i32(ret, val);
+        break;
+    default:
+        tcg_gen_mov_i32(ret, val);
+        break;
+    }
+}
+
+static void tcg_gen_atomic_zext_i64(TCGv_i64 ret, TCGv_i64 val,
+                                    TCGMemOp memop)
+{
+    switch (memop & MO_SIZE) {
+    case MO_8:
+        tcg_gen_ext8u_i64(ret, val);
+        break;
+    case MO_16:
+        tcg_gen_ext16u_i64(ret, val);
+        break;
+    case MO_32:
+        tcg_gen_ext32u_i64(ret, val);
+        break;
+    default:
+        tcg_gen_mov_i64(ret, val);
+        break;
+    }
+}
+
+void tcg_gen_atomic_cmpxchg_i32(TCGv_i32 retv, TCGv addr, TCGv_i32 cmpv,
+                                TCGv_i32 newv, TCGArg idx, TCGMemOp memop)
+{
+    memop = tcg_canonicalize_memop(memop, 0, 0);
+    if (tcg_atomic_inline(memop)) {
+        TCGv_i32 t = tcg_temp_new_i32();
+
+        tcg_gen_atomic_zext_i32(t, cmpv, memop);
+        tcg_gen_op5(&tcg_ctx, INDEX_op_atomic_cmpxchg_i32, GET_TCGV_I32(retv),
+                    tcg_atomic_addr(addr), GET_TCGV_I32(t),
+                    GET_TCGV_I32(newv), make_memop_idx(memop & ~MO_SIGN, idx));
+        tcg_temp_free_i32(t);
+    } else {
+        TCGv_i32 oi = tcg_atomic_memop_idx(memop, idx);
+
+        gen_helper_atomic_cmpxchgl(retv, tcg_ctx.tcg_env, addr, cmpv, newv,
+                                   oi);
+        tcg_temp_free_i32(oi);
+    }
+    tcg_gen_atomic_ext_i32(retv, memop);
+}
+
+void tcg_gen_atomic_cmpxchg_i64(TCGv_i64 retv, TCGv addr, TCGv_i64 cmpv,
+                                TCGv_i64 newv, TCGArg idx, TCGMemOp memop)
+{
+    memop = tcg_canonicalize_memop(memop, 1, 0);
+    if (tcg_atomic_inline(memop)) {
+        TCGv_i64 t = tcg_temp_new_i64();
+
+        tcg_gen_atomic_zext_i64(t, cmpv, memop);
+        tcg_gen_op5(&tcg_ctx, INDEX_op_atomic_cmpxchg_i64, GET_TCGV_I64(retv),
+                    tcg_atomic_addr(addr), GET_TCGV_I64(t),
+                    GET_TCGV_I64(newv), make_memop_idx(memop & ~MO_SIGN, idx));
+        tcg_temp_free_i64(t);
+    } else {
+        TCGv_i32 oi = tcg_atomic_memop_idx(memop, idx);
+
+        gen_helper_atomic_cmpxchgq(retv, tcg_ctx.tcg_env, addr, cmpv, newv,
+                                   oi);
+        tcg_temp_free_i32(oi);
+    }
+    tcg_gen_atomic_ext_i64(retv, memop);
+}
+
+void tcg_gen_atomic_xchg_i32(TCGv_i32 ret, TCGv addr, TCGv_i32 val,
+                             TCGArg idx, TCGMemOp memop)
+{
+    memop = tcg_canonicalize_memop(memop, 0, 0);
+    if (tcg_atomic_inline(memop)) {
+        tcg_gen_op4(&tcg_ctx, INDEX_op_atomic_xchg_i32, GET_TCGV_I32(ret),
+                    tcg_atomic_addr(addr), GET_TCGV_I32(val),
+                    make_memop_idx(memop & ~MO_SIGN, idx));
+    } else {
+        TCGv_i32 oi = tcg_atomic_memop_idx(memop, idx);
+
+        gen_helper_atomic_xchgl(ret, tcg_ctx.tcg_env, addr, val, oi);
+        tcg_temp_free_i32(oi);
+    }
+    tcg_gen_atomic_ext_i32(ret, memop);
+}
+
+void tcg_gen_atomic_xchg_i64(TCGv_i64 ret, TCGv addr, TCGv_i64 val,
+                             TCGArg idx, TCGMemOp memop)
+{
+    memop = tcg_canonicalize_memop(memop, 1, 0);
+    if (tcg_atomic_inline(memop)) {
+        tcg_gen_op4(&tcg_ctx, INDEX_op_atomic_xchg_i64, GET_TCGV_I64(ret),
+                    tcg_atomic_addr(addr), GET_TCGV_I64(val),
+                    make_memop_idx(memop & ~MO_SIGN, idx));
+    } else {
+        TCGv_i32 oi = tcg_atomic_memop_idx(memop, idx);
+
+        gen_helper_atomic_xchgq(ret, tcg_ctx.tcg_env, addr, val, oi);
+        tcg_temp_free_i32(oi);
+    }
+    tcg_gen_atomic_ext_i64(ret, memop);
+}
+
+void tcg_gen_atomic_fetch_add_i32(TCGv_i32 ret, TCGv addr, TCGv_i32 val,
+                                  TCGArg idx, TCGMemOp memop)
+{
+    memop = tcg_canonicalize_memop(memop, 0, 0);
+    if (tcg_atomic_inline(memop)) {
+        tcg_gen_op4(&tcg_ctx, INDEX_op_atomic_add_i32, GET_TCGV_I32(ret),
+                    tcg_atomic_addr(addr), GET_TCGV_I32(val),
+                    make_memop_idx(memop & ~MO_SIGN, idx));
+    } else {
+        TCGv_i32 oi = tcg_atomic_memop_idx(memop, idx);
+
+        gen_helper_atomic_fetch_addl(ret, tcg_ctx.tcg_env, addr, val, oi);
+        tcg_temp_free_i32(oi);
+    }
+    tcg_gen_atomic_ext_i32(ret, memop);
+}
+
+void tcg_gen_atomic_fetch_add_i64(TCGv_i64 ret, TCGv addr, TCGv_i64 val,
+                                  TCGArg idx, TCGMemOp memop)
+{
+    memop = tcg_canonicalize_memop(memop, 1, 0);
+    if (tcg_atomic_inline(memop)) {
+        tcg_gen_op4(&tcg_ctx, INDEX_op_atomic_add_i64, GET_TCGV_I64(ret),
+                    tcg_atomic_addr(addr), GET_TCGV_I64(val),
+                    make_memop_idx(memop & ~MO_SIGN, idx));
+    } else {
+        TCGv_i32 oi = tcg_atomic_memop_idx(memop, idx);
+
+        gen_helper_atomic_fetch_addq(ret, tcg_ctx.tcg_env, addr, val, oi);
+        tcg_temp_free_i32(oi);
+    }
+    tcg_gen_atomic_ext_i64(ret, memop);
+}
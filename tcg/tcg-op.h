@@ -735,6 +735,9 @@ void tcg_gen_goto_tb(unsigned idx);
 #define TCGV_EQUAL(a, b) TCGV_EQUAL_I32(a, b)
 #define tcg_gen_qemu_ld_tl tcg_gen_qemu_ld_i32
 #define tcg_gen_qemu_st_tl tcg_gen_qemu_st_i32
+#define tcg_gen_atomic_cmpxchg_tl tcg_gen_atomic_cmpxchg_i32
+#define tcg_gen_atomic_xchg_tl tcg_gen_atomic_xchg_i32
+#define tcg_gen_atomic_fetch_add_tl tcg_gen_atomic_fetch_add_i32
 #else
 #define TCGv TCGv_i64
 #define tcg_temp_new() tcg_temp_new_i64()
@@ -747,13 +750,45 @@ void tcg_gen_goto_tb(unsigned idx);
 #define TCGV_EQUAL(a, b) TCGV_EQUAL_I64(a, b)
 #define tcg_gen_qemu_ld_tl tcg_gen_qemu_ld_i64
 #define tcg_gen_qemu_st_tl tcg_gen_qemu_st_i64
+#define tcg_gen_atomic_cmpxchg_tl tcg_gen_atomic_cmpxchg_i64
+#define tcg_gen_atomic_xchg_tl tcg_gen_atomic_xchg_i64
+#define tcg_gen_atomic_fetch_add_tl tcg_gen_atomic_fetch_add_i64
 #endif
 
+/* Lane-wise vector operations on OPRSZ bytes at offsets from BASE.  */
+void tcg_gen_vec_add(unsigned vece, TCGv_ptr base, tcg_target_long dofs,
+                     tcg_target_long aofs, tcg_target_long bofs,
+                     unsigned oprsz);
+void tcg_gen_vec_sub(unsigned vece, TCGv_ptr base, tcg_target_long dofs,
+                     tcg_target_long aofs, tcg_target_long bofs,
+                     unsigned oprsz);
+void tcg_gen_vec_and(TCGv_ptr base, tcg_target_long dofs,
+                     tcg_target_long aofs, tcg_target_long bofs,
+                     unsigned oprsz);
+void tcg_gen_vec_or(TCGv_ptr base, tcg_target_long dofs,
+                    tcg_target_long aofs, tcg_target_long bofs,
+                    unsigned oprsz);
+void tcg_gen_vec_xor(TCGv_ptr base, tcg_target_long dofs,
+                     tcg_target_long aofs, tcg_target_long bofs,
+                     unsigned oprsz);
+void tcg_gen_vec_andc(TCGv_ptr base, tcg_target_long dofs,
+                      tcg_target_long aofs, tcg_target_long bofs,
+                      unsigned oprsz);
+
 void tcg_gen_qemu_ld_i32(TCGv_i32, TCGv, TCGArg, TCGMemOp);
 void tcg_gen_qemu_st_i32(TCGv_i32, TCGv, TCGArg, TCGMemOp);
 void tcg_gen_qemu_ld_i64(TCGv_i64, TCGv, TCGArg, TCGMemOp);
 void tcg_gen_qemu_st_i64(TCGv_i64, TCGv, TCGArg, TCGMemOp);
 
+void tcg_gen_atomic_cmpxchg_i32(TCGv_i32, TCGv, TCGv_i32, TCGv_i32,
+                                TCGArg, TCGMemOp);
+void tcg_gen_atomic_cmpxchg_i64(TCGv_i64, TCGv, TCGv_i64, TCGv_i64,
+                                TCGArg, TCGMemOp);
+void tcg_gen_atomic_xchg_i32(TCGv_i32, TCGv, TCGv_i32, TCGArg, TCGMemOp);
+void tcg_gen_atomic_xchg_i64(TCGv_i64, TCGv, TCGv_i64, TCGArg, TCGMemOp);
+void tcg_gen_atomic_fetch_add_i32(TCGv_i32, TCGv, TCGv_i32, TCGArg, TCGMemOp);
+void tcg_gen_atomic_fetch_add_i64(TCGv_i64, TCGv, TCGv_i64, TCGArg, TCGMemOp);
+
 static inline void tcg_gen_qemu_ld8u(TCGv ret, TCGv addr, int mem_index)
 {
     tcg_gen_qemu_ld_tl(ret, addr, mem_index, MO_UB);
@@ -969,6 +1004,8 @@ static inline void tcg_gen_qemu_st64(TCGv_i64 arg, TCGv addr, int mem_index)
 #if UINTPTR_MAX == UINT32_MAX
 # define tcg_gen_ld_ptr(R, A, O) \
     tcg_gen_ld_i32(TCGV_PTR_TO_NAT(R), (A), (O))
+# define tcg_gen_st_ptr(R, A, O) \
+    tcg_gen_st_i32(TCGV_PTR_TO_NAT(R), (A), (O))
 # define tcg_gen_discard_ptr(A) \
     tcg_gen_discard_i32(TCGV_PTR_TO_NAT(A))
 # define tcg_gen_add_ptr(R, A, B) \
@@ -980,6 +1017,8 @@ static inline void tcg_gen_qemu_st64(TCGv_i64 arg, TCGv addr, int mem_index)
 #else
 # define tcg_gen_ld_ptr(R, A, O) \
     tcg_gen_ld_i64(TCGV_PTR_TO_NAT(R), (A), (O))
+# define tcg_gen_st_ptr(R, A, O) \
+    tcg_gen_st_i64(TCGV_PTR_TO_NAT(R), (A), (O))
 # define tcg_gen_discard_ptr(A) \
     tcg_gen_discard_i64(TCGV_PTR_TO_NAT(A))
 # define tcg_gen_add_ptr(R, A, B) \
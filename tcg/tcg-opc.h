@@ -188,6 +188,22 @@ DEF(qemu_ld_i64, DATA64_ARGS, TLADDR_ARGS, 1,
 DEF(qemu_st_i64, 0, TLADDR_ARGS + DATA64_ARGS, 1,
     TCG_OPF_CALL_CLOBBER | TCG_OPF_SIDE_EFFECTS | TCG_OPF_64BIT)
 
+DEF(atomic_cmpxchg_i32, 1, TLADDR_ARGS + 2, 1,
+    TCG_OPF_CALL_CLOBBER | TCG_OPF_SIDE_EFFECTS | IMPL(TCG_TARGET_HAS_atomic))
+DEF(atomic_xchg_i32, 1, TLADDR_ARGS + 1, 1,
+    TCG_OPF_CALL_CLOBBER | TCG_OPF_SIDE_EFFECTS | IMPL(TCG_TARGET_HAS_atomic))
+DEF(atomic_add_i32, 1, TLADDR_ARGS + 1, 1,
+    TCG_OPF_CALL_CLOBBER | TCG_OPF_SIDE_EFFECTS | IMPL(TCG_TARGET_HAS_atomic))
+DEF(atomic_cmpxchg_i64, 1, TLADDR_ARGS + 2, 1,
+    TCG_OPF_CALL_CLOBBER | TCG_OPF_SIDE_EFFECTS | IMPL64
+    | IMPL(TCG_TARGET_HAS_atomic))
+DEF(atomic_xchg_i64, 1, TLADDR_ARGS + 1, 1,
+    TCG_OPF_CALL_CLOBBER | TCG_OPF_SIDE_EFFECTS | IMPL64
+    | IMPL(TCG_TARGET_HAS_atomic))
+DEF(atomic_add_i64, 1, TLADDR_ARGS + 1, 1,
+    TCG_OPF_CALL_CLOBBER | TCG_OPF_SIDE_EFFECTS | IMPL64
+    | IMPL(TCG_TARGET_HAS_atomic))
+
 #undef TLADDR_ARGS
 #undef DATA64_ARGS
 #undef IMPL
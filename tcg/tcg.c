@@ -1301,12 +1301,57 @@ static inline void tcg_la_bb_end(TCGContext *s, uint8_t *dead_temps,
     }
 }
 
+/* liveness analysis: end of basic block through a branch.  All temps are
+   dead and globals are saved by the register allocator, but a global only
+   has to be up to date in memory if its value is still needed by one of
+   the successors: the destination label (described by label_mem, NULL if
+   it has not been analyzed yet, i.e. for a backward branch) and, for a
+   conditional branch, the fall through block. */
+static inline void tcg_la_branch_end(TCGContext *s, uint8_t *dead_temps,
+                                     uint8_t *mem_temps,
+                                     const uint8_t *label_mem,
+                                     bool fallthrough)
+{
+    int i;
+
+    for (i = 0; i < s->nb_globals; i++) {
+        uint8_t needed = label_mem ? label_mem[i] : 1;
+
+        if (fallthrough) {
+            needed |= mem_temps[i] | !dead_temps[i];
+        }
+        dead_temps[i] = 1;
+        mem_temps[i] = needed;
+    }
+    for (i = s->nb_globals; i < s->nb_temps; i++) {
+        dead_temps[i] = 1;
+        mem_temps[i] = s->temps[i].temp_local;
+    }
+}
+
+/* liveness analysis: start of basic block at a label.  Record in
+   label_mem which globals are needed by the block, so that the branches
+   to this label can drop the dead stores to the other ones. */
+static inline void tcg_la_label(TCGContext *s, uint8_t *dead_temps,
+                                uint8_t *mem_temps, uint8_t *label_mem)
+{
+    int i;
+
+    for (i = 0; i < s->nb_globals; i++) {
+        label_mem[i] = mem_temps[i] | !dead_temps[i];
+    }
+    tcg_la_branch_end(s, dead_temps, mem_temps, label_mem, false);
+}
+
 /* Liveness analysis : update the opc_dead_args array to tell if a
    given input arguments is dead. Instructions updating dead
-   temporaries are removed. */
+   temporaries are removed.  Liveness of the globals is propagated
+   backwards across the labels of the TB, so that stores to globals
+   which are overwritten in every successor before being read (e.g.
+   condition code computations) are removed as well. */
 static void tcg_liveness_analysis(TCGContext *s)
 {
-    uint8_t *dead_temps, *mem_temps;
+    uint8_t *dead_temps, *mem_temps, *label_mem, *label_seen;
     int oi, oi_prev, nb_ops;
 
     nb_ops = s->gen_next_op_idx;
@@ -1317,6 +1362,10 @@ static void tcg_liveness_analysis(TCGContext *s)
     mem_temps = tcg_malloc(s->nb_temps);
     tcg_la_func_end(s, dead_temps, mem_temps);
 
+    label_mem = tcg_malloc(s->nb_labels * s->nb_globals);
+    label_seen = tcg_malloc(s->nb_labels);
+    memset(label_seen, 0, s->nb_labels);
+
     for (oi = s->gen_last_op_idx; oi >= 0; oi = oi_prev) {
         int i, nb_iargs, nb_oargs;
         TCGOpcode opc_new, opc_new2;
@@ -1496,6 +1545,11 @@ static void tcg_liveness_analysis(TCGContext *s)
                     }
                 }
             do_remove:
+#ifdef CONFIG_PROFILER
+                if (args[0] < s->nb_globals) {
+                    s->del_global_op_count++;
+                }
+#endif
                 tcg_op_remove(s, op);
             } else {
             do_not_remove:
@@ -1516,7 +1570,32 @@ static void tcg_liveness_analysis(TCGContext *s)
 
                 /* if end of basic block, update */
                 if (def->flags & TCG_OPF_BB_END) {
-                    tcg_la_bb_end(s, dead_temps, mem_temps);
+                    TCGLabel *l;
+
+                    switch (opc) {
+                    case INDEX_op_set_label:
+                        l = arg_label(args[0]);
+                        tcg_la_label(s, dead_temps, mem_temps,
+                                     &label_mem[l->id * s->nb_globals]);
+                        label_seen[l->id] = 1;
+                        break;
+                    case INDEX_op_br:
+                    case INDEX_op_brcond_i32:
+                    case INDEX_op_brcond2_i32:
+                    case INDEX_op_brcond_i64:
+                        /* the label is always the last constant argument */
+                        l = arg_label(args[nb_oargs + nb_iargs
+                                           + def->nb_cargs - 1]);
+                        tcg_la_branch_end(s, dead_temps, mem_temps,
+                                          label_seen[l->id]
+                                          ? &label_mem[l->id * s->nb_globals]
+                                          : NULL,
+                                          opc != INDEX_op_br);
+                        break;
+                    default:
+                        tcg_la_bb_end(s, dead_temps, mem_temps);
+                        break;
+                    }
                 } else if (def->flags & TCG_OPF_SIDE_EFFECTS) {
                     /* globals should be synced to memory */
                     memset(mem_temps, 1, s->nb_globals);
@@ -2427,6 +2506,12 @@ void tcg_dump_info(FILE *f, fprintf_function cpu_fprintf)
     cpu_fprintf(f, "deleted ops/TB      %0.2f\n",
                 s->tb_count ? 
                 (double)s->del_op_count / s->tb_count : 0);
+    cpu_fprintf(f, "  dead globals/TB   %0.2f\n",
+                s->tb_count ?
+                (double)s->del_global_op_count / s->tb_count : 0);
+    cpu_fprintf(f, "avg live ops/TB     %0.1f\n",
+                s->tb_count ?
+                (double)(s->op_count - s->del_op_count) / s->tb_count : 0);
     cpu_fprintf(f, "avg temps/TB        %0.2f max=%d\n",
                 s->tb_count ? 
                 (double)s->temp_count / s->tb_count : 0,
@@ -98,6 +98,11 @@ typedef uint64_t TCGRegSet;
 #define TCG_TARGET_HAS_sub2_i32         1
 #endif
 
+/* Backends that emit the atomic operations inline define this to 1.  */
+#ifndef TCG_TARGET_HAS_atomic
+#define TCG_TARGET_HAS_atomic           0
+#endif
+
 #ifndef TCG_TARGET_deposit_i32_valid
 #define TCG_TARGET_deposit_i32_valid(ofs, len) 1
 #endif
@@ -511,6 +516,10 @@ struct TCGContext {
 
     GHashTable *helpers;
 
+    /* The CPU state, as the target's "env" global.  Set by the targets
+       that use the atomic operations, which can fall back to helpers.  */
+    TCGv_ptr tcg_env;
+
 #ifdef CONFIG_PROFILER
     /* profiling info */
     int64_t tb_count1;
@@ -520,6 +529,7 @@ struct TCGContext {
     int64_t temp_count;
     int temp_count_max;
     int64_t del_op_count;
+    int64_t del_global_op_count; /* dead stores to globals removed */
     int64_t code_in_len;
     int64_t code_out_len;
     int64_t interm_time;
@@ -981,6 +991,17 @@ void helper_be_stl_mmu(CPUArchState *env, target_ulong addr, uint32_t val,
 void helper_be_stq_mmu(CPUArchState *env, target_ulong addr, uint64_t val,
                        TCGMemOpIdx oi, uintptr_t retaddr);
 
+/* Slow path of the atomic operations, value zero-extended to 64 bits.  */
+uint64_t helper_atomic_cmpxchg_mmu(CPUArchState *env, target_ulong addr,
+                                   uint64_t cmpv, uint64_t newv,
+                                   TCGMemOpIdx oi, uintptr_t retaddr);
+uint64_t helper_atomic_xchg_mmu(CPUArchState *env, target_ulong addr,
+                                uint64_t val, TCGMemOpIdx oi,
+                                uintptr_t retaddr);
+uint64_t helper_atomic_fetch_add_mmu(CPUArchState *env, target_ulong addr,
+                                     uint64_t val, TCGMemOpIdx oi,
+                                     uintptr_t retaddr);
+
 /* Temporary aliases until backends are converted.  */
 #ifdef TARGET_WORDS_BIGENDIAN
 # define helper_ret_ldsw_mmu  helper_be_ldsw_mmu
@@ -0,0 +1,202 @@
+/*
+ * QTest testcase for the af-packet network backend
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <glib.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <net/if.h>
+#include <linux/if_ether.h>
+#include <linux/if_packet.h>
+#include "libqtest.h"
+#include "qemu/osdep.h"
+
+/* IEEE 802 local experimental ethertype */
+#define TEST_ETHERTYPE      0x88b5
+#define TEST_FRAME_LEN      60
+#define TEST_TIMEOUT_MS     5000
+
+/* A veth pair: QEMU uses the first end, the test the second */
+static char *veth[2];
+
+static bool veth_create(void)
+{
+    char *cmd;
+    int ret;
+
+    veth[0] = g_strdup_printf("qafp%da", getpid());
+    veth[1] = g_strdup_printf("qafp%db", getpid());
+    cmd = g_strdup_printf("(ip link add %s type veth peer name %s && "
+                          "ip link set %s up && ip link set %s up || "
+                          "{ ip link del %s; false; }) >/dev/null 2>&1",
+                          veth[0], veth[1], veth[0], veth[1], veth[0]);
+    ret = system(cmd);
+    g_free(cmd);
+    return ret == 0;
+}
+
+static void veth_destroy(void)
+{
+    char *cmd = g_strdup_printf("ip link del %s", veth[0]);
+
+    g_assert_cmpint(system(cmd), ==, 0);
+    g_free(cmd);
+}
+
+static int udp_socket(uint16_t *port)
+{
+    struct sockaddr_in addr = {
+        .sin_family = AF_INET,
+        .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+    };
+    socklen_t len = sizeof(addr);
+    int fd;
+
+    fd = socket(AF_INET, SOCK_DGRAM, 0);
+    g_assert_cmpint(fd, >=, 0);
+    g_assert_cmpint(bind(fd, (struct sockaddr *)&addr, len), ==, 0);
+    g_assert_cmpint(getsockname(fd, (struct sockaddr *)&addr, &len), ==, 0);
+    *port = ntohs(addr.sin_port);
+    return fd;
+}
+
+static int packet_socket(const char *ifname)
+{
+    struct sockaddr_ll sll = {
+        .sll_family = AF_PACKET,
+        .sll_protocol = htons(TEST_ETHERTYPE),
+        .sll_ifindex = if_nametoindex(ifname),
+    };
+    int fd;
+
+    g_assert_cmpint(sll.sll_ifindex, !=, 0);
+    fd = socket(AF_PACKET, SOCK_RAW, htons(TEST_ETHERTYPE));
+    g_assert_cmpint(fd, >=, 0);
+    g_assert_cmpint(bind(fd, (struct sockaddr *)&sll, sizeof(sll)), ==, 0);
+    return fd;
+}
+
+static void build_frame(uint8_t *buf, const char *payload)
+{
+    static const uint8_t src[ETH_ALEN] = { 0x02, 0, 0, 0, 0, 0x01 };
+
+    memset(buf, 0, TEST_FRAME_LEN);
+    memset(buf, 0xff, ETH_ALEN);
+    memcpy(buf + ETH_ALEN, src, ETH_ALEN);
+    buf[12] = TEST_ETHERTYPE >> 8;
+    buf[13] = TEST_ETHERTYPE & 0xff;
+    memcpy(buf + ETH_HLEN, payload, strlen(payload));
+}
+
+/* Wait for @frame on @fd, skipping any other traffic */
+static bool wait_frame(int fd, const uint8_t *frame)
+{
+    gint64 deadline = g_get_monotonic_time() + TEST_TIMEOUT_MS * 1000;
+    uint8_t buf[2048];
+    struct pollfd pfd = {
+        .fd = fd,
+        .events = POLLIN,
+    };
+
+    while (g_get_monotonic_time() < deadline) {
+        ssize_t n;
+
+        if (poll(&pfd, 1, 100) <= 0) {
+            continue;
+        }
+        n = recv(fd, buf, sizeof(buf), 0);
+        if (n >= TEST_FRAME_LEN && !memcmp(buf, frame, TEST_FRAME_LEN)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Tests only initialization on the loopback interface */
+static void test_af_packet_init(void)
+{
+    qtest_start("-netdev af-packet,id=hs0,ifname=lo "
+                "-device e1000,netdev=hs0");
+    qtest_end();
+}
+
+/* Connect the backend on a veth end to a UDP socket backend through a
+ * hub, and pass one frame in each direction.
+ */
+static void test_af_packet_roundtrip(void)
+{
+    struct sockaddr_in qemu_addr = {
+        .sin_family = AF_INET,
+        .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+    };
+    uint8_t frame[TEST_FRAME_LEN];
+    uint16_t test_port, qemu_port;
+    int udp_fd, tmp_fd, pkt_fd;
+    char *args;
+
+    udp_fd = udp_socket(&test_port);
+    tmp_fd = udp_socket(&qemu_port);
+    close(tmp_fd);
+    pkt_fd = packet_socket(veth[1]);
+
+    args = g_strdup_printf("-net af-packet,vlan=0,ifname=%s "
+                           "-net socket,vlan=0,udp=127.0.0.1:%d,"
+                           "localaddr=127.0.0.1:%d",
+                           veth[0], test_port, qemu_port);
+    qtest_start(args);
+    g_free(args);
+
+    /* guest to host: UDP -> hub -> af-packet TX */
+    build_frame(frame, "af-packet tx");
+    qemu_addr.sin_port = htons(qemu_port);
+    g_assert_cmpint(sendto(udp_fd, frame, sizeof(frame), 0,
+                           (struct sockaddr *)&qemu_addr,
+                           sizeof(qemu_addr)), ==, sizeof(frame));
+    g_assert(wait_frame(pkt_fd, frame));
+
+    /* host to guest: af-packet RX -> hub -> UDP */
+    build_frame(frame, "af-packet rx");
+    g_assert_cmpint(send(pkt_fd, frame, sizeof(frame), 0), ==,
+                    sizeof(frame));
+    g_assert(wait_frame(udp_fd, frame));
+
+    qtest_end();
+    close(pkt_fd);
+    close(udp_fd);
+}
+
+int main(int argc, char **argv)
+{
+    bool have_veth = false;
+    int ret;
+    int fd;
+
+    g_test_init(&argc, &argv, NULL);
+
+    /* The backend needs CAP_NET_RAW, creating a veth CAP_NET_ADMIN */
+    fd = socket(AF_PACKET, SOCK_RAW, 0);
+    if (fd >= 0) {
+        close(fd);
+        qtest_add_func("/af-packet/init", test_af_packet_init);
+        have_veth = veth_create();
+        if (have_veth) {
+            qtest_add_func("/af-packet/roundtrip", test_af_packet_roundtrip);
+        }
+    }
+
+    ret = g_test_run();
+
+    if (have_veth) {
+        veth_destroy();
+    }
+    return ret;
+}
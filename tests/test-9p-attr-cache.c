@@ -0,0 +1,153 @@
+/*
+ * Test the virtio 9p attribute cache
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#include <glib.h>
+#include "qemu-common.h"
+#include "hw/9pfs/virtio-9p-attr-cache.h"
+
+static void cache_stat(V9fsAttrCache *c, const char *path, mode_t mode)
+{
+    struct stat st = { .st_mode = mode };
+    struct stat tmp;
+    uint64_t seq;
+    int err;
+
+    g_assert(!v9fs_attr_cache_lookup(c, path, &tmp, &err, &seq));
+    v9fs_attr_cache_insert(c, path, &st, 0, seq);
+}
+
+static bool is_cached(V9fsAttrCache *c, const char *path)
+{
+    struct stat st;
+    uint64_t seq;
+    int err;
+
+    return v9fs_attr_cache_lookup(c, path, &st, &err, &seq);
+}
+
+static void test_attr_cache_hit(void)
+{
+    V9fsAttrCache *c = v9fs_attr_cache_new(V9FS_CACHE_STRICT, 0);
+    struct stat st;
+    uint64_t seq;
+    int err;
+
+    cache_stat(c, "/file", S_IFREG | 0644);
+    g_assert(v9fs_attr_cache_lookup(c, "/file", &st, &err, &seq));
+    g_assert_cmpint(err, ==, 0);
+    g_assert_cmpint(st.st_mode, ==, S_IFREG | 0644);
+
+    /* negative entries */
+    g_assert(!v9fs_attr_cache_lookup(c, "/none", &st, &err, &seq));
+    v9fs_attr_cache_insert(c, "/none", NULL, ENOENT, seq);
+    g_assert(v9fs_attr_cache_lookup(c, "/none", &st, &err, &seq));
+    g_assert_cmpint(err, ==, ENOENT);
+}
+
+static void test_attr_cache_lru(void)
+{
+    V9fsAttrCache *c = v9fs_attr_cache_new(V9FS_CACHE_STRICT, 0);
+    char path[32];
+    int i;
+
+    for (i = 0; i < V9FS_ATTR_CACHE_MAX_ENTRIES; i++) {
+        snprintf(path, sizeof(path), "/%d", i);
+        cache_stat(c, path, S_IFREG);
+    }
+
+    /* Use the oldest entry, so that the next one is evicted instead */
+    g_assert(is_cached(c, "/0"));
+    cache_stat(c, "/new", S_IFREG);
+
+    g_assert(is_cached(c, "/0"));
+    g_assert(!is_cached(c, "/1"));
+    g_assert(is_cached(c, "/2"));
+    g_assert(is_cached(c, "/new"));
+}
+
+static void test_attr_cache_stale_insert(void)
+{
+    V9fsAttrCache *c = v9fs_attr_cache_new(V9FS_CACHE_STRICT, 0);
+    struct stat st = { .st_mode = S_IFREG };
+    uint64_t seq;
+    int err;
+
+    /* An invalidation while the lstat() runs drops its result */
+    g_assert(!v9fs_attr_cache_lookup(c, "/file", &st, &err, &seq));
+    v9fs_attr_cache_invalidate(c, "/other");
+    v9fs_attr_cache_insert(c, "/file", &st, 0, seq);
+    g_assert(!is_cached(c, "/file"));
+
+    g_assert(!v9fs_attr_cache_lookup(c, "/file", &st, &err, &seq));
+    v9fs_attr_cache_insert(c, "/file", &st, 0, seq);
+    g_assert(is_cached(c, "/file"));
+}
+
+static void test_attr_cache_invalidate_tree(void)
+{
+    V9fsAttrCache *c = v9fs_attr_cache_new(V9FS_CACHE_STRICT, 0);
+
+    cache_stat(c, "/d", S_IFDIR);
+    cache_stat(c, "/d/x", S_IFDIR);
+    cache_stat(c, "/d/x/y", S_IFREG);
+    cache_stat(c, "/dx", S_IFREG);
+
+    v9fs_attr_cache_invalidate_tree(c, "/d");
+    g_assert(!is_cached(c, "/d"));
+    g_assert(!is_cached(c, "/d/x"));
+    g_assert(!is_cached(c, "/d/x/y"));
+    g_assert(is_cached(c, "/dx"));
+
+    cache_stat(c, "/d", S_IFDIR);
+    cache_stat(c, "/d/x", S_IFREG);
+    v9fs_attr_cache_invalidate_parent(c, "/d/x");
+    g_assert(!is_cached(c, "/d"));
+    g_assert(is_cached(c, "/d/x"));
+}
+
+static void test_attr_cache_inode_changed(void)
+{
+    V9fsAttrCache *c = v9fs_attr_cache_new(V9FS_CACHE_STRICT, 0);
+    struct stat st;
+    uint64_t seq;
+    int err;
+
+    cache_stat(c, "/dir", S_IFDIR);
+    cache_stat(c, "/file", S_IFREG);
+    g_assert(!v9fs_attr_cache_lookup(c, "/none", &st, &err, &seq));
+    v9fs_attr_cache_insert(c, "/none", NULL, ENOENT, seq);
+
+    /* Only non-directories can be other names for the changed inode */
+    v9fs_attr_cache_inode_changed(c);
+    g_assert(is_cached(c, "/dir"));
+    g_assert(!is_cached(c, "/file"));
+    g_assert(is_cached(c, "/none"));
+}
+
+static void test_attr_cache_timeout(void)
+{
+    V9fsAttrCache *c = v9fs_attr_cache_new(V9FS_CACHE_TIMEOUT, 0);
+
+    cache_stat(c, "/file", S_IFREG);
+    g_assert(!is_cached(c, "/file"));
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/9p/attr-cache/hit", test_attr_cache_hit);
+    g_test_add_func("/9p/attr-cache/lru", test_attr_cache_lru);
+    g_test_add_func("/9p/attr-cache/stale-insert",
+                    test_attr_cache_stale_insert);
+    g_test_add_func("/9p/attr-cache/invalidate-tree",
+                    test_attr_cache_invalidate_tree);
+    g_test_add_func("/9p/attr-cache/inode-changed",
+                    test_attr_cache_inode_changed);
+    g_test_add_func("/9p/attr-cache/timeout", test_attr_cache_timeout);
+    return g_test_run();
+}
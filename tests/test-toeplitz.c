@@ -0,0 +1,127 @@
+/*
+ * Test the Toeplitz hash used for Receive Side Scaling
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#include <glib.h>
+#include "qemu/osdep.h"
+#include "qemu/bswap.h"
+#include "net/eth.h"
+
+/* Verification suite from the Microsoft RSS specification */
+static const uint8_t rss_key[40] = {
+    0x6d, 0x5a, 0x56, 0xda, 0x25, 0x5b, 0x0e, 0xc2,
+    0x41, 0x67, 0x25, 0x3d, 0x43, 0xa3, 0x8f, 0xb0,
+    0xd0, 0xca, 0x2b, 0xcb, 0xae, 0x7b, 0x30, 0xb4,
+    0x77, 0xcb, 0x2d, 0xa3, 0x80, 0x30, 0xf2, 0x0c,
+    0x6a, 0x42, 0xb7, 0x3b, 0xbe, 0xac, 0x01, 0xfa,
+};
+
+typedef struct {
+    uint8_t src[4];
+    uint8_t dst[4];
+    uint16_t sport;
+    uint16_t dport;
+    uint32_t hash_ip;
+    uint32_t hash_tcp;
+} ToeplitzIPv4Test;
+
+static const ToeplitzIPv4Test ipv4_tests[] = {
+    { { 66, 9, 149, 187 }, { 161, 142, 100, 80 }, 2794, 1766,
+      0x323e8fc2, 0x51ccc178 },
+    { { 199, 92, 111, 2 }, { 65, 69, 140, 83 }, 14230, 4739,
+      0xd718262a, 0xc626b0ea },
+    { { 24, 19, 198, 95 }, { 12, 22, 207, 184 }, 12898, 38024,
+      0xd2d0a5de, 0x5c2b394a },
+    { { 38, 27, 205, 30 }, { 209, 142, 163, 6 }, 48228, 2217,
+      0x82989176, 0xafc7327f },
+    { { 153, 39, 163, 191 }, { 202, 188, 127, 2 }, 44251, 1303,
+      0x5d1809c5, 0x10e828a2 },
+};
+
+static void test_toeplitz_ipv4(void)
+{
+    uint8_t input[12];
+    int i;
+
+    for (i = 0; i < ARRAY_SIZE(ipv4_tests); i++) {
+        const ToeplitzIPv4Test *t = &ipv4_tests[i];
+
+        memcpy(input, t->src, 4);
+        memcpy(input + 4, t->dst, 4);
+        stw_be_p(input + 8, t->sport);
+        stw_be_p(input + 10, t->dport);
+
+        g_assert_cmphex(eth_toeplitz_hash(rss_key, input, 8), ==,
+                        t->hash_ip);
+        g_assert_cmphex(eth_toeplitz_hash(rss_key, input, 12), ==,
+                        t->hash_tcp);
+    }
+}
+
+typedef struct {
+    uint8_t src[16];
+    uint8_t dst[16];
+    uint16_t sport;
+    uint16_t dport;
+    uint32_t hash_ip;
+    uint32_t hash_tcp;
+} ToeplitzIPv6Test;
+
+static const ToeplitzIPv6Test ipv6_tests[] = {
+    /* 3ffe:2501:200:1fff::7 -> 3ffe:2501:200:3::1 */
+    { { 0x3f, 0xfe, 0x25, 0x01, 0x02, 0x00, 0x1f, 0xff,
+        0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x07 },
+      { 0x3f, 0xfe, 0x25, 0x01, 0x02, 0x00, 0x00, 0x03,
+        0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x01 },
+      2794, 1766, 0x2cc18cd5, 0x40207d3d },
+    /* 3ffe:501:8::260:97ff:fe40:efab -> ff02::1 */
+    { { 0x3f, 0xfe, 0x05, 0x01, 0x00, 0x08, 0x00, 0x00,
+        0x02, 0x60, 0x97, 0xff, 0xfe, 0x40, 0xef, 0xab },
+      { 0xff, 0x02, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+        0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x01 },
+      14230, 4739, 0x0f0c461c, 0xdde51bbf },
+    /* 3ffe:1900:4545:3:200:f8ff:fe21:67cf -> fe80::200:f8ff:fe21:67cf */
+    { { 0x3f, 0xfe, 0x19, 0x00, 0x45, 0x45, 0x00, 0x03,
+        0x02, 0x00, 0xf8, 0xff, 0xfe, 0x21, 0x67, 0xcf },
+      { 0xfe, 0x80, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+        0x02, 0x00, 0xf8, 0xff, 0xfe, 0x21, 0x67, 0xcf },
+      44251, 38024, 0x4b61e985, 0x02d1feef },
+};
+
+static void test_toeplitz_ipv6(void)
+{
+    uint8_t input[36];
+    int i;
+
+    for (i = 0; i < ARRAY_SIZE(ipv6_tests); i++) {
+        const ToeplitzIPv6Test *t = &ipv6_tests[i];
+
+        memcpy(input, t->src, 16);
+        memcpy(input + 16, t->dst, 16);
+        stw_be_p(input + 32, t->sport);
+        stw_be_p(input + 34, t->dport);
+
+        g_assert_cmphex(eth_toeplitz_hash(rss_key, input, 32), ==,
+                        t->hash_ip);
+        g_assert_cmphex(eth_toeplitz_hash(rss_key, input, 36), ==,
+                        t->hash_tcp);
+    }
+}
+
+static void test_toeplitz_empty(void)
+{
+    g_assert_cmphex(eth_toeplitz_hash(rss_key, NULL, 0), ==, 0);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/toeplitz/ipv4", test_toeplitz_ipv4);
+    g_test_add_func("/toeplitz/ipv6", test_toeplitz_ipv6);
+    g_test_add_func("/toeplitz/empty", test_toeplitz_empty);
+    return g_test_run();
+}
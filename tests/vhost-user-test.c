@@ -49,9 +49,19 @@
 
 #define HUGETLBFS_MAGIC       0x958458f6
 
+/* Where the migration test writes behind the back of QEMU, in the free
+ * conventional memory of the first guest page.
+ */
+#define TEST_MEM_OFFSET       0x800
+#define TEST_MEM_WORDS        256
+
 /*********** FROM hw/virtio/vhost-user.c *************************************/
 
 #define VHOST_MEMORY_MAX_NREGIONS    8
+#define VHOST_USER_F_PROTOCOL_FEATURES 30
+#define VHOST_USER_PROTOCOL_F_LOG_SHMFD 1
+
+#define VHOST_LOG_PAGE 0x1000
 
 typedef enum VhostUserRequest {
     VHOST_USER_NONE = 0,
@@ -69,6 +79,10 @@ typedef enum VhostUserRequest {
     VHOST_USER_SET_VRING_KICK = 12,
     VHOST_USER_SET_VRING_CALL = 13,
     VHOST_USER_SET_VRING_ERR = 14,
+    VHOST_USER_GET_PROTOCOL_FEATURES = 15,
+    VHOST_USER_SET_PROTOCOL_FEATURES = 16,
+    VHOST_USER_GET_QUEUE_NUM = 17,
+    VHOST_USER_SET_VRING_ENABLE = 18,
     VHOST_USER_MAX
 } VhostUserRequest;
 
@@ -85,6 +99,11 @@ typedef struct VhostUserMemory {
     VhostUserMemoryRegion regions[VHOST_MEMORY_MAX_NREGIONS];
 } VhostUserMemory;
 
+typedef struct VhostUserLog {
+    uint64_t mmap_size;
+    uint64_t mmap_offset;
+} VhostUserLog;
+
 typedef struct VhostUserMsg {
     VhostUserRequest request;
 
@@ -97,6 +116,7 @@ typedef struct VhostUserMsg {
         struct vhost_vring_state state;
         struct vhost_vring_addr addr;
         VhostUserMemory memory;
+        VhostUserLog log;
     };
 } QEMU_PACKED VhostUserMsg;
 
@@ -111,10 +131,20 @@ static VhostUserMsg m __attribute__ ((unused));
 #define VHOST_USER_VERSION    (0x1)
 /*****************************************************************************/
 
-int fds_num = 0, fds[VHOST_MEMORY_MAX_NREGIONS];
-static VhostUserMemory memory;
-static GMutex *data_mutex;
-static GCond *data_cond;
+typedef struct TestServer {
+    gchar *socket_path;
+    gchar *chr_name;
+    CharDriverState *chr;
+    int fds_num;
+    int fds[VHOST_MEMORY_MAX_NREGIONS];
+    VhostUserMemory memory;
+    GMutex *data_mutex;
+    GCond *data_cond;
+    int log_fd;
+    uint64_t log_size;
+} TestServer;
+
+static const char *hugefs;
 
 static gint64 _get_time(void)
 {
@@ -201,58 +231,135 @@ static GThread *_thread_new(const gchar *name, GThreadFunc func, gpointer data)
     return thread;
 }
 
-static void read_guest_mem(void)
+static void wait_for_fds(TestServer *s)
 {
-    uint32_t *guest_mem;
     gint64 end_time;
-    int i, j;
-    size_t size;
 
-    g_mutex_lock(data_mutex);
+    g_mutex_lock(s->data_mutex);
 
     end_time = _get_time() + 5 * G_TIME_SPAN_SECOND;
-    while (!fds_num) {
-        if (!_cond_wait_until(data_cond, data_mutex, end_time)) {
+    while (!s->fds_num) {
+        if (!_cond_wait_until(s->data_cond, s->data_mutex, end_time)) {
             /* timeout has passed */
-            g_assert(fds_num);
+            g_assert(s->fds_num);
             break;
         }
     }
 
     /* check for sanity */
-    g_assert_cmpint(fds_num, >, 0);
-    g_assert_cmpint(fds_num, ==, memory.nregions);
+    g_assert_cmpint(s->fds_num, >, 0);
+    g_assert_cmpint(s->fds_num, ==, s->memory.nregions);
 
-    /* iterate all regions */
-    for (i = 0; i < fds_num; i++) {
+    g_mutex_unlock(s->data_mutex);
+}
 
-        /* We'll check only the region statring at 0x0*/
-        if (memory.regions[i].guest_phys_addr != 0x0) {
-            continue;
+static void wait_for_log_fd(TestServer *s)
+{
+    gint64 end_time;
+
+    g_mutex_lock(s->data_mutex);
+
+    end_time = _get_time() + 5 * G_TIME_SPAN_SECOND;
+    while (s->log_fd == -1) {
+        if (!_cond_wait_until(s->data_cond, s->data_mutex, end_time)) {
+            /* timeout has passed */
+            g_assert(s->log_fd != -1);
+            break;
         }
+    }
+
+    g_mutex_unlock(s->data_mutex);
+}
 
-        g_assert_cmpint(memory.regions[i].memory_size, >, 1024);
+/* Map the region of guest memory that starts at address 0 */
+static uint32_t *map_guest_mem(TestServer *s, size_t *size)
+{
+    uint32_t *guest_mem;
+    int i;
+
+    for (i = 0; i < s->fds_num; i++) {
+        if (s->memory.regions[i].guest_phys_addr != 0x0) {
+            continue;
+        }
 
-        size =  memory.regions[i].memory_size + memory.regions[i].mmap_offset;
+        g_assert_cmpint(s->memory.regions[i].memory_size, >, 1024);
 
-        guest_mem = mmap(0, size, PROT_READ | PROT_WRITE,
-                         MAP_SHARED, fds[i], 0);
+        *size = s->memory.regions[i].memory_size +
+                s->memory.regions[i].mmap_offset;
 
+        guest_mem = mmap(0, *size, PROT_READ | PROT_WRITE,
+                         MAP_SHARED, s->fds[i], 0);
         g_assert(guest_mem != MAP_FAILED);
-        guest_mem += (memory.regions[i].mmap_offset / sizeof(*guest_mem));
 
-        for (j = 0; j < 256; j++) {
-            uint32_t a = readl(memory.regions[i].guest_phys_addr + j*4);
-            uint32_t b = guest_mem[j];
+        return guest_mem;
+    }
+
+    g_assert_not_reached();
+    return NULL;
+}
 
-            g_assert_cmpint(a, ==, b);
+static uint32_t *guest_mem_base(TestServer *s, uint32_t *guest_mem)
+{
+    int i;
+
+    for (i = 0; i < s->fds_num; i++) {
+        if (s->memory.regions[i].guest_phys_addr == 0x0) {
+            return guest_mem + s->memory.regions[i].mmap_offset /
+                               sizeof(*guest_mem);
         }
+    }
+
+    g_assert_not_reached();
+    return NULL;
+}
+
+static void read_guest_mem(const void *data)
+{
+    TestServer *s = (TestServer *)data;
+    uint32_t *guest_mem, *base;
+    size_t size;
+    int j;
+
+    wait_for_fds(s);
 
-        munmap(guest_mem, memory.regions[i].memory_size);
+    g_mutex_lock(s->data_mutex);
+
+    guest_mem = map_guest_mem(s, &size);
+    base = guest_mem_base(s, guest_mem);
+
+    for (j = 0; j < 256; j++) {
+        uint32_t a = readl(j * 4);
+        uint32_t b = base[j];
+
+        g_assert_cmpint(a, ==, b);
     }
 
-    g_assert_cmpint(1, ==, 1);
-    g_mutex_unlock(data_mutex);
+    munmap(guest_mem, size);
+
+    g_mutex_unlock(s->data_mutex);
+}
+
+/* Write guest memory the way a vhost-user slave does, without QEMU
+ * knowing about it.
+ */
+static void write_guest_mem(TestServer *s, uint32_t seed)
+{
+    uint32_t *guest_mem, *base;
+    size_t size;
+    int j;
+
+    g_mutex_lock(s->data_mutex);
+
+    guest_mem = map_guest_mem(s, &size);
+    base = guest_mem_base(s, guest_mem) + TEST_MEM_OFFSET / sizeof(*base);
+
+    for (j = 0; j < TEST_MEM_WORDS; j++) {
+        base[j] = seed + j;
+    }
+
+    munmap(guest_mem, size);
+
+    g_mutex_unlock(s->data_mutex);
 }
 
 static void *thread_function(void *data)
@@ -270,7 +377,8 @@ static int chr_can_read(void *opaque)
 
 static void chr_read(void *opaque, const uint8_t *buf, int size)
 {
-    CharDriverState *chr = opaque;
+    TestServer *s = opaque;
+    CharDriverState *chr = s->chr;
     VhostUserMsg msg;
     uint8_t *p = (uint8_t *) &msg;
     int fd;
@@ -280,7 +388,7 @@ static void chr_read(void *opaque, const uint8_t *buf, int size)
         return;
     }
 
-    g_mutex_lock(data_mutex);
+    g_mutex_lock(s->data_mutex);
     memcpy(p, buf, VHOST_USER_HDR_SIZE);
 
     if (msg.size) {
@@ -293,7 +401,17 @@ static void chr_read(void *opaque, const uint8_t *buf, int size)
         /* send back features to qemu */
         msg.flags |= VHOST_USER_REPLY_MASK;
         msg.size = sizeof(m.u64);
-        msg.u64 = 0;
+        msg.u64 = (1ULL << VHOST_F_LOG_ALL) |
+                  (1ULL << VHOST_USER_F_PROTOCOL_FEATURES);
+        p = (uint8_t *) &msg;
+        qemu_chr_fe_write_all(chr, p, VHOST_USER_HDR_SIZE + msg.size);
+        break;
+
+    case VHOST_USER_GET_PROTOCOL_FEATURES:
+        /* send back protocol features to qemu */
+        msg.flags |= VHOST_USER_REPLY_MASK;
+        msg.size = sizeof(m.u64);
+        msg.u64 = 1ULL << VHOST_USER_PROTOCOL_F_LOG_SHMFD;
         p = (uint8_t *) &msg;
         qemu_chr_fe_write_all(chr, p, VHOST_USER_HDR_SIZE + msg.size);
         break;
@@ -309,11 +427,12 @@ static void chr_read(void *opaque, const uint8_t *buf, int size)
 
     case VHOST_USER_SET_MEM_TABLE:
         /* received the mem table */
-        memcpy(&memory, &msg.memory, sizeof(msg.memory));
-        fds_num = qemu_chr_fe_get_msgfds(chr, fds, sizeof(fds) / sizeof(int));
+        memcpy(&s->memory, &msg.memory, sizeof(msg.memory));
+        s->fds_num = qemu_chr_fe_get_msgfds(chr, s->fds,
+                                            G_N_ELEMENTS(s->fds));
 
         /* signal the test that it can continue */
-        g_cond_signal(data_cond);
+        g_cond_signal(s->data_cond);
         break;
 
     case VHOST_USER_SET_VRING_KICK:
@@ -327,10 +446,29 @@ static void chr_read(void *opaque, const uint8_t *buf, int size)
          */
         qemu_set_nonblock(fd);
         break;
+
+    case VHOST_USER_SET_LOG_BASE:
+        if (s->log_fd != -1) {
+            close(s->log_fd);
+            s->log_fd = -1;
+        }
+        qemu_chr_fe_get_msgfds(chr, &s->log_fd, 1);
+        s->log_size = msg.log.mmap_size;
+
+        /* acknowledge the switch to the new log */
+        msg.flags |= VHOST_USER_REPLY_MASK;
+        msg.size = 0;
+        p = (uint8_t *) &msg;
+        qemu_chr_fe_write_all(chr, p, VHOST_USER_HDR_SIZE);
+
+        g_cond_signal(s->data_cond);
+        break;
+
     default:
         break;
     }
-    g_mutex_unlock(data_mutex);
+
+    g_mutex_unlock(s->data_mutex);
 }
 
 static const char *init_hugepagefs(void)
@@ -366,44 +504,154 @@ static const char *init_hugepagefs(void)
     return path;
 }
 
+static TestServer *test_server_new(const gchar *name)
+{
+    TestServer *server = g_new0(TestServer, 1);
+    gchar *chr_path;
+
+    server->socket_path = g_strdup_printf("/tmp/vhost-%s-%d.sock",
+                                          name, getpid());
+
+    chr_path = g_strdup_printf("unix:%s,server,nowait", server->socket_path);
+    server->chr_name = g_strdup_printf("chr-%s", name);
+    server->chr = qemu_chr_new(server->chr_name, chr_path, NULL);
+    g_free(chr_path);
+
+    qemu_chr_add_handlers(server->chr, chr_can_read, chr_read, NULL, server);
+
+    server->data_mutex = _mutex_new();
+    server->data_cond = _cond_new();
+    server->log_fd = -1;
+
+    return server;
+}
+
+static void test_server_free(TestServer *server)
+{
+    int i;
+
+    qemu_chr_delete(server->chr);
+
+    for (i = 0; i < server->fds_num; i++) {
+        close(server->fds[i]);
+    }
+
+    if (server->log_fd != -1) {
+        close(server->log_fd);
+    }
+
+    unlink(server->socket_path);
+    g_free(server->socket_path);
+
+    _cond_free(server->data_cond);
+    _mutex_free(server->data_mutex);
+
+    g_free(server->chr_name);
+    g_free(server);
+}
+
+/* Pages that the slave writes during migration must reach the destination
+ * through the dirty log, since QEMU does not see the writes.
+ */
+static void test_migrate(void)
+{
+    TestServer *s = test_server_new("src");
+    TestServer *dest = test_server_new("dest");
+    QTestState *global = global_qtest, *from, *to;
+    gchar *uri = g_strdup_printf("unix:/tmp/vhost-migrate-%d.sock", getpid());
+    gchar *cmd;
+    QDict *rsp;
+    uint8_t *log;
+    int j;
+
+    cmd = g_strdup_printf(QEMU_CMD, hugefs, s->socket_path);
+    from = qtest_start(cmd);
+    g_free(cmd);
+
+    wait_for_fds(s);
+
+    cmd = g_strdup_printf(QEMU_CMD " -incoming %s", hugefs,
+                          dest->socket_path, uri);
+    to = qtest_init(cmd);
+    g_free(cmd);
+
+    /* slow down migration so that the log is in use when we write */
+    rsp = qmp("{ 'execute': 'migrate_set_speed',"
+              "'arguments': { 'value': 10 } }");
+    g_assert(qdict_haskey(rsp, "return"));
+    QDECREF(rsp);
+
+    cmd = g_strdup_printf("{ 'execute': 'migrate',"
+                          "'arguments': { 'uri': '%s' } }", uri);
+    rsp = qmp(cmd);
+    g_free(cmd);
+    g_assert(qdict_haskey(rsp, "return"));
+    QDECREF(rsp);
+
+    wait_for_log_fd(s);
+    g_assert_cmpint(s->log_size, >, 0);
+
+    log = mmap(0, s->log_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+               s->log_fd, 0);
+    g_assert(log != MAP_FAILED);
+
+    /* modify the first page and mark it dirty */
+    write_guest_mem(s, 0x42);
+    __sync_fetch_and_or(&log[0], 1);
+    munmap(log, s->log_size);
+
+    /* speed things up */
+    rsp = qmp("{ 'execute': 'migrate_set_speed',"
+              "'arguments': { 'value': 0 } }");
+    g_assert(qdict_haskey(rsp, "return"));
+    QDECREF(rsp);
+
+    qmp_eventwait("STOP");
+
+    global_qtest = to;
+    qmp_eventwait("RESUME");
+
+    for (j = 0; j < TEST_MEM_WORDS; j++) {
+        g_assert_cmpint(readl(TEST_MEM_OFFSET + j * 4), ==, 0x42 + j);
+    }
+
+    qtest_quit(to);
+    test_server_free(dest);
+    qtest_quit(from);
+    test_server_free(s);
+    g_free(uri);
+
+    global_qtest = global;
+}
+
 int main(int argc, char **argv)
 {
     QTestState *s = NULL;
-    CharDriverState *chr = NULL;
-    const char *hugefs = 0;
-    char *socket_path = 0;
+    TestServer *server = NULL;
     char *qemu_cmd = 0;
-    char *chr_path = 0;
     int ret;
 
     g_test_init(&argc, &argv, NULL);
 
     module_call_init(MODULE_INIT_QOM);
+    qemu_add_opts(&qemu_chardev_opts);
 
     hugefs = init_hugepagefs();
     if (!hugefs) {
         return 0;
     }
 
-    socket_path = g_strdup_printf("/tmp/vhost-%d.sock", getpid());
-
-    /* create char dev and add read handlers */
-    qemu_add_opts(&qemu_chardev_opts);
-    chr_path = g_strdup_printf("unix:%s,server,nowait", socket_path);
-    chr = qemu_chr_new("chr0", chr_path, NULL);
-    g_free(chr_path);
-    qemu_chr_add_handlers(chr, chr_can_read, chr_read, NULL, chr);
+    server = test_server_new("test");
 
     /* run the main loop thread so the chardev may operate */
-    data_mutex = _mutex_new();
-    data_cond = _cond_new();
     _thread_new(NULL, thread_function, NULL);
 
-    qemu_cmd = g_strdup_printf(QEMU_CMD, hugefs, socket_path);
+    qemu_cmd = g_strdup_printf(QEMU_CMD, hugefs, server->socket_path);
     s = qtest_start(qemu_cmd);
     g_free(qemu_cmd);
 
-    qtest_add_func("/vhost-user/read-guest-mem", read_guest_mem);
+    qtest_add_data_func("/vhost-user/read-guest-mem", server, read_guest_mem);
+    qtest_add_func("/vhost-user/migrate", test_migrate);
 
     ret = g_test_run();
 
@@ -412,10 +660,7 @@ int main(int argc, char **argv)
     }
 
     /* cleanup */
-    unlink(socket_path);
-    g_free(socket_path);
-    _cond_free(data_cond);
-    _mutex_free(data_mutex);
+    test_server_free(server);
 
     return ret;
 }
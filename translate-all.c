@@ -58,6 +58,7 @@
 #endif
 
 #include "exec/cputlb.h"
+#include "exec/tb-profile.h"
 #include "translate-all.h"
 #include "qemu/bitmap.h"
 #include "qemu/timer.h"
@@ -1008,6 +1009,9 @@ TranslationBlock *tb_gen_code(CPUState *cpu,
     if (use_icount) {
         cflags |= CF_USE_ICOUNT;
     }
+    if (tb_profile_enabled) {
+        cflags |= CF_PROFILE;
+    }
     tb = tb_alloc(pc);
     if (!tb) {
         /* flush must be done */
@@ -1612,6 +1616,11 @@ void dump_exec_info(FILE *f, fprintf_function cpu_fprintf)
     cpu_fprintf(f, "TB invalidate count %d\n",
             tcg_ctx.tb_ctx.tb_phys_invalidate_count);
     cpu_fprintf(f, "TLB flush count     %d\n", tlb_flush_count);
+    cpu_fprintf(f, "TLB page flushes    %d (large page=%d)\n",
+                tlb_flush_page_count, tlb_flush_large_count);
+    cpu_fprintf(f, "TLB refill count    %d (victim TLB hits=%d)\n",
+                tlb_refill_count, tlb_victim_hit_count);
+    cpu_fprintf(f, "TLB resize count    %d\n", tlb_resize_count);
     tcg_dump_info(f, cpu_fprintf);
 }
 
@@ -22,6 +22,7 @@
 #include "tcg.h"
 #include "qemu/bitops.h"
 #include "exec/cpu_ldst.h"
+#include "exec/helper-proto.h"
 
 #undef EAX
 #undef ECX
@@ -33,6 +34,7 @@
 #undef EDI
 #undef EIP
 #include <signal.h>
+#include <pthread.h>
 #ifdef __linux__
 #include <sys/ucontext.h>
 #endif
@@ -127,6 +129,107 @@ static inline int handle_cpu_signal(uintptr_t pc, unsigned long address,
     return 1;
 }
 
+/* Guest memory is mapped directly, faults in the atomic helpers are
+   handled by handle_cpu_signal() like those of generated code.  Not every
+   host can do unaligned atomics, so unaligned operands raise the target's
+   alignment fault if it asked for one and are otherwise emulated with
+   atomic_slow_ld and atomic_slow_st.  */
+static void *atomic_mmu_lookup(CPUArchState *env, target_ulong addr,
+                               TCGMemOpIdx oi, uintptr_t retaddr)
+{
+    TCGMemOp mop = get_memop(oi);
+
+    if (addr & ((1 << (mop & MO_SIZE)) - 1)) {
+        CPUState *cpu = ENV_GET_CPU(env);
+        CPUClass *cc = CPU_GET_CLASS(cpu);
+
+        if ((mop & MO_AMASK) == MO_ALIGN && cc->do_unaligned_access) {
+            cc->do_unaligned_access(cpu, addr, 1, 1, retaddr);
+        }
+        return NULL;
+    }
+    return g2h(addr);
+}
+
+/* Serializes the emulated read-modify-writes of all threads.  */
+static pthread_mutex_t atomic_slow_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void atomic_slow_lock(CPUArchState *env, target_ulong addr,
+                             TCGMemOpIdx oi)
+{
+    unsigned size = 1 << (get_memop(oi) & MO_SIZE);
+
+    /* handle_cpu_signal() does not return, so fault in both ends of the
+       operand for writing before taking the lock.  */
+    atomic_fetch_add((uint8_t *)g2h(addr), 0);
+    atomic_fetch_add((uint8_t *)g2h(addr + size - 1), 0);
+    pthread_mutex_lock(&atomic_slow_mutex);
+}
+
+static void atomic_slow_unlock(void)
+{
+    pthread_mutex_unlock(&atomic_slow_mutex);
+}
+
+static uint64_t atomic_slow_ld(CPUArchState *env, target_ulong addr,
+                               TCGMemOpIdx oi, uintptr_t retaddr)
+{
+    void *haddr = g2h(addr);
+
+    switch (get_memop(oi) & (MO_BSWAP | MO_SIZE)) {
+    case MO_UB:
+        return ldub_p(haddr);
+    case MO_LEUW:
+        return lduw_le_p(haddr);
+    case MO_BEUW:
+        return lduw_be_p(haddr);
+    case MO_LEUL:
+        return (uint32_t)ldl_le_p(haddr);
+    case MO_BEUL:
+        return (uint32_t)ldl_be_p(haddr);
+    case MO_LEQ:
+        return ldq_le_p(haddr);
+    case MO_BEQ:
+        return ldq_be_p(haddr);
+    default:
+        tcg_abort();
+    }
+}
+
+static void atomic_slow_st(CPUArchState *env, target_ulong addr,
+                           uint64_t val, TCGMemOpIdx oi, uintptr_t retaddr)
+{
+    void *haddr = g2h(addr);
+
+    switch (get_memop(oi) & (MO_BSWAP | MO_SIZE)) {
+    case MO_UB:
+        stb_p(haddr, val);
+        break;
+    case MO_LEUW:
+        stw_le_p(haddr, val);
+        break;
+    case MO_BEUW:
+        stw_be_p(haddr, val);
+        break;
+    case MO_LEUL:
+        stl_le_p(haddr, val);
+        break;
+    case MO_BEUL:
+        stl_be_p(haddr, val);
+        break;
+    case MO_LEQ:
+        stq_le_p(haddr, val);
+        break;
+    case MO_BEQ:
+        stq_be_p(haddr, val);
+        break;
+    default:
+        tcg_abort();
+    }
+}
+
+#include "atomic_template.h"
+
 #if defined(__i386__)
 
 #if defined(__APPLE__)
@@ -0,0 +1,83 @@
+/*
+ * Anonymous shared memory that can be passed to other processes
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu-common.h"
+#include "qemu/memfd.h"
+#include "qemu/error-report.h"
+
+#include <sys/mman.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+
+#ifndef MFD_CLOEXEC
+#define MFD_CLOEXEC 0x0001U
+#endif
+
+static int qemu_memfd_create(const char *name)
+{
+#ifdef __NR_memfd_create
+    return syscall(__NR_memfd_create, name, MFD_CLOEXEC);
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+void *qemu_memfd_alloc(const char *name, size_t size, int *fd)
+{
+    void *ptr;
+    int mfd;
+
+    mfd = qemu_memfd_create(name);
+    if (mfd == -1) {
+        /* Older kernels: use an unlinked file in the shared memory fs */
+        char *fname = g_strdup_printf("/dev/shm/qemu-%d-%s-XXXXXX",
+                                      getpid(), name);
+
+        mfd = mkstemp(fname);
+        if (mfd != -1) {
+            unlink(fname);
+            qemu_set_cloexec(mfd);
+        }
+        g_free(fname);
+        if (mfd == -1) {
+            error_report("failed to allocate shared memory for %s: %s",
+                         name, strerror(errno));
+            return NULL;
+        }
+    }
+
+    if (ftruncate(mfd, size) == -1) {
+        error_report("failed to resize shared memory for %s: %s",
+                     name, strerror(errno));
+        close(mfd);
+        return NULL;
+    }
+
+    ptr = mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, mfd, 0);
+    if (ptr == MAP_FAILED) {
+        error_report("failed to map shared memory for %s: %s",
+                     name, strerror(errno));
+        close(mfd);
+        return NULL;
+    }
+
+    *fd = mfd;
+    return ptr;
+}
+
+void qemu_memfd_free(void *ptr, size_t size, int fd)
+{
+    if (ptr) {
+        munmap(ptr, size);
+    }
+
+    if (fd != -1) {
+        close(fd);
+    }
+}
@@ -3252,7 +3252,7 @@ int main(int argc, char **argv, char **envp)
             case QEMU_OPTION_virtfs: {
                 QemuOpts *fsdev;
                 QemuOpts *device;
-                const char *writeout, *sock_fd, *socket;
+                const char *writeout, *sock_fd, *socket, *cache;
 
                 olist = qemu_find_opts("virtfs");
                 if (!olist) {
@@ -3303,6 +3303,14 @@ int main(int argc, char **argv, char **envp)
                 if (sock_fd) {
                     qemu_opt_set(fsdev, "sock_fd", sock_fd, &error_abort);
                 }
+                cache = qemu_opt_get(opts, "cache");
+                if (cache) {
+                    qemu_opt_set(fsdev, "cache", cache, &error_abort);
+                }
+                cache = qemu_opt_get(opts, "cache_timeout");
+                if (cache) {
+                    qemu_opt_set(fsdev, "cache_timeout", cache, &error_abort);
+                }
 
                 qemu_opt_set_bool(fsdev, "readonly",
                                   qemu_opt_get_bool(opts, "readonly", 0),